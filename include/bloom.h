@@ -0,0 +1,28 @@
+#pragma once
+
+#include "error.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Blocked Bloom filter over 64 bit keys. All bits of a key are in the same
+/// cache line, so a lookup touches a single line of memory. Keys are added
+/// with atomic operations, adds and lookups might run concurrently.
+typedef struct bloom_t bloom_t;
+
+/// Creates an empty filter sized for the expected number of keys. Ten bits per
+/// key give a false positive rate of about one percent.
+result_t
+bloom_open(bloom_t** out, uint64_t count, uint32_t bits_per_key);
+
+/// Frees the filter.
+result_t
+bloom_close(bloom_t** out);
+
+void
+bloom_add(bloom_t* filter, uint64_t key);
+
+/// Returns false if the key was never added, might return true for keys that
+/// were not added.
+bool
+bloom_contains(const bloom_t* filter, uint64_t key);
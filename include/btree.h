@@ -1,3 +1,219 @@
 #pragma once
 
+#include "blob.h"
+#include "error.h"
+#include "pager.h"
+#include "wal.h"
+
+#include <stdint.h>
+
 typedef struct btree_t btree_t;
+
+/// Consistent view of a tree at a point in time, see btree_snapshot_open.
+typedef struct btree_snapshot_t btree_snapshot_t;
+
+/// State of an incremental compaction, see btree_compaction_open.
+typedef struct btree_compaction_t btree_compaction_t;
+
+/// Maximum number of levels reported by btree_stats.
+#define BTREE_STATS_MAX_HEIGHT 16
+
+/// Number of buckets of the fill factor distributions, each bucket covers an
+/// equal share of the usable page space.
+#define BTREE_STATS_FILL_BUCKETS 10
+
+/// Shape of a tree as reported by btree_stats.
+typedef struct {
+    uint16_t height;
+    uint32_t page_count;
+
+    /// Number of pages per level, the root is on level zero.
+    uint32_t level_page_count[BTREE_STATS_MAX_HEIGHT];
+
+    /// Number of leaf and inner pages per fill factor bucket.
+    uint32_t leaf_fill[BTREE_STATS_FILL_BUCKETS];
+    uint32_t inner_fill[BTREE_STATS_FILL_BUCKETS];
+
+    uint64_t row_count;
+    uint64_t cell_count;
+    uint64_t cell_bytes;
+    double avg_cell_size;
+
+    /// Contiguous free space between the cell pointers and the cell data.
+    uint64_t free_bytes;
+
+    /// Free space scattered between cells, only reusable after compaction.
+    uint64_t fragmented_bytes;
+} btree_stats_t;
+
+/// Counters of all trees of the process, see btree_stats_snapshot.
+typedef struct {
+    /// Number of lookups, including the ones answered by the filter.
+    uint64_t lookups;
+    uint64_t inserts;
+
+    /// Number of split pages, including the root.
+    uint64_t splits;
+
+    /// Number of started compactions and of the leaves they compacted.
+    uint64_t compactions;
+    uint64_t compacted_leaves;
+} btree_counters_t;
+
+/// Opens an existing tree by its id in the catalog.
+result_t
+btree_open(btree_t** out, pager_t* pager, uint32_t id);
+
+/// Opens an existing tree by its name in the catalog.
+result_t
+btree_open_by_name(btree_t** out, pager_t* pager, const char* name);
+
+/// Creates a new and empty tree of the given type and registers it in the
+/// catalog. The name is optional but has to be unique if provided.
+result_t
+btree_create(btree_t** out, pager_t* pager, const char* name, uint16_t type);
+
+/// Returns the id of the tree in the catalog.
+uint32_t
+btree_get_id(const btree_t* btree);
+
+/// Sets the dictionary used to compress the values of a compressed table. The
+/// dictionary is not persisted and the same dictionary has to be set whenever
+/// the tree is opened, before any value is inserted or looked up.
+result_t
+btree_set_dictionary(btree_t* btree, blob_t data);
+
+/// Inserts a row. Buffered trees do not look for the key before the insert,
+/// the insert replaces the value of an existing row like btree_upsert.
+result_t
+btree_insert(btree_t* btree, blob_t key, blob_t value);
+
+/// Inserts a row or replaces its value. Only supported by buffered trees, which
+/// add the change as message to the buffer of the root. Full buffers move the
+/// messages for one child down in a batch, so leaves are written once per
+/// batch instead of once per change. Snapshots and compaction are not
+/// supported by buffered trees.
+result_t
+btree_upsert(btree_t* btree, blob_t key, blob_t value);
+
+/// Deletes a row if it exists, see btree_upsert.
+result_t
+btree_delete(btree_t* btree, blob_t key);
+
+/// Looks up the value of a key. Buffered messages on the way down are merged,
+/// the newest message for the key decides.
+result_t
+btree_lookup(const btree_t* btree, blob_t key, unsigned char** out);
+
+result_t
+btree_table_insert(btree_t* btree, uint64_t id, blob_t value);
+
+/// Deletes a row of a buffered table, see btree_delete.
+result_t
+btree_table_delete(btree_t* btree, uint64_t id);
+
+/// Looks up a value in a table like btree_table_lookup, but sets found to false
+/// instead of failing with ENOENT for missing rows.
+result_t
+btree_table_find(const btree_t* btree, uint64_t id, blob_t* out, bool* found);
+
+/// Looks up a value in a table. For compressed tables the value is
+/// decompressed into a thread local buffer, which is only valid until the next
+/// lookup on the same thread.
+result_t
+btree_table_lookup(const btree_t* btree, uint64_t id, blob_t* out);
+
+/// Produces the rows of a bulk build in ascending order of their ids, sets found
+/// to false after the last row. The value has to stay valid until the next
+/// call.
+typedef result_t (*btree_build_next_t)(void* context, uint64_t* id, blob_t* value, bool* found);
+
+/// Builds a new table from rows in ascending order of their ids. The leaves are
+/// packed completely and written from left to right to consecutive pages where
+/// possible, the inner levels are built bottom up. The table is registered in
+/// the catalog once it is complete, the name is optional.
+result_t
+btree_table_build(btree_t** out, pager_t* pager, const char* name, btree_build_next_t next, void* context);
+
+/// Builds a Bloom filter over the ids of a table from a snapshot of its rows.
+/// Lookups of ids the filter rejects report missing rows without fixing a
+/// page, inserts add their ids to the filter. The filter is sized for the
+/// current number of rows and replaces an existing filter, btree_compact
+/// rebuilds it. Concurrent builds wait for each other. A replaced filter is
+/// freed by a later build once no lookup or insert uses a filter. Fails with
+/// EINVAL for indexes and buffered tables. Must not run concurrently with
+/// btree_compact.
+result_t
+btree_filter_build(btree_t* btree, uint32_t bits_per_key);
+
+/// Redoes a logged change of an exclusively fixed page of a tree, see
+/// recovery_run. The LSN of the page is not changed.
+result_t
+btree_redo(page_t page, uint16_t page_size, const wal_record_t* record);
+
+/// Opens a snapshot of the tree. Rows inserted after the snapshot was opened
+/// are not visible to it. Scans copy one leaf at a time and hold no latches
+/// between calls, so they neither wait for writers nor stall them. Leaves are
+/// unfixed with pager_unfix_once, so scans do not replace the working set of
+/// the pager. Inserts keep the timestamps of their keys while a snapshot is
+/// open. The timestamps are sharded by key, an insert and a scanned row only
+/// share a latch if their keys fall into the same shard.
+result_t
+btree_snapshot_open(btree_snapshot_t** out, btree_t* btree);
+
+/// Returns the next row of the snapshot in key order, the key and value are
+/// valid until the next call. Sets found to false after the last row.
+result_t
+btree_snapshot_next(btree_snapshot_t* snapshot, blob_t* key, blob_t* value, bool* found);
+
+/// Returns the next row of a table snapshot, see btree_snapshot_next. Values
+/// of compressed tables are decompressed.
+result_t
+btree_snapshot_table_next(btree_snapshot_t* snapshot, uint64_t* id, blob_t* value, bool* found);
+
+/// Closes the snapshot and drops the versions no open snapshot needs anymore.
+result_t
+btree_snapshot_close(btree_snapshot_t** out);
+
+/// Walks the tree and reports its shape. Only holds shared latches on one page
+/// at a time. Optionally verifies the key order and the sibling links and
+/// fails with EINVAL on the first violation. Pages that are split during the
+/// walk might not be counted.
+result_t
+btree_stats(const btree_t* btree, bool verify, btree_stats_t* out);
+
+/// Sums the counters of all threads, see pager_stats_snapshot.
+void
+btree_stats_snapshot(btree_counters_t* out);
+
+/// Prepares an online compaction of the tree. The compaction packs the leaves
+/// up to the fill factor, a share of the usable page space, and rewrites them
+/// to consecutive page ids in key order. Only one compaction per tree might
+/// run at a time.
+result_t
+btree_compaction_open(btree_compaction_t** out, btree_t* btree, double fill);
+
+/// Compacts the leaves below the next inner page. Only the path to the inner
+/// page and the leaves below it are latched, operations on the rest of the
+/// tree proceed concurrently. Sets done after the last leaf was compacted.
+result_t
+btree_compaction_step(btree_compaction_t* compaction, bool* done);
+
+/// Frees the compaction, might be called before the compaction is done.
+result_t
+btree_compaction_close(btree_compaction_t** out);
+
+/// Compacts the whole tree step by step, see btree_compaction_open. Rebuilds
+/// the filter of the tree if it has one.
+result_t
+btree_compact(btree_t* btree, double fill);
+
+/// Frees all pages of the tree, removes it from the catalog and frees the tree.
+/// No other thread might use the tree.
+result_t
+btree_drop(btree_t** out);
+
+/// Writes the statistics of the tree to the catalog and frees the tree. All
+/// snapshots of the tree have to be closed before.
+result_t
+btree_close(btree_t** out);
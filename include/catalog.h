@@ -0,0 +1,84 @@
+#pragma once
+
+#include "error.h"
+#include "pager.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Maximum size of a tree name including the null terminator.
+#define CATALOG_NAME_SIZE 32
+
+/// Entry of a tree in the catalog.
+typedef struct {
+    /// Number of rows in the tree, might lag behind for open trees.
+    uint64_t row_count;
+
+    /// Unique id of the tree, zero marks an empty entry.
+    uint32_t id;
+
+    /// Current root page of the tree.
+    page_id_t root;
+
+    /// Number of pages in the tree, might lag behind for open trees.
+    uint32_t page_count;
+
+    /// Type flags of the tree.
+    uint16_t flags;
+
+    /// Number of levels in the tree, a single leaf has height one.
+    uint16_t height;
+
+    /// Optional name of the tree, empty for anonymous trees.
+    char name[CATALOG_NAME_SIZE];
+} catalog_entry_t;
+
+/// Location of an entry in the catalog, stays valid for the lifetime of the
+/// tree.
+typedef struct {
+    page_id_t page;
+    uint16_t slot;
+} catalog_ref_t;
+
+/// Registers a new tree in the catalog, which is stored in the meta page of
+/// the pager and initialised on first use. Names have to be unique, anonymous
+/// trees are registered with a null or empty name.
+result_t
+catalog_register(
+  pager_t* pager,
+  const char* name,
+  page_id_t root,
+  uint16_t flags,
+  catalog_ref_t* ref,
+  catalog_entry_t* out
+);
+
+/// Removes the entry of a tree from the catalog, the pages of the tree are not
+/// freed.
+result_t
+catalog_unregister(pager_t* pager, catalog_ref_t ref);
+
+/// Finds the entry of a tree by its id. Fails with ENOENT if there is none.
+result_t
+catalog_find_by_id(pager_t* pager, uint32_t id, catalog_ref_t* ref, catalog_entry_t* out);
+
+/// Finds the entry of a tree by its name. Fails with ENOENT if there is none.
+result_t
+catalog_find_by_name(pager_t* pager, const char* name, catalog_ref_t* ref, catalog_entry_t* out);
+
+/// Iterates over all entries of the catalog. Starts with a zeroed reference
+/// and sets found to false after the last entry.
+result_t
+catalog_next(pager_t* pager, catalog_ref_t* ref, catalog_entry_t* out, bool* found);
+
+/// Reads the current state of an entry.
+result_t
+catalog_read(pager_t* pager, catalog_ref_t ref, catalog_entry_t* out);
+
+/// Atomically replaces the root and height of a tree.
+result_t
+catalog_set_root(pager_t* pager, catalog_ref_t ref, page_id_t root, uint16_t height);
+
+/// Atomically adds the deltas to the statistics of a tree.
+result_t
+catalog_add_stats(pager_t* pager, catalog_ref_t ref, int64_t rows, int32_t pages);
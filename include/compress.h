@@ -0,0 +1,39 @@
+#pragma once
+
+#include "blob.h"
+#include "error.h"
+
+#include <stdint.h>
+
+/// Shared dictionary for the compression codec. Prepared once and afterward
+/// only read, so it can be used by any number of threads concurrently.
+typedef struct compress_dict_t compress_dict_t;
+
+/// Prepares a dictionary from sample data. The data is copied and should
+/// contain byte sequences that are common in the compressed values.
+result_t
+compress_dict_open(compress_dict_t** out, blob_t data);
+
+/// Frees the dictionary.
+result_t
+compress_dict_close(compress_dict_t** out);
+
+/// Returns the maximum size of the compressed output for an input of the given
+/// size.
+uint64_t
+compress_bound(uint64_t size);
+
+/// Compresses the source into the destination, which has to provide at least
+/// compress_bound bytes. Returns the size of the compressed output. The
+/// dictionary is optional.
+uint64_t
+compress_encode(unsigned char* dst, blob_t src, const compress_dict_t* dict);
+
+/// Returns the size of the decompressed output without decompressing it.
+uint64_t
+compress_decode_len(const unsigned char* src);
+
+/// Decompresses the source into the destination. Has to be called with the
+/// same dictionary that was used to compress the source.
+result_t
+compress_decode(unsigned char* dst, uint64_t capacity, blob_t src, const compress_dict_t* dict, blob_t* out);
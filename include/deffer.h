@@ -3,6 +3,7 @@
 #include "error.h"
 #include "util.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -37,3 +38,7 @@ defer_impl(free) {
     defer_guard();
     free(*defer_arg(void*));
 }
+
+defer_impl(pthread_mutex_unlock) {
+    pthread_mutex_unlock(defer_arg(pthread_mutex_t));
+}
@@ -9,6 +9,19 @@
 #define SUCCESS 0
 #define FAILURE 1
 
+/// Whether failures record a trace of frames or only the error code. Traces
+/// are kept in debug builds or when built with -DERROR_TRACE=1, release builds
+/// do not evaluate the messages at all.
+#ifndef ERROR_TRACE
+#ifdef DEBUG
+#define ERROR_TRACE 1
+#else
+#define ERROR_TRACE 0
+#endif
+#endif
+
+/// Frame of an error trace as returned by error_trace_nth. The message is only
+/// formatted when the frame is read.
 typedef struct {
     const char* file;
     const char* func;
@@ -22,8 +35,14 @@ typedef struct {
 void
 error_push(const char* file, const char* func, uint32_t line, int32_t code);
 
-/// Appends a message to the last reported error by the current thread.
-__attribute__((__format__(__printf__, 1, 0))) void
+/// Reports a thread local error without a trace frame.
+void
+error_set_code(int32_t code);
+
+/// Appends a message to the last reported error by the current thread. Only the
+/// format and the arguments are recorded, strings are copied. Supports the
+/// conversions of printf except for '*' widths and precisions and %n.
+__attribute__((__format__(__printf__, 1, 2))) void
 error_append_message(const char* format, ...);
 
 /// Returns the last error code reported by the current thread.
@@ -35,6 +54,7 @@ uint32_t
 error_trace_length(void);
 
 /// Gets the nth frame of the error trace or null if the index is out of bounds.
+/// Formats the message of the frame, which stays valid until the next error.
 error_frame_t*
 error_trace_nth(uint32_t n);
 
@@ -42,12 +62,22 @@ error_trace_nth(uint32_t n);
 void
 error_clear(void);
 
+#if ERROR_TRACE
 #define failure(code, ...)                                                                                             \
     do {                                                                                                               \
         error_push(__FILE__, __FUNCTION__, __LINE__, code);                                                            \
         (void)(__VA_ARGS__);                                                                                           \
         return FAILURE;                                                                                                \
     } while (0)
+#else
+// the message is not evaluated, sizeof only keeps its variables used
+#define failure(code, ...)                                                                                             \
+    do {                                                                                                               \
+        (void)sizeof((__VA_ARGS__, 0));                                                                                \
+        error_set_code(code);                                                                                          \
+        return FAILURE;                                                                                                \
+    } while (0)
+#endif
 
 #define ensure(expr, ...)                                                                                              \
     do {                                                                                                               \
@@ -6,11 +6,34 @@
 
 #include "deffer.h"
 
+/// Reader-writer latch. Waiters spin with backoff for a short while and then
+/// park until the latch is released. A waiting writer stops new readers, so
+/// that a constant stream of readers cannot starve it.
+///
+/// Read-mostly latches can be biased towards readers, see
+/// latch_set_read_mostly. Shared latches are released by the thread that
+/// acquired them.
 typedef _Atomic int32_t latch_t;
 
+/// Bits of a latch, the number of readers is stored in the low bits.
+#define LATCH_WRITER INT32_MIN
+#define LATCH_WAITERS (1 << 30)
+#define LATCH_INTENT (1 << 29)
+#define LATCH_READ_MOSTLY (1 << 28)
+#define LATCH_BIASED (1 << 27)
+#define LATCH_READERS ((1 << 27) - 1)
+
 void
 latch_init(latch_t* latch);
 
+/// Enables the distributed reader mode for a read-mostly latch. While the
+/// latch is biased, readers register in a global table of visible readers
+/// instead of the shared counter, so they do not contend on its cache line.
+/// Writers clear the bias and scan the table for readers instead, the bias is
+/// restored after some further shared acquisitions.
+void
+latch_set_read_mostly(latch_t* latch);
+
 void
 latch_acquire_read(latch_t* latch);
 
@@ -23,6 +46,18 @@ latch_acquire_write(latch_t* latch);
 bool
 latch_try_acquire_write(latch_t* latch);
 
+/// Acquires the latch exclusively without stopping new readers while waiting.
+/// Required if readers might wait for other latches while holding this one,
+/// the waiting writer would otherwise block the threads they wait for.
+void
+latch_acquire_write_reader_biased(latch_t* latch);
+
+/// Upgrades a shared latch to an exclusive one if the thread is the only
+/// reader. Never waits, other readers might try to upgrade as well. The latch
+/// is still held shared if the upgrade fails.
+bool
+latch_try_upgrade(latch_t* latch);
+
 void
 latch_acquire(latch_t* latch, bool exclusive);
 
@@ -35,6 +70,24 @@ latch_release_write(latch_t* latch);
 bool
 latch_available(const latch_t* latch);
 
+/// Counters of all latches of the process, see latch_stats_snapshot.
+typedef struct {
+    /// Number of shared and exclusive acquisitions, successful upgrades count
+    /// as exclusive acquisitions.
+    uint64_t shared;
+    uint64_t exclusive;
+
+    /// Number of backoff rounds of waiting threads that spun, yielded the
+    /// processor or parked the thread.
+    uint64_t spins;
+    uint64_t yields;
+    uint64_t parks;
+} latch_stats_t;
+
+/// Sums the counters of all threads, see pager_stats_snapshot.
+void
+latch_stats_snapshot(latch_stats_t* out);
+
 defer_impl(latch_release_read) {
     defer_guard();
     latch_release_read(defer_arg(latch_t));
@@ -45,6 +98,6 @@ defer_impl(latch_release_write) {
     latch_release_write(defer_arg(latch_t));
 }
 
-#define assert_latch_read_access(latch) assert(latch != 0)
+#define assert_latch_read_access(latch) assert(((latch) & (LATCH_WRITER | LATCH_READERS | LATCH_READ_MOSTLY)) != 0)
 
-#define assert_latch_write_access(latch) assert(latch < 0)
+#define assert_latch_write_access(latch) assert(((latch) & LATCH_WRITER) != 0)
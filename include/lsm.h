@@ -0,0 +1,59 @@
+#pragma once
+
+#include "blob.h"
+#include "error.h"
+#include "pager.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Log-structured table beside btree_t. Writes land in an in-memory skiplist
+/// (the memtable) and never touch a page on the writing thread. Full memtables
+/// are frozen and a background thread bulk builds them into immutable tables
+/// (runs), see btree_table_build, and merges the runs once there are enough of
+/// them. Memtables are not logged, rows are only durable once their memtable
+/// was flushed to a run.
+typedef struct lsm_t lsm_t;
+
+/// Opens the table with the given name, the runs are stored in the catalog as
+/// "name.seq" and reopened in the order of their sequence numbers. The memtable
+/// size is the number of bytes of a memtable, including its index.
+result_t
+lsm_open(lsm_t** out, pager_t* pager, const char* name, size_t memtable_size);
+
+/// Inserts or replaces the value of a row. Values are limited to a quarter of
+/// the page size.
+result_t
+lsm_put(lsm_t* lsm, uint64_t id, blob_t value);
+
+/// Deletes a row, deleting a missing row is not an error.
+result_t
+lsm_delete(lsm_t* lsm, uint64_t id);
+
+/// Looks up a value, probes the memtables and then the runs from newest to
+/// oldest. Sets found to false for missing rows. The value is copied into a
+/// thread local buffer, which is only valid until the next lookup on the same
+/// thread.
+result_t
+lsm_find(lsm_t* lsm, uint64_t id, blob_t* out, bool* found);
+
+/// Looks up a value like lsm_find, but fails with ENOENT for missing rows.
+result_t
+lsm_lookup(lsm_t* lsm, uint64_t id, blob_t* out);
+
+/// Freezes the current memtable and waits until all frozen memtables were
+/// written to runs. Fails with the error of the background thread if a flush or
+/// a merge failed.
+result_t
+lsm_flush(lsm_t* lsm);
+
+/// Returns the number of runs, i.e. the number of trees probed by a lookup
+/// that misses all memtables.
+uint32_t
+lsm_get_run_count(lsm_t* lsm);
+
+/// Flushes the memtables, stops the background thread and frees the table. No
+/// other thread might use the table.
+result_t
+lsm_close(lsm_t** out);
@@ -1,54 +1,239 @@
 #pragma once
 
+#include "blob.h"
 #include "error.h"
 #include "deffer.h"
 
 #include <stdint.h>
 
 /// The minimum alignment of a page guaranteed by the pager.
-#define PAGE_ALIGNMENT 4
+#define PAGE_ALIGNMENT 8
 
 /// The unique id of a page. Zero is an invalid page ID.
 typedef uint32_t page_id_t;
 
+/// Log sequence number, the position after a record in the write-ahead log.
+/// The first bytes of every page store the LSN of the last record that
+/// modified the page.
+typedef uint64_t lsn_t;
+
+typedef struct wal_t wal_t;
+
+/// Page reserved for metadata, i.e. the catalog. Never returned by pager_next.
+#define PAGER_META_PAGE 1
+
+/// Number of consecutive page ids in an extent. Pages allocated with a hint
+/// are placed in the extent of the hint, so related pages stay close.
+#define PAGER_EXTENT_SIZE 64
+
 typedef struct {
     page_id_t id;
     unsigned char* data;
 } page_t;
 
+/// Location of the last checkpoint in the log, see pager_checkpoint.
+typedef struct {
+    /// End of the log when the checkpoint started.
+    lsn_t begin;
+
+    /// End of the last record of the checkpoint, zero if there is none.
+    lsn_t end;
+} pager_checkpoint_t;
+
 /// Thread safe page cache implementation. Uses a hash map for page lookups and
-/// CLOCK ring with a retry bit for page eviction.
+/// CLOCK ring for page eviction, see pager_policy_t.
 typedef struct pager_t pager_t;
 
+/// Replacement policy of a pager, decides which pages get another pass of the
+/// CLOCK hand.
+typedef enum {
+    /// Every fix sets the reference bit, which saves the page once. A single
+    /// large scan replaces the whole working set.
+    PAGER_POLICY_CLOCK,
+
+    /// Like the first queue of 2Q, new pages are on probation and the fix
+    /// that created the page does not reference it. Pages read once by a scan
+    /// are the first victims.
+    PAGER_POLICY_PROBATION,
+
+    /// Pages on probation, and every pass of the hand that finds the page
+    /// referenced raises its usage count up to PAGER_MAX_USAGE. Pages lose
+    /// one count per pass, so frequently used pages survive several passes
+    /// without a fix, similar to LRU-K.
+    PAGER_POLICY_FREQUENCY,
+} pager_policy_t;
+
+/// Highest usage count of PAGER_POLICY_FREQUENCY.
+#define PAGER_MAX_USAGE 3
+
 /// Allocates and initialises a new pager. The total capacity of the pager is
 /// about 70% of the hash map directory, and the directory size has to be a
 /// power of 2.
 result_t
 pager_open(pager_t** out, uint16_t page_size, uint32_t directory_size);
 
+/// Allocates and initialises a new pager that holds as many pages as fit into
+/// the bytes, including the headers of the pages. The directory is sized for
+/// the capacity.
+result_t
+pager_open_capacity(pager_t** out, uint16_t page_size, uint64_t bytes);
+
+/// Allocates and initialises a new pager that is backed by a file. Pages are
+/// read from the file on the first fix and written back on eviction. All pages
+/// in the file are treated as allocated.
+result_t
+pager_open_file(pager_t** out, const char* path, uint16_t page_size, uint32_t directory_size);
+
+/// Changes the capacity to the pages that fit into the bytes, see
+/// pager_open_capacity, while other threads keep fixing pages. Shrinking
+/// evicts pages down to the new capacity and releases the memory of their
+/// frames, and fails with ENOMEM if too many pages are fixed; the pager keeps
+/// the new capacity and evicts on later misses. The directory is rehashed
+/// entry by entry, threads only wait for the entries that are moved.
+result_t
+pager_resize(pager_t* pager, uint64_t bytes);
+
+/// Changes the replacement policy, the default is PAGER_POLICY_CLOCK. Pages
+/// created before keep their probation state.
+void
+pager_set_policy(pager_t* pager, pager_policy_t policy);
+
+/// Sets the log of the pager. The log is flushed up to the LSN of a page
+/// before the page is written back, and pager_log appends to it.
+void
+pager_set_wal(pager_t* pager, wal_t* wal);
+
+/// Counters of all pagers of the process, see pager_stats_snapshot.
+typedef struct {
+    /// Number of fixes that found the page in memory.
+    uint64_t hits;
+
+    /// Number of fixes that had to create the page, i.e. read it from the file.
+    uint64_t misses;
+
+    /// Number of pages evicted to make room for other pages.
+    uint64_t evictions;
+
+    /// Number of ring entries looked at to find a page to evict.
+    uint64_t evict_scanned;
+
+    /// Number of recently used pages that were skipped once by clearing their
+    /// reference flag or lowering their usage count.
+    uint64_t evict_cleared;
+
+    /// Number of evictions that found no page to evict.
+    uint64_t evict_failures;
+} pager_stats_t;
+
+/// Sums the counters of all threads. The counters only grow, rates are the
+/// difference of two snapshots.
+void
+pager_stats_snapshot(pager_stats_t* out);
+
 /// Returns the size of a single page.
 uint16_t
 pager_get_page_size(const pager_t* pager);
 
 /// Retrieves a page. With write lock if exclusive is set to true and with a
-/// shared read lock if exclusive is set to false.
+/// shared read lock if exclusive is set to false. Pages that were not written
+/// before are zeroed.
 result_t
 pager_fix(pager_t* pager, page_id_t id, bool exclusive, page_t* out);
 
-/// Retrieves a new page with write lock.
+/// Allocates a new and zeroed page and retrieves it with write lock. The page
+/// is placed after the hint in the same extent if possible, otherwise in an
+/// empty extent. Freed page ids are reused.
+result_t
+pager_alloc(pager_t* pager, page_id_t hint, page_t* out);
+
+/// Allocates a new page in an empty extent and retrieves it with write lock.
 result_t
 pager_next(pager_t* pager, page_t* out);
 
+/// Allocates a range of consecutive page ids in new extents and returns the
+/// first one. The pages are created on the first pager_fix.
+result_t
+pager_reserve(pager_t* pager, uint32_t count, page_id_t* first);
+
+/// Returns allocated page ids that are not in use, e.g. the unused part of a
+/// reserved range. The pages must not be fixed again.
+void
+pager_release(pager_t* pager, page_id_t first, uint32_t count);
+
+/// Drops an exclusively fixed page from the pager, releases the lock and
+/// returns the id to the allocator. The page has to be unreachable for other
+/// threads, threads that fixed it before are waited for.
+void
+pager_free(pager_t* pager, page_t page);
+
+/// Returns the LSN stored at the start of the page.
+lsn_t
+pager_get_lsn(page_t page);
+
+/// Stores the LSN at the start of the page.
+void
+pager_set_lsn(page_t page, lsn_t lsn);
+
+/// Appends a record for a change to an exclusively fixed page to the log and
+/// stores its LSN in the page. Does nothing if the pager has no log.
+result_t
+pager_log(pager_t* pager, page_t page, uint8_t type, blob_t payload);
+
+/// Appends the image of an exclusively fixed page to the log, see pager_log.
+result_t
+pager_log_image(pager_t* pager, page_t page);
+
+/// Writes all modified pages back to the file and syncs it. Pages that are
+/// fixed exclusively are waited for.
+result_t
+pager_flush(pager_t* pager);
+
+/// Writes a fuzzy checkpoint. Appends the table of modified pages, each with
+/// a lower bound for the start of the first record that is not yet in the
+/// file, and stores the location of the checkpoint in the unused page zero of
+/// the file. Writers are not blocked, but only one checkpoint might run at a
+/// time. Requires a log.
+result_t
+pager_checkpoint(pager_t* pager);
+
+/// Reads the location of the last checkpoint, which is zeroed if there is
+/// none or the pager is not backed by a file.
+result_t
+pager_get_checkpoint(const pager_t* pager, pager_checkpoint_t* out);
+
+/// Marks a page id as allocated, used by the recovery for pages that were
+/// allocated after the file was last written.
+result_t
+pager_claim(pager_t* pager, page_id_t id);
+
+/// Upgrades a shared fixed page to an exclusive one, see latch_try_upgrade.
+/// The page stays fixed shared if the upgrade fails.
+bool
+pager_try_upgrade(page_t page);
+
+/// Lets readers of a page that is read by most operations register in a
+/// global table instead of the shared counter of its latch, see
+/// latch_set_read_mostly. The page has to be fixed, the flag is lost when the
+/// page is evicted.
+void
+pager_set_read_mostly(page_t page);
+
 /// Unfixes a page and releases the lock.
 void
 pager_unfix(page_t page);
 
+/// Unfixes a page without referencing it, for pages that are used once like
+/// the leaves of a scan. Pages that nobody else references are evicted first.
+void
+pager_unfix_once(page_t page);
+
 defer_impl(pager_unfix) {
     defer_guard();
     pager_unfix(*defer_arg(page_t));
 }
 
-/// Closes the pager and frees all allocated pages. Should only be called if no
-/// page is fixed any more. Otherwise, the behaviour is undefined.
+/// Closes the pager and frees all allocated pages, modified pages are written
+/// back to the file first. Should only be called if no page is fixed any
+/// more. Otherwise, the behaviour is undefined.
 result_t
 pager_close(pager_t** out);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "error.h"
+#include "pager.h"
+#include "wal.h"
+#include "winter.h"
+
+#include <stdint.h>
+
+/// Summary of a recovery run.
+typedef struct {
+    /// Position in the log from which the records were read.
+    lsn_t start;
+
+    /// Number of records read from the log.
+    uint64_t record_count;
+
+    /// Number of records applied to pages that did not contain them yet.
+    uint64_t redo_count;
+} recovery_stats_t;
+
+/// Brings the pages in the file up to date with the log after a crash. The
+/// log is read from the last checkpoint on, or from the oldest change of a
+/// page in its dirty page table. The records are partitioned by page id across
+/// the worker threads, so the changes to each page are applied in log order.
+/// Afterward all pages are written back and a new checkpoint is written. The
+/// log has to be set for the pager and no other thread might use the pager
+/// during the recovery. The stats are optional.
+result_t
+recovery_run(pager_t* pager, wal_t* wal, uint32_t threads, recovery_stats_t* out);
+
+/// Copies a file as it is on disk, i.e. the state after a crash at this point.
+TEST_ONLY result_t
+recovery_copy_file(const char* source, const char* target);
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+/// Number of bits of a latency below its highest set bit that select the
+/// bucket, i.e. eight buckets per power of two with a relative error of at
+/// most one eighth.
+#define STATS_HISTOGRAM_SUB_BITS 3
+
+#define STATS_HISTOGRAM_BUCKETS ((64 - STATS_HISTOGRAM_SUB_BITS + 1) << STATS_HISTOGRAM_SUB_BITS)
+
+/// Every thread records the latency of every n-th operation per histogram.
+#define STATS_DEFAULT_SAMPLE_RATE 16
+
+/// Runtime counters of the whole process, see pager_stats_snapshot,
+/// latch_stats_snapshot and btree_stats_snapshot.
+typedef enum {
+    STATS_PAGER_HITS,
+    STATS_PAGER_MISSES,
+    STATS_PAGER_EVICTIONS,
+    STATS_PAGER_EVICT_SCANNED,
+    STATS_PAGER_EVICT_CLEARED,
+    STATS_PAGER_EVICT_FAILURES,
+
+    STATS_LATCH_SHARED,
+    STATS_LATCH_EXCLUSIVE,
+    STATS_LATCH_SPINS,
+    STATS_LATCH_YIELDS,
+    STATS_LATCH_PARKS,
+
+    STATS_BTREE_LOOKUPS,
+    STATS_BTREE_INSERTS,
+    STATS_BTREE_SPLITS,
+    STATS_BTREE_COMPACTIONS,
+    STATS_BTREE_COMPACTED_LEAVES,
+
+    STATS_COUNT,
+} stats_counter_t;
+
+/// Latency histograms of the whole process, in nanoseconds.
+typedef enum {
+    /// Fixes that had to create the page, including the eviction.
+    STATS_HISTOGRAM_PAGER_MISS,
+    STATS_HISTOGRAM_PAGER_EVICT,
+
+    /// Acquisitions that had to back off, from the first backoff round on.
+    STATS_HISTOGRAM_LATCH_WAIT,
+
+    STATS_HISTOGRAM_BTREE_LOOKUP,
+    STATS_HISTOGRAM_BTREE_INSERT,
+
+    /// Inserts that split at least one page, also recorded as inserts.
+    STATS_HISTOGRAM_BTREE_SPLIT,
+
+    STATS_HISTOGRAM_COUNT,
+} stats_histogram_t;
+
+/// Histogram merged from all threads, see stats_latency_snapshot.
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} stats_latency_t;
+
+/// Counters of one thread. Only the owning thread writes them, so counting
+/// needs no atomic read-modify-write and touches no shared cache line.
+/// Snapshots sum the shards of all threads. Shards of finished threads are
+/// reused by new threads and keep their counts.
+typedef struct stats_shard_t {
+    alignas(64) _Atomic uint64_t counters[STATS_COUNT];
+
+    /// Operations per histogram until the next one is sampled.
+    uint32_t countdown[STATS_HISTOGRAM_COUNT];
+    _Atomic uint64_t histograms[STATS_HISTOGRAM_COUNT][STATS_HISTOGRAM_BUCKETS];
+
+    _Atomic bool used;
+    struct stats_shard_t* next;
+} stats_shard_t;
+
+extern _Thread_local stats_shard_t* stats_local;
+
+extern _Atomic uint32_t stats_sample_rate;
+
+/// Claims a shard for the calling thread.
+stats_shard_t*
+stats_register(void);
+
+/// Sums a range of counters over all shards, the result might miss
+/// increments that happen concurrently.
+void
+stats_sum(stats_counter_t first, uint32_t count, uint64_t* out);
+
+/// Records the latency of every rate-th operation of a thread per histogram,
+/// zero disables the histograms.
+void
+stats_set_sample_rate(uint32_t rate);
+
+/// Merges the histogram of all threads.
+void
+stats_latency_snapshot(stats_histogram_t histogram, stats_latency_t* out);
+
+/// Returns the upper bound of the bucket of the latency at the quantile, or
+/// zero for empty histograms.
+uint64_t
+stats_latency_percentile(const stats_latency_t* latency, double quantile);
+
+/// Returns the bucket of a latency, buckets grow exponentially.
+__attribute__((unused)) static inline uint32_t
+stats_bucket(const uint64_t value) {
+    if (value < (1u << STATS_HISTOGRAM_SUB_BITS)) {
+        return (uint32_t)value;
+    }
+
+    const uint32_t shift = (uint32_t)(63 - __builtin_clzll(value) - STATS_HISTOGRAM_SUB_BITS);
+    const uint32_t sub = (uint32_t)(value >> shift) & ((1u << STATS_HISTOGRAM_SUB_BITS) - 1);
+
+    return ((shift + 1) << STATS_HISTOGRAM_SUB_BITS) | sub;
+}
+
+__attribute__((unused)) static inline void
+stats_add(const stats_counter_t counter, const uint64_t value) {
+    stats_shard_t* shard = stats_local != nullptr ? stats_local : stats_register();
+    _Atomic uint64_t* slot = &shard->counters[counter];
+
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/// Returns the count of the calling thread.
+__attribute__((unused)) static inline uint64_t
+stats_local_count(const stats_counter_t counter) {
+    stats_shard_t* shard = stats_local != nullptr ? stats_local : stats_register();
+
+    return atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+}
+
+/// Starts to measure an operation for the histogram. Returns zero if the
+/// operation is not sampled, otherwise the start time for stats_record.
+__attribute__((unused)) static inline uint64_t
+stats_start(const stats_histogram_t histogram) {
+    stats_shard_t* shard = stats_local != nullptr ? stats_local : stats_register();
+
+    if (shard->countdown[histogram] > 1) {
+        shard->countdown[histogram] -= 1;
+        return 0;
+    }
+
+    const uint32_t rate = atomic_load_explicit(&stats_sample_rate, memory_order_relaxed);
+    if (rate == 0) {
+        return 0;
+    }
+    shard->countdown[histogram] = rate;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/// Records the latency of an operation started with stats_start, ignores
+/// operations that were not sampled.
+__attribute__((unused)) static inline void
+stats_record(const stats_histogram_t histogram, const uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const uint64_t end = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+
+    _Atomic uint64_t* slot = &stats_local->histograms[histogram][stats_bucket(end - start)];
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + 1, memory_order_relaxed);
+}
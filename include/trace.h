@@ -0,0 +1,65 @@
+#pragma once
+
+#include "error.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Number of events per thread, older events are overwritten.
+#define TRACE_RING_SIZE 4096
+
+typedef enum {
+    /// A latch acquisition started to back off, the argument is the latch.
+    TRACE_LATCH_WAIT_BEGIN,
+
+    /// The contended acquisition succeeded, the argument is the latch.
+    TRACE_LATCH_WAIT_END,
+
+    /// A fix had to create the page, the argument is the page id.
+    TRACE_PAGER_MISS,
+
+    /// The argument is the page id of the victim.
+    TRACE_PAGER_EVICT,
+
+    /// The argument is the page id of the split page.
+    TRACE_BTREE_SPLIT,
+} trace_kind_t;
+
+/// Event as stored in the ring and in the dump, time is in nanoseconds of
+/// CLOCK_MONOTONIC.
+typedef struct {
+    uint64_t time;
+    uint64_t argument;
+    uint32_t thread;
+    uint32_t kind;
+} trace_event_t;
+
+extern _Atomic bool trace_enabled;
+
+/// Starts or stops recording events, recorded events are kept.
+void
+trace_enable(bool enabled);
+
+/// Appends an event to the ring of the calling thread, see trace_event.
+void
+trace_record(trace_kind_t kind, uint64_t argument);
+
+/// Writes the events of all threads ordered by time to a binary file. Events
+/// that are overwritten while dumping are skipped.
+result_t
+trace_dump(const char* path);
+
+/// Converts a dump to the JSON format of the Chrome trace viewer, latch
+/// waits become duration events and all other events instant events.
+result_t
+trace_convert(const char* dump_path, const char* json_path);
+
+/// Records an event if tracing is enabled, costs a single load and branch
+/// otherwise.
+__attribute__((unused)) static inline void
+trace_event(const trace_kind_t kind, const uint64_t argument) {
+    if (__builtin_expect(atomic_load_explicit(&trace_enabled, memory_order_relaxed), 0)) {
+        trace_record(kind, argument);
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "blob.h"
+#include "error.h"
+#include "pager.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Write-ahead log. Records are buffered in memory and written by whichever
+/// thread flushes first, a single sync makes the records of all waiting
+/// threads durable (group commit).
+typedef struct wal_t wal_t;
+
+/// Types of the log records.
+enum {
+    /// Marks the end of a unit of work, has no page and no payload.
+    WAL_RECORD_COMMIT = 1,
+
+    /// After image of a whole page, used for structural changes.
+    WAL_RECORD_PAGE_IMAGE = 2,
+
+    /// Insert of a cell into a leaf, the payload is the cell.
+    WAL_RECORD_LEAF_INSERT = 3,
+
+    /// Insert of a separator into an inner page, the payload is the id of the
+    /// new child followed by the key.
+    WAL_RECORD_INNER_INSERT = 4,
+
+    /// Part of the dirty page table of a fuzzy checkpoint, has no page. The
+    /// payload is the LSN at the start of the checkpoint followed by pairs of
+    /// page id and recovery LSN, see pager_checkpoint.
+    WAL_RECORD_CHECKPOINT = 5,
+
+    /// Message of a buffered tree, applied to a leaf or added to the buffer of
+    /// an inner page. The payload is the message.
+    WAL_RECORD_MESSAGE = 6,
+};
+
+/// Record as returned by wal_read.
+typedef struct {
+    /// End of the record in the log, pages modified by the record store this
+    /// LSN.
+    lsn_t lsn;
+
+    uint8_t type;
+    page_id_t page;
+    blob_t payload;
+} wal_record_t;
+
+/// Opens or creates the log file. Records after the last complete record,
+/// i.e. from a torn write, are discarded.
+result_t
+wal_open(wal_t** out, const char* path);
+
+/// Appends a record to the log buffer and returns its LSN. The record is not
+/// durable before the log is flushed.
+result_t
+wal_append(wal_t* wal, uint8_t type, page_id_t page, blob_t payload, lsn_t* out);
+
+/// Waits until all records up to the LSN are durable.
+result_t
+wal_flush(wal_t* wal, lsn_t lsn);
+
+/// Appends a commit record and waits until it is durable. Concurrent commits
+/// share the sync of the log file.
+result_t
+wal_commit(wal_t* wal, lsn_t* out);
+
+/// Returns the end of the last appended record.
+lsn_t
+wal_get_end_lsn(wal_t* wal);
+
+/// Returns the end of the durable part of the log.
+lsn_t
+wal_get_flushed_lsn(wal_t* wal);
+
+/// Reads the durable record at the cursor and advances the cursor to the next
+/// record, start with a cursor of zero. Sets found to false at the end of the
+/// log. The payload is valid until the next read, reads must not run
+/// concurrently.
+result_t
+wal_read(wal_t* wal, lsn_t* cursor, wal_record_t* out, bool* found);
+
+/// Flushes the log and closes it.
+result_t
+wal_close(wal_t** out);
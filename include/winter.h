@@ -44,6 +44,16 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// not declared by unistd.h in strict POSIX mode
+extern long
+syscall(long number, ...);
+#endif
+
 #include "error.h"
 
 #define WINTER_VERSION "0.0.1"
@@ -53,6 +63,14 @@
 #define WINTER_DEFAULT_TIMEOUT_MS 2000
 #define WINTER_PROCESS_POLL_MS 5
 
+#define WINTER_BENCH_TIMEOUT_MS 60000
+#define WINTER_BENCH_DEFAULT_TIME_MS 500
+#define WINTER_BENCH_CALIBRATION_MS 50
+#define WINTER_BENCH_MAX_SAMPLES (1 << 16)
+#define WINTER_BENCH_MAX_NAME 260
+#define WINTER_BENCH_MAX_COUNTERS 8
+#define WINTER_BENCH_PERF_EVENTS 6
+
 #define WINTER_COLOR_BOLD "\033[1m"
 #define WINTER_COLOR_RESET "\033[0m"
 #define WINTER_COLOR_SUCCESS "\033[32m"
@@ -76,6 +94,12 @@ enum {
     _WINTER_OPT_DEBUG,
     _WINTER_OPT_RERUN,
     _WINTER_OPT_TIMEOUT,
+    _WINTER_OPT_BENCH,
+    _WINTER_OPT_BENCH_PERF,
+    _WINTER_OPT_BENCH_TIME,
+    _WINTER_OPT_BENCH_FORMAT,
+    _WINTER_OPT_BENCH_OUTPUT,
+    _WINTER_OPT_BASELINE,
     _WINTER_OPT_LAST,
 };
 
@@ -91,6 +115,7 @@ typedef struct {
     uint64_t id;
     uint16_t threads;
     double timeout;
+    bool bench;
 } winter_test_t;
 
 typedef struct {
@@ -99,6 +124,48 @@ typedef struct {
     void (*func)(uint64_t, winter_array_t*);
 } winter_suite_t;
 
+typedef struct {
+    char name[WINTER_BENCH_MAX_NAME];
+    double ns_per_op;
+} winter_baseline_t;
+
+typedef struct {
+    const char* name;
+    uint64_t value;
+} winter_counter_t;
+
+enum {
+    _WINTER_BENCH_CALIBRATE,
+    _WINTER_BENCH_MEASURE,
+    _WINTER_BENCH_DONE,
+};
+
+/// State of one benchmark thread. The body runs for the calibration time
+/// first, which determines the number of measured iterations. Only every
+/// stride-th measured iteration is timed on its own for the percentiles.
+typedef struct {
+    uint64_t iteration;
+    uint64_t count;
+    uint64_t target;
+    uint64_t stride;
+
+    uint64_t phase_start;
+    uint64_t sample_start;
+    uint64_t start;
+    uint64_t end;
+
+    uint64_t* samples;
+    uint32_t sample_count;
+
+    /// Hardware counters of the measured iterations, a negative file
+    /// descriptor marks a counter that is not available.
+    int perf_fds[WINTER_BENCH_PERF_EVENTS];
+    uint64_t perf[WINTER_BENCH_PERF_EVENTS];
+
+    uint8_t phase;
+    bool sampling;
+} winter_bench_t;
+
 typedef struct {
     bool initialized;
 
@@ -115,7 +182,19 @@ typedef struct {
         bool color;
         bool rerun;
         bool timeout;
+        bool bench;
     } opts;
+
+    struct {
+        double time;
+        bool json;
+        bool perf;
+        const char* output;
+        winter_array_t baseline;
+
+        winter_counter_t counters[WINTER_BENCH_MAX_COUNTERS];
+        uint32_t counter_count;
+    } bench;
 } winter_t;
 
 /// Global state, shared between threads and resources.
@@ -126,6 +205,7 @@ typedef struct {
     uint32_t linenum;
 
     uint16_t thread_id;
+    winter_bench_t* bench;
 } winter_local_t;
 
 /// Thread local state, private to each thread.
@@ -141,6 +221,7 @@ typedef struct {
 typedef struct {
     winter_unit_t* unit;
     uint16_t thread_id;
+    winter_bench_t* bench;
 } winter_args_t;
 
 typedef struct {
@@ -208,7 +289,9 @@ _winter_initialize(void) {
     _winter.initialized = true;
     _winter_array_init(&_winter.suites, sizeof(winter_suite_t));
     _winter_array_init(&_winter.patterns, sizeof(const char*));
+    _winter_array_init(&_winter.bench.baseline, sizeof(winter_baseline_t));
     _winter.print.file = stderr;
+    _winter.bench.time = WINTER_BENCH_DEFAULT_TIME_MS;
     pthread_mutex_init(&_winter.print.mutex, nullptr);
 }
 
@@ -227,6 +310,14 @@ _winter_now(void) {
     return (double)tv.tv_sec * 1000.0 + (double)tv.tv_usec / 1000.0;
 }
 
+WINTER_FUNC uint64_t
+_winter_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
 WINTER_FUNC void
 _winter_sleep_ms(uint32_t ms) {
     struct timespec ts = {
@@ -312,10 +403,462 @@ _winter_print_summary(const double start_time, const uint32_t success_count, con
     _winter_print("\n");
 }
 
+// ### BENCHMARKS #####################################################################################################
+
+static const char* const _winter_perf_names[WINTER_BENCH_PERF_EVENTS] = {
+    "instructions", "cycles", "l1d-misses", "llc-misses", "branch-misses", "dtlb-misses",
+};
+
+#ifdef __linux__
+#define _WINTER_PERF_CACHE(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} _winter_perf_events[WINTER_BENCH_PERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HW_CACHE, _WINTER_PERF_CACHE(PERF_COUNT_HW_CACHE_L1D) },
+    { PERF_TYPE_HW_CACHE, _WINTER_PERF_CACHE(PERF_COUNT_HW_CACHE_LL) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, _WINTER_PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB) },
+};
+#endif
+
+/// Starts the hardware counters of the calling thread. Every counter is opened
+/// on its own, counters the hardware, the kernel or the permissions do not
+/// allow are skipped.
+WINTER_FUNC void
+_winter_perf_start(winter_bench_t* bench) {
+    for (uint32_t i = 0; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+        bench->perf_fds[i] = -1;
+    }
+    if (!_winter.bench.perf) {
+        return;
+    }
+
+#ifdef __linux__
+    for (uint32_t i = 0; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = _winter_perf_events[i].type;
+        attr.config = _winter_perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        bench->perf_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    for (uint32_t i = 0; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+        if (bench->perf_fds[i] >= 0) {
+            ioctl(bench->perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(bench->perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+/// Stops the hardware counters of the calling thread. Counters that were
+/// multiplexed with others are scaled up to the whole measurement.
+WINTER_FUNC void
+_winter_perf_stop(winter_bench_t* bench) {
+#ifdef __linux__
+    for (uint32_t i = 0; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+        if (bench->perf_fds[i] >= 0) {
+            ioctl(bench->perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    for (uint32_t i = 0; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+        const int fd = bench->perf_fds[i];
+        if (fd < 0) {
+            continue;
+        }
+
+        // value, time enabled and time running
+        uint64_t values[3];
+        if (read(fd, values, sizeof(values)) == sizeof(values) && values[2] > 0) {
+            bench->perf[i] = (uint64_t)((double)values[0] * (double)values[1] / (double)values[2]);
+        } else {
+            bench->perf_fds[i] = -1;
+        }
+        close(fd);
+    }
+#else
+    (void)bench;
+#endif
+}
+
+WINTER_FUNC void
+_winter_bench_start(void) {
+    winter_bench_t* bench = _winter_local.bench;
+    if (bench == nullptr) {
+        _winter_fatal_error("Benchmark loop outside of a benchmark");
+    }
+
+    bench->samples = malloc(sizeof(uint64_t) * WINTER_BENCH_MAX_SAMPLES);
+    if (bench->samples == nullptr) {
+        _winter_fatal_error("Sample allocation failed");
+    }
+
+    bench->phase = _WINTER_BENCH_CALIBRATE;
+    bench->phase_start = _winter_now_ns();
+}
+
+/// Condition of the benchmark loop, evaluated before every iteration.
+WINTER_FUNC bool
+_winter_bench_next(void) {
+    winter_bench_t* bench = _winter_local.bench;
+
+    if (bench->phase == _WINTER_BENCH_CALIBRATE) {
+        const uint64_t now = _winter_now_ns();
+        const uint64_t elapsed = now - bench->phase_start;
+
+        if (elapsed < WINTER_BENCH_CALIBRATION_MS * 1000000ull || bench->count == 0) {
+            bench->count += 1;
+            bench->iteration += 1;
+            return true;
+        }
+
+        const double target = (double)bench->count * _winter.bench.time * 1000000.0 / (double)elapsed;
+        bench->target = target < 1 ? 1 : (uint64_t)target;
+        bench->stride = bench->target / WINTER_BENCH_MAX_SAMPLES + 1;
+        bench->count = 0;
+        bench->phase = _WINTER_BENCH_MEASURE;
+        _winter_perf_start(bench);
+        bench->start = _winter_now_ns();
+    }
+
+    if (bench->phase != _WINTER_BENCH_MEASURE) {
+        return false;
+    }
+
+    if (bench->sampling) {
+        bench->samples[bench->sample_count++] = _winter_now_ns() - bench->sample_start;
+        bench->sampling = false;
+    }
+
+    if (bench->count == bench->target) {
+        bench->end = _winter_now_ns();
+        bench->phase = _WINTER_BENCH_DONE;
+        _winter_perf_stop(bench);
+        return false;
+    }
+
+    bench->count += 1;
+    bench->iteration += 1;
+
+    if (bench->count % bench->stride == 0 && bench->sample_count < WINTER_BENCH_MAX_SAMPLES) {
+        bench->sampling = true;
+        bench->sample_start = _winter_now_ns();
+    }
+
+    return true;
+}
+
+WINTER_FUNC void
+_winter_bench_counter(const char* name, const uint64_t value) {
+    if (_winter.bench.counter_count == WINTER_BENCH_MAX_COUNTERS) {
+        _winter_fatal_error("Too many benchmark counters");
+    }
+
+    _winter.bench.counters[_winter.bench.counter_count++] = (winter_counter_t){ name, value };
+}
+
+WINTER_FUNC int
+_winter_bench_compare(const void* a, const void* b) {
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/// Returns the nearest-rank percentile of sorted samples.
+WINTER_FUNC uint64_t
+_winter_bench_percentile(const uint64_t* samples, const uint32_t count, const double p) {
+    if (count == 0) {
+        return 0;
+    }
+
+    const uint32_t index = (uint32_t)(p * (double)count);
+    return samples[index < count ? index : count - 1];
+}
+
+WINTER_FUNC const winter_baseline_t*
+_winter_bench_find_baseline(const char* name) {
+    for (size_t i = 0; i < _winter.bench.baseline.length; ++i) {
+        const winter_baseline_t* baseline = _winter_array_get(&_winter.bench.baseline, i);
+        if (strcmp(baseline->name, name) == 0) {
+            return baseline;
+        }
+    }
+
+    return nullptr;
+}
+
+WINTER_FUNC void
+_winter_bench_load_baseline(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+        _winter_fatal_error("Failed to open baseline %s (%s)", path, strerror(errno));
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        char suite[128], test[128];
+        winter_baseline_t baseline;
+
+        // lines written by the csv output, the header does not match
+        if (sscanf(line, "%127[^,],\"%127[^\"]\",%*u,%*u,%lf", suite, test, &baseline.ns_per_op) != 3) {
+            continue;
+        }
+
+        snprintf(baseline.name, sizeof(baseline.name), "%s:%s", suite, test);
+        _winter_array_push(&_winter.bench.baseline, &baseline);
+    }
+
+    fclose(file);
+}
+
+/// Sums the hardware counters of all threads per measured operation. Returns
+/// a mask of the counters that were available on all threads.
+WINTER_FUNC uint32_t
+_winter_bench_perf(const winter_bench_t* benches, const uint16_t threads, double* per_op) {
+    uint32_t mask = (1u << WINTER_BENCH_PERF_EVENTS) - 1;
+    uint64_t ops = 0;
+
+    for (uint32_t i = 0; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+        per_op[i] = 0;
+    }
+    for (uint16_t i = 0; i < threads; ++i) {
+        ops += benches[i].count;
+
+        for (uint32_t j = 0; j < WINTER_BENCH_PERF_EVENTS; ++j) {
+            if (benches[i].perf_fds[j] < 0) {
+                mask &= ~(1u << j);
+            }
+            per_op[j] += (double)benches[i].perf[j];
+        }
+    }
+
+    for (uint32_t i = 0; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+        per_op[i] /= (double)ops;
+    }
+
+    return mask;
+}
+
+WINTER_FUNC void
+_winter_bench_write(
+  const winter_unit_t* unit,
+  const winter_bench_t* benches,
+  const double ns_per_op,
+  const double ops_per_sec,
+  const uint64_t ops,
+  const uint64_t* samples,
+  const uint32_t sample_count
+) {
+    FILE* file = fopen(_winter.bench.output, "a");
+    if (file == nullptr) {
+        _winter_print(WINTER_INDENT "Failed to open benchmark output (%s).\n", strerror(errno));
+        return;
+    }
+
+    const uint64_t p50 = _winter_bench_percentile(samples, sample_count, 0.5);
+    const uint64_t p90 = _winter_bench_percentile(samples, sample_count, 0.9);
+    const uint64_t p99 = _winter_bench_percentile(samples, sample_count, 0.99);
+    const uint64_t p999 = _winter_bench_percentile(samples, sample_count, 0.999);
+    const uint64_t max = sample_count > 0 ? samples[sample_count - 1] : 0;
+
+    if (!_winter.bench.json) {
+        fprintf(
+          file,
+          "%s,\"%s\",%u,%ju,%.3f,%.0f,%ju,%ju,%ju,%ju,%ju\n",
+          unit->suite->name,
+          unit->test->name,
+          unit->test->threads,
+          (uintmax_t)ops,
+          ns_per_op,
+          ops_per_sec,
+          (uintmax_t)p50,
+          (uintmax_t)p90,
+          (uintmax_t)p99,
+          (uintmax_t)p999,
+          (uintmax_t)max
+        );
+    } else {
+        fprintf(
+          file,
+          "{\"suite\":\"%s\",\"test\":\"%s\",\"threads\":%u,\"ops\":%ju,\"ns_per_op\":%.3f,\"ops_per_sec\":%.0f,"
+          "\"p50_ns\":%ju,\"p90_ns\":%ju,\"p99_ns\":%ju,\"p999_ns\":%ju,\"max_ns\":%ju,\"per_thread\":[",
+          unit->suite->name,
+          unit->test->name,
+          unit->test->threads,
+          (uintmax_t)ops,
+          ns_per_op,
+          ops_per_sec,
+          (uintmax_t)p50,
+          (uintmax_t)p90,
+          (uintmax_t)p99,
+          (uintmax_t)p999,
+          (uintmax_t)max
+        );
+
+        for (uint16_t i = 0; i < unit->test->threads; ++i) {
+            const winter_bench_t* bench = &benches[i];
+            fprintf(
+              file,
+              "%s{\"ops\":%ju,\"ns_per_op\":%.3f}",
+              i > 0 ? "," : "",
+              (uintmax_t)bench->count,
+              (double)(bench->end - bench->start) / (double)bench->count
+            );
+        }
+
+        fprintf(file, "],\"counters\":{");
+        for (uint32_t i = 0; i < _winter.bench.counter_count; ++i) {
+            const winter_counter_t* counter = &_winter.bench.counters[i];
+            fprintf(file, "%s\"%s\":%ju", i > 0 ? "," : "", counter->name, (uintmax_t)counter->value);
+        }
+
+        // hardware counters per operation, unavailable counters are left out
+        double per_op[WINTER_BENCH_PERF_EVENTS];
+        const uint32_t mask = _winter_bench_perf(benches, unit->test->threads, per_op);
+
+        fprintf(file, "},\"perf\":{");
+        for (uint32_t i = 0, first = 1; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+            if (mask & (1u << i)) {
+                fprintf(file, "%s\"%s\":%.3f", first ? "" : ",", _winter_perf_names[i], per_op[i]);
+                first = 0;
+            }
+        }
+
+        fprintf(file, "}}\n");
+    }
+
+    fclose(file);
+}
+
+/// Prints the results of all threads of a benchmark, runs in the process of
+/// the benchmark after all threads finished.
+WINTER_FUNC void
+_winter_bench_report(const winter_unit_t* unit, winter_bench_t* benches) {
+    const uint16_t threads = unit->test->threads;
+
+    uint64_t ops = 0, iterations = 0, busy = 0, first = UINT64_MAX, last = 0;
+    uint32_t sample_count = 0;
+    for (uint16_t i = 0; i < threads; ++i) {
+        const winter_bench_t* bench = &benches[i];
+        if (bench->phase != _WINTER_BENCH_DONE) {
+            _winter_print(WINTER_INDENT "Benchmark loop of thread %u did not finish.\n", i);
+            _exit(WINTER_EXIT_FAILURE);
+        }
+
+        ops += bench->count;
+        iterations += bench->iteration;
+        busy += bench->end - bench->start;
+        first = bench->start < first ? bench->start : first;
+        last = bench->end > last ? bench->end : last;
+        sample_count += bench->sample_count;
+    }
+
+    uint64_t* samples = malloc(sizeof(uint64_t) * (sample_count > 0 ? sample_count : 1));
+    if (samples == nullptr) {
+        _winter_fatal_error("Sample allocation failed");
+    }
+
+    uint32_t offset = 0;
+    for (uint16_t i = 0; i < threads; ++i) {
+        memcpy(samples + offset, benches[i].samples, sizeof(uint64_t) * benches[i].sample_count);
+        offset += benches[i].sample_count;
+    }
+    qsort(samples, sample_count, sizeof(uint64_t), _winter_bench_compare);
+
+    const double ns_per_op = (double)busy / (double)ops;
+    const double ops_per_sec = (double)ops * 1e9 / (double)(last - first > 0 ? last - first : 1);
+
+    _winter_print(WINTER_INDENT "%.2f ns/op, %.0f ops/s, %ju ops\n", ns_per_op, ops_per_sec, (uintmax_t)ops);
+    _winter_print(
+      WINTER_INDENT "p50 %ju ns, p90 %ju ns, p99 %ju ns, p99.9 %ju ns, max %ju ns\n",
+      (uintmax_t)_winter_bench_percentile(samples, sample_count, 0.5),
+      (uintmax_t)_winter_bench_percentile(samples, sample_count, 0.9),
+      (uintmax_t)_winter_bench_percentile(samples, sample_count, 0.99),
+      (uintmax_t)_winter_bench_percentile(samples, sample_count, 0.999),
+      (uintmax_t)(sample_count > 0 ? samples[sample_count - 1] : 0)
+    );
+
+    for (uint16_t i = 0; threads > 1 && i < threads; ++i) {
+        winter_bench_t* bench = &benches[i];
+        qsort(bench->samples, bench->sample_count, sizeof(uint64_t), _winter_bench_compare);
+
+        _winter_print(
+          WINTER_INDENT "thread %u: %ju ops, %.2f ns/op, p50 %ju ns, p99 %ju ns\n",
+          i,
+          (uintmax_t)bench->count,
+          (double)(bench->end - bench->start) / (double)bench->count,
+          (uintmax_t)_winter_bench_percentile(bench->samples, bench->sample_count, 0.5),
+          (uintmax_t)_winter_bench_percentile(bench->samples, bench->sample_count, 0.99)
+        );
+    }
+
+    // counters cover the calibration as well
+    for (uint32_t i = 0; i < _winter.bench.counter_count; ++i) {
+        const winter_counter_t* counter = &_winter.bench.counters[i];
+        _winter_print(
+          WINTER_INDENT "%s %ju (%.4f/op)\n",
+          counter->name,
+          (uintmax_t)counter->value,
+          (double)counter->value / (double)iterations
+        );
+    }
+
+    if (_winter.bench.perf) {
+        double per_op[WINTER_BENCH_PERF_EVENTS];
+        const uint32_t mask = _winter_bench_perf(benches, threads, per_op);
+
+        if (mask == 0) {
+            _winter_print(WINTER_INDENT "perf counters unavailable\n");
+        }
+        for (uint32_t i = 0; i < WINTER_BENCH_PERF_EVENTS; ++i) {
+            if (mask & (1u << i)) {
+                _winter_print(WINTER_INDENT "%s %.2f/op\n", _winter_perf_names[i], per_op[i]);
+            }
+        }
+        if ((mask & 3) == 3 && per_op[1] > 0) {
+            _winter_print(WINTER_INDENT "ipc %.2f\n", per_op[0] / per_op[1]);
+        }
+    }
+
+    char name[WINTER_BENCH_MAX_NAME];
+    snprintf(name, sizeof(name), "%s:%s", unit->suite->name, unit->test->name);
+
+    const winter_baseline_t* baseline = _winter_bench_find_baseline(name);
+    if (baseline != nullptr) {
+        _winter_print(
+          WINTER_INDENT "baseline %.2f ns/op, %+.1f%%\n",
+          baseline->ns_per_op,
+          (ns_per_op - baseline->ns_per_op) * 100.0 / baseline->ns_per_op
+        );
+    }
+
+    if (_winter.bench.output != nullptr) {
+        _winter_bench_write(unit, benches, ns_per_op, ops_per_sec, ops, samples, sample_count);
+    }
+
+    free(samples);
+    for (uint16_t i = 0; i < threads; ++i) {
+        free(benches[i].samples);
+    }
+}
+
 WINTER_FUNC void*
 _winter_thread_entry(void* void_args) {
     const winter_args_t* args = void_args;
     _winter_local.thread_id = args->thread_id;
+    _winter_local.bench = args->bench;
     args->unit->suite->func(args->unit->test->id, nullptr);
     return nullptr;
 }
@@ -324,15 +867,19 @@ WINTER_FUNC void
 _winter_process_entry(winter_unit_t* unit) {
     unit->suite->func(WINTER_FUNC_BEFORE_EACH, nullptr);
 
+    winter_bench_t benches[unit->test->threads];
+    memset(benches, 0, sizeof(benches));
+
     if (unit->test->threads == 1) {
         _winter_local.thread_id = 0;
+        _winter_local.bench = unit->test->bench ? &benches[0] : nullptr;
         unit->suite->func(unit->test->id, nullptr);
     } else {
         pthread_t threads[unit->test->threads];
         winter_args_t args[unit->test->threads];
 
         for (uint16_t i = 0; i < unit->test->threads; ++i) {
-            args[i] = (winter_args_t){ unit, i };
+            args[i] = (winter_args_t){ unit, i, unit->test->bench ? &benches[i] : nullptr };
 
             if (pthread_create(&threads[i], nullptr, _winter_thread_entry, &args[i]) != 0) {
                 _winter_print(WINTER_INDENT "Failed to create thread (%s).\n", strerror(errno));
@@ -348,6 +895,10 @@ _winter_process_entry(winter_unit_t* unit) {
     }
 
     unit->suite->func(WINTER_FUNC_AFTER_EACH, nullptr);
+
+    if (unit->test->bench) {
+        _winter_bench_report(unit, benches);
+    }
 }
 
 static volatile sig_atomic_t _winter_debug_abort = false;
@@ -435,9 +986,10 @@ _winter_unit_execute(winter_unit_t* unit) {
 
         // no status reported by child process
         if (ret == 0) {
-            if (_winter.opts.timeout && _winter_now() - unit->start_time > unit->test->timeout) {
+            const double timeout = unit->test->timeout + (unit->test->bench ? _winter.bench.time : 0);
+            if (_winter.opts.timeout && _winter_now() - unit->start_time > timeout) {
                 _winter_kill_process(pid);
-                _winter_print(WINTER_INDENT "Process timed out after %.0fs.\n", (unit->test->timeout / 1000));
+                _winter_print(WINTER_INDENT "Process timed out after %.0fs.\n", (timeout / 1000));
                 return false;
             }
 
@@ -528,13 +1080,26 @@ _winter_list(void) {
     _winter_print(WINTER_COLOR_BOLD "\nTest suites:\n" WINTER_COLOR_RESET);
 
     size_t total_tests = 0;
+    size_t total_benches = 0;
     for (size_t i = 0; i < _winter.suites.length; ++i) {
         const winter_suite_t* suite = _winter_array_get(&_winter.suites, i);
-        _winter_print(WINTER_COLOR_DESC "%s:" WINTER_COLOR_RESET " %ji tests\n", suite->name, suite->tests.length);
-        total_tests += suite->tests.length;
+
+        size_t benches = 0;
+        for (size_t j = 0; j < suite->tests.length; ++j) {
+            benches += ((const winter_test_t*)_winter_array_get(&suite->tests, j))->bench ? 1 : 0;
+        }
+
+        _winter_print(
+          WINTER_COLOR_DESC "%s:" WINTER_COLOR_RESET " %ji tests, %ji benchmarks\n",
+          suite->name,
+          suite->tests.length - benches,
+          benches
+        );
+        total_tests += suite->tests.length - benches;
+        total_benches += benches;
     }
 
-    _winter_print(WINTER_COLOR_BOLD "\nTotal: %ji tests.\n" WINTER_COLOR_RESET, total_tests);
+    _winter_print(WINTER_COLOR_BOLD "\nTotal: %ji tests, %ji benchmarks.\n" WINTER_COLOR_RESET, total_tests, total_benches);
 }
 
 WINTER_FUNC void
@@ -567,12 +1132,18 @@ _winter_print_help(const char* path) {
     _winter_print_usage(path, "--version | -v", "Print version and exit");
     _winter_print_usage(path, "--list | -l", "Print a list of all available tests");
     _winter_print_usage(path, "--debug pattern", "Run one test and wait for a debugger to attach to the test");
+    _winter_print_usage(path, "--bench [patterns]", "Run all benchmarks instead of the tests that match the patterns");
 
     fprintf(stdout, "\nOptions:\n");
     _winter_print_opt_flag("color", "c", "Whether to print output in color", "on when output is TTY");
     _winter_print_opt_flag("rerun", "r", "Rerun failed test and wait for a debugger to attach to the test", "off");
     _winter_print_opt_flag("pid", "p", "Print the pid of the test process", "off");
     _winter_print_opt_flag("timeout", "t", "Whether to fail a test after its timeout.", "on");
+    _winter_print_opt_flag("bench-perf", "P", "Count instructions, cycles and misses of benchmarks on Linux", "off");
+    _winter_print_opt_str("bench-time", "Measured time of every benchmark thread in milliseconds", "500");
+    _winter_print_opt_str("bench-format", "Format of the benchmark output file, csv or json lines", "csv");
+    _winter_print_opt_str("bench-output", "File the benchmark results are written to", "none");
+    _winter_print_opt_str("baseline", "Results of an earlier run in csv to compare the benchmarks with", "none");
 }
 
 #define _winter_opt_flag(opt, n, sn)                                                                                   \
@@ -603,8 +1174,14 @@ _winter_parse_args(const int argc, const char** argv) {
     _winter_opt_flag(opts[_WINTER_OPT_COLOR], "color", 'c');
     _winter_opt_flag(opts[_WINTER_OPT_RERUN], "rerun", 'r');
     _winter_opt_flag(opts[_WINTER_OPT_TIMEOUT], "timeout", 't');
+    _winter_opt_flag(opts[_WINTER_OPT_BENCH], "bench", 'b');
+    _winter_opt_flag(opts[_WINTER_OPT_BENCH_PERF], "bench-perf", 'P');
 
     _winter_opt_str(opts[_WINTER_OPT_DEBUG], "debug");
+    _winter_opt_str(opts[_WINTER_OPT_BENCH_TIME], "bench-time");
+    _winter_opt_str(opts[_WINTER_OPT_BENCH_FORMAT], "bench-format");
+    _winter_opt_str(opts[_WINTER_OPT_BENCH_OUTPUT], "bench-output");
+    _winter_opt_str(opts[_WINTER_OPT_BASELINE], "baseline");
 
     for (int i = 1; i < argc; ++i) {
         const char* arg = argv[i];
@@ -676,11 +1253,46 @@ _winter_parse_args(const int argc, const char** argv) {
     const bool no_color = getenv("NO_COLOR") != nullptr;
     _winter_opt_default(opts[_WINTER_OPT_COLOR], is_tty && !no_color);
     _winter_opt_default(opts[_WINTER_OPT_TIMEOUT], true);
+#ifdef WINTER_BENCH
+    _winter_opt_default(opts[_WINTER_OPT_BENCH], true);
+#endif
 
     _winter.opts.list = opts[_WINTER_OPT_LIST].bool_val;
     _winter.opts.color = opts[_WINTER_OPT_COLOR].bool_val;
     _winter.opts.rerun = opts[_WINTER_OPT_RERUN].bool_val;
     _winter.opts.timeout = opts[_WINTER_OPT_TIMEOUT].bool_val;
+    _winter.opts.bench = opts[_WINTER_OPT_BENCH].bool_val;
+    _winter.bench.perf = opts[_WINTER_OPT_BENCH_PERF].bool_val;
+
+    if (opts[_WINTER_OPT_BENCH_TIME].str_val != nullptr) {
+        _winter.bench.time = strtod(opts[_WINTER_OPT_BENCH_TIME].str_val, nullptr);
+        if (_winter.bench.time <= 0) {
+            _winter_fatal_error("Invalid benchmark time: %s", opts[_WINTER_OPT_BENCH_TIME].str_val);
+        }
+    }
+    if (opts[_WINTER_OPT_BENCH_FORMAT].str_val != nullptr) {
+        const char* format = opts[_WINTER_OPT_BENCH_FORMAT].str_val;
+        if (strcmp(format, "json") != 0 && strcmp(format, "csv") != 0) {
+            _winter_fatal_error("Unknown benchmark format: %s", format);
+        }
+        _winter.bench.json = strcmp(format, "json") == 0;
+    }
+    if (opts[_WINTER_OPT_BASELINE].str_val != nullptr) {
+        _winter_bench_load_baseline(opts[_WINTER_OPT_BASELINE].str_val);
+    }
+
+    // every benchmark process appends its results to the file
+    _winter.bench.output = opts[_WINTER_OPT_BENCH_OUTPUT].str_val;
+    if (_winter.bench.output != nullptr) {
+        FILE* file = fopen(_winter.bench.output, "w");
+        if (file == nullptr) {
+            _winter_fatal_error("Failed to open %s (%s)", _winter.bench.output, strerror(errno));
+        }
+        if (!_winter.bench.json) {
+            fprintf(file, "suite,test,threads,ops,ns_per_op,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+        }
+        fclose(file);
+    }
 }
 
 WINTER_FUNC bool
@@ -701,6 +1313,10 @@ _winter_is_suite_enabled(const winter_suite_t* suite) {
 
 WINTER_FUNC bool
 _winter_is_unit_enabled(const winter_unit_t* unit) {
+    // benchmarks only run with --bench, and then only benchmarks
+    if (unit->test->bench != _winter.opts.bench) {
+        return false;
+    }
     if (_winter.patterns.length == 0) {
         return true;
     }
@@ -737,6 +1353,15 @@ _winter_main(const int argc, const char** argv) {
             continue;
         }
 
+        bool has_units = false;
+        for (size_t k = 0; k < suite->tests.length && !has_units; ++k) {
+            const winter_unit_t unit = { .suite = suite, .test = _winter_array_get(&suite->tests, k) };
+            has_units = _winter_is_unit_enabled(&unit);
+        }
+        if (!has_units) {
+            continue;
+        }
+
         _winter_print_suite_begin(suite);
 
         uint32_t suite_test_count = 0;
@@ -988,7 +1613,7 @@ _winter_assert_str(
 #define describe(name)                                                                                                 \
     static void _winter_test_##name(uint64_t, winter_array_t*);                                                        \
                                                                                                                        \
-    __attribute__((constructor(__COUNTER__ + 203))) static void _winter_constructor_pager(void) {                      \
+    __attribute__((constructor(__COUNTER__ + 203))) static void _winter_constructor_##name(void) {                    \
         _winter_initialize();                                                                                          \
                                                                                                                        \
         winter_array_t tests;                                                                                          \
@@ -1017,18 +1642,38 @@ _winter_assert_str(
 
 #endif
 
-#define _winter_test(name, i, threads, timeout)                                                                        \
+#define _winter_test(name, i, threads, timeout, bench)                                                                 \
     if (index == WINTER_FUNC_INFO) {                                                                                   \
-        _winter_array_push(out, &(winter_test_t){ name, i + 6, threads, timeout });                                    \
+        _winter_array_push(out, &(winter_test_t){ name, i + 6, threads, timeout, bench });                             \
     }                                                                                                                  \
     if (index == i + 6)
 
-#define test(name, timeout, threads) _winter_test(name, __COUNTER__, threads, timeout * 1000)
+#define test(name, timeout, threads) _winter_test(name, __COUNTER__, threads, timeout * 1000, false)
 
-#define it(name) _winter_test(name, __COUNTER__, 1, WINTER_DEFAULT_TIMEOUT_MS)
+#define it(name) _winter_test(name, __COUNTER__, 1, WINTER_DEFAULT_TIMEOUT_MS, false)
 
 #define parallel(name, threads)                                                                                        \
-    _winter_test(name " (parallel " #threads ")", __COUNTER__, threads, WINTER_DEFAULT_TIMEOUT_MS)
+    _winter_test(name " (parallel " #threads ")", __COUNTER__, threads, WINTER_DEFAULT_TIMEOUT_MS, false)
+
+/// Benchmark that runs its body on every thread like parallel, but only with
+/// --bench. The body sets up the thread and runs the measured code in a
+/// bench_loop.
+#define bench(name, threads)                                                                                           \
+    _winter_test(name " (bench " #threads ")", __COUNTER__, threads, WINTER_BENCH_TIMEOUT_MS, true)
+
+/// Runs its body for a calibrated number of iterations, so the body has to
+/// work for any number of iterations, see bench_iteration. Only one loop might
+/// run per thread and benchmark.
+#define bench_loop() for (_winter_bench_start(); _winter_bench_next();)
+
+/// Reports a counter with the results of the benchmark, e.g. from after_each.
+/// The counter should cover the whole benchmark, its rate is computed from the
+/// calibration and measured iterations of all threads.
+#define bench_counter(name, value) _winter_bench_counter(name, value)
+
+/// Index of the current iteration of the benchmark loop on this thread,
+/// counts calibration and measured iterations.
+#define bench_iteration() (_winter_local.bench->iteration - 1)
 
 #define before_each() if (index == WINTER_FUNC_BEFORE_EACH)
 
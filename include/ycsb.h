@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+/// Distribution of the keys a workload touches.
+typedef enum {
+    YCSB_UNIFORM,
+
+    /// Zipfian with a skew of 0.99, the popular keys are scattered over the
+    /// whole key range like the scrambled zipfian generator of YCSB.
+    YCSB_ZIPFIAN,
+
+    /// Zipfian over the distance to the most recently inserted key.
+    YCSB_LATEST,
+} ycsb_distribution_t;
+
+typedef enum {
+    YCSB_READ,
+    YCSB_UPDATE,
+    YCSB_INSERT,
+    YCSB_SCAN,
+    YCSB_READ_MODIFY_WRITE,
+} ycsb_op_t;
+
+/// Mix of operations of a workload, the shares are in percent and add up to
+/// one hundred.
+typedef struct {
+    uint8_t read;
+    uint8_t update;
+    uint8_t insert;
+    uint8_t scan;
+    uint8_t read_modify_write;
+    ycsb_distribution_t distribution;
+} ycsb_workload_t;
+
+/// The core workloads of YCSB: update heavy, read mostly, read only, read
+/// latest, short ranges and read-modify-write.
+extern const ycsb_workload_t ycsb_workload_a;
+extern const ycsb_workload_t ycsb_workload_b;
+extern const ycsb_workload_t ycsb_workload_c;
+extern const ycsb_workload_t ycsb_workload_d;
+extern const ycsb_workload_t ycsb_workload_e;
+extern const ycsb_workload_t ycsb_workload_f;
+
+/// Deterministic generator of keys and operations, every thread should use its
+/// own generator with its own seed.
+typedef struct {
+    uint64_t state;
+    ycsb_distribution_t distribution;
+    uint64_t count;
+    double zetan;
+    double alpha;
+    double eta;
+    double half;
+} ycsb_generator_t;
+
+/// Prepares a generator for keys out of [0, count). Zipfian generators sum
+/// over all keys once, which takes a while for large counts.
+void
+ycsb_generator_init(ycsb_generator_t* generator, ycsb_distribution_t distribution, uint64_t count, uint64_t seed);
+
+/// Returns the next pseudo random number of the generator.
+uint64_t
+ycsb_random(ycsb_generator_t* generator);
+
+/// Returns the next key. Latest generators pick keys relative to the end of
+/// [0, count), all other generators ignore the count and stay in the range
+/// they were prepared for.
+uint64_t
+ycsb_next_key(ycsb_generator_t* generator, uint64_t count);
+
+/// Picks the next operation of a workload.
+ycsb_op_t
+ycsb_next_op(ycsb_generator_t* generator, const ycsb_workload_t* workload);
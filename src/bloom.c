@@ -0,0 +1,144 @@
+#include "bloom.h"
+
+#include "winter.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Number of 64 bit words per block, i.e. one cache line. Every key sets one
+/// bit in each word of its block.
+#define BLOOM_BLOCK_WORDS 8
+
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_WORDS * 64)
+
+struct bloom_t {
+    uint64_t block_count;
+    alignas(64) _Atomic uint64_t words[];
+};
+
+/// Odd constants that select the bit in each word, from the split block Bloom
+/// filter of Parquet.
+static const uint32_t bloom_salts[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du, 0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+};
+
+/// Finalizer of splitmix64, ids are often dense and need to be spread out.
+static uint64_t
+bloom_hash(uint64_t key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+
+    return key;
+}
+
+static uint64_t
+bloom_mask(const uint32_t hash, const uint32_t word) {
+    return 1ull << ((hash * bloom_salts[word]) >> 26);
+}
+
+result_t
+bloom_open(bloom_t** out, const uint64_t count, const uint32_t bits_per_key) {
+    ensure(out != nullptr);
+    ensure(bits_per_key > 0);
+
+    uint64_t block_count = (count * bits_per_key + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+    if (block_count == 0) {
+        block_count = 1;
+    }
+
+    const size_t size = sizeof(bloom_t) + block_count * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+    bloom_t* filter = aligned_alloc(alignof(bloom_t), size);
+    if (filter == nullptr) {
+        failure(ENOMEM, msg("no memory for filter"), with_uint(block_count));
+    }
+    memset(filter, 0, size);
+    filter->block_count = block_count;
+
+    *out = filter;
+
+    return SUCCESS;
+}
+
+result_t
+bloom_close(bloom_t** out) {
+    ensure(out != nullptr);
+
+    free(*out);
+    *out = nullptr;
+
+    return SUCCESS;
+}
+
+void
+bloom_add(bloom_t* filter, const uint64_t key) {
+    const uint64_t hash = bloom_hash(key);
+    _Atomic uint64_t* block = &filter->words[(hash >> 32) % filter->block_count * BLOOM_BLOCK_WORDS];
+
+    for (uint32_t i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+        const uint64_t mask = bloom_mask((uint32_t)hash, i);
+
+        // most keys of a dense filter find some of their bits already set
+        if ((atomic_load_explicit(&block[i], memory_order_relaxed) & mask) == 0) {
+            atomic_fetch_or_explicit(&block[i], mask, memory_order_release);
+        }
+    }
+}
+
+bool
+bloom_contains(const bloom_t* filter, const uint64_t key) {
+    const uint64_t hash = bloom_hash(key);
+    const _Atomic uint64_t* block = &filter->words[(hash >> 32) % filter->block_count * BLOOM_BLOCK_WORDS];
+
+    for (uint32_t i = 0; i < BLOOM_BLOCK_WORDS; ++i) {
+        if ((atomic_load_explicit(&block[i], memory_order_acquire) & bloom_mask((uint32_t)hash, i)) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+describe(bloom) {
+    static bloom_t* filter;
+
+    after_each() {
+        assert_success(bloom_close(&filter));
+    }
+
+    it("empty filter") {
+        assert_success(bloom_open(&filter, 0, 10));
+
+        for (uint64_t i = 0; i < 1000; ++i) {
+            assertis(!bloom_contains(filter, i));
+        }
+    }
+
+    it("contains all added keys") {
+        assert_success(bloom_open(&filter, 10000, 10));
+
+        for (uint64_t i = 0; i < 10000; ++i) {
+            bloom_add(filter, i * 7);
+        }
+        for (uint64_t i = 0; i < 10000; ++i) {
+            assertis(bloom_contains(filter, i * 7));
+        }
+    }
+
+    it("few false positives") {
+        assert_success(bloom_open(&filter, 10000, 10));
+
+        for (uint64_t i = 0; i < 10000; ++i) {
+            bloom_add(filter, i);
+        }
+
+        uint32_t false_positives = 0;
+        for (uint64_t i = 10000; i < 110000; ++i) {
+            false_positives += bloom_contains(filter, i);
+        }
+        assertis(false_positives < 2000);
+    }
+}
@@ -1,14 +1,26 @@
 #include "btree.h"
 
 #include "blob.h"
+#include "bloom.h"
+#include "catalog.h"
+#include "compress.h"
 #include "deffer.h"
 #include "error.h"
+#include "latch.h"
 #include "pager.h"
+#include "recovery.h"
+#include "stats.h"
+#include "trace.h"
 #include "uuid.h"
 #include "varint.h"
+#include "wal.h"
 #include "winter.h"
+#include "ycsb.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 static int
 key_compare(const unsigned char* a, const unsigned char* b) {
@@ -23,12 +35,16 @@ enum {
     PAGE_FLAG_LEAF = (1u << 0),
     PAGE_FLAG_TABLE = (1u << 1),
     PAGE_FLAG_INDEX_UUID = (1u << 2),
+    PAGE_FLAG_COMPRESSED = (1u << 3),
+    PAGE_FLAG_BUFFERED = (1u << 4),
 };
 
 #define page_is_leaf(flags) (((flags) & PAGE_FLAG_LEAF) != 0)
 #define page_is_inner(flags) (((flags) & PAGE_FLAG_LEAF) == 0)
 #define page_is_table(flags) (((flags) & PAGE_FLAG_TABLE) != 0)
 #define page_is_index_uuid(flags) (((flags) & PAGE_FLAG_INDEX_UUID) != 0)
+#define page_is_compressed(flags) (((flags) & PAGE_FLAG_COMPRESSED) != 0)
+#define page_is_buffered(flags) (((flags) & PAGE_FLAG_BUFFERED) != 0)
 
 static uint16_t
 page_flags_package(const bool leaf, const uint16_t type) {
@@ -36,20 +52,143 @@ page_flags_package(const bool leaf, const uint16_t type) {
 }
 
 typedef struct {
+    /// LSN of the last logged change, see pager_log.
+    lsn_t lsn;
+
     uint16_t cell_count;
     uint16_t data_start;
     uint16_t free_space;
     uint16_t flags;
     page_id_t right;
+
+    /// Buffered messages of inner pages in buffered trees. The pointers to the
+    /// messages follow the pointers to the cells and are ordered by key, the
+    /// space includes the pointers.
+    uint16_t message_count;
+    uint16_t message_space;
 } header_t;
 
+/// Copy of a key, large enough for every key type.
+typedef struct {
+    uint16_t size;
+    unsigned char data[sizeof(uuid_t)];
+} key_copy_t;
+
+static void
+key_copy(key_copy_t* dst, const blob_t key) {
+    dst->size = (uint16_t)min(key.size, sizeof(dst->data));
+    memcpy(dst->data, key.data, dst->size);
+}
+
+/// Timestamp of an inserted key, kept while an open snapshot might not see it.
+typedef struct {
+    key_copy_t key;
+
+    /// Zero marks an empty slot.
+    uint64_t timestamp;
+} version_t;
+
+/// The versions are split by the hash of their keys into shards with their
+/// own latches, so inserts and snapshot scans only meet on the keys of one
+/// shard.
+#define VERSION_SHARD_BITS 6
+#define VERSION_SHARDS (1u << VERSION_SHARD_BITS)
+
+/// Open addressing hash map from keys to their insert timestamps.
+typedef struct {
+    alignas(64) latch_t latch;
+
+    /// Read without the latch by scans, zero if there is nothing to look up.
+    _Atomic uint32_t count;
+    uint32_t capacity;
+    version_t* versions;
+} version_shard_t;
+
 struct btree_t {
     pager_t* pager;
-    page_id_t root;
+    _Atomic page_id_t root;
 
     uint16_t page_size;
+
+    /// Type flags of the tree, shared by all pages.
+    uint16_t flags;
+
+    /// Number of levels, only modified while the root is fixed exclusively.
+    uint16_t height;
+
+    /// Id of the tree and the location of its entry in the catalog.
+    uint32_t id;
+    catalog_ref_t ref;
+
+    /// Changes to the statistics that were not yet written to the catalog.
+    _Atomic int64_t row_delta;
+    _Atomic int32_t page_delta;
+
+    /// Dictionary for compressed tables, optional.
+    compress_dict_t* dictionary;
+
+    /// Timestamp of the last insert.
+    _Atomic uint64_t clock;
+
+    /// Number of open snapshots, inserts only keep versions while it is not
+    /// zero.
+    _Atomic uint32_t snapshot_count;
+
+    /// Protects the list of snapshots, acquired before the latches of the
+    /// version shards.
+    latch_t snapshot_latch;
+
+    /// Open snapshots ordered by their timestamp, the oldest first.
+    btree_snapshot_t* snapshots;
+    btree_snapshot_t* snapshots_tail;
+
+    /// Shards of the versions of inserted keys.
+    version_shard_t* versions;
+
+    /// Bloom filter over the ids of a table, optional. Replaced filters stay
+    /// allocated until no lookup or insert uses a filter, see
+    /// btree_filter_reclaim.
+    _Atomic(bloom_t*) filter;
+    bloom_t** retired_filters;
+    uint32_t retired_count;
+    uint32_t filter_bits;
+
+    /// Filter that is being built, inserts add their ids to it as well.
+    _Atomic(bloom_t*) next_filter;
+
+    /// Number of lookups and inserts that loaded a filter and might still use
+    /// it.
+    _Atomic uint32_t filter_users;
+
+    /// Serialises filter builds, protects the retired filters.
+    latch_t filter_latch;
+};
+
+struct btree_snapshot_t {
+    btree_t* btree;
+    uint64_t timestamp;
+
+    btree_snapshot_t* prev;
+    btree_snapshot_t* next;
+
+    /// Copy of the current leaf and the index of the next cell in it.
+    unsigned char* leaf;
+    uint16_t index;
+
+    /// Upper bound of the current leaf, the next leaf starts after it. Not
+    /// bounded for the last leaf.
+    key_copy_t upper;
+    bool bounded;
+    bool started;
+
+    /// Buffer for the values decompressed by btree_snapshot_table_next.
+    unsigned char* buffer;
 };
 
+/// Buffer for values decompressed by btree_table_lookup. Values have to fit
+/// into a single page and can therefore never be larger than this buffer.
+_Thread_local static unsigned char lookup_buffer[UINT16_MAX];
+
 static page_id_t
 payload_get_page_id(const unsigned char* payload) {
     page_id_t id;
@@ -122,6 +261,24 @@ payload_put_len(const uint16_t flags, const blob_t key, const blob_t value) {
     }
 }
 
+/// Returns the space of the longest separator including its pointer.
+static uint16_t
+page_get_separator_max_len(const uint16_t flags) {
+    const uint16_t max_key_len = page_is_index_uuid(flags) ? sizeof(uuid_t) : 9;
+    return sizeof(page_id_t) + max_key_len + sizeof(uint16_t);
+}
+
+/// Returns whether the insert might not fit into the page. Inner pages have
+/// to fit the separator of a split child, which might be longer than the key.
+static bool
+page_needs_split(const uint16_t flags, const uint16_t free_space, const blob_t key, const blob_t value) {
+    if (page_is_leaf(flags)) {
+        return free_space < payload_put_len(flags, key, value) + sizeof(uint16_t);
+    }
+
+    return free_space < page_get_separator_max_len(flags);
+}
+
 static header_t*
 page_get_header(unsigned char* page) {
     return (header_t*)page;
@@ -135,7 +292,7 @@ page_get_cells(unsigned char* page) {
 static uint16_t
 page_get_space(unsigned char* page) {
     const header_t* header = page_get_header(page);
-    return header->data_start - sizeof(header_t) - sizeof(uint16_t) * header->cell_count;
+    return header->data_start - sizeof(header_t) - sizeof(uint16_t) * (header->cell_count + header->message_count);
 }
 
 static unsigned char*
@@ -143,41 +300,164 @@ page_get_payload(unsigned char* page, const uint16_t index) {
     return page + page_get_cells(page)[index];
 }
 
-result_t
-btree_open(btree_t** out, pager_t* pager, const page_id_t root) {
-    ensure(out != nullptr);
-    ensure(pager != nullptr);
+/// Operations of buffered messages. A message is the operation followed by a
+/// leaf cell for puts or only the key for deletes.
+enum {
+    /// Inserts the row or replaces its value.
+    MESSAGE_PUT = 1,
+
+    /// Deletes the row if it exists.
+    MESSAGE_DELETE = 2,
+};
+
+static unsigned char*
+page_get_message(unsigned char* page, const uint16_t index) {
+    return page_get_payload(page, page_get_header(page)->cell_count + index);
+}
+
+static blob_t
+message_get_key(const uint16_t flags, unsigned char* message) {
+    return payload_get_key(flags | PAGE_FLAG_LEAF, message + 1);
+}
+
+static uint16_t
+message_get_len(const uint16_t flags, const unsigned char* message) {
+    if (message[0] == MESSAGE_PUT) {
+        return 1 + payload_get_len(flags | PAGE_FLAG_LEAF, message + 1);
+    } else /* if (message[0] == MESSAGE_DELETE) */ {
+        return 1 + payload_get_key_len(flags | PAGE_FLAG_LEAF, message + 1);
+    }
+}
+
+static void
+page_init(unsigned char* page, const uint16_t page_size, const uint16_t flags) {
+    header_t* header = page_get_header(page);
+    header->lsn = 0;
+    header->cell_count = 0;
+    header->data_start = page_size;
+    header->free_space = page_size - sizeof(header_t);
+    header->flags = flags;
+    header->right = 0;
+    header->message_count = 0;
+    header->message_space = 0;
+}
+
+/// Number of levels from the root whose inner pages are read-mostly, every
+/// descent passes them and writers only change them on splits.
+#define BTREE_READ_MOSTLY_LEVELS 2
+
+/// Marks an inner page of the top levels as read-mostly, see
+/// pager_set_read_mostly. Descents mark the pages again after an eviction.
+static void
+page_mark_read_mostly(const page_t page, const uint32_t level) {
+    if (level < BTREE_READ_MOSTLY_LEVELS && page_is_inner(page_get_header(page.data)->flags)) {
+        pager_set_read_mostly(page);
+    }
+}
 
+/// Initialises the in memory state of a tree from its catalog entry.
+static result_t
+btree_init(btree_t** out, pager_t* pager, const catalog_ref_t ref, const catalog_entry_t* entry) {
     btree_t* btree;
     try_alloc(btree, sizeof(btree_t));
-    errdefer(free, btree);
+
+    btree->versions = aligned_alloc(alignof(version_shard_t), sizeof(version_shard_t) * VERSION_SHARDS);
+    if (btree->versions == nullptr) {
+        free(btree);
+        failure(ENOMEM, msg("failed to allocate version shards"));
+    }
+    memset(btree->versions, 0, sizeof(version_shard_t) * VERSION_SHARDS);
 
     btree->pager = pager;
     btree->page_size = pager_get_page_size(pager);
-    btree->root = root;
+    btree->root = entry->root;
+    btree->flags = entry->flags;
+    btree->height = entry->height;
+    btree->id = entry->id;
+    btree->ref = ref;
 
     *out = btree;
 
     return SUCCESS;
 }
 
+/// Writes the accumulated changes of the statistics to the catalog.
+static result_t
+btree_flush_stats(btree_t* btree) {
+    const int64_t rows = atomic_exchange(&btree->row_delta, 0);
+    const int32_t pages = atomic_exchange(&btree->page_delta, 0);
+
+    if (rows != 0 || pages != 0) {
+        try(catalog_add_stats(btree->pager, btree->ref, rows, pages));
+    }
+
+    return SUCCESS;
+}
+
+result_t
+btree_open(btree_t** out, pager_t* pager, const uint32_t id) {
+    ensure(out != nullptr);
+    ensure(pager != nullptr);
+
+    catalog_ref_t ref;
+    catalog_entry_t entry;
+    try(catalog_find_by_id(pager, id, &ref, &entry));
+
+    return btree_init(out, pager, ref, &entry);
+}
+
+result_t
+btree_open_by_name(btree_t** out, pager_t* pager, const char* name) {
+    ensure(out != nullptr);
+    ensure(pager != nullptr);
+
+    catalog_ref_t ref;
+    catalog_entry_t entry;
+    try(catalog_find_by_name(pager, name, &ref, &entry));
+
+    return btree_init(out, pager, ref, &entry);
+}
+
 result_t
-btree_create(btree_t** out, pager_t* pager, uint16_t type) {
+btree_create(btree_t** out, pager_t* pager, const char* name, const uint16_t type) {
     ensure(out != nullptr);
     ensure(pager != nullptr);
 
     page_t root;
     try(pager_next(pager, &root));
-    defer(pager_unfix, root);
 
-    header_t* header = page_get_header(root.data);
-    header->cell_count = 0;
-    header->data_start = pager_get_page_size(pager);
-    header->free_space = pager_get_page_size(pager) - sizeof(header_t);
-    header->flags = page_flags_package(true, type);
-    header->right = 0;
+    page_init(root.data, pager_get_page_size(pager), page_flags_package(true, type));
+
+    // the root is unreachable without the catalog entry
+    catalog_ref_t ref;
+    catalog_entry_t entry;
+    handle(pager_log_image(pager, root)) {
+        pager_free(pager, root);
+        forward();
+    }
+    handle(catalog_register(pager, name, root.id, type, &ref, &entry)) {
+        pager_free(pager, root);
+        forward();
+    }
+    pager_unfix(root);
+
+    return btree_init(out, pager, ref, &entry);
+}
 
-    return btree_open(out, pager, root.id);
+uint32_t
+btree_get_id(const btree_t* btree) {
+    return btree->id;
+}
+
+result_t
+btree_set_dictionary(btree_t* btree, const blob_t data) {
+    ensure(btree != nullptr);
+    ensure(page_is_compressed(btree->flags));
+    ensure(btree->dictionary == nullptr);
+
+    try(compress_dict_open(&btree->dictionary, data));
+
+    return SUCCESS;
 }
 
 bool
@@ -202,6 +482,28 @@ page_find_pointer(unsigned char* page, const blob_t key, uint16_t* out) {
     return false;
 }
 
+/// Finds the buffered message for the key, or the position to insert it.
+static bool
+page_find_message(unsigned char* page, const blob_t key, uint16_t* out) {
+    const header_t* header = page_get_header(page);
+
+    for (uint16_t i = 0; i < header->message_count; ++i) {
+        const int ret = key_compare(page_get_message(page, i) + 1, key.data);
+
+        if (ret == 0) {
+            *out = i;
+            return true;
+        }
+        if (ret > 0) {
+            *out = i;
+            return false;
+        }
+    }
+
+    *out = header->message_count;
+    return false;
+}
+
 static void
 page_compact(unsigned char* page, const uint16_t page_size) {
     header_t* header = page_get_header(page);
@@ -210,9 +512,11 @@ page_compact(unsigned char* page, const uint16_t page_size) {
     unsigned char buffer[page_size];
     uint16_t data_start = page_size;
 
-    for (uint16_t i = 0; i < header->cell_count; ++i) {
+    const uint16_t pointer_count = header->cell_count + header->message_count;
+    for (uint16_t i = 0; i < pointer_count; ++i) {
         const unsigned char* payload = page_get_payload(page, i);
-        const uint16_t size = payload_get_len(header->flags, payload);
+        const uint16_t size = i < header->cell_count ? payload_get_len(header->flags, payload)
+                                                     : message_get_len(header->flags, payload);
 
         data_start -= size;
         memcpy(buffer + data_start, payload, size);
@@ -223,11 +527,13 @@ page_compact(unsigned char* page, const uint16_t page_size) {
     memcpy(page + data_start, buffer + data_start, page_size - data_start);
 
     header->data_start = data_start;
-    header->free_space = page_size - data_start - sizeof(header_t) - sizeof(uint16_t) * header->cell_count;
+    header->free_space = data_start - sizeof(header_t) - sizeof(uint16_t) * pointer_count;
 }
 
+/// Reserves space for a payload and inserts its pointer at the index, the
+/// caller counts it as cell or message.
 static void
-page_insert_payload(
+page_insert_pointer(
   unsigned char* page,
   const uint16_t page_size,
   const uint16_t index,
@@ -243,9 +549,11 @@ page_insert_payload(
         page_compact(page, page_size);
     }
 
+    const uint16_t pointer_count = header->cell_count + header->message_count;
+
     uint16_t* pointers = page_get_cells(page);
-    if (index != header->cell_count) {
-        memmove(pointers + index + 1, pointers + index, sizeof(uint16_t) * (header->cell_count - index));
+    if (index != pointer_count) {
+        memmove(pointers + index + 1, pointers + index, sizeof(uint16_t) * (pointer_count - index));
     }
 
     const uint16_t payload_start = (uint16_t)(header->data_start - payload_size);
@@ -253,13 +561,38 @@ page_insert_payload(
 
     header->data_start = payload_start;
     header->free_space -= total_size;
-    header->cell_count += 1;
 
     *out = page + payload_start;
 }
 
+static void
+page_insert_payload(
+  unsigned char* page,
+  const uint16_t page_size,
+  const uint16_t index,
+  const uint64_t payload_size,
+  unsigned char** out
+) {
+    page_insert_pointer(page, page_size, index, payload_size, out);
+    page_get_header(page)->cell_count += 1;
+}
+
+/// Removes consecutive pointers, the space of their payloads is reclaimed by
+/// the next compaction. The size includes the pointers, the caller adjusts
+/// the counts.
+static void
+page_remove_pointers(unsigned char* page, const uint16_t index, const uint16_t count, const uint16_t size) {
+    header_t* header = page_get_header(page);
+    uint16_t* pointers = page_get_cells(page);
+
+    const uint16_t pointer_count = header->cell_count + header->message_count;
+    memmove(pointers + index, pointers + index + count, sizeof(uint16_t) * (uint16_t)(pointer_count - index - count));
+
+    header->free_space += size;
+}
+
 static result_t
-page_insert_leaf(unsigned char* page, const uint16_t page_size, const blob_t key, const blob_t value) {
+page_insert_leaf(unsigned char* page, const uint16_t page_size, const blob_t key, const blob_t value, blob_t* out) {
     uint16_t index;
     if (page_find_pointer(page, key, &index)) {
         failure(EEXIST, msg("key already exists on leaf page"));
@@ -272,6 +605,161 @@ page_insert_leaf(unsigned char* page, const uint16_t page_size, const blob_t key
     // payload_put_value(page_get_header(page)->flags, ptr + key.size, value);
     memcpy(ptr + key.size, value.data, value.size);
 
+    *out = (blob_t){ key.size + value.size, ptr };
+
+    return SUCCESS;
+}
+
+static uint32_t
+version_hash(const blob_t key) {
+    uint32_t hash = 2166136261u;
+    for (uint64_t i = 0; i < key.size; ++i) {
+        hash = (hash ^ key.data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/// Returns the shard of a key, the low bits of the hash select the shard and
+/// the others the slot within it.
+static version_shard_t*
+version_shard(const btree_t* btree, const blob_t key) {
+    return &btree->versions[version_hash(key) & (VERSION_SHARDS - 1)];
+}
+
+static uint32_t
+version_slot(const version_t* versions, const uint32_t capacity, const blob_t key) {
+    uint32_t slot = (version_hash(key) >> VERSION_SHARD_BITS) & (capacity - 1);
+    while (versions[slot].timestamp != 0) {
+        const version_t* version = &versions[slot];
+        if (version->key.size == key.size && memcmp(version->key.data, key.data, key.size) == 0) {
+            break;
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    return slot;
+}
+
+/// Rebuilds a shard with the given capacity and drops the versions that are
+/// not newer than the timestamp.
+static result_t
+version_rebuild(version_shard_t* shard, const uint32_t capacity, const uint64_t timestamp) {
+    version_t* versions;
+    try_alloc(versions, sizeof(version_t) * capacity);
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < shard->capacity; ++i) {
+        const version_t* version = &shard->versions[i];
+        if (version->timestamp > timestamp) {
+            versions[version_slot(versions, capacity, (blob_t){ version->key.size, (unsigned char*)version->key.data })] = *version;
+            count += 1;
+        }
+    }
+
+    free(shard->versions);
+    shard->versions = versions;
+    shard->capacity = capacity;
+    atomic_store(&shard->count, count);
+
+    return SUCCESS;
+}
+
+/// Drops all versions that every open snapshot sees. Expects the snapshot
+/// latch to be acquired exclusively.
+static void
+version_prune(btree_t* btree) {
+    assert_latch_write_access(btree->snapshot_latch);
+
+    for (uint32_t i = 0; i < VERSION_SHARDS; ++i) {
+        version_shard_t* shard = &btree->versions[i];
+        latch_acquire_write(&shard->latch);
+        defer(latch_release_write, shard->latch);
+
+        if (btree->snapshots == nullptr) {
+            free(shard->versions);
+            shard->versions = nullptr;
+            shard->capacity = 0;
+            atomic_store(&shard->count, 0);
+            continue;
+        }
+
+        // pruning only saves memory, the versions are kept if it fails
+        if (version_rebuild(shard, shard->capacity, btree->snapshots->timestamp) != SUCCESS) {
+            error_clear();
+        }
+    }
+}
+
+/// Assigns the next timestamp to an inserted key. The timestamp is kept as
+/// long as a snapshot is open, expects the leaf to be fixed exclusively so
+/// that no snapshot sees the key before its timestamp.
+static result_t
+version_add(btree_t* btree, const blob_t key) {
+    // pairs with the snapshot count and the clock in btree_snapshot_open,
+    // either the insert sees the snapshot or the snapshot sees the timestamp
+    const uint64_t timestamp = atomic_fetch_add(&btree->clock, 1) + 1;
+    if (atomic_load(&btree->snapshot_count) == 0) {
+        return SUCCESS;
+    }
+
+    version_shard_t* shard = version_shard(btree, key);
+    latch_acquire_write(&shard->latch);
+    defer(latch_release_write, shard->latch);
+
+    const uint32_t count = atomic_load(&shard->count);
+    if ((count + 1) * 2 > shard->capacity) {
+        try(version_rebuild(shard, max(shard->capacity * 2, 64u), 0));
+    }
+
+    version_t* version = &shard->versions[version_slot(shard->versions, shard->capacity, key)];
+    key_copy(&version->key, key);
+    version->timestamp = timestamp;
+    atomic_fetch_add(&shard->count, 1);
+
+    return SUCCESS;
+}
+
+/// Returns whether the key was inserted before the snapshot was opened.
+static bool
+version_visible(const btree_snapshot_t* snapshot, const blob_t key) {
+    version_shard_t* shard = version_shard(snapshot->btree, key);
+
+    // an insert of a key in the copied leaf recorded its version before the
+    // leaf latch was released
+    if (atomic_load(&shard->count) == 0) {
+        return true;
+    }
+
+    latch_acquire_read(&shard->latch);
+    defer(latch_release_read, shard->latch);
+
+    if (shard->capacity == 0) {
+        return true;
+    }
+
+    const version_t* version = &shard->versions[version_slot(shard->versions, shard->capacity, key)];
+    return version->timestamp == 0 || version->timestamp <= snapshot->timestamp;
+}
+
+/// Inserts into a leaf and logs the new cell.
+static result_t
+btree_insert_leaf(btree_t* btree, const page_t page, const blob_t key, const blob_t value) {
+    blob_t cell;
+    try(page_insert_leaf(page.data, btree->page_size, key, value, &cell));
+
+    // the insert is not logged yet, so the cell is dropped again and the
+    // space of its payload reclaimed by the next compaction
+    handle(version_add(btree, key)) {
+        uint16_t index;
+        page_find_pointer(page.data, key, &index);
+        page_remove_pointers(page.data, index, 1, (uint16_t)(sizeof(uint16_t) + cell.size));
+        page_get_header(page.data)->cell_count -= 1;
+        forward();
+    }
+
+    try(pager_log(btree->pager, page, WAL_RECORD_LEAF_INSERT, cell));
+
     return SUCCESS;
 }
 
@@ -300,6 +788,20 @@ page_insert_inner(
     }
 }
 
+/// Inserts a separator into an inner page and logs the new child with the
+/// separator.
+static result_t
+btree_insert_inner(const btree_t* btree, const page_t page, const uint16_t index, const blob_t key, const page_id_t page_id) {
+    page_insert_inner(page.data, btree->page_size, index, key, page_id);
+
+    unsigned char payload[sizeof(page_id_t) + key.size];
+    memcpy(payload, &page_id, sizeof(page_id_t));
+    memcpy(payload + sizeof(page_id_t), key.data, key.size);
+    try(pager_log(btree->pager, page, WAL_RECORD_INNER_INSERT, (blob_t){ sizeof(payload), payload }));
+
+    return SUCCESS;
+}
+
 static uint16_t
 page_split(const page_t page, const page_t next, const uint16_t page_size) {
     header_t* page_header = page_get_header(page.data);
@@ -319,24 +821,72 @@ page_split(const page_t page, const page_t next, const uint16_t page_size) {
         next_pointers[i - split] = next_data_start;
     }
 
+    const uint16_t next_cell_count = page_header->cell_count - split;
+
+    // buffered messages follow the separators, the ones after the split key
+    // move to the next page and the others close the gap left by the cells
+    uint16_t* pointers = page_get_cells(page.data);
+    uint16_t kept_count = 0, kept_space = 0;
+    uint16_t moved_count = 0, moved_space = 0;
+
+    if (page_header->message_count > 0) {
+        const unsigned char* split_key = payload_get_key_ptr(page_header->flags, page_get_payload(page.data, split - 1));
+
+        for (uint16_t i = 0; i < page_header->message_count; ++i) {
+            const uint16_t index = page_header->cell_count + i;
+            const unsigned char* message = page_get_payload(page.data, index);
+            const uint16_t size = message_get_len(page_header->flags, message);
+
+            if (key_compare(message + 1, split_key) > 0) {
+                next_data_start -= size;
+                memcpy(next.data + next_data_start, message, size);
+
+                next_pointers[next_cell_count + moved_count] = next_data_start;
+                moved_count += 1;
+                moved_space += (uint16_t)(size + sizeof(uint16_t));
+            } else {
+                pointers[split + kept_count] = pointers[index];
+                kept_count += 1;
+                kept_space += (uint16_t)(size + sizeof(uint16_t));
+            }
+        }
+    }
+
     next_header->flags = page_header->flags;
-    next_header->cell_count = page_header->cell_count - split;
+    next_header->cell_count = next_cell_count;
     next_header->data_start = next_data_start;
-    next_header->free_space = next_data_start - sizeof(header_t) - sizeof(uint16_t) * next_header->cell_count;
+    next_header->free_space = next_data_start - sizeof(header_t) - sizeof(uint16_t) * (next_cell_count + moved_count);
     next_header->right = page_header->right;
+    next_header->message_count = moved_count;
+    next_header->message_space = moved_space;
 
     page_header->cell_count = split;
     page_header->right = next.id;
+    page_header->message_count = kept_count;
+    page_header->message_space = kept_space;
     page_compact(page.data, page_size);
 
     return split;
 }
 
+/// Logs the images of both halves of a split, structural changes are not
+/// logged as physiological records.
+static result_t
+btree_log_split(const btree_t* btree, const page_t page, const page_t split) {
+    stats_add(STATS_BTREE_SPLITS, 1);
+    trace_event(TRACE_BTREE_SPLIT, page.id);
+
+    try(pager_log_image(btree->pager, page));
+    try(pager_log_image(btree->pager, split));
+
+    return SUCCESS;
+}
+
 result_t
-btree_insert_walk(const btree_t* btree, page_t parent, const blob_t key, const blob_t value) {
+btree_insert_walk(btree_t* btree, page_t parent, const blob_t key, const blob_t value) {
     const header_t* parent_header = page_get_header(parent.data);
     assert(page_is_inner(parent_header->flags));
-    assert(parent_header->free_space >= payload_put_len(parent_header->flags, key, value));
+    assert(!page_needs_split(parent_header->flags, parent_header->free_space, key, value));
 
     page_t page;
     { // parent lock scope
@@ -359,14 +909,19 @@ btree_insert_walk(const btree_t* btree, page_t parent, const blob_t key, const b
 
         // split the page if there might be not enough space
         const header_t* header = page_get_header(page.data);
-        if (header->free_space < payload_put_len(header->flags, key, value)) {
+        if (page_needs_split(header->flags, header->free_space, key, value)) {
+            errdefer(pager_unfix, page);
+
             page_t split;
-            try(pager_next(btree->pager, &split));
+            try(pager_alloc(btree->pager, page.id, &split));
+            errdefer(pager_unfix, split);
+            atomic_fetch_add(&btree->page_delta, 1);
 
             const uint16_t split_index = page_split(page, split, btree->page_size);
             const blob_t split_key = payload_get_key(header->flags, page_get_payload(page.data, split_index - 1));
 
-            page_insert_inner(parent.data, btree->page_size, index, split_key, split.id);
+            try(btree_log_split(btree, page, split));
+            try(btree_insert_inner(btree, parent, index, split_key, split.id));
 
             if (key_compare(key.data, split_key.data) < 0) {
                 pager_unfix(split);
@@ -380,7 +935,7 @@ btree_insert_walk(const btree_t* btree, page_t parent, const blob_t key, const b
     const header_t* header = page_get_header(page.data);
     if (page_is_leaf(header->flags)) {
         defer(pager_unfix, page);
-        try(page_insert_leaf(page.data, btree->page_size, key, value));
+        try(btree_insert_leaf(btree, page, key, value));
     } else {
         try(btree_insert_walk(btree, page, key, value));
     }
@@ -388,71 +943,112 @@ btree_insert_walk(const btree_t* btree, page_t parent, const blob_t key, const b
     return SUCCESS;
 }
 
-result_t
-btree_insert(btree_t* btree, const blob_t key, const blob_t value) {
-    page_t root;
-    try(pager_fix(btree->pager, btree->root, true, &root));
-    errdefer(pager_unfix, root);
-
-    const header_t* header = page_get_header(root.data);
-    if (header->free_space < payload_put_len(header->flags, key, value)) {
-        page_t split;
-        try(pager_next(btree->pager, &split));
-        // TODO: this page will be unreachable on error
+/// Fixes the current root. The root might be split while the latch is waited
+/// for, so its id is checked again once the page is fixed.
+static result_t
+btree_fix_root(const btree_t* btree, const bool exclusive, page_t* out) {
+    while (true) {
+        const page_id_t root = atomic_load(&btree->root);
+        try(pager_fix(btree->pager, root, exclusive, out));
 
-        const uint16_t split_index = page_split(root, split, btree->page_size);
-        const blob_t split_key = payload_get_key(header->flags, page_get_payload(root.data, split_index - 1));
+        if (atomic_load(&btree->root) == root) {
+            return SUCCESS;
+        }
+        pager_unfix(*out);
+    }
+}
 
-        page_t new;
-        try(pager_next(btree->pager, &new));
-        defer(pager_unfix, new);
+/// Logs a split root and writes the statistics of the grown tree.
+static result_t
+btree_log_root_split(btree_t* btree, const page_t root, const page_t split, const page_t new) {
+    try(btree_log_split(btree, root, split));
+    try(pager_log_image(btree->pager, new));
+    try(btree_flush_stats(btree));
 
-        header_t* new_header = page_get_header(new.data);
-        new_header->flags = header->flags & ~PAGE_FLAG_LEAF;
-        new_header->cell_count = 1;
-        new_header->data_start = btree->page_size - (sizeof(page_id_t) + (uint16_t) split_key.size);
-        new_header->free_space = new_header->data_start - sizeof(header_t) - sizeof(uint16_t);
-        new_header->right = split.id;
+    return SUCCESS;
+}
 
-        uint16_t* new_pointers = page_get_cells(new.data);
-        new_pointers[0] = new_header->data_start;
+/// Splits the root below a new root. The old root, its new sibling and the new
+/// root stay fixed exclusively, the split key points into the old root. The
+/// root has to be fixed with btree_fix_root.
+static result_t
+btree_split_root(btree_t* btree, const page_t root, page_t* split_out, page_t* new_out, blob_t* split_key_out) {
+    const header_t* header = page_get_header(root.data);
 
-        unsigned char* new_cell = page_get_payload(new.data, 0);
-        memcpy(new_cell, &root.id, sizeof(page_id_t));
-        memcpy(new_cell + sizeof(page_id_t), split_key.data, split_key.size);
+    page_t split;
+    try(pager_alloc(btree->pager, root.id, &split));
 
-        // TODO: this needs to be synchronized
-        btree->root = new.id;
+    page_t new;
+    handle(pager_alloc(btree->pager, root.id, &new)) {
+        pager_free(btree->pager, split);
+        forward();
+    }
 
-        if (key_compare(key.data, split_key.data) < 0) {
-            pager_unfix(split);
-        } else {
-            pager_unfix(root);
-            root = split;
-        }
+    // the catalog is changed before the root, a failure leaves the tree as it
+    // was and the new pages are freed again
+    const uint16_t height = (uint16_t)(btree->height + 1);
+    handle(catalog_set_root(btree->pager, btree->ref, new.id, height)) {
+        pager_free(btree->pager, new);
+        pager_free(btree->pager, split);
+        forward();
     }
 
-    if (page_is_leaf(page_get_header(root.data)->flags)) {
-        defer(pager_unfix, root);
-        try(page_insert_leaf(root.data, btree->page_size, key, value));
-    } else {
-        try(btree_insert_walk(btree, root, key, value));
+    const uint16_t split_index = page_split(root, split, btree->page_size);
+    const blob_t split_key = payload_get_key(header->flags, page_get_payload(root.data, split_index - 1));
+
+    header_t* new_header = page_get_header(new.data);
+    new_header->flags = header->flags & ~PAGE_FLAG_LEAF;
+    new_header->cell_count = 1;
+    new_header->data_start = btree->page_size - (sizeof(page_id_t) + (uint16_t) split_key.size);
+    new_header->free_space = new_header->data_start - sizeof(header_t) - sizeof(uint16_t);
+    new_header->right = split.id;
+
+    uint16_t* new_pointers = page_get_cells(new.data);
+    new_pointers[0] = new_header->data_start;
+
+    unsigned char* new_cell = page_get_payload(new.data, 0);
+    memcpy(new_cell, &root.id, sizeof(page_id_t));
+    memcpy(new_cell + sizeof(page_id_t), split_key.data, split_key.size);
+
+    // threads waiting for the old root see the new id once they have the
+    // latch. The tree is complete in memory even if logging fails below
+    btree->height = height;
+    atomic_fetch_add(&btree->page_delta, 2);
+    atomic_store(&btree->root, new.id);
+
+    handle(btree_log_root_split(btree, root, split, new)) {
+        pager_unfix(new);
+        pager_unfix(split);
+        forward();
     }
 
+    *split_out = split;
+    *new_out = new;
+    *split_key_out = split_key;
+
     return SUCCESS;
 }
 
-result_t
-btree_lookup(const btree_t* btree, const blob_t key, unsigned char** out) {
+/// Inserts into the leaf with shared latches coupled on the way down and only
+/// upgrades the latch of the leaf. Sets inserted to false and changes nothing
+/// if the leaf has to be split or has other readers, the caller falls back to
+/// exclusive latches then.
+static result_t
+btree_insert_shared(btree_t* btree, const blob_t key, const blob_t value, bool* inserted) {
+    *inserted = false;
+
     page_t page;
-    try(pager_fix(btree->pager, btree->root, true, &page));
+    try(btree_fix_root(btree, false, &page));
     defer(pager_unfix, page);
 
-    while (page_is_inner(page_get_header(page.data)->flags)) {
-        uint16_t index;
-        page_find_pointer(page.data, key, &index);
-
+    for (uint32_t level = 0; page_is_inner(page_get_header(page.data)->flags); ++level) {
         const header_t* header = page_get_header(page.data);
+        page_mark_read_mostly(page, level);
+
+        uint16_t index;
+        if (page_find_pointer(page.data, key, &index)) {
+            failure(EEXIST, msg("key already exists on page"));
+        }
 
         page_id_t next;
         if (index == header->cell_count) {
@@ -463,70 +1059,2944 @@ btree_lookup(const btree_t* btree, const blob_t key, unsigned char** out) {
         assert(next != 0);
 
         page_t child;
-        try(pager_fix(btree->pager, next, true, &child));
+        try(pager_fix(btree->pager, next, false, &child));
+        pager_unfix(page);
+
+        page = child;
+    }
+
+    // a split changes the parent, which is not latched any more
+    const header_t* header = page_get_header(page.data);
+    if (page_needs_split(header->flags, header->free_space, key, value)) {
+        return SUCCESS;
+    }
+
+    // waiting for the other readers could deadlock with another upgrade
+    if (!pager_try_upgrade(page)) {
+        return SUCCESS;
+    }
+
+    try(btree_insert_leaf(btree, page, key, value));
+    *inserted = true;
+
+    return SUCCESS;
+}
+
+/// Inserts a row without recording its latency, see btree_insert.
+static result_t
+btree_insert_row(btree_t* btree, const blob_t key, const blob_t value) {
+    if (page_is_buffered(btree->flags)) {
+        return btree_upsert(btree, key, value);
+    }
+
+    bool inserted;
+    try(btree_insert_shared(btree, key, value, &inserted));
+
+    if (!inserted) {
+        page_t root;
+        try(btree_fix_root(btree, true, &root));
+        errdefer(pager_unfix, root);
+
+        const header_t* header = page_get_header(root.data);
+        if (page_needs_split(header->flags, header->free_space, key, value)) {
+            page_t split, new;
+            blob_t split_key;
+            try(btree_split_root(btree, root, &split, &new, &split_key));
+            pager_unfix(new);
+
+            if (key_compare(key.data, split_key.data) < 0) {
+                pager_unfix(split);
+            } else {
+                pager_unfix(root);
+                root = split;
+            }
+        }
+
+        if (page_is_leaf(page_get_header(root.data)->flags)) {
+            defer(pager_unfix, root);
+            try(btree_insert_leaf(btree, root, key, value));
+        } else {
+            try(btree_insert_walk(btree, root, key, value));
+        }
+    }
+
+    atomic_fetch_add(&btree->row_delta, 1);
+
+    // tables without a filter skip the shared counter, a filter that is built
+    // concurrently snapshots the row afterward
+    if (atomic_load(&btree->filter) == nullptr && atomic_load(&btree->next_filter) == nullptr) {
+        return SUCCESS;
+    }
+
+    // the next filter is loaded first, once it is gone the filter is the new
+    // one, see btree_filter_build
+    atomic_fetch_add(&btree->filter_users, 1);
+    bloom_t* next_filter = atomic_load(&btree->next_filter);
+    bloom_t* filter = atomic_load(&btree->filter);
+
+    uint64_t id;
+    varint_get(key.data, &id);
+
+    if (filter != nullptr) {
+        bloom_add(filter, id);
+    }
+    if (next_filter != nullptr) {
+        bloom_add(next_filter, id);
+    }
+    atomic_fetch_sub(&btree->filter_users, 1);
+
+    return SUCCESS;
+}
+
+result_t
+btree_insert(btree_t* btree, const blob_t key, const blob_t value) {
+    stats_add(STATS_BTREE_INSERTS, 1);
+
+    const uint64_t splits = stats_local_count(STATS_BTREE_SPLITS);
+    const uint64_t start = stats_start(STATS_HISTOGRAM_BTREE_INSERT);
+
+    try(btree_insert_row(btree, key, value));
+
+    stats_record(STATS_HISTOGRAM_BTREE_INSERT, start);
+    if (stats_local_count(STATS_BTREE_SPLITS) != splits) {
+        stats_record(STATS_HISTOGRAM_BTREE_SPLIT, start);
+    }
+
+    return SUCCESS;
+}
+
+/// Share of the usable page space for the messages of an inner page, the
+/// separators use the other half.
+static uint16_t
+buffer_get_capacity(const uint16_t page_size) {
+    return (uint16_t)((page_size - sizeof(header_t)) / 2);
+}
+
+/// Returns whether the separators of a buffered inner page might exceed their
+/// share of the page after the next split of a child.
+static bool
+buffer_needs_split(const uint16_t page_size, const header_t* header) {
+    const uint16_t separator_space = (uint16_t)(page_size - sizeof(header_t) - header->free_space - header->message_space);
+    return separator_space + page_get_separator_max_len(header->flags) > buffer_get_capacity(page_size);
+}
+
+static bool
+buffer_fits(const uint16_t page_size, const header_t* header, const blob_t message) {
+    return header->message_space + message.size + sizeof(uint16_t) <= buffer_get_capacity(page_size);
+}
+
+/// Returns whether the page has to be split before the message is pushed into
+/// it, see buffer_push.
+static bool
+message_needs_split(const uint16_t page_size, const header_t* header, const blob_t message) {
+    if (page_is_inner(header->flags)) {
+        return buffer_needs_split(page_size, header);
+    }
+    if (message.data[0] != MESSAGE_PUT) {
+        return false;
+    }
+
+    return header->free_space < message.size - 1 + sizeof(uint16_t);
+}
+
+/// Adds a message to the buffer of an inner page and drops the older message
+/// for the same key.
+static void
+buffer_add(unsigned char* page, const uint16_t page_size, const blob_t message) {
+    header_t* header = page_get_header(page);
+    assert(page_is_inner(header->flags));
+
+    const blob_t key = message_get_key(header->flags, message.data);
+
+    uint16_t index;
+    if (page_find_message(page, key, &index)) {
+        const uint16_t size = message_get_len(header->flags, page_get_message(page, index)) + sizeof(uint16_t);
+        page_remove_pointers(page, header->cell_count + index, 1, size);
+
+        header->message_count -= 1;
+        header->message_space -= size;
+    }
+
+    unsigned char* ptr;
+    page_insert_pointer(page, page_size, header->cell_count + index, message.size, &ptr);
+    memcpy(ptr, message.data, message.size);
+
+    header->message_count += 1;
+    header->message_space += (uint16_t)(message.size + sizeof(uint16_t));
+}
+
+/// Applies a message to a leaf and counts the change of the number of rows.
+static result_t
+page_apply_message(unsigned char* page, const uint16_t page_size, const blob_t message, int64_t* rows) {
+    header_t* header = page_get_header(page);
+    assert(page_is_leaf(header->flags));
+
+    const blob_t key = message_get_key(header->flags, message.data);
+
+    uint16_t index;
+    if (page_find_pointer(page, key, &index)) {
+        const uint16_t size = payload_get_len(header->flags, page_get_payload(page, index)) + sizeof(uint16_t);
+        page_remove_pointers(page, index, 1, size);
+
+        header->cell_count -= 1;
+        *rows -= 1;
+    }
+
+    if (message.data[0] == MESSAGE_PUT) {
+        const blob_t value = { message.size - 1 - key.size, message.data + 1 + key.size };
+
+        blob_t cell;
+        try(page_insert_leaf(page, page_size, key, value, &cell));
+        *rows += 1;
+    }
+
+    return SUCCESS;
+}
+
+static result_t
+buffer_flush(btree_t* btree, page_t page, bool* moved);
+
+/// Applies a message to a leaf or adds it to the buffer of an inner page. Full
+/// buffers are flushed first, sets pushed to false if the buffer can not make
+/// space because the page has to be split.
+static result_t
+buffer_push(btree_t* btree, const page_t page, const blob_t message, bool* pushed) {
+    const header_t* header = page_get_header(page.data);
+
+    if (page_is_leaf(header->flags)) {
+        int64_t rows = 0;
+        try(page_apply_message(page.data, btree->page_size, message, &rows));
+        try(pager_log(btree->pager, page, WAL_RECORD_MESSAGE, message));
+
+        atomic_fetch_add(&btree->row_delta, rows);
+        *pushed = true;
+
+        return SUCCESS;
+    }
+
+    while (!buffer_fits(btree->page_size, header, message)) {
+        bool moved;
+        try(buffer_flush(btree, page, &moved));
+
+        if (!moved) {
+            *pushed = false;
+            return SUCCESS;
+        }
+    }
+
+    buffer_add(page.data, btree->page_size, message);
+    try(pager_log(btree->pager, page, WAL_RECORD_MESSAGE, message));
+    *pushed = true;
+
+    return SUCCESS;
+}
+
+/// Pushes a message from a buffered inner page into the child covering its
+/// key. Full children are split first, sets routed to false if the page has no
+/// space left for another separator.
+static result_t
+buffer_route(btree_t* btree, const page_t page, const blob_t message, bool* routed) {
+    const header_t* header = page_get_header(page.data);
+    const blob_t key = message_get_key(header->flags, message.data);
+
+    uint16_t index;
+    page_find_pointer(page.data, key, &index);
+
+    page_id_t next;
+    if (index == header->cell_count) {
+        next = header->right;
+    } else {
+        next = payload_get_page_id(page_get_payload(page.data, index));
+    }
+    assert(next != 0);
+
+    page_t child;
+    try(pager_fix(btree->pager, next, true, &child));
+    defer(pager_unfix, child);
+
+    for (;;) {
+        const header_t* child_header = page_get_header(child.data);
+
+        if (message_needs_split(btree->page_size, child_header, message)) {
+            if (buffer_needs_split(btree->page_size, header)) {
+                *routed = false;
+                return SUCCESS;
+            }
+
+            page_t split;
+            try(pager_alloc(btree->pager, child.id, &split));
+            errdefer(pager_unfix, split);
+            atomic_fetch_add(&btree->page_delta, 1);
+
+            const uint16_t split_index = page_split(child, split, btree->page_size);
+            const blob_t split_key = payload_get_key(child_header->flags, page_get_payload(child.data, split_index - 1));
+
+            try(btree_log_split(btree, child, split));
+            try(btree_insert_inner(btree, page, index, split_key, split.id));
+
+            // the split key stays in the left page, so does its message
+            if (key_compare(key.data, split_key.data) <= 0) {
+                pager_unfix(split);
+            } else {
+                pager_unfix(child);
+                child = split;
+            }
+        }
+
+        bool pushed;
+        try(buffer_push(btree, child, message, &pushed));
+
+        if (pushed) {
+            *routed = true;
+            return SUCCESS;
+        }
+        if (!message_needs_split(btree->page_size, page_get_header(child.data), message)) {
+            failure(ENOSPC, msg("buffer of the child can not make space"), with_uint(child.id));
+        }
+    }
+}
+
+/// Pushes messages of a batch into the children until one can not be routed,
+/// the offset is advanced past the routed messages.
+static result_t
+buffer_route_batch(btree_t* btree, const page_t page, const blob_t batch, uint16_t* offset) {
+    const uint16_t flags = page_get_header(page.data)->flags;
+
+    while (*offset < batch.size) {
+        const blob_t message = { message_get_len(flags, batch.data + *offset), batch.data + *offset };
+
+        bool routed;
+        try(buffer_route(btree, page, message, &routed));
+
+        if (!routed) {
+            break;
+        }
+
+        *offset += (uint16_t)message.size;
+    }
+
+    return SUCCESS;
+}
+
+/// Adds the messages of a batch from the offset on back into the buffer.
+static void
+buffer_restore(unsigned char* page, const uint16_t page_size, const blob_t batch, uint16_t offset) {
+    const uint16_t flags = page_get_header(page)->flags;
+
+    while (offset < batch.size) {
+        const blob_t message = { message_get_len(flags, batch.data + offset), batch.data + offset };
+        buffer_add(page, page_size, message);
+
+        offset += (uint16_t)message.size;
+    }
+}
+
+/// Moves the buffered messages of the child with the most buffered bytes one
+/// level down and logs the image of the page. Sets moved to false if not even
+/// the first message could be moved.
+static result_t
+buffer_flush(btree_t* btree, const page_t page, bool* moved) {
+    header_t* header = page_get_header(page.data);
+    assert(header->message_count > 0);
+
+    // messages and separators are both ordered by key, so the messages of a
+    // child are consecutive
+    uint16_t first = 0, best_first = 0, best_count = 0;
+    uint16_t space = 0, best_space = 0;
+    uint16_t child = 0;
+
+    for (uint16_t i = 0; i < header->message_count; ++i) {
+        unsigned char* message = page_get_message(page.data, i);
+
+        uint16_t message_child = child;
+        while (message_child < header->cell_count &&
+               key_compare(payload_get_key_ptr(header->flags, page_get_payload(page.data, message_child)), message + 1) < 0) {
+            message_child += 1;
+        }
+
+        if (message_child != child) {
+            child = message_child;
+            first = i;
+            space = 0;
+        }
+
+        space += (uint16_t)(message_get_len(header->flags, message) + sizeof(uint16_t));
+        if (space > best_space) {
+            best_first = first;
+            best_count = (uint16_t)(i - first + 1);
+            best_space = space;
+        }
+    }
+
+    unsigned char batch_data[best_space];
+    blob_t batch = { 0, batch_data };
+
+    for (uint16_t i = best_first; i < best_first + best_count; ++i) {
+        const unsigned char* message = page_get_message(page.data, i);
+        const uint16_t size = message_get_len(header->flags, message);
+
+        memcpy(batch.data + batch.size, message, size);
+        batch.size += size;
+    }
+
+    page_remove_pointers(page.data, header->cell_count + best_first, best_count, best_space);
+    header->message_count -= best_count;
+    header->message_space -= best_space;
+
+    uint16_t offset = 0;
+    handle(buffer_route_batch(btree, page, batch, &offset)) {
+        buffer_restore(page.data, btree->page_size, batch, offset);
+        forward();
+    }
+
+    buffer_restore(page.data, btree->page_size, batch, offset);
+    try(pager_log_image(btree->pager, page));
+
+    *moved = offset > 0;
+
+    return SUCCESS;
+}
+
+static result_t
+btree_buffer_message(btree_t* btree, const blob_t message) {
+    page_t root;
+    try(btree_fix_root(btree, true, &root));
+    defer(pager_unfix, root);
+
+    for (;;) {
+        const header_t* header = page_get_header(root.data);
+
+        if (message_needs_split(btree->page_size, header, message)) {
+            page_t split, new;
+            blob_t split_key;
+            try(btree_split_root(btree, root, &split, &new, &split_key));
+
+            if (page_is_inner(header->flags)) {
+                // the message goes into the empty buffer of the new root
+                pager_unfix(split);
+                pager_unfix(root);
+                root = new;
+            } else {
+                pager_unfix(new);
+
+                const blob_t key = message_get_key(header->flags, message.data);
+                if (key_compare(key.data, split_key.data) <= 0) {
+                    pager_unfix(split);
+                } else {
+                    pager_unfix(root);
+                    root = split;
+                }
+            }
+        }
+
+        bool pushed;
+        try(buffer_push(btree, root, message, &pushed));
+
+        if (pushed) {
+            return SUCCESS;
+        }
+        if (!message_needs_split(btree->page_size, page_get_header(root.data), message)) {
+            failure(ENOSPC, msg("buffer of the root can not make space"));
+        }
+    }
+}
+
+result_t
+btree_upsert(btree_t* btree, const blob_t key, const blob_t value) {
+    ensure(btree != nullptr);
+    ensure(page_is_buffered(btree->flags));
+
+    unsigned char message[1 + key.size + value.size];
+    message[0] = MESSAGE_PUT;
+    memcpy(message + 1, key.data, key.size);
+    memcpy(message + 1 + key.size, value.data, value.size);
+
+    return btree_buffer_message(btree, (blob_t){ sizeof(message), message });
+}
+
+result_t
+btree_delete(btree_t* btree, const blob_t key) {
+    ensure(btree != nullptr);
+    ensure(page_is_buffered(btree->flags));
+
+    unsigned char message[1 + key.size];
+    message[0] = MESSAGE_DELETE;
+    memcpy(message + 1, key.data, key.size);
+
+    return btree_buffer_message(btree, (blob_t){ sizeof(message), message });
+}
+
+result_t
+btree_redo(const page_t page, const uint16_t page_size, const wal_record_t* record) {
+    ensure(record != nullptr);
+
+    const header_t* header = page_get_header(page.data);
+    const blob_t payload = record->payload;
+
+    if (record->type == WAL_RECORD_LEAF_INSERT) {
+        ensure(page_is_leaf(header->flags), with_uint(page.id));
+
+        const blob_t key = payload_get_key(header->flags, payload.data);
+        const blob_t value = { payload.size - key.size, payload.data + key.size };
+
+        blob_t cell;
+        try(page_insert_leaf(page.data, page_size, key, value, &cell));
+    } else if (record->type == WAL_RECORD_INNER_INSERT) {
+        ensure(page_is_inner(header->flags), with_uint(page.id));
+
+        // the separator is inserted at the same position as before, it is
+        // smaller than the key the split was made for
+        const blob_t key = { payload.size - sizeof(page_id_t), payload.data + sizeof(page_id_t) };
+
+        uint16_t index;
+        page_find_pointer(page.data, key, &index);
+        page_insert_inner(page.data, page_size, index, key, payload_get_page_id(payload.data));
+    } else if (record->type == WAL_RECORD_MESSAGE) {
+        if (page_is_leaf(header->flags)) {
+            int64_t rows = 0;
+            try(page_apply_message(page.data, page_size, payload, &rows));
+        } else {
+            buffer_add(page.data, page_size, payload);
+        }
+    } else {
+        failure(EINVAL, msg("record is not a tree record"), with_uint(record->type));
+    }
+
+    return SUCCESS;
+}
+
+/// Looks up the value of a key, sets found to false instead of failing if
+/// there is none.
+static result_t
+btree_find(const btree_t* btree, const blob_t key, unsigned char** out, bool* found) {
+    stats_add(STATS_BTREE_LOOKUPS, 1);
+
+    page_t page;
+    try(btree_fix_root(btree, false, &page));
+    defer(pager_unfix, page);
+
+    for (uint32_t level = 0; page_is_inner(page_get_header(page.data)->flags); ++level) {
+        const header_t* header = page_get_header(page.data);
+        page_mark_read_mostly(page, level);
+
+        // buffered messages are newer than everything below them
+        uint16_t index;
+        if (page_find_message(page.data, key, &index)) {
+            unsigned char* message = page_get_message(page.data, index);
+            *found = message[0] == MESSAGE_PUT;
+            if (*found) {
+                *out = payload_get_value_ptr(header->flags | PAGE_FLAG_LEAF, message + 1);
+            }
+
+            return SUCCESS;
+        }
+
+        page_find_pointer(page.data, key, &index);
+
+        page_id_t next;
+        if (index == header->cell_count) {
+            next = header->right;
+        } else {
+            next = payload_get_page_id(page_get_payload(page.data, index));
+        }
+        assert(next != 0);
+
+        page_t child;
+        try(pager_fix(btree->pager, next, false, &child));
         pager_unfix(page);
 
-        page = child;
+        page = child;
+    }
+
+    uint16_t index = 0;
+    *found = page_find_pointer(page.data, key, &index);
+    if (!*found) {
+        return SUCCESS;
+    }
+
+    const uint16_t flags = page_get_header(page.data)->flags;
+    *out = payload_get_value_ptr(flags, page_get_payload(page.data, index));
+
+    return SUCCESS;
+}
+
+result_t
+btree_lookup(const btree_t* btree, const blob_t key, unsigned char** out) {
+    const uint64_t start = stats_start(STATS_HISTOGRAM_BTREE_LOOKUP);
+
+    bool found;
+    try(btree_find(btree, key, out, &found));
+    stats_record(STATS_HISTOGRAM_BTREE_LOOKUP, start);
+
+    if (!found) {
+        failure(ENOENT, msg("key not found"));
+    }
+
+    return SUCCESS;
+}
+
+result_t
+btree_table_insert(btree_t* btree, const uint64_t id, const blob_t value) {
+    unsigned char key_buf[9];
+    const uint64_t key_len = varint_put(key_buf, id);
+
+    // values of compressed tables are stored as blob of the compressed data,
+    // splits move the cells without decompressing them
+    blob_t raw = value;
+    unsigned char compressed_buf[page_is_compressed(btree->flags) ? compress_bound(value.size) : 1];
+    if (page_is_compressed(btree->flags)) {
+        raw = (blob_t){ compress_encode(compressed_buf, value, btree->dictionary), compressed_buf };
+    }
+
+    // TODO: this is unsave :c
+    unsigned char value_buf[blob_put_len(raw)];
+    const uint64_t value_len = blob_put(value_buf, raw);
+
+    return btree_insert(btree, (blob_t){ key_len, key_buf }, (blob_t){ value_len, value_buf });
+}
+
+result_t
+btree_table_delete(btree_t* btree, const uint64_t id) {
+    unsigned char key[9];
+    const uint16_t key_len = varint_put(key, id);
+
+    return btree_delete(btree, (blob_t){ key_len, key });
+}
+
+result_t
+btree_table_find(const btree_t* btree, const uint64_t id, blob_t* out, bool* found) {
+    // most lookups of missing rows end here without fixing a page. The filter
+    // is loaded again once the lookup is counted, see btree_filter_reclaim
+    if (atomic_load(&btree->filter) != nullptr) {
+        btree_t* counted = (btree_t*)btree;
+        atomic_fetch_add(&counted->filter_users, 1);
+        const bloom_t* filter = atomic_load(&btree->filter);
+        const bool rejected = filter != nullptr && !bloom_contains(filter, id);
+        atomic_fetch_sub(&counted->filter_users, 1);
+
+        if (rejected) {
+            stats_add(STATS_BTREE_LOOKUPS, 1);
+            *found = false;
+            return SUCCESS;
+        }
+    }
+
+    unsigned char key[9];
+    const uint16_t key_len = varint_put(key, id);
+
+    unsigned char* value;
+    const uint64_t start = stats_start(STATS_HISTOGRAM_BTREE_LOOKUP);
+    try(btree_find(btree, (blob_t){ key_len, key }, &value, found));
+    stats_record(STATS_HISTOGRAM_BTREE_LOOKUP, start);
+
+    if (!*found) {
+        return SUCCESS;
+    }
+
+    blob_get(value, out);
+
+    // decompress lazily, only the value that was looked up
+    if (page_is_compressed(btree->flags)) {
+        try(compress_decode(lookup_buffer, sizeof(lookup_buffer), *out, btree->dictionary, out));
+    }
+
+    return SUCCESS;
+}
+
+result_t
+btree_table_lookup(const btree_t* btree, const uint64_t id, blob_t* out) {
+    bool found;
+    try(btree_table_find(btree, id, out, &found));
+
+    if (!found) {
+        failure(ENOENT, msg("row not found"), with_uint(id));
+    }
+
+    return SUCCESS;
+}
+
+/// Pages of one level of a bulk build, the last key of each page becomes its
+/// separator on the next level.
+typedef struct {
+    page_id_t* pages;
+    key_copy_t* keys;
+    uint32_t count;
+    uint32_t capacity;
+} build_level_t;
+
+defer_impl(build_levels_free) {
+    for (uint16_t i = 0; i < BTREE_STATS_MAX_HEIGHT; ++i) {
+        free(defer_arg(build_level_t)[i].pages);
+        free(defer_arg(build_level_t)[i].keys);
+    }
+}
+
+static result_t
+build_level_add(build_level_t* level, const page_id_t page, const key_copy_t* key) {
+    if (level->count == level->capacity) {
+        const uint32_t capacity = max(level->capacity * 2, 64u);
+
+        page_id_t* pages = realloc(level->pages, sizeof(page_id_t) * capacity);
+        if (pages == nullptr) {
+            failure(ENOMEM, msg("failed to grow the pages of a level"), with_uint(capacity));
+        }
+        level->pages = pages;
+
+        key_copy_t* keys = realloc(level->keys, sizeof(key_copy_t) * capacity);
+        if (keys == nullptr) {
+            failure(ENOMEM, msg("failed to grow the keys of a level"), with_uint(capacity));
+        }
+        level->keys = keys;
+
+        level->capacity = capacity;
+    }
+
+    level->pages[level->count] = page;
+    level->keys[level->count] = *key;
+    level->count += 1;
+
+    return SUCCESS;
+}
+
+/// Logs a completed page of a bulk build and adds it to its level.
+static result_t
+build_finish_page(pager_t* pager, build_level_t* level, const page_t page, const key_copy_t* last) {
+    try(pager_log_image(pager, page));
+    try(build_level_add(level, page.id, last));
+
+    return SUCCESS;
+}
+
+/// Packs the rows into the current leaf and the leaves after it, every leaf is
+/// filled before the next one is allocated. The last leaf is left fixed.
+static result_t
+build_fill_leaves(pager_t* pager, build_level_t* level, btree_build_next_t next, void* context, page_t* page, uint64_t* rows, uint32_t* pages) {
+    const uint16_t page_size = pager_get_page_size(pager);
+    const uint16_t flags = page_flags_package(true, PAGE_FLAG_TABLE);
+
+    key_copy_t last = { 0 };
+    while (true) {
+        uint64_t id;
+        blob_t value;
+        bool found;
+        try(next(context, &id, &value, &found));
+
+        if (!found) {
+            break;
+        }
+
+        unsigned char key_buf[9];
+        const blob_t key = { varint_put(key_buf, id), key_buf };
+        ensure(*rows == 0 || key_compare(key.data, last.data) > 0, with_uint(id));
+
+        const uint64_t cell_size = key.size + blob_put_len(value);
+        ensure(cell_size + sizeof(uint16_t) <= page_size - sizeof(header_t), with_uint(cell_size));
+
+        header_t* header = page_get_header(page->data);
+        if (header->free_space < cell_size + sizeof(uint16_t)) {
+            page_t leaf;
+            try(pager_alloc(pager, page->id, &leaf));
+
+            page_init(leaf.data, page_size, flags);
+            header->right = leaf.id;
+            handle(build_finish_page(pager, level, *page, &last)) {
+                pager_free(pager, leaf);
+                forward();
+            }
+
+            pager_unfix(*page);
+            *page = leaf;
+            *pages += 1;
+        }
+
+        unsigned char* ptr;
+        page_insert_payload(page->data, page_size, page_get_header(page->data)->cell_count, cell_size, &ptr);
+        memcpy(ptr, key.data, key.size);
+        blob_put(ptr + key.size, value);
+
+        key_copy(&last, key);
+        *rows += 1;
+    }
+
+    try(build_finish_page(pager, level, *page, &last));
+
+    return SUCCESS;
+}
+
+/// Packs the rows into leaves from left to right.
+static result_t
+build_leaves(pager_t* pager, build_level_t* level, btree_build_next_t next, void* context, uint64_t* rows, uint32_t* pages) {
+    page_t page;
+    try(pager_next(pager, &page));
+
+    page_init(page.data, pager_get_page_size(pager), page_flags_package(true, PAGE_FLAG_TABLE));
+    *pages += 1;
+
+    // the fixed page is not part of the level if the build fails
+    handle(build_fill_leaves(pager, level, next, context, &page, rows, pages)) {
+        pager_free(pager, page);
+        forward();
+    }
+    pager_unfix(page);
+
+    return SUCCESS;
+}
+
+/// Packs the pages of a level into the current inner page and the inner pages
+/// after it. Like after splits, the right pointer of every inner page but the
+/// last is a link to its sibling and the last child is a cell. The last inner
+/// page is left fixed.
+static result_t
+build_fill_inner(pager_t* pager, const build_level_t* level, build_level_t* parents, page_t* page, uint32_t* pages) {
+    const uint16_t page_size = pager_get_page_size(pager);
+    const uint16_t flags = page_flags_package(false, PAGE_FLAG_TABLE);
+
+    for (uint32_t i = 0; i < level->count; ++i) {
+        header_t* header = page_get_header(page->data);
+
+        if (i == level->count - 1) {
+            header->right = level->pages[i];
+            try(build_finish_page(pager, parents, *page, &level->keys[i]));
+            break;
+        }
+
+        const blob_t key = { level->keys[i].size, (unsigned char*)level->keys[i].data };
+        if (header->free_space < page_get_separator_max_len(flags)) {
+            page_t inner;
+            try(pager_alloc(pager, page->id, &inner));
+
+            page_init(inner.data, page_size, flags);
+            header->right = inner.id;
+            handle(build_finish_page(pager, parents, *page, &level->keys[i - 1])) {
+                pager_free(pager, inner);
+                forward();
+            }
+
+            pager_unfix(*page);
+            *page = inner;
+            *pages += 1;
+        }
+
+        unsigned char* ptr;
+        page_insert_payload(page->data, page_size, page_get_header(page->data)->cell_count, sizeof(page_id_t) + key.size, &ptr);
+        memcpy(ptr, &level->pages[i], sizeof(page_id_t));
+        memcpy(ptr + sizeof(page_id_t), key.data, key.size);
+    }
+
+    return SUCCESS;
+}
+
+/// Packs the pages of a level into the inner pages of the next level.
+static result_t
+build_inner(pager_t* pager, const build_level_t* level, build_level_t* parents, uint32_t* pages) {
+    page_t page;
+    try(pager_alloc(pager, level->pages[level->count - 1], &page));
+
+    page_init(page.data, pager_get_page_size(pager), page_flags_package(false, PAGE_FLAG_TABLE));
+    *pages += 1;
+
+    // the fixed page is not part of the parents if the build fails
+    handle(build_fill_inner(pager, level, parents, &page, pages)) {
+        pager_free(pager, page);
+        forward();
+    }
+    pager_unfix(page);
+
+    return SUCCESS;
+}
+
+/// Returns the pages of all levels of a failed bulk build to the allocator.
+static void
+build_levels_release(pager_t* pager, const build_level_t* levels) {
+    for (uint16_t i = 0; i < BTREE_STATS_MAX_HEIGHT; ++i) {
+        for (uint32_t j = 0; j < levels[i].count; ++j) {
+            pager_release(pager, levels[i].pages[j], 1);
+        }
+    }
+}
+
+/// Builds the levels from the leaves up to the single root.
+static result_t
+build_levels(pager_t* pager, build_level_t* levels, btree_build_next_t next, void* context, uint64_t* rows, uint32_t* pages, uint16_t* height) {
+    try(build_leaves(pager, &levels[0], next, context, rows, pages));
+
+    *height = 1;
+    while (levels[*height - 1].count > 1) {
+        // btree_stats can not inspect higher trees either
+        ensure(*height < BTREE_STATS_MAX_HEIGHT, with_uint(*height));
+
+        try(build_inner(pager, &levels[*height - 1], &levels[*height], pages));
+        *height += 1;
+    }
+
+    return SUCCESS;
+}
+
+result_t
+btree_table_build(btree_t** out, pager_t* pager, const char* name, btree_build_next_t next, void* context) {
+    ensure(out != nullptr);
+    ensure(pager != nullptr);
+    ensure(next != nullptr);
+
+    // the finished levels are kept until the tree is registered, their pages
+    // are released if the build fails
+    build_level_t levels[BTREE_STATS_MAX_HEIGHT] = { 0 };
+    defer(build_levels_free, levels);
+
+    uint64_t rows = 0;
+    uint32_t pages = 0;
+    uint16_t height;
+    handle(build_levels(pager, levels, next, context, &rows, &pages, &height)) {
+        build_levels_release(pager, levels);
+        forward();
+    }
+
+    catalog_ref_t ref;
+    catalog_entry_t entry;
+    handle(catalog_register(pager, name, levels[height - 1].pages[0], PAGE_FLAG_TABLE, &ref, &entry)) {
+        build_levels_release(pager, levels);
+        forward();
+    }
+    try(catalog_set_root(pager, ref, entry.root, height));
+    try(catalog_add_stats(pager, ref, (int64_t)rows, (int32_t)pages - 1));
+    try(catalog_read(pager, ref, &entry));
+
+    return btree_init(out, pager, ref, &entry);
+}
+
+result_t
+btree_snapshot_open(btree_snapshot_t** out, btree_t* btree) {
+    ensure(out != nullptr);
+    ensure(btree != nullptr);
+    ensure(!page_is_buffered(btree->flags));
+
+    btree_snapshot_t* snapshot;
+    try_alloc(snapshot, sizeof(btree_snapshot_t));
+    errdefer(free, snapshot);
+
+    try_alloc(snapshot->leaf, btree->page_size);
+    errdefer(free, snapshot->leaf);
+
+    if (page_is_compressed(btree->flags)) {
+        try_alloc(snapshot->buffer, UINT16_MAX);
+    }
+
+    snapshot->btree = btree;
+
+    latch_acquire_write(&btree->snapshot_latch);
+    defer(latch_release_write, btree->snapshot_latch);
+
+    // versions recorded without an open snapshot are visible to this one
+    if (atomic_fetch_add(&btree->snapshot_count, 1) == 0) {
+        version_prune(btree);
+    }
+    snapshot->timestamp = atomic_load(&btree->clock);
+
+    snapshot->prev = btree->snapshots_tail;
+    if (btree->snapshots_tail == nullptr) {
+        btree->snapshots = snapshot;
+    } else {
+        btree->snapshots_tail->next = snapshot;
+    }
+    btree->snapshots_tail = snapshot;
+
+    *out = snapshot;
+
+    return SUCCESS;
+}
+
+/// Fixes the leaf after the upper bound of the current leaf with shared
+/// latches coupled on the way down, and updates the upper bound.
+static result_t
+snapshot_descend(btree_snapshot_t* snapshot, page_t* out) {
+    btree_t* btree = snapshot->btree;
+
+    page_t page;
+    try(btree_fix_root(btree, false, &page));
+
+    const key_copy_t cursor = snapshot->upper;
+    snapshot->bounded = false;
+
+    for (uint32_t level = 0; page_is_inner(page_get_header(page.data)->flags); ++level) {
+        const header_t* header = page_get_header(page.data);
+        page_mark_read_mostly(page, level);
+
+        uint16_t index = 0;
+        if (snapshot->started && page_find_pointer(page.data, (blob_t){ cursor.size, (unsigned char*)cursor.data }, &index)) {
+            index += 1;
+        }
+
+        page_id_t next;
+        if (index == header->cell_count) {
+            next = header->right;
+        } else {
+            unsigned char* payload = page_get_payload(page.data, index);
+            next = payload_get_page_id(payload);
+
+            key_copy(&snapshot->upper, payload_get_key(header->flags, payload));
+            snapshot->bounded = true;
+        }
+
+        page_t child;
+        handle(pager_fix(btree->pager, next, false, &child)) {
+            pager_unfix(page);
+            forward();
+        }
+        pager_unfix(page);
+
+        page = child;
+    }
+
+    *out = page;
+
+    return SUCCESS;
+}
+
+result_t
+btree_snapshot_next(btree_snapshot_t* snapshot, blob_t* key, blob_t* value, bool* found) {
+    ensure(snapshot != nullptr);
+    ensure(key != nullptr);
+    ensure(value != nullptr);
+    ensure(found != nullptr);
+
+    const btree_t* btree = snapshot->btree;
+    *found = false;
+
+    while (true) {
+        const header_t* header = page_get_header(snapshot->leaf);
+        if (snapshot->started && snapshot->index < header->cell_count) {
+            unsigned char* payload = page_get_payload(snapshot->leaf, snapshot->index++);
+
+            *key = payload_get_key(header->flags, payload);
+            if (!version_visible(snapshot, *key)) {
+                continue;
+            }
+
+            unsigned char* value_ptr = payload_get_value_ptr(header->flags, payload);
+            *value = (blob_t){ payload_get_value_len(header->flags, value_ptr), value_ptr };
+            *found = true;
+
+            return SUCCESS;
+        }
+
+        if (snapshot->started && !snapshot->bounded) {
+            return SUCCESS;
+        }
+
+        // the leaf is copied, so the latch is only held for the copy
+        const key_copy_t after = snapshot->upper;
+        const bool started = snapshot->started;
+
+        page_t page;
+        try(snapshot_descend(snapshot, &page));
+        memcpy(snapshot->leaf, page.data, btree->page_size);
+        pager_unfix_once(page);
+
+        // keys up to the previous bound were in the previous leaf, or were
+        // inserted after it was copied and are not visible
+        snapshot->index = 0;
+        snapshot->started = true;
+        if (started && page_find_pointer(snapshot->leaf, (blob_t){ after.size, (unsigned char*)after.data }, &snapshot->index)) {
+            snapshot->index += 1;
+        }
+    }
+}
+
+result_t
+btree_snapshot_table_next(btree_snapshot_t* snapshot, uint64_t* id, blob_t* value, bool* found) {
+    ensure(id != nullptr);
+
+    blob_t key, raw;
+    try(btree_snapshot_next(snapshot, &key, &raw, found));
+    if (!*found) {
+        return SUCCESS;
+    }
+
+    varint_get(key.data, id);
+    blob_get(raw.data, value);
+
+    if (page_is_compressed(snapshot->btree->flags)) {
+        try(compress_decode(snapshot->buffer, UINT16_MAX, *value, snapshot->btree->dictionary, value));
+    }
+
+    return SUCCESS;
+}
+
+result_t
+btree_snapshot_close(btree_snapshot_t** out) {
+    ensure(out != nullptr);
+
+    btree_snapshot_t* snapshot = *out;
+    btree_t* btree = snapshot->btree;
+
+    // only the oldest snapshot holds back the pruning
+    const bool oldest = snapshot->prev == nullptr;
+
+    {
+        latch_acquire_write(&btree->snapshot_latch);
+        defer(latch_release_write, btree->snapshot_latch);
+
+        if (snapshot->prev == nullptr) {
+            btree->snapshots = snapshot->next;
+        } else {
+            snapshot->prev->next = snapshot->next;
+        }
+        if (snapshot->next == nullptr) {
+            btree->snapshots_tail = snapshot->prev;
+        } else {
+            snapshot->next->prev = snapshot->prev;
+        }
+
+        atomic_fetch_sub(&btree->snapshot_count, 1);
+        if (oldest) {
+            version_prune(btree);
+        }
+    }
+
+    free(snapshot->buffer);
+    free(snapshot->leaf);
+    free(snapshot);
+    *out = nullptr;
+
+    return SUCCESS;
+}
+
+/// Adds the ids of all rows in a snapshot of the tree to the filter.
+static result_t
+btree_filter_fill(btree_t* btree, bloom_t* filter) {
+    btree_snapshot_t* snapshot;
+    try(btree_snapshot_open(&snapshot, btree));
+
+    while (true) {
+        blob_t key, value;
+        bool found;
+        handle(btree_snapshot_next(snapshot, &key, &value, &found)) {
+            const int32_t result = btree_snapshot_close(&snapshot);
+            (void)result;
+            forward();
+        }
+
+        if (!found) {
+            break;
+        }
+
+        uint64_t id;
+        varint_get(key.data, &id);
+        bloom_add(filter, id);
+    }
+
+    return btree_snapshot_close(&snapshot);
+}
+
+/// Frees the retired filters if no lookup or insert uses a filter. Threads
+/// count themselves before they load a filter, so once the count was zero after
+/// a filter was retired no thread can still hold it. The filter latch has to be
+/// held exclusively.
+static result_t
+btree_filter_reclaim(btree_t* btree) {
+    if (btree->retired_count == 0 || atomic_load(&btree->filter_users) != 0) {
+        return SUCCESS;
+    }
+
+    for (uint32_t i = 0; i < btree->retired_count; ++i) {
+        try(bloom_close(&btree->retired_filters[i]));
+    }
+    btree->retired_count = 0;
+
+    return SUCCESS;
+}
+
+result_t
+btree_filter_build(btree_t* btree, const uint32_t bits_per_key) {
+    ensure(btree != nullptr);
+    ensure(page_is_table(btree->flags) && !page_is_buffered(btree->flags));
+
+    latch_acquire_write(&btree->filter_latch);
+    defer(latch_release_write, btree->filter_latch);
+
+    // filters retired by earlier builds whose users were not done yet
+    try(btree_filter_reclaim(btree));
+
+    catalog_entry_t entry;
+    try(catalog_read(btree->pager, btree->ref, &entry));
+    const int64_t rows = (int64_t)entry.row_count + atomic_load(&btree->row_delta);
+
+    // either the old or, after a failure, the new filter is retired
+    bloom_t** retired = realloc(btree->retired_filters, sizeof(bloom_t*) * (btree->retired_count + 1));
+    if (retired == nullptr) {
+        failure(ENOMEM, msg("no memory for retired filters"));
+    }
+    btree->retired_filters = retired;
+
+    bloom_t* filter;
+    try(bloom_open(&filter, rows > 0 ? (uint64_t)rows : 0, bits_per_key));
+
+    // inserts that the snapshot misses add their ids to the new filter, an
+    // insert might still use it after a failure
+    atomic_store(&btree->next_filter, filter);
+    handle(btree_filter_fill(btree, filter)) {
+        atomic_store(&btree->next_filter, nullptr);
+        btree->retired_filters[btree->retired_count++] = filter;
+        forward();
+    }
+
+    bloom_t* old = atomic_exchange(&btree->filter, filter);
+    atomic_store(&btree->next_filter, nullptr);
+    if (old != nullptr) {
+        btree->retired_filters[btree->retired_count++] = old;
+    }
+    btree->filter_bits = bits_per_key;
+
+    return btree_filter_reclaim(btree);
+}
+
+/// State of a statistics walk over the tree.
+typedef struct {
+    const btree_t* btree;
+    btree_stats_t* stats;
+    bool verify;
+
+    /// Level of the first leaf, all other leaves have to be on the same level.
+    uint16_t leaf_level;
+
+    /// The last visited leaf and its right sibling at the time of the visit.
+    page_id_t prev_leaf;
+    page_id_t prev_right;
+} stats_walk_t;
+
+/// Number of right links that are followed to find the next leaf. Leaves that
+/// were split concurrently are between the last and the next visited leaf.
+#define STATS_SIBLING_HOPS 16
+
+static uint16_t
+stats_fill_bucket(const uint16_t page_size, const header_t* header) {
+    const uint32_t capacity = page_size - sizeof(header_t);
+    const uint32_t used = capacity - header->free_space;
+
+    return (uint16_t)min(used * BTREE_STATS_FILL_BUCKETS / capacity, BTREE_STATS_FILL_BUCKETS - 1);
+}
+
+/// Verifies that the cells of the page are ordered and within the bounds of
+/// the subtree. The lower bound is exclusive, the upper bound inclusive.
+static result_t
+stats_verify_page(
+  const stats_walk_t* walk,
+  unsigned char* page,
+  const page_id_t id,
+  const key_copy_t* lower,
+  const key_copy_t* upper
+) {
+    const header_t* header = page_get_header(page);
+    const uint16_t page_size = walk->btree->page_size;
+
+    if ((header->flags & ~PAGE_FLAG_LEAF) != walk->btree->flags) {
+        failure(EINVAL, msg("page type does not match the tree"), with_uint(id), with_uint(header->flags));
+    }
+    if (header->free_space < page_get_space(page)) {
+        failure(EINVAL, msg("free space smaller than the gap"), with_uint(id), with_uint(header->free_space));
+    }
+
+    const uint16_t* pointers = page_get_cells(page);
+    for (uint16_t i = 0; i < header->cell_count; ++i) {
+        if (pointers[i] < header->data_start || pointers[i] >= page_size) {
+            failure(EINVAL, msg("cell pointer out of bounds"), with_uint(id), with_uint(i), with_uint(pointers[i]));
+        }
+
+        unsigned char* key = payload_get_key_ptr(header->flags, page_get_payload(page, i));
+        if (i > 0) {
+            unsigned char* prev = payload_get_key_ptr(header->flags, page_get_payload(page, i - 1));
+            if (key_compare(prev, key) >= 0) {
+                failure(EINVAL, msg("keys out of order"), with_uint(id), with_uint(i));
+            }
+        }
+        if (lower != nullptr && key_compare(key, lower->data) <= 0) {
+            failure(EINVAL, msg("key below the lower bound of the subtree"), with_uint(id), with_uint(i));
+        }
+        if (upper != nullptr && key_compare(key, upper->data) > 0) {
+            failure(EINVAL, msg("key above the upper bound of the subtree"), with_uint(id), with_uint(i));
+        }
+    }
+
+    return SUCCESS;
+}
+
+/// Verifies that the leaf can be reached from the previous leaf by following
+/// right links.
+static result_t
+stats_verify_sibling(const stats_walk_t* walk, const page_id_t id) {
+    page_id_t right = walk->prev_right;
+
+    for (uint32_t i = 0; i < STATS_SIBLING_HOPS && right != 0 && right != id; ++i) {
+        page_t sibling;
+        try(pager_fix(walk->btree->pager, right, false, &sibling));
+        right = page_get_header(sibling.data)->right;
+        pager_unfix(sibling);
+    }
+
+    if (right != id) {
+        failure(EINVAL, msg("leaf not reachable from its left sibling"), with_uint(walk->prev_leaf), with_uint(id));
+    }
+
+    return SUCCESS;
+}
+
+static result_t
+stats_walk(stats_walk_t* walk, const page_id_t id, const uint16_t level, const key_copy_t* lower, const key_copy_t* upper) {
+    btree_stats_t* stats = walk->stats;
+
+    if (level >= BTREE_STATS_MAX_HEIGHT) {
+        failure(EINVAL, msg("tree is too high"), with_uint(id), with_uint(level));
+    }
+
+    uint16_t key_count = 0;
+    uint16_t child_count = 0;
+    page_id_t* children = nullptr;
+    key_copy_t* keys = nullptr;
+    defer(free, children);
+    defer(free, keys);
+
+    bool leaf;
+    page_id_t right;
+    { // page lock scope, children are visited after releasing the page
+        page_t page;
+        try(pager_fix(walk->btree->pager, id, false, &page));
+        defer(pager_unfix, page);
+
+        const header_t* header = page_get_header(page.data);
+        leaf = page_is_leaf(header->flags);
+        right = header->right;
+
+        if (walk->verify) {
+            try(stats_verify_page(walk, page.data, id, lower, upper));
+        }
+
+        const uint16_t space = page_get_space(page.data);
+        stats->height = (uint16_t)max(stats->height, level + 1u);
+        stats->page_count += 1;
+        stats->level_page_count[level] += 1;
+        stats->free_bytes += space;
+        stats->fragmented_bytes += (uint64_t)(header->free_space - space);
+        stats->cell_count += header->cell_count;
+        for (uint16_t i = 0; i < header->cell_count; ++i) {
+            stats->cell_bytes += payload_get_len(header->flags, page_get_payload(page.data, i));
+        }
+
+        if (leaf) {
+            stats->leaf_fill[stats_fill_bucket(walk->btree->page_size, header)] += 1;
+            stats->row_count += header->cell_count;
+        } else {
+            stats->inner_fill[stats_fill_bucket(walk->btree->page_size, header)] += 1;
+
+            // the right pointer of inner pages with an upper bound is a stale
+            // link to the sibling and not a child, its key range is empty
+            const bool has_right = upper == nullptr;
+            key_count = header->cell_count;
+            child_count = (uint16_t)(key_count + (has_right ? 1 : 0));
+
+            try_alloc(children, sizeof(page_id_t) * child_count);
+            try_alloc(keys, sizeof(key_copy_t) * key_count);
+
+            for (uint16_t i = 0; i < key_count; ++i) {
+                unsigned char* payload = page_get_payload(page.data, i);
+                children[i] = payload_get_page_id(payload);
+                key_copy(&keys[i], payload_get_key(header->flags, payload));
+            }
+            if (has_right) {
+                children[key_count] = header->right;
+            }
+        }
+    }
+
+    if (leaf) {
+        if (walk->verify && walk->prev_leaf == 0) {
+            walk->leaf_level = level;
+        }
+        if (walk->verify && walk->leaf_level != level) {
+            failure(EINVAL, msg("leaves on different levels"), with_uint(id), with_uint(level));
+        }
+        if (walk->verify && walk->prev_leaf != 0) {
+            try(stats_verify_sibling(walk, id));
+        }
+
+        walk->prev_leaf = id;
+        walk->prev_right = right;
+
+        return SUCCESS;
+    }
+
+    for (uint16_t i = 0; i < child_count; ++i) {
+        if (walk->verify && children[i] == 0) {
+            failure(EINVAL, msg("invalid child pointer"), with_uint(id), with_uint(i));
+        }
+
+        const key_copy_t* child_lower = i == 0 ? lower : &keys[i - 1];
+        const key_copy_t* child_upper = i < key_count ? &keys[i] : upper;
+
+        try(stats_walk(walk, children[i], (uint16_t)(level + 1), child_lower, child_upper));
+    }
+
+    return SUCCESS;
+}
+
+result_t
+btree_stats(const btree_t* btree, const bool verify, btree_stats_t* out) {
+    ensure(btree != nullptr);
+    ensure(out != nullptr);
+
+    memset(out, 0, sizeof(btree_stats_t));
+
+    stats_walk_t walk = {
+        .btree = btree,
+        .stats = out,
+        .verify = verify,
+    };
+    try(stats_walk(&walk, btree->root, 0, nullptr, nullptr));
+
+    // the last leaf might have been split concurrently, but the chain of right
+    // links has to end eventually
+    if (verify && walk.prev_right != 0) {
+        try(stats_verify_sibling(&walk, 0));
+    }
+
+    if (out->cell_count > 0) {
+        out->avg_cell_size = (double)out->cell_bytes / (double)out->cell_count;
+    }
+
+    return SUCCESS;
+}
+
+void
+btree_stats_snapshot(btree_counters_t* out) {
+    uint64_t counters[5];
+    stats_sum(STATS_BTREE_LOOKUPS, 5, counters);
+
+    *out = (btree_counters_t){
+        .lookups = counters[0],
+        .inserts = counters[1],
+        .splits = counters[2],
+        .compactions = counters[3],
+        .compacted_leaves = counters[4],
+    };
+}
+
+struct btree_compaction_t {
+    btree_t* btree;
+
+    /// Maximum number of bytes used on a compacted leaf.
+    uint32_t target;
+
+    /// Upper bound of the last compacted inner page, all leaves up to this key
+    /// are compacted. Empty before the first step.
+    key_copy_t cursor;
+    bool started;
+    bool done;
+
+    /// Last leaf of the previous step, its right link might have to be updated.
+    page_id_t prev_leaf;
+
+    /// Range of reserved page ids for the compacted leaves.
+    page_id_t next;
+    page_id_t end;
+};
+
+/// Position of a cell within the leaves below an inner page.
+typedef struct {
+    uint16_t child;
+    uint16_t cell;
+} compact_pos_t;
+
+/// Leaves below an inner page that are fixed during a compaction step. Leaves
+/// that were freed by the compaction are reset to a null page.
+typedef struct {
+    page_t* pages;
+    uint16_t count;
+} compact_children_t;
+
+defer_impl(compact_children_unfix) {
+    const compact_children_t* children = defer_arg(compact_children_t);
+
+    for (uint16_t i = 0; i < children->count; ++i) {
+        if (children->pages[i].data != nullptr) {
+            pager_unfix(children->pages[i]);
+        }
+    }
+    free(children->pages);
+}
+
+/// Skips over the end of the current leaf and over empty leaves.
+static void
+compact_normalize(const page_t* children, const uint16_t child_count, compact_pos_t* pos) {
+    while (pos->child < child_count && pos->cell >= page_get_header(children[pos->child].data)->cell_count) {
+        pos->child += 1;
+        pos->cell = 0;
+    }
+}
+
+/// Takes the cells for the next compacted leaf, as many as fit into the target
+/// but at least one. Copies the cells to the destination if it is provided and
+/// returns the last taken cell.
+static unsigned char*
+compact_fill_page(
+  const page_t* children,
+  const uint16_t child_count,
+  const uint32_t target,
+  const uint16_t page_size,
+  compact_pos_t* pos,
+  unsigned char* dst
+) {
+    uint32_t used = 0;
+    unsigned char* last = nullptr;
+
+    while (pos->child < child_count) {
+        unsigned char* page = children[pos->child].data;
+        unsigned char* payload = page_get_payload(page, pos->cell);
+        const uint16_t size = payload_get_len(page_get_header(page)->flags, payload);
+
+        if (last != nullptr && used + size + sizeof(uint16_t) > target) {
+            break;
+        }
+
+        if (dst != nullptr) {
+            unsigned char* ptr;
+            page_insert_payload(dst, page_size, page_get_header(dst)->cell_count, size, &ptr);
+            memcpy(ptr, payload, size);
+        }
+
+        used += size + (uint32_t)sizeof(uint16_t);
+        last = payload;
+
+        pos->cell += 1;
+        compact_normalize(children, child_count, pos);
+    }
+
+    return last;
+}
+
+/// Descends to the inner page above the next leaves that are not compacted
+/// yet. Latches are coupled on the way down, the returned page stays fixed
+/// exclusively. Sets bounded if the inner page has an upper bound.
+static result_t
+compact_descend(btree_compaction_t* compaction, page_t* out, key_copy_t* upper, bool* bounded) {
+    btree_t* btree = compaction->btree;
+
+    page_t page;
+    try(btree_fix_root(btree, true, &page));
+    errdefer(pager_unfix, page);
+
+    // only root splits change the height, which is stable while the current
+    // root is fixed exclusively
+    if (btree->height < 2) {
+        pager_unfix(page);
+        *out = (page_t){ 0, nullptr };
+        return SUCCESS;
+    }
+
+    *bounded = false;
+    for (uint16_t level = 0; level + 2u < btree->height; ++level) {
+        const header_t* header = page_get_header(page.data);
+
+        uint16_t index = 0;
+        if (compaction->started && page_find_pointer(page.data, (blob_t){ compaction->cursor.size, compaction->cursor.data }, &index)) {
+            index += 1;
+        }
+
+        page_id_t next;
+        if (index == header->cell_count) {
+            next = header->right;
+        } else {
+            unsigned char* payload = page_get_payload(page.data, index);
+            next = payload_get_page_id(payload);
+
+            key_copy(upper, payload_get_key(header->flags, payload));
+            *bounded = true;
+        }
+
+        page_t child;
+        try(pager_fix(btree->pager, next, true, &child));
+        pager_unfix(page);
+
+        page = child;
+    }
+
+    *out = page;
+
+    return SUCCESS;
+}
+
+/// Finds the leaf left of the first leaf below the current inner page, starting
+/// at the last leaf of the previous step, and points it to the compacted leaf.
+static result_t
+compact_link_left(btree_compaction_t* compaction, const page_id_t old, const page_id_t new) {
+    page_id_t id = compaction->prev_leaf;
+
+    while (id != 0) {
+        page_t page;
+        try(pager_fix(compaction->btree->pager, id, true, &page));
+        defer(pager_unfix, page);
+
+        header_t* header = page_get_header(page.data);
+        if (header->right == old) {
+            header->right = new;
+            try(pager_log_image(compaction->btree->pager, page));
+            return SUCCESS;
+        }
+
+        id = header->right;
+    }
+
+    failure(EINVAL, msg("left sibling of leaf not found"), with_uint(old));
+}
+
+/// Rewrites the leaves below the inner page and frees the old leaves. Returns
+/// without any change if the leaves are already compacted.
+static result_t
+compact_leaves(btree_compaction_t* compaction, page_t parent, page_t* children, const uint16_t child_count, const bool bounded) {
+    btree_t* btree = compaction->btree;
+    header_t* parent_header = page_get_header(parent.data);
+    const uint32_t capacity = (uint32_t)(btree->page_size - sizeof(header_t));
+
+    // first pass, only count the compacted leaves and the size of the cells
+    // in the inner page
+    uint16_t page_count = 0;
+    uint32_t parent_bytes = 0;
+    compact_pos_t pos = { 0, 0 };
+    compact_normalize(children, child_count, &pos);
+    while (pos.child < child_count) {
+        const unsigned char* last = compact_fill_page(children, child_count, compaction->target, btree->page_size, &pos, nullptr);
+        page_count += 1;
+
+        if (pos.child < child_count) {
+            parent_bytes += (uint32_t)(sizeof(uint16_t) + sizeof(page_id_t) + payload_get_key_len(btree->flags, last));
+        }
+    }
+    if (bounded) {
+        const uint16_t last = parent_header->cell_count - 1;
+        parent_bytes += (uint32_t)(sizeof(uint16_t) + payload_get_len(parent_header->flags, page_get_payload(parent.data, last)));
+    }
+
+    bool consecutive = compaction->prev_leaf == 0 || children[0].id == compaction->prev_leaf + 1;
+    for (uint16_t i = 1; i < child_count; ++i) {
+        consecutive = consecutive && children[i].id == children[0].id + i;
+    }
+
+    // the separators of the compacted leaves might be longer than the old ones
+    if (page_count == 0 || (page_count == child_count && consecutive) || parent_bytes > capacity) {
+        compaction->prev_leaf = children[child_count - 1].id;
+        return SUCCESS;
+    }
+
+    if (compaction->end - compaction->next < page_count) {
+        pager_release(btree->pager, compaction->next, compaction->end - compaction->next);
+        compaction->next = compaction->end;
+
+        try(pager_reserve(btree->pager, page_count, &compaction->next));
+        compaction->end = compaction->next + page_count;
+    }
+    const page_id_t first = compaction->next;
+
+    key_copy_t* separators;
+    try_alloc(separators, sizeof(key_copy_t) * page_count);
+    defer(free, separators);
+
+    // second pass, write the compacted leaves, they stay unreachable until the
+    // left sibling and the inner page are updated
+    pos = (compact_pos_t){ 0, 0 };
+    compact_normalize(children, child_count, &pos);
+    const uint16_t leaf_flags = page_flags_package(true, btree->flags);
+    for (uint16_t i = 0; i < page_count; ++i) {
+        page_t page;
+        try(pager_fix(btree->pager, first + i, true, &page));
+        defer(pager_unfix, page);
+
+        page_init(page.data, btree->page_size, leaf_flags);
+        unsigned char* last = compact_fill_page(children, child_count, compaction->target, btree->page_size, &pos, page.data);
+        key_copy(&separators[i], payload_get_key(leaf_flags, last));
+
+        const bool is_last = i + 1u == page_count;
+        page_get_header(page.data)->right = is_last ? page_get_header(children[child_count - 1].data)->right : first + i + 1u;
+
+        try(pager_log_image(btree->pager, page));
+    }
+
+    compaction->next += page_count;
+
+    if (compaction->prev_leaf != 0) {
+        try(compact_link_left(compaction, children[0].id, first));
+    }
+
+    // rebuild the inner page, the last leaf keeps the old separator since it
+    // is the upper bound of the inner page
+    unsigned char buffer[btree->page_size];
+    page_init(buffer, btree->page_size, parent_header->flags);
+    page_get_header(buffer)->right = parent_header->right;
+
+    for (uint16_t i = 0; i < page_count; ++i) {
+        blob_t key = { separators[i].size, separators[i].data };
+
+        const bool is_last = i + 1u == page_count;
+        if (is_last && !bounded) {
+            page_get_header(buffer)->right = first + i;
+            break;
+        }
+        if (is_last) {
+            key = payload_get_key(parent_header->flags, page_get_payload(parent.data, parent_header->cell_count - 1));
+        }
+
+        const page_id_t id = first + i;
+        unsigned char* ptr;
+        page_insert_payload(buffer, btree->page_size, i, sizeof(page_id_t) + key.size, &ptr);
+        memcpy(ptr, &id, sizeof(page_id_t));
+        memcpy(ptr + sizeof(page_id_t), key.data, key.size);
+    }
+
+    memcpy(parent.data, buffer, btree->page_size);
+    try(pager_log_image(btree->pager, parent));
+
+    for (uint16_t i = 0; i < child_count; ++i) {
+        pager_free(btree->pager, children[i]);
+        children[i] = (page_t){ 0, nullptr };
+    }
+
+    atomic_fetch_add(&btree->page_delta, (int32_t)page_count - (int32_t)child_count);
+    compaction->prev_leaf = first + page_count - 1u;
+
+    return SUCCESS;
+}
+
+result_t
+btree_compaction_open(btree_compaction_t** out, btree_t* btree, const double fill) {
+    ensure(out != nullptr);
+    ensure(btree != nullptr);
+    ensure(!page_is_buffered(btree->flags));
+    ensure(fill > 0 && fill <= 1);
+
+    btree_stats_t stats;
+    try(btree_stats(btree, false, &stats));
+    stats_add(STATS_BTREE_COMPACTIONS, 1);
+
+    btree_compaction_t* compaction;
+    try_alloc(compaction, sizeof(btree_compaction_t));
+    errdefer(free, compaction);
+
+    compaction->btree = btree;
+    compaction->target = (uint32_t)((btree->page_size - sizeof(header_t)) * fill);
+    compaction->done = stats.height < 2;
+
+    // reserve enough ids for all leaves up front to keep them consecutive,
+    // steps reserve more if the tree grows concurrently
+    if (!compaction->done) {
+        const uint32_t leaves = stats.level_page_count[stats.height - 1];
+        try(pager_reserve(btree->pager, leaves, &compaction->next));
+        compaction->end = compaction->next + leaves;
+    }
+
+    *out = compaction;
+
+    return SUCCESS;
+}
+
+result_t
+btree_compaction_step(btree_compaction_t* compaction, bool* done) {
+    ensure(compaction != nullptr);
+    ensure(done != nullptr);
+
+    if (compaction->done) {
+        *done = true;
+        return SUCCESS;
+    }
+
+    page_t parent;
+    key_copy_t upper;
+    bool bounded;
+    try(compact_descend(compaction, &parent, &upper, &bounded));
+
+    // the tree might have shrunk to a single leaf
+    if (parent.data == nullptr) {
+        compaction->done = *done = true;
+        return SUCCESS;
+    }
+    defer(pager_unfix, parent);
+
+    const header_t* header = page_get_header(parent.data);
+
+    // the right pointer of inner pages with an upper bound is a stale link to
+    // the sibling and not a child
+    const uint16_t child_count = (uint16_t)(header->cell_count + (bounded ? 0 : 1));
+
+    compact_children_t children = { .count = 0 };
+    try_alloc(children.pages, sizeof(page_t) * child_count);
+    defer(compact_children_unfix, children);
+
+    for (uint16_t i = 0; i < child_count; ++i) {
+        const page_id_t id = i < header->cell_count ? payload_get_page_id(page_get_payload(parent.data, i)) : header->right;
+
+        try(pager_fix(compaction->btree->pager, id, true, &children.pages[i]));
+        children.count += 1;
+    }
+
+    try(compact_leaves(compaction, parent, children.pages, child_count, bounded));
+    stats_add(STATS_BTREE_COMPACTED_LEAVES, child_count);
+
+    if (!bounded) {
+        compaction->done = true;
+    } else {
+        compaction->cursor = upper;
+        compaction->started = true;
+    }
+    *done = compaction->done;
+
+    return SUCCESS;
+}
+
+/// Returns the unused reserved page ids and frees the compaction.
+static void
+compaction_free(btree_compaction_t* compaction) {
+    if (compaction->end > compaction->next) {
+        pager_release(compaction->btree->pager, compaction->next, compaction->end - compaction->next);
+    }
+
+    free(compaction);
+}
+
+defer_impl(compaction_free) {
+    compaction_free(*defer_arg(btree_compaction_t*));
+}
+
+result_t
+btree_compaction_close(btree_compaction_t** out) {
+    ensure(out != nullptr);
+
+    compaction_free(*out);
+    *out = nullptr;
+
+    return SUCCESS;
+}
+
+result_t
+btree_compact(btree_t* btree, const double fill) {
+    btree_compaction_t* compaction;
+    try(btree_compaction_open(&compaction, btree, fill));
+    defer(compaction_free, compaction);
+
+    bool done = false;
+    while (!done) {
+        try(btree_compaction_step(compaction, &done));
+    }
+
+    // sizes the filter for the rows inserted since it was built
+    if (atomic_load(&btree->filter) != nullptr) {
+        try(btree_filter_build(btree, btree->filter_bits));
+    }
+
+    return SUCCESS;
+}
+
+/// Frees a page and all pages below it. The right pointer of inner pages with
+/// an upper bound is a link to the sibling, see stats_walk.
+static result_t
+btree_drop_page(pager_t* pager, const page_id_t id, const bool bounded) {
+    page_t page;
+    try(pager_fix(pager, id, true, &page));
+    errdefer(pager_unfix, page);
+
+    const header_t* header = page_get_header(page.data);
+    if (page_is_inner(header->flags)) {
+        for (uint16_t i = 0; i < header->cell_count; ++i) {
+            try(btree_drop_page(pager, payload_get_page_id(page_get_payload(page.data, i)), true));
+        }
+        if (!bounded) {
+            try(btree_drop_page(pager, header->right, false));
+        }
+    }
+
+    pager_free(pager, page);
+
+    return SUCCESS;
+}
+
+result_t
+btree_drop(btree_t** out) {
+    ensure(out != nullptr);
+
+    btree_t* btree = *out;
+    ensure(btree->snapshots == nullptr);
+
+    try(catalog_unregister(btree->pager, btree->ref));
+    try(btree_drop_page(btree->pager, btree->root, false));
+
+    // the statistics of the tree are gone with its entry
+    atomic_store(&btree->row_delta, 0);
+    atomic_store(&btree->page_delta, 0);
+
+    return btree_close(out);
+}
+
+result_t
+btree_close(btree_t** out) {
+    ensure(out != nullptr);
+
+    btree_t* btree = *out;
+
+    ensure(btree->snapshots == nullptr);
+    try(btree_flush_stats(btree));
+
+    for (uint32_t i = 0; i < VERSION_SHARDS; ++i) {
+        free(btree->versions[i].versions);
+    }
+    free(btree->versions);
+
+    bloom_t* filter = atomic_load(&btree->filter);
+    if (filter != nullptr) {
+        try(bloom_close(&filter));
+    }
+    for (uint32_t i = 0; i < btree->retired_count; ++i) {
+        try(bloom_close(&btree->retired_filters[i]));
+    }
+    free(btree->retired_filters);
+
+    if (btree->dictionary != nullptr) {
+        try(compress_dict_close(&btree->dictionary));
+    }
+
+    free(btree);
+    *out = nullptr;
+
+    return SUCCESS;
+}
+
+static header_t
+test_get_root_header(const btree_t* btree) {
+    page_t root;
+    assert_success(pager_fix(btree->pager, btree->root, false, &root));
+    defer(pager_unfix, root);
+
+    return *page_get_header(root.data);
+}
+
+/// Follows the right links from the leftmost leaf and asserts that the leaves
+/// have consecutive page ids. Returns the number of leaves.
+static uint32_t
+test_assert_consecutive_leaves(const btree_t* btree) {
+    page_t page;
+    assert_success(pager_fix(btree->pager, btree->root, false, &page));
+
+    while (page_is_inner(page_get_header(page.data)->flags)) {
+        const header_t* header = page_get_header(page.data);
+        const page_id_t next = header->cell_count > 0 ? payload_get_page_id(page_get_payload(page.data, 0)) : header->right;
+
+        pager_unfix(page);
+        assert_success(pager_fix(btree->pager, next, false, &page));
+    }
+
+    uint32_t count = 1;
+    for (page_id_t right = page_get_header(page.data)->right; right != 0; count++) {
+        asserteq_uint(right, page.id + 1);
+
+        pager_unfix(page);
+        assert_success(pager_fix(btree->pager, right, false, &page));
+        right = page_get_header(page.data)->right;
+    }
+    pager_unfix(page);
+
+    return count;
+}
+
+/// Returns the number of versions in all shards.
+static uint32_t
+test_version_count(const btree_t* btree) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < VERSION_SHARDS; ++i) {
+        count += atomic_load(&btree->versions[i].count);
+    }
+
+    return count;
+}
+
+describe(btree_table) {
+
+    static uint16_t page_size = 1024;
+
+    static pager_t* pager;
+    static btree_t* btree;
+
+    static blob_t value;
+    static uint16_t inner_cell_count;
+    static uint16_t leaf_cell_count;
+
+    /// Threads of a parallel test that are done.
+    static _Atomic uint32_t finished;
+
+    before_each() {
+        value = blob_from_string("hello world");
+        finished = 0;
+
+        inner_cell_count = (page_size - sizeof(header_t)) / (sizeof(uint16_t) + sizeof(page_id_t) + 1);
+        leaf_cell_count = (page_size - sizeof(header_t)) / (sizeof(uint16_t) + 1 + blob_put_len(value));
+
+        assert_success(pager_open(&pager, page_size, 512));
+        assert_success(btree_create(&btree, pager, nullptr, PAGE_FLAG_TABLE));
+    }
+
+    after_each() {
+        assert_success(btree_close(&btree));
+        assert_success(pager_close(&pager));
+        error_clear();
+    }
+
+    it("alignment") {
+        // make sure the alignment of the header is compatible with the
+        // guaranteed alignment of the page
+        assertis(PAGE_ALIGNMENT % alignof(header_t) == 0);
+    }
+
+    it("insert into root leaf") {
+        assert_success(btree_table_insert(btree, 7, value));
+
+        blob_t result;
+        assert_success(btree_table_lookup(btree, 7, &result));
+        asserteq_int(blob_cmp(result, value), 0);
+    }
+
+    it("fill root leaf") {
+        for (uint16_t i = 0; i < leaf_cell_count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        const header_t header = test_get_root_header(btree);
+        assertis(page_is_leaf(header.flags));
+        asserteq_uint(header.cell_count, leaf_cell_count);
+        asserteq_uint(header.right, 0);
+
+        for (uint16_t i = 0; i < leaf_cell_count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+    }
+
+    it("split root leaf") {
+        for (uint16_t i = 0; i < leaf_cell_count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        {
+            assert_success(btree_table_insert(btree, leaf_cell_count, value));
+
+            const header_t header = test_get_root_header(btree);
+            assertis(page_is_inner(header.flags));
+            asserteq_uint(header.cell_count, 1);
+            assertneq_uint(header.right, 0);
+        }
+
+        for (uint16_t i = 0; i <= leaf_cell_count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+    }
+
+    it("count splits and lookups") {
+        btree_counters_t before;
+        btree_stats_snapshot(&before);
+
+        for (uint16_t i = 0; i <= leaf_cell_count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+        blob_t result;
+        assert_success(btree_table_lookup(btree, 0, &result));
+
+        btree_counters_t after;
+        btree_stats_snapshot(&after);
+        asserteq_uint(after.inserts - before.inserts, leaf_cell_count + 1);
+        asserteq_uint(after.splits - before.splits, 1);
+        asserteq_uint(after.lookups - before.lookups, 1);
+    }
+
+    it("split inner node") {
+        for (uint16_t i = 0; i < leaf_cell_count * inner_cell_count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        for (uint16_t i = 0; i < leaf_cell_count * inner_cell_count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+    }
+
+    it("reopen after root split") {
+        for (uint16_t i = 0; i <= leaf_cell_count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        const uint32_t id = btree_get_id(btree);
+        const page_id_t root = btree->root;
+        assert_success(btree_close(&btree));
+
+        assert_success(btree_open(&btree, pager, id));
+        asserteq_uint(btree->root, root);
+        asserteq_uint(btree->height, 2);
+
+        catalog_entry_t entry;
+        assert_success(catalog_read(pager, btree->ref, &entry));
+        asserteq_uint(entry.row_count, leaf_cell_count + 1);
+        asserteq_uint(entry.page_count, 3);
+
+        for (uint16_t i = 0; i <= leaf_cell_count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+    }
+
+    it("open by name") {
+        btree_t* named;
+        assert_success(btree_create(&named, pager, "users", PAGE_FLAG_TABLE));
+        assert_success(btree_table_insert(named, 3, value));
+        assert_success(btree_close(&named));
+
+        page_t page;
+        assert_success(pager_next(pager, &page));
+        const page_id_t next = page.id;
+        pager_free(pager, page);
+
+        // the root of the duplicate is freed again
+        btree_t* duplicate;
+        assert_failure(btree_create(&duplicate, pager, "users", PAGE_FLAG_TABLE), EEXIST);
+        error_clear();
+
+        assert_success(pager_next(pager, &page));
+        asserteq_uint(page.id, next);
+        pager_unfix(page);
+
+        assert_success(btree_open_by_name(&named, pager, "users"));
+        assertneq_uint(btree_get_id(named), btree_get_id(btree));
+
+        blob_t result;
+        assert_success(btree_table_lookup(named, 3, &result));
+        asserteq_int(blob_cmp(result, value), 0);
+        assert_success(btree_close(&named));
+    }
+
+    it("allocate split pages in the extent of the tree") {
+        for (uint32_t i = 0; i < leaf_cell_count * 10u; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        page_t root;
+        assert_success(pager_fix(pager, btree->root, false, &root));
+        defer(pager_unfix, root);
+
+        const header_t* header = page_get_header(root.data);
+        asserteq_uint(header->right / PAGER_EXTENT_SIZE, root.id / PAGER_EXTENT_SIZE);
+        for (uint16_t i = 0; i < header->cell_count; ++i) {
+            asserteq_uint(payload_get_page_id(page_get_payload(root.data, i)) / PAGER_EXTENT_SIZE, root.id / PAGER_EXTENT_SIZE);
+        }
+    }
+
+    it("log inserts and splits") {
+        char path[32] = "/tmp/wednesday-wal-XXXXXX";
+        const int fd = mkstemp(path);
+        assertis(fd >= 0);
+        close(fd);
+
+        wal_t* wal;
+        assert_success(wal_open(&wal, path));
+        pager_set_wal(pager, wal);
+
+        const uint32_t count = leaf_cell_count * 4u;
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        lsn_t commit;
+        assert_success(wal_commit(wal, &commit));
+        assertis(test_get_root_header(btree).lsn <= commit);
+
+        uint32_t counts[WAL_RECORD_INNER_INSERT + 1] = { 0 };
+        lsn_t cursor = 0;
+        for (bool found = true; found;) {
+            wal_record_t record;
+            assert_success(wal_read(wal, &cursor, &record, &found));
+            if (found) {
+                counts[record.type] += 1;
+            }
+        }
+        asserteq_uint(counts[WAL_RECORD_LEAF_INSERT], count);
+        asserteq_uint(counts[WAL_RECORD_COMMIT], 1);
+        assertis(counts[WAL_RECORD_INNER_INSERT] > 0);
+        assertis(counts[WAL_RECORD_PAGE_IMAGE] > 0);
+
+        pager_set_wal(pager, nullptr);
+        assert_success(wal_close(&wal));
+        unlink(path);
+    }
+
+    it("scan a snapshot in key order") {
+        const uint32_t count = leaf_cell_count * 4u;
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, count - i - 1, value));
+        }
+
+        btree_snapshot_t* snapshot;
+        assert_success(btree_snapshot_open(&snapshot, btree));
+
+        uint32_t rows = 0;
+        for (bool found = true; found;) {
+            uint64_t id;
+            blob_t result;
+            assert_success(btree_snapshot_table_next(snapshot, &id, &result, &found));
+            if (found) {
+                asserteq_uint(id, rows);
+                asserteq_int(blob_cmp(result, value), 0);
+                rows += 1;
+            }
+        }
+        asserteq_uint(rows, count);
+
+        assert_success(btree_snapshot_close(&snapshot));
+    }
+
+    it("hide rows inserted after the snapshot") {
+        const uint32_t count = leaf_cell_count * 4u;
+        for (uint32_t i = 0; i < count; i += 2) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        btree_snapshot_t* before;
+        assert_success(btree_snapshot_open(&before, btree));
+
+        // the odd rows split the leaves the snapshot has not read yet
+        for (uint32_t i = 1; i < count; i += 2) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        btree_snapshot_t* after;
+        assert_success(btree_snapshot_open(&after, btree));
+
+        uint32_t rows = 0;
+        for (bool found = true; found;) {
+            uint64_t id;
+            blob_t result;
+            assert_success(btree_snapshot_table_next(before, &id, &result, &found));
+            if (found) {
+                asserteq_uint(id, rows * 2);
+                rows += 1;
+            }
+        }
+        asserteq_uint(rows, count / 2);
+
+        rows = 0;
+        for (bool found = true; found;) {
+            uint64_t id;
+            blob_t result;
+            assert_success(btree_snapshot_table_next(after, &id, &result, &found));
+            rows += found;
+        }
+        asserteq_uint(rows, count);
+
+        // the versions are dropped once no snapshot needs them
+        assert_success(btree_snapshot_close(&after));
+        asserteq_uint(test_version_count(btree), count / 2);
+        assert_success(btree_snapshot_close(&before));
+        asserteq_uint(test_version_count(btree), 0);
+    }
+
+    it("scan a snapshot while inserting") {
+        const uint32_t count = leaf_cell_count * 8u;
+        for (uint32_t i = 0; i < count; i += 4) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        btree_snapshot_t* snapshot;
+        assert_success(btree_snapshot_open(&snapshot, btree));
+
+        // interleave the scan with inserts before and after its position
+        uint32_t rows = 0;
+        uint32_t next = 1;
+        for (bool found = true; found;) {
+            uint64_t id;
+            blob_t result;
+            assert_success(btree_snapshot_table_next(snapshot, &id, &result, &found));
+            if (found) {
+                asserteq_uint(id, rows * 4);
+                rows += 1;
+            }
+
+            for (uint32_t i = 0; i < 2 && next < count; ++i, ++next) {
+                if (next % 4 != 0) {
+                    assert_success(btree_table_insert(btree, next, value));
+                }
+            }
+        }
+        asserteq_uint(rows, count / 4);
+
+        assert_success(btree_snapshot_close(&snapshot));
+    }
+
+    it("stats of empty tree") {
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+
+        asserteq_uint(stats.height, 1);
+        asserteq_uint(stats.page_count, 1);
+        asserteq_uint(stats.level_page_count[0], 1);
+        asserteq_uint(stats.leaf_fill[0], 1);
+        asserteq_uint(stats.row_count, 0);
+        asserteq_uint(stats.free_bytes, page_size - sizeof(header_t));
+        asserteq_uint(stats.fragmented_bytes, 0);
+    }
+
+    it("stats after splits") {
+        const uint32_t count = leaf_cell_count * 10u;
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+
+        asserteq_uint(stats.height, 2);
+        asserteq_uint(stats.level_page_count[0], 1);
+        asserteq_uint(stats.page_count, stats.level_page_count[1] + 1);
+        asserteq_uint(stats.row_count, count);
+        asserteq_uint(stats.cell_count, count + stats.level_page_count[1] - 1);
+        assertis(stats.avg_cell_size > 0);
+
+        uint32_t leaves = 0;
+        for (uint32_t i = 0; i < BTREE_STATS_FILL_BUCKETS; ++i) {
+            leaves += stats.leaf_fill[i];
+        }
+        asserteq_uint(leaves, stats.level_page_count[1]);
+    }
+
+    it("stats of three levels") {
+        for (uint32_t i = 0; i < leaf_cell_count * inner_cell_count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        asserteq_uint(stats.height, 3);
+        asserteq_uint(stats.row_count, leaf_cell_count * inner_cell_count);
+    }
+
+    it("verify detects unordered keys") {
+        for (uint32_t i = 0; i < leaf_cell_count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        page_t root;
+        assert_success(pager_fix(pager, btree->root, true, &root));
+        uint16_t* pointers = page_get_cells(root.data);
+        const uint16_t tmp = pointers[0];
+        pointers[0] = pointers[1];
+        pointers[1] = tmp;
+        pager_unfix(root);
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, false, &stats));
+        assert_failure(btree_stats(btree, true, &stats), EINVAL);
+    }
+
+    it("verify detects broken sibling link") {
+        for (uint32_t i = 0; i < leaf_cell_count * 4u; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        page_t root;
+        assert_success(pager_fix(pager, btree->root, false, &root));
+        const page_id_t leaf_id = payload_get_page_id(page_get_payload(root.data, 0));
+        pager_unfix(root);
+
+        page_t leaf;
+        assert_success(pager_fix(pager, leaf_id, true, &leaf));
+        page_get_header(leaf.data)->right = 0;
+        pager_unfix(leaf);
+
+        btree_stats_t stats;
+        assert_failure(btree_stats(btree, true, &stats), EINVAL);
+    }
+
+    it("compact root leaf") {
+        assert_success(btree_table_insert(btree, 3, value));
+        assert_success(btree_compact(btree, 1.0));
+
+        blob_t result;
+        assert_success(btree_table_lookup(btree, 3, &result));
+        asserteq_int(blob_cmp(result, value), 0);
+    }
+
+    it("compact half full leaves") {
+        // ascending inserts leave every split leaf half full
+        const uint32_t count = leaf_cell_count * 10u;
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        btree_stats_t before;
+        assert_success(btree_stats(btree, true, &before));
+
+        assert_success(btree_compact(btree, 1.0));
+
+        btree_stats_t after;
+        assert_success(btree_stats(btree, true, &after));
+        asserteq_uint(after.row_count, count);
+        assertis(after.level_page_count[1] <= before.level_page_count[1] / 2 + 1);
+        assertis(after.page_count < before.page_count);
+        asserteq_uint(test_assert_consecutive_leaves(btree), after.level_page_count[1]);
+
+        for (uint32_t i = 0; i < count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+
+        const uint32_t id = btree_get_id(btree);
+        assert_success(btree_close(&btree));
+        assert_success(btree_open(&btree, pager, id));
+
+        catalog_entry_t entry;
+        assert_success(catalog_read(pager, btree->ref, &entry));
+        asserteq_uint(entry.page_count, after.page_count);
+    }
+
+    it("compact with fill factor") {
+        const uint32_t count = leaf_cell_count * 10u;
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        assert_success(btree_compact(btree, 0.75));
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        asserteq_uint(stats.row_count, count);
+        assertis(stats.leaf_fill[BTREE_STATS_FILL_BUCKETS - 1] == 0);
+        test_assert_consecutive_leaves(btree);
+    }
+
+    it("compact compacted tree") {
+        for (uint32_t i = 0; i < leaf_cell_count * 10u; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+        assert_success(btree_compact(btree, 1.0));
+
+        page_t root;
+        assert_success(pager_fix(pager, btree->root, false, &root));
+        unsigned char before[page_size];
+        memcpy(before, root.data, page_size);
+        pager_unfix(root);
+
+        // the leaves are already packed and consecutive, nothing is rewritten
+        assert_success(btree_compact(btree, 1.0));
+
+        assert_success(pager_fix(pager, btree->root, false, &root));
+        asserteq_int(memcmp(before, root.data, page_size), 0);
+        pager_unfix(root);
+    }
+
+    it("compact three levels") {
+        // inserts in reverse order leave the split pages half full, the pager
+        // has to fit the tree and the compacted leaves of one step
+        const uint32_t count = leaf_cell_count * inner_cell_count / 2u;
+        for (uint32_t i = count; i > 0; --i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        assert_success(btree_compact(btree, 1.0));
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        asserteq_uint(stats.height, 3);
+        asserteq_uint(stats.row_count, count);
+        test_assert_consecutive_leaves(btree);
+
+        for (uint32_t i = 1; i <= count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+    }
+
+    it("insert between compaction steps") {
+        // even keys first, the odd keys are inserted while compacting
+        const uint32_t count = leaf_cell_count * 20u;
+        for (uint32_t i = 0; i < count; i += 2) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        btree_compaction_t* compaction;
+        assert_success(btree_compaction_open(&compaction, btree, 1.0));
+
+        uint32_t next = 1;
+        for (bool done = false; !done;) {
+            assert_success(btree_compaction_step(compaction, &done));
+
+            for (uint32_t i = 0; i < leaf_cell_count && next < count; ++i, next += 2) {
+                assert_success(btree_table_insert(btree, next, value));
+            }
+        }
+        assert_success(btree_compaction_close(&compaction));
+
+        for (; next < count; next += 2) {
+            assert_success(btree_table_insert(btree, next, value));
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        asserteq_uint(stats.row_count, count);
+
+        for (uint32_t i = 0; i < count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+    }
+
+    parallel("split inner node", 8) {
+        const uint32_t per_thread = (uint32_t)(leaf_cell_count * inner_cell_count) / 8;
+
+        // the root is split while other threads wait for it
+        for (uint32_t i = 0; i < per_thread; ++i) {
+            const uint64_t id = i + per_thread * (uint32_t)thread_index();
+            assert_success(btree_table_insert(btree, id, value));
+
+            // the value points into a page other threads modify
+            unsigned char key[9];
+            unsigned char* result;
+            assert_success(btree_lookup(btree, (blob_t){ varint_put(key, id), key }, &result));
+        }
+
+        if (atomic_fetch_add(&finished, 1) + 1 < 8) {
+            return;
+        }
+
+        for (uint32_t i = 0; i < per_thread * 8; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        asserteq_uint(stats.row_count, per_thread * 8);
+        assertis(stats.height > 2);
+    }
+
+    bench("look up rows", 4) {
+        const uint64_t first = thread_index() * 1000;
+        for (uint64_t i = 0; i < 1000; ++i) {
+            assert_success(btree_table_insert(btree, first + i, value));
+        }
+
+        bench_loop() {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, first + bench_iteration() % 1000, &result));
+        }
+    }
+}
+
+describe(btree_compressed) {
+
+    static uint16_t page_size = 1024;
+
+    static pager_t* pager;
+    static btree_t* btree;
+
+    static blob_t value;
+    static uint16_t leaf_cell_count;
+
+    before_each() {
+        value = blob_from_string("{\"name\":\"alice\",\"status\":\"active\",\"role\":\"admin\",\"tags\":[]}");
+        const blob_t dictionary = blob_from_string("{\"name\":\"\",\"status\":\"active\",\"role\":\"admin\",\"tags\":[]}");
+
+        // number of cells in a leaf if the values would be stored uncompressed
+        leaf_cell_count = (page_size - sizeof(header_t)) / (sizeof(uint16_t) + 1 + blob_put_len(value));
+
+        assert_success(pager_open(&pager, page_size, 512));
+        assert_success(btree_create(&btree, pager, nullptr, PAGE_FLAG_TABLE | PAGE_FLAG_COMPRESSED));
+        assert_success(btree_set_dictionary(btree, dictionary));
+    }
+
+    after_each() {
+        assert_success(btree_close(&btree));
+        assert_success(pager_close(&pager));
+        error_clear();
+    }
+
+    it("insert into root leaf") {
+        assert_success(btree_table_insert(btree, 7, value));
+
+        blob_t result;
+        assert_success(btree_table_lookup(btree, 7, &result));
+        asserteq_int(blob_cmp(result, value), 0);
+    }
+
+    it("fit more values into root leaf") {
+        for (uint16_t i = 0; i < leaf_cell_count * 2; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        const header_t header = test_get_root_header(btree);
+        assertis(page_is_leaf(header.flags));
+        asserteq_uint(header.cell_count, leaf_cell_count * 2);
+
+        for (uint16_t i = 0; i < leaf_cell_count * 2; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+    }
+
+    it("split compressed leaves") {
+        for (uint16_t i = 0; i < leaf_cell_count * 20; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+
+        for (uint16_t i = 0; i < leaf_cell_count * 20; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+    }
+
+    it("set dictionary on uncompressed table") {
+        btree_t* table;
+        assert_success(btree_create(&table, pager, nullptr, PAGE_FLAG_TABLE));
+        assert_failure(btree_set_dictionary(table, value), EINVAL);
+        assert_success(btree_close(&table));
+    }
+}
+
+describe(btree_buffered) {
+
+    static uint16_t page_size = 1024;
+
+    static pager_t* pager;
+    static btree_t* btree;
+
+    static blob_t value;
+
+    /// Threads of a parallel test that are done.
+    static _Atomic uint32_t finished;
+
+    before_each() {
+        value = blob_from_string("hello world");
+        finished = 0;
+
+        assert_success(pager_open(&pager, page_size, 512));
+        assert_success(btree_create(&btree, pager, nullptr, PAGE_FLAG_TABLE | PAGE_FLAG_BUFFERED));
+    }
+
+    after_each() {
+        assert_success(btree_close(&btree));
+        assert_success(pager_close(&pager));
+        error_clear();
+    }
+
+    it("insert and look up rows") {
+        const uint32_t count = 5000;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, i * 7919 % count, value));
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+
+        blob_t result;
+        assert_failure(btree_table_lookup(btree, count, &result), ENOENT);
+
+        // some rows are still buffered above the leaves
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        assertis(stats.height > 2);
+        assertis(stats.row_count < count);
+        assertis(test_get_root_header(btree).message_count > 0);
+    }
+
+    parallel("insert rows from several threads", 8) {
+        const uint32_t count = 400;
+
+        // the root is split several times while other threads wait for it,
+        // the lookups wait for the pages the inserts have latched
+        for (uint32_t i = 0; i < count; ++i) {
+            const uint64_t id = i * 8 + thread_index();
+            assert_success(btree_table_insert(btree, id, value));
+
+            // the value points into a page other threads modify
+            unsigned char key[9];
+            unsigned char* result;
+            assert_success(btree_lookup(btree, (blob_t){ varint_put(key, id), key }, &result));
+        }
+
+        if (atomic_fetch_add(&finished, 1) + 1 < 8) {
+            return;
+        }
+
+        for (uint32_t i = 0; i < count * 8; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, value), 0);
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        assertis(stats.height > 2);
+    }
+
+    it("replace values") {
+        const blob_t other = blob_from_string("goodbye world");
+        const uint32_t count = 2000;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+        for (uint32_t i = 0; i < count; i += 2) {
+            assert_success(btree_table_insert(btree, i, other));
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, i % 2 == 0 ? other : value), 0);
+        }
+    }
+
+    it("delete rows") {
+        const uint32_t count = 2000;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+        for (uint32_t i = 0; i < count; i += 3) {
+            assert_success(btree_table_delete(btree, i));
+        }
+        assert_success(btree_table_insert(btree, 0, value));
+
+        for (uint32_t i = 0; i < count; ++i) {
+            blob_t result;
+            if (i % 3 == 0 && i != 0) {
+                assert_failure(btree_table_lookup(btree, i, &result), ENOENT);
+            } else {
+                assert_success(btree_table_lookup(btree, i, &result));
+                asserteq_int(blob_cmp(result, value), 0);
+            }
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+    }
+
+    it("count rows once messages reach the leaves") {
+        const uint32_t count = 20000;
+
+        // deletes of missing rows and repeated puts do not change the count
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(btree_table_insert(btree, i % 100, value));
+            assert_success(btree_table_delete(btree, 100 + i % 100));
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        assertis(stats.row_count <= 100);
+
+        const uint32_t id = btree_get_id(btree);
+        assert_success(btree_close(&btree));
+        assert_success(btree_open(&btree, pager, id));
+
+        // the catalog only counts the rows in the leaves
+        catalog_entry_t entry;
+        assert_success(catalog_read(pager, btree->ref, &entry));
+        asserteq_uint(entry.row_count, stats.row_count);
     }
 
-    uint16_t index = 0;
-    if (!page_find_pointer(page.data, key, &index)) {
-        failure(ENOENT, msg("key not found on leaf page"));
+    it("reject operations that need unbuffered trees") {
+        btree_snapshot_t* snapshot;
+        assert_failure(btree_snapshot_open(&snapshot, btree), EINVAL);
+
+        btree_compaction_t* compaction;
+        assert_failure(btree_compaction_open(&compaction, btree, 1), EINVAL);
+
+        btree_t* table;
+        assert_success(btree_create(&table, pager, nullptr, PAGE_FLAG_TABLE));
+        assert_failure(btree_table_delete(table, 7), EINVAL);
+        assert_success(btree_close(&table));
     }
+}
 
-    const uint16_t flags = page_get_header(page.data)->flags;
-    *out = payload_get_value_ptr(flags, page_get_payload(page.data, index));
+/// Rows of a test build, the ids are multiples of the step.
+typedef struct {
+    uint64_t index;
+    uint64_t count;
+    uint64_t step;
+    blob_t value;
+} test_build_t;
+
+static result_t
+test_build_next(void* context, uint64_t* id, blob_t* value, bool* found) {
+    test_build_t* build = context;
+
+    *found = build->index < build->count;
+    if (*found) {
+        *id = build->index * build->step;
+        *value = build->value;
+        build->index += 1;
+    }
 
     return SUCCESS;
 }
 
-result_t
-btree_table_insert(btree_t* btree, const uint64_t id, const blob_t value) {
-    unsigned char key_buf[9];
-    const uint64_t key_len = varint_put(key_buf, id);
+/// Returns the same id twice.
+static result_t
+test_build_unordered(void* context, uint64_t* id, blob_t* value, bool* found) {
+    test_build_t* build = context;
 
-    // TODO: this is unsave :c
-    unsigned char value_buf[blob_put_len(value)];
-    const uint64_t value_len = blob_put(value_buf, value);
+    *found = true;
+    *id = 7;
+    *value = build->value;
 
-    return btree_insert(btree, (blob_t){ key_len, key_buf }, (blob_t){ value_len, value_buf });
+    return SUCCESS;
 }
 
-result_t
-btree_table_lookup(const btree_t* btree, const uint64_t id, blob_t* out) {
-    unsigned char key[9];
-    const uint16_t key_len = varint_put(key, id);
+/// Returns the rows like test_build_next and fails afterward.
+static result_t
+test_build_failing(void* context, uint64_t* id, blob_t* value, bool* found) {
+    test_build_t* build = context;
+    if (build->index == build->count) {
+        failure(EIO, msg("failed to read the next row"));
+    }
 
-    unsigned char* value;
-    try(btree_lookup(btree, (blob_t){ key_len, key }, &value));
+    return test_build_next(context, id, value, found);
+}
 
-    blob_get(value, out);
+describe(btree_build) {
 
-    return SUCCESS;
-}
+    static uint16_t page_size = 1024;
 
-result_t
-btree_close(btree_t** out) {
-    ensure(out != nullptr);
+    static pager_t* pager;
+    static btree_t* btree;
 
-    btree_t* btree = *out;
+    before_each() {
+        assert_success(pager_open(&pager, page_size, 2048));
+    }
 
-    free(btree);
-    *out = nullptr;
+    after_each() {
+        if (btree != nullptr) {
+            assert_success(btree_close(&btree));
+        }
+        assert_success(pager_close(&pager));
+        error_clear();
+    }
 
-    return SUCCESS;
-}
+    it("build an empty table") {
+        test_build_t build = { .count = 0 };
+        assert_success(btree_table_build(&btree, pager, nullptr, test_build_next, &build));
 
-static header_t
-test_get_root_header(const btree_t* btree) {
-    page_t root;
-    assert_success(pager_fix(btree->pager, btree->root, false, &root));
-    defer(pager_unfix, root);
+        blob_t result;
+        bool found;
+        assert_success(btree_table_find(btree, 7, &result, &found));
+        assertis(!found);
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        asserteq_uint(stats.height, 1);
+        asserteq_uint(stats.row_count, 0);
+    }
 
-    return *page_get_header(root.data);
+    it("build a densely packed table") {
+        test_build_t build = { .count = 20000, .step = 2, .value = blob_from_string("hello world") };
+        assert_success(btree_table_build(&btree, pager, "built", test_build_next, &build));
+
+        for (uint64_t i = 0; i < build.count; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i * 2, &result));
+            asserteq_int(blob_cmp(result, build.value), 0);
+            assert_failure(btree_table_lookup(btree, i * 2 + 1, &result), ENOENT);
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        assertis(stats.height > 2);
+        asserteq_uint(stats.row_count, build.count);
+
+        // only the last leaf is not full
+        const uint32_t leaves = stats.level_page_count[stats.height - 1];
+        asserteq_uint(stats.leaf_fill[BTREE_STATS_FILL_BUCKETS - 1], leaves - 1);
+        asserteq_uint(test_assert_consecutive_leaves(btree), leaves);
+
+        catalog_entry_t entry;
+        assert_success(catalog_read(pager, btree->ref, &entry));
+        asserteq_uint(entry.row_count, build.count);
+        asserteq_uint(entry.page_count, stats.page_count);
+        asserteq_uint(entry.height, stats.height);
+    }
+
+    it("insert into a built table") {
+        test_build_t build = { .count = 5000, .step = 2, .value = blob_from_string("hello world") };
+        assert_success(btree_table_build(&btree, pager, nullptr, test_build_next, &build));
+
+        for (uint64_t i = 0; i < build.count; ++i) {
+            assert_success(btree_table_insert(btree, i * 2 + 1, build.value));
+        }
+
+        for (uint64_t i = 0; i < build.count * 2; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i, &result));
+            asserteq_int(blob_cmp(result, build.value), 0);
+        }
+
+        btree_stats_t stats;
+        assert_success(btree_stats(btree, true, &stats));
+        asserteq_uint(stats.row_count, build.count * 2);
+    }
+
+    it("reject unordered rows") {
+        test_build_t build = { .value = blob_from_string("hello world") };
+        assert_failure(btree_table_build(&btree, pager, nullptr, test_build_unordered, &build), EINVAL);
+        btree = nullptr;
+    }
+
+    it("release the pages of a failed build") {
+        page_t page;
+        assert_success(pager_next(pager, &page));
+        const page_id_t first = page.id;
+        pager_free(pager, page);
+
+        test_build_t build = { .count = 5000, .step = 1, .value = blob_from_string("hello world") };
+        assert_failure(btree_table_build(&btree, pager, nullptr, test_build_failing, &build), EIO);
+        btree = nullptr;
+        error_clear();
+
+        // the leaves of the failed build are free again
+        assert_success(pager_next(pager, &page));
+        asserteq_uint(page.id, first);
+        pager_free(pager, page);
+    }
+
+    it("drop a table") {
+        test_build_t build = { .count = 5000, .step = 1, .value = blob_from_string("hello world") };
+        assert_success(btree_table_build(&btree, pager, "built", test_build_next, &build));
+        const page_id_t root = btree->root;
+        assert_success(btree_drop(&btree));
+
+        catalog_ref_t ref;
+        catalog_entry_t entry;
+        assert_failure(catalog_find_by_name(pager, "built", &ref, &entry), ENOENT);
+        error_clear();
+
+        // the freed pages are reused by the next build
+        build.index = 0;
+        assert_success(btree_table_build(&btree, pager, "built", test_build_next, &build));
+        assertis(btree->root <= root);
+    }
 }
 
-describe(btree_table) {
+describe(btree_filter) {
 
     static uint16_t page_size = 1024;
 
@@ -534,17 +4004,16 @@ describe(btree_table) {
     static btree_t* btree;
 
     static blob_t value;
-    static uint16_t inner_cell_count;
-    static uint16_t leaf_cell_count;
+
+    /// Threads of a parallel test that are done.
+    static _Atomic uint32_t finished;
 
     before_each() {
         value = blob_from_string("hello world");
-
-        inner_cell_count = (page_size - sizeof(header_t)) / (sizeof(uint16_t) + sizeof(page_id_t) + 1);
-        leaf_cell_count = (page_size - sizeof(header_t)) / (sizeof(uint16_t) + 1 + blob_put_len(value));
+        finished = 0;
 
         assert_success(pager_open(&pager, page_size, 512));
-        assert_success(btree_create(&btree, pager, PAGE_FLAG_TABLE));
+        assert_success(btree_create(&btree, pager, nullptr, PAGE_FLAG_TABLE));
     }
 
     after_each() {
@@ -553,81 +4022,406 @@ describe(btree_table) {
         error_clear();
     }
 
-    it("alignment") {
-        // make sure the alignment of the header is compatible with the
-        // guaranteed alignment of the page
-        assertis(PAGE_ALIGNMENT % alignof(header_t) == 0);
-    }
+    it("reject missing rows without fixing a page") {
+        for (uint64_t i = 0; i < 1000; ++i) {
+            assert_success(btree_table_insert(btree, i * 2, value));
+        }
+        assert_success(btree_filter_build(btree, 10));
 
-    it("insert into root leaf") {
-        assert_success(btree_table_insert(btree, 7, value));
+        // lookups that reach the tree fail on the invalid root
+        const page_id_t root = btree->root;
+        btree->root = 0;
 
-        blob_t result;
-        assert_success(btree_table_lookup(btree, 7, &result));
-        asserteq_int(blob_cmp(result, value), 0);
-    }
+        uint32_t rejected = 0;
+        for (uint64_t i = 0; i < 1000; ++i) {
+            blob_t result;
+            bool found = true;
+            if (btree_table_find(btree, i * 2 + 1, &result, &found) == SUCCESS) {
+                assertis(!found);
+                rejected += 1;
+            }
+        }
+        error_clear();
+        assertis(rejected > 950);
 
-    it("fill root leaf") {
-        for (uint16_t i = 0; i < leaf_cell_count; ++i) {
-            assert_success(btree_table_insert(btree, i, value));
+        btree->root = root;
+        for (uint64_t i = 0; i < 1000; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i * 2, &result));
         }
+    }
 
-        const header_t header = test_get_root_header(btree);
-        assertis(page_is_leaf(header.flags));
-        asserteq_uint(header.cell_count, leaf_cell_count);
-        asserteq_uint(header.right, 0);
+    it("add inserted rows") {
+        assert_success(btree_filter_build(btree, 10));
 
-        for (uint16_t i = 0; i < leaf_cell_count; ++i) {
+        for (uint64_t i = 0; i < 2000; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+        }
+        for (uint64_t i = 0; i < 2000; ++i) {
             blob_t result;
             assert_success(btree_table_lookup(btree, i, &result));
             asserteq_int(blob_cmp(result, value), 0);
         }
     }
 
-    it("split root leaf") {
-        for (uint16_t i = 0; i < leaf_cell_count; ++i) {
-            assert_success(btree_table_insert(btree, i, value));
+    it("rebuild on compaction") {
+        assert_success(btree_filter_build(btree, 10));
+        for (uint64_t i = 0; i < 2000; ++i) {
+            assert_success(btree_table_insert(btree, i * 2, value));
         }
 
-        {
-            assert_success(btree_table_insert(btree, leaf_cell_count, value));
+        const bloom_t* filter = atomic_load(&btree->filter);
+        assert_success(btree_compact(btree, 1.0));
+        assertis(atomic_load(&btree->filter) != filter);
+        asserteq_uint(btree->retired_count, 0);
 
-            const header_t header = test_get_root_header(btree);
-            assertis(page_is_inner(header.flags));
-            asserteq_uint(header.cell_count, 1);
-            assertneq_uint(header.right, 0);
+        for (uint64_t i = 0; i < 2000; ++i) {
+            blob_t result;
+            assert_success(btree_table_lookup(btree, i * 2, &result));
         }
+    }
 
-        for (uint16_t i = 0; i <= leaf_cell_count; ++i) {
+    it("keep replaced filters while they are used") {
+        assert_success(btree_filter_build(btree, 10));
+
+        // a lookup that loaded the filter before it was replaced
+        atomic_store(&btree->filter_users, 1);
+        assert_success(btree_filter_build(btree, 10));
+        asserteq_uint(btree->retired_count, 1);
+
+        atomic_store(&btree->filter_users, 0);
+        assert_success(btree_filter_build(btree, 10));
+        asserteq_uint(btree->retired_count, 0);
+    }
+
+    parallel("rebuild while rows are inserted", 4) {
+        const uint32_t count = 1000;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            const uint64_t id = i * 4 + thread_index();
+            assert_success(btree_table_insert(btree, id, value));
+
+            if (i % 250 == 0) {
+                assert_success(btree_filter_build(btree, 10));
+            }
+
+            blob_t result;
+            bool found;
+            assert_success(btree_table_find(btree, id + 4, &result, &found));
+        }
+
+        if (atomic_fetch_add(&finished, 1) + 1 < 4) {
+            return;
+        }
+
+        for (uint32_t i = 0; i < count * 4; ++i) {
             blob_t result;
             assert_success(btree_table_lookup(btree, i, &result));
-            asserteq_int(blob_cmp(result, value), 0);
         }
     }
 
-    it("split inner node") {
-        for (uint16_t i = 0; i < leaf_cell_count * inner_cell_count; ++i) {
+    it("reject buffered tables") {
+        btree_t* buffered;
+        assert_success(btree_create(&buffered, pager, nullptr, PAGE_FLAG_TABLE | PAGE_FLAG_BUFFERED));
+        assert_failure(btree_filter_build(buffered, 10), EINVAL);
+        error_clear();
+        assert_success(btree_close(&buffered));
+    }
+}
+
+describe(btree_recovery) {
+    static char page_path[40];
+    static char wal_path[40];
+    static char crash_page_path[48];
+    static char crash_wal_path[48];
+
+    static pager_t* pager;
+    static wal_t* wal;
+
+    before_each() {
+        strcpy(page_path, "/tmp/wednesday-pages-XXXXXX");
+        strcpy(wal_path, "/tmp/wednesday-wal-XXXXXX");
+
+        int fd = mkstemp(page_path);
+        assertis(fd >= 0);
+        close(fd);
+        fd = mkstemp(wal_path);
+        assertis(fd >= 0);
+        close(fd);
+
+        strcat(strcpy(crash_page_path, page_path), "-crash");
+        strcat(strcpy(crash_wal_path, wal_path), "-crash");
+
+        assert_success(pager_open_file(&pager, page_path, 1024, 64));
+        assert_success(wal_open(&wal, wal_path));
+        pager_set_wal(pager, wal);
+    }
+
+    after_each() {
+        pager_set_wal(pager, nullptr);
+        assert_success(pager_close(&pager));
+        assert_success(wal_close(&wal));
+
+        unlink(page_path);
+        unlink(wal_path);
+        unlink(crash_page_path);
+        unlink(crash_wal_path);
+        error_clear();
+    }
+
+    it("recover committed inserts") {
+        const blob_t value = blob_from_string("hello world");
+
+        btree_t* btree;
+        assert_success(btree_create(&btree, pager, "table", PAGE_FLAG_TABLE));
+
+        // the tree does not fit into the pager, so part of it is in the file
+        // and part of it only in the log
+        for (uint32_t i = 0; i < 2000; ++i) {
             assert_success(btree_table_insert(btree, i, value));
+            if (i == 1000) {
+                assert_success(pager_flush(pager));
+                assert_success(pager_checkpoint(pager));
+            }
         }
 
-        for (uint16_t i = 0; i < leaf_cell_count * inner_cell_count; ++i) {
+        lsn_t lsn;
+        assert_success(wal_commit(wal, &lsn));
+
+        assert_success(recovery_copy_file(page_path, crash_page_path));
+        assert_success(recovery_copy_file(wal_path, crash_wal_path));
+
+        assert_success(btree_close(&btree));
+        pager_set_wal(pager, nullptr);
+        assert_success(pager_close(&pager));
+        assert_success(wal_close(&wal));
+
+        assert_success(pager_open_file(&pager, crash_page_path, 1024, 64));
+        assert_success(wal_open(&wal, crash_wal_path));
+        pager_set_wal(pager, wal);
+
+        recovery_stats_t stats;
+        assert_success(recovery_run(pager, wal, 4, &stats));
+        assertis(stats.start > 0);
+        assertis(stats.redo_count > 0);
+
+        assert_success(btree_open_by_name(&btree, pager, "table"));
+        for (uint32_t i = 0; i < 2000; ++i) {
             blob_t result;
             assert_success(btree_table_lookup(btree, i, &result));
             asserteq_int(blob_cmp(result, value), 0);
         }
+
+        btree_stats_t tree_stats;
+        assert_success(btree_stats(btree, true, &tree_stats));
+        assert_success(btree_close(&btree));
+    }
+
+    it("recover buffered messages") {
+        const blob_t value = blob_from_string("hello world");
+
+        btree_t* btree;
+        assert_success(btree_create(&btree, pager, "table", PAGE_FLAG_TABLE | PAGE_FLAG_BUFFERED));
+
+        for (uint32_t i = 0; i < 4000; ++i) {
+            assert_success(btree_table_insert(btree, i, value));
+            if (i % 2 == 1) {
+                assert_success(btree_table_delete(btree, i - 1));
+            }
+        }
+
+        lsn_t lsn;
+        assert_success(wal_commit(wal, &lsn));
+
+        assert_success(recovery_copy_file(page_path, crash_page_path));
+        assert_success(recovery_copy_file(wal_path, crash_wal_path));
+
+        assert_success(btree_close(&btree));
+        pager_set_wal(pager, nullptr);
+        assert_success(pager_close(&pager));
+        assert_success(wal_close(&wal));
+
+        assert_success(pager_open_file(&pager, crash_page_path, 1024, 64));
+        assert_success(wal_open(&wal, crash_wal_path));
+        pager_set_wal(pager, wal);
+
+        assert_success(recovery_run(pager, wal, 4, nullptr));
+
+        assert_success(btree_open_by_name(&btree, pager, "table"));
+        for (uint32_t i = 0; i < 4000; ++i) {
+            blob_t result;
+            if (i % 2 == 0) {
+                assert_failure(btree_table_lookup(btree, i, &result), ENOENT);
+            } else {
+                assert_success(btree_table_lookup(btree, i, &result));
+                asserteq_int(blob_cmp(result, value), 0);
+            }
+        }
+
+        btree_stats_t tree_stats;
+        assert_success(btree_stats(btree, true, &tree_stats));
+        assert_success(btree_close(&btree));
+    }
+}
+
+/// Table shared by the threads of a YCSB benchmark, the first thread creates
+/// and loads it.
+typedef struct {
+    pthread_mutex_t mutex;
+    pager_t* pager;
+    btree_t* btree;
+
+    /// Number of rows, inserts append new ids at the end.
+    _Atomic uint64_t count;
+
+    /// Number of operations per ycsb_op_t.
+    _Atomic uint64_t ops[5];
+} test_ycsb_t;
+
+static btree_t*
+test_ycsb_load(test_ycsb_t* ycsb, const uint16_t flags, const uint32_t record_count, const blob_t value) {
+    pthread_mutex_lock(&ycsb->mutex);
+
+    if (ycsb->btree == nullptr) {
+        // leaves are at least half full, the whole table fits into the pager
+        const uint32_t pages = (uint32_t)(record_count * (value.size + 16ull) / 2048) + 64;
+
+        uint32_t directory_size = 512;
+        while (directory_size * 0.7 < pages * 2) {
+            directory_size *= 2;
+        }
+
+        assert_success(pager_open(&ycsb->pager, 4096, directory_size));
+        assert_success(btree_create(&ycsb->btree, ycsb->pager, nullptr, flags));
+
+        for (uint32_t i = 0; i < record_count; ++i) {
+            assert_success(btree_table_insert(ycsb->btree, i, value));
+        }
+        atomic_store(&ycsb->count, record_count);
+    }
+
+    pthread_mutex_unlock(&ycsb->mutex);
+
+    return ycsb->btree;
+}
+
+/// Runs a YCSB workload against a table of record_count rows with values of
+/// value_size bytes. Updates replace rows and are only supported by buffered
+/// tables, scans read from a snapshot and are only supported by unbuffered
+/// tables. Snapshots can not seek yet, scans start at the first row.
+static void
+test_ycsb_run(
+  test_ycsb_t* ycsb,
+  const ycsb_workload_t* workload,
+  const uint16_t flags,
+  const uint32_t record_count,
+  const uint16_t value_size
+) {
+    assertis(page_is_buffered(flags) || workload->update + workload->read_modify_write == 0);
+    assertis(!page_is_buffered(flags) || workload->scan == 0);
+
+    unsigned char value_data[value_size];
+    memset(value_data, 'a' + thread_index(), value_size);
+    const blob_t value = { value_size, value_data };
+
+    btree_t* btree = test_ycsb_load(ycsb, flags, record_count, value);
+
+    ycsb_generator_t generator;
+    ycsb_generator_init(&generator, workload->distribution, record_count, thread_index());
+
+    bench_loop() {
+        const ycsb_op_t op = ycsb_next_op(&generator, workload);
+        atomic_fetch_add_explicit(&ycsb->ops[op], 1, memory_order_relaxed);
+
+        if (op == YCSB_INSERT) {
+            assert_success(btree_table_insert(btree, atomic_fetch_add(&ycsb->count, 1), value));
+            continue;
+        }
+
+        const uint64_t id = ycsb_next_key(&generator, atomic_load(&ycsb->count));
+
+        if (op == YCSB_SCAN) {
+            const uint64_t length = ycsb_random(&generator) % 100 + 1;
+
+            btree_snapshot_t* snapshot;
+            assert_success(btree_snapshot_open(&snapshot, btree));
+
+            bool found = true;
+            for (uint64_t i = 0; i < length && found; ++i) {
+                uint64_t row;
+                blob_t result;
+                assert_success(btree_snapshot_table_next(snapshot, &row, &result, &found));
+            }
+
+            assert_success(btree_snapshot_close(&snapshot));
+            continue;
+        }
+
+        if (op != YCSB_UPDATE) {
+            // rows of the latest distribution might still be inserted
+            bool found;
+            blob_t result;
+            assert_success(btree_table_find(btree, id, &result, &found));
+        }
+        if (op != YCSB_READ) {
+            const uint64_t iteration = bench_iteration();
+            memcpy(value_data, &iteration, min(sizeof(iteration), (size_t)value_size));
+            assert_success(btree_table_insert(btree, id, value));
+        }
     }
+}
+
+describe(btree_ycsb) {
+    static test_ycsb_t ycsb = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+    after_each() {
+        const char* names[] = { "reads", "updates", "inserts", "scans", "read-modify-writes" };
+        for (uint32_t i = 0; i < 5; ++i) {
+            const uint64_t count = atomic_exchange(&ycsb.ops[i], 0);
+            if (count > 0) {
+                bench_counter(names[i], count);
+            }
+        }
 
-    // parallel("split inner node", 8) {
-    //     const uint16_t per_thread = (leaf_cell_count * inner_cell_count) / 8;
+        assert_success(btree_close(&ycsb.btree));
+        assert_success(pager_close(&ycsb.pager));
+        error_clear();
+    }
 
-    //     for (uint16_t i = 0; i < per_thread; ++i) {
-    //         assert_success(btree_table_insert(btree, i + per_thread * thread_index(), value));
-    //     }
+    bench("workload a, update heavy", 4) {
+        test_ycsb_run(&ycsb, &ycsb_workload_a, PAGE_FLAG_TABLE | PAGE_FLAG_BUFFERED, 10000, 100);
+    }
+    bench("workload b, read mostly", 4) {
+        test_ycsb_run(&ycsb, &ycsb_workload_b, PAGE_FLAG_TABLE | PAGE_FLAG_BUFFERED, 10000, 100);
+    }
+    bench("workload c, read only", 1) {
+        test_ycsb_run(&ycsb, &ycsb_workload_c, PAGE_FLAG_TABLE, 10000, 100);
+    }
+    bench("workload c, read only", 4) {
+        test_ycsb_run(&ycsb, &ycsb_workload_c, PAGE_FLAG_TABLE, 10000, 100);
+    }
+    bench("workload c, read only", 8) {
+        test_ycsb_run(&ycsb, &ycsb_workload_c, PAGE_FLAG_TABLE, 10000, 100);
+    }
+    bench("workload c, read only, uniform", 4) {
+        ycsb_workload_t workload = ycsb_workload_c;
+        workload.distribution = YCSB_UNIFORM;
 
-    //     for (uint16_t i = 0; i < per_thread; ++i) {
-    //         blob_t result;
-    //         assert_success(btree_table_lookup(btree, i + per_thread * thread_index(), &result));
-    //         asserteq_int(blob_cmp(result, value), 0);
-    //     }
-    // }
+        test_ycsb_run(&ycsb, &workload, PAGE_FLAG_TABLE, 10000, 100);
+    }
+    bench("workload c, read only, 1000 byte values", 4) {
+        test_ycsb_run(&ycsb, &ycsb_workload_c, PAGE_FLAG_TABLE, 10000, 1000);
+    }
+    bench("workload c, read only, 100000 rows", 4) {
+        test_ycsb_run(&ycsb, &ycsb_workload_c, PAGE_FLAG_TABLE, 100000, 100);
+    }
+    bench("workload d, read latest", 4) {
+        test_ycsb_run(&ycsb, &ycsb_workload_d, PAGE_FLAG_TABLE, 10000, 100);
+    }
+    bench("workload e, short ranges", 4) {
+        test_ycsb_run(&ycsb, &ycsb_workload_e, PAGE_FLAG_TABLE, 10000, 100);
+    }
+    bench("workload f, read-modify-write", 4) {
+        test_ycsb_run(&ycsb, &ycsb_workload_f, PAGE_FLAG_TABLE | PAGE_FLAG_BUFFERED, 10000, 100);
+    }
 }
@@ -0,0 +1,524 @@
+#include "catalog.h"
+
+#include "deffer.h"
+#include "util.h"
+#include "winter.h"
+
+/// Marks an initialised catalog, the meta page of a new pager is zeroed.
+#define CATALOG_MAGIC 0x74616377u
+
+/// Header of a catalog page. The catalog starts at the meta page of the pager
+/// and continues in a linked list of pages, each storing an array of entries.
+typedef struct {
+    /// LSN of the last logged change, see pager_log.
+    lsn_t lsn;
+
+    uint32_t magic;
+
+    /// Next unused tree id, only maintained on the meta page.
+    uint32_t next_id;
+
+    /// Next page of the catalog or zero if this is the last one.
+    page_id_t next;
+} catalog_header_t;
+
+static catalog_header_t*
+catalog_get_header(unsigned char* page) {
+    return (catalog_header_t*)page;
+}
+
+static uint16_t
+catalog_slot_count(const pager_t* pager) {
+    return (uint16_t)((pager_get_page_size(pager) - sizeof(catalog_header_t)) / sizeof(catalog_entry_t));
+}
+
+/// Entries are copied in and out since they are not aligned within the page.
+static void
+catalog_get_entry(const unsigned char* page, const uint16_t slot, catalog_entry_t* out) {
+    memcpy(out, page + sizeof(catalog_header_t) + sizeof(catalog_entry_t) * slot, sizeof(catalog_entry_t));
+}
+
+static void
+catalog_put_entry(unsigned char* page, const uint16_t slot, const catalog_entry_t* entry) {
+    memcpy(page + sizeof(catalog_header_t) + sizeof(catalog_entry_t) * slot, entry, sizeof(catalog_entry_t));
+}
+
+/// Checks that the meta page contains a catalog. Returns false if the catalog
+/// was not initialised yet.
+static result_t
+catalog_check(unsigned char* meta, bool* initialised) {
+    const catalog_header_t* header = catalog_get_header(meta);
+
+    if (header->magic != 0 && header->magic != CATALOG_MAGIC) {
+        failure(EINVAL, msg("meta page does not contain a catalog"), with_uint(header->magic));
+    }
+
+    *initialised = header->magic == CATALOG_MAGIC;
+
+    return SUCCESS;
+}
+
+/// Walks the catalog and searches for an entry that matches the id or the
+/// name. Optionally reports the first empty slot and the last page of the
+/// catalog. The meta page has to be fixed by the caller.
+static result_t
+catalog_search(
+  pager_t* pager,
+  const page_t meta,
+  const uint32_t id,
+  const char* name,
+  catalog_ref_t* ref,
+  catalog_entry_t* out,
+  bool* found,
+  catalog_ref_t* empty,
+  page_id_t* last
+) {
+    const uint16_t slot_count = catalog_slot_count(pager);
+
+    *found = false;
+    if (empty != nullptr) {
+        *empty = (catalog_ref_t){ 0, 0 };
+    }
+
+    page_t page = meta;
+    while (true) {
+        for (uint16_t slot = 0; slot < slot_count; ++slot) {
+            catalog_entry_t entry;
+            catalog_get_entry(page.data, slot, &entry);
+
+            if (entry.id == 0) {
+                if (empty != nullptr && empty->page == 0) {
+                    *empty = (catalog_ref_t){ page.id, slot };
+                }
+                continue;
+            }
+
+            const bool id_match = id != 0 && entry.id == id;
+            const bool name_match = name != nullptr && strncmp(entry.name, name, CATALOG_NAME_SIZE) == 0;
+            if (id_match || name_match) {
+                *ref = (catalog_ref_t){ page.id, slot };
+                *out = entry;
+                *found = true;
+                break;
+            }
+        }
+
+        const page_id_t next = catalog_get_header(page.data)->next;
+        if (page.id != meta.id) {
+            pager_unfix(page);
+        }
+
+        if (*found) {
+            return SUCCESS;
+        }
+        if (next == 0) {
+            if (last != nullptr) {
+                *last = page.id;
+            }
+            return SUCCESS;
+        }
+
+        try(pager_fix(pager, next, false, &page));
+    }
+}
+
+result_t
+catalog_register(
+  pager_t* pager,
+  const char* name,
+  const page_id_t root,
+  const uint16_t flags,
+  catalog_ref_t* ref,
+  catalog_entry_t* out
+) {
+    ensure(pager != nullptr);
+    ensure(ref != nullptr);
+    ensure(out != nullptr);
+    ensure(name == nullptr || strlen(name) < CATALOG_NAME_SIZE);
+
+    if (name != nullptr && name[0] == '\0') {
+        name = nullptr;
+    }
+
+    // the exclusive latch on the meta page serializes all registrations
+    page_t meta;
+    try(pager_fix(pager, PAGER_META_PAGE, true, &meta));
+    defer(pager_unfix, meta);
+
+    catalog_header_t* meta_header = catalog_get_header(meta.data);
+
+    bool initialised;
+    try(catalog_check(meta.data, &initialised));
+    if (!initialised) {
+        meta_header->magic = CATALOG_MAGIC;
+        meta_header->next_id = 1;
+        meta_header->next = 0;
+    }
+
+    bool found;
+    catalog_ref_t empty;
+    page_id_t last;
+    catalog_entry_t existing;
+    try(catalog_search(pager, meta, 0, name, ref, &existing, &found, &empty, &last));
+
+    if (found) {
+        failure(EEXIST, msg("tree with the same name already exists"), with_uint(existing.id));
+    }
+
+    catalog_entry_t entry = {
+        .row_count = 0,
+        .id = meta_header->next_id,
+        .root = root,
+        .page_count = 1,
+        .flags = flags,
+        .height = 1,
+    };
+    if (name != nullptr) {
+        memcpy(entry.name, name, strlen(name));
+    }
+
+    page_t page;
+    if (empty.page == 0) {
+        // all pages are full, append a new page to the end of the list
+        try(pager_alloc(pager, last, &page));
+
+        if (last == meta.id) {
+            meta_header->next = page.id;
+        } else {
+            page_t prev;
+            try(pager_fix(pager, last, true, &prev));
+            defer(pager_unfix, prev);
+
+            catalog_get_header(prev.data)->next = page.id;
+            try(pager_log_image(pager, prev));
+        }
+
+        empty = (catalog_ref_t){ page.id, 0 };
+    } else if (empty.page != meta.id) {
+        try(pager_fix(pager, empty.page, true, &page));
+    } else {
+        page = meta;
+    }
+
+    catalog_put_entry(page.data, empty.slot, &entry);
+    if (page.id != meta.id) {
+        defer(pager_unfix, page);
+        try(pager_log_image(pager, page));
+    }
+
+    meta_header->next_id += 1;
+    try(pager_log_image(pager, meta));
+
+    *ref = empty;
+    *out = entry;
+
+    return SUCCESS;
+}
+
+result_t
+catalog_unregister(pager_t* pager, const catalog_ref_t ref) {
+    ensure(pager != nullptr);
+    ensure(ref.slot < catalog_slot_count(pager));
+
+    page_t page;
+    try(pager_fix(pager, ref.page, true, &page));
+    defer(pager_unfix, page);
+
+    catalog_entry_t entry;
+    catalog_get_entry(page.data, ref.slot, &entry);
+    ensure(entry.id != 0);
+
+    // the empty slot is reused by the next registration, the id is not
+    memset(&entry, 0, sizeof(catalog_entry_t));
+    catalog_put_entry(page.data, ref.slot, &entry);
+    try(pager_log_image(pager, page));
+
+    return SUCCESS;
+}
+
+/// Searches the catalog with a shared latch on the meta page.
+static result_t
+catalog_find(pager_t* pager, const uint32_t id, const char* name, catalog_ref_t* ref, catalog_entry_t* out) {
+    page_t meta;
+    try(pager_fix(pager, PAGER_META_PAGE, false, &meta));
+    defer(pager_unfix, meta);
+
+    bool found = false;
+
+    bool initialised;
+    try(catalog_check(meta.data, &initialised));
+    if (initialised) {
+        try(catalog_search(pager, meta, id, name, ref, out, &found, nullptr, nullptr));
+    }
+
+    if (!found) {
+        failure(ENOENT, msg("tree not found in catalog"), with_uint(id));
+    }
+
+    return SUCCESS;
+}
+
+result_t
+catalog_find_by_id(pager_t* pager, const uint32_t id, catalog_ref_t* ref, catalog_entry_t* out) {
+    ensure(pager != nullptr);
+    ensure(ref != nullptr);
+    ensure(out != nullptr);
+    ensure(id != 0);
+
+    return catalog_find(pager, id, nullptr, ref, out);
+}
+
+result_t
+catalog_find_by_name(pager_t* pager, const char* name, catalog_ref_t* ref, catalog_entry_t* out) {
+    ensure(pager != nullptr);
+    ensure(ref != nullptr);
+    ensure(out != nullptr);
+    ensure(name != nullptr && name[0] != '\0');
+
+    return catalog_find(pager, 0, name, ref, out);
+}
+
+result_t
+catalog_next(pager_t* pager, catalog_ref_t* ref, catalog_entry_t* out, bool* found) {
+    ensure(pager != nullptr);
+    ensure(ref != nullptr);
+    ensure(out != nullptr);
+    ensure(found != nullptr);
+
+    const uint16_t slot_count = catalog_slot_count(pager);
+
+    // the shared latch on the meta page blocks concurrent registrations
+    page_t meta;
+    try(pager_fix(pager, PAGER_META_PAGE, false, &meta));
+    defer(pager_unfix, meta);
+
+    *found = false;
+
+    bool initialised;
+    try(catalog_check(meta.data, &initialised));
+    if (!initialised) {
+        return SUCCESS;
+    }
+
+    page_t page = meta;
+    uint32_t slot = 0;
+    if (ref->page != 0) {
+        if (ref->page != meta.id) {
+            try(pager_fix(pager, ref->page, false, &page));
+        }
+        slot = ref->slot + 1u;
+    }
+
+    while (true) {
+        for (; slot < slot_count; ++slot) {
+            catalog_get_entry(page.data, (uint16_t)slot, out);
+
+            if (out->id != 0) {
+                *ref = (catalog_ref_t){ page.id, (uint16_t)slot };
+                *found = true;
+                break;
+            }
+        }
+
+        const page_id_t next = catalog_get_header(page.data)->next;
+        if (page.id != meta.id) {
+            pager_unfix(page);
+        }
+
+        if (*found || next == 0) {
+            return SUCCESS;
+        }
+
+        try(pager_fix(pager, next, false, &page));
+        slot = 0;
+    }
+}
+
+result_t
+catalog_read(pager_t* pager, const catalog_ref_t ref, catalog_entry_t* out) {
+    ensure(pager != nullptr);
+    ensure(out != nullptr);
+    ensure(ref.slot < catalog_slot_count(pager));
+
+    page_t page;
+    try(pager_fix(pager, ref.page, false, &page));
+    defer(pager_unfix, page);
+
+    catalog_get_entry(page.data, ref.slot, out);
+
+    return SUCCESS;
+}
+
+result_t
+catalog_set_root(pager_t* pager, const catalog_ref_t ref, const page_id_t root, const uint16_t height) {
+    ensure(pager != nullptr);
+    ensure(ref.slot < catalog_slot_count(pager));
+
+    page_t page;
+    try(pager_fix(pager, ref.page, true, &page));
+    defer(pager_unfix, page);
+
+    catalog_entry_t entry;
+    catalog_get_entry(page.data, ref.slot, &entry);
+    ensure(entry.id != 0);
+
+    entry.root = root;
+    entry.height = height;
+    catalog_put_entry(page.data, ref.slot, &entry);
+    try(pager_log_image(pager, page));
+
+    return SUCCESS;
+}
+
+result_t
+catalog_add_stats(pager_t* pager, const catalog_ref_t ref, const int64_t rows, const int32_t pages) {
+    ensure(pager != nullptr);
+    ensure(ref.slot < catalog_slot_count(pager));
+
+    page_t page;
+    try(pager_fix(pager, ref.page, true, &page));
+    defer(pager_unfix, page);
+
+    catalog_entry_t entry;
+    catalog_get_entry(page.data, ref.slot, &entry);
+    ensure(entry.id != 0);
+
+    entry.row_count = (uint64_t)((int64_t)entry.row_count + rows);
+    entry.page_count = (uint32_t)((int32_t)entry.page_count + pages);
+    catalog_put_entry(page.data, ref.slot, &entry);
+    try(pager_log_image(pager, page));
+
+    return SUCCESS;
+}
+
+describe(catalog) {
+    static pager_t* pager;
+
+    before_each() {
+        assert_success(pager_open(&pager, 256, 64));
+    }
+
+    after_each() {
+        assert_success(pager_close(&pager));
+        error_clear();
+    }
+
+    it("find in empty catalog") {
+        catalog_ref_t ref;
+        catalog_entry_t entry;
+        assert_failure(catalog_find_by_name(pager, "users", &ref, &entry), ENOENT);
+        assert_failure(catalog_find_by_id(pager, 1, &ref, &entry), ENOENT);
+    }
+
+    it("register and find tree") {
+        catalog_ref_t ref;
+        catalog_entry_t entry;
+        assert_success(catalog_register(pager, "users", 7, 2, &ref, &entry));
+        asserteq_uint(entry.id, 1);
+        asserteq_uint(entry.root, 7);
+
+        catalog_ref_t found_ref;
+        catalog_entry_t found;
+        assert_success(catalog_find_by_name(pager, "users", &found_ref, &found));
+        asserteq_uint(found.id, entry.id);
+        asserteq_uint(found.root, 7);
+        asserteq_uint(found.flags, 2);
+        asserteq_str(found.name, "users");
+
+        assert_success(catalog_find_by_id(pager, entry.id, &found_ref, &found));
+        asserteq_str(found.name, "users");
+        asserteq_uint(found_ref.page, ref.page);
+        asserteq_uint(found_ref.slot, ref.slot);
+    }
+
+    it("register duplicate name") {
+        catalog_ref_t ref;
+        catalog_entry_t entry;
+        assert_success(catalog_register(pager, "users", 7, 2, &ref, &entry));
+        assert_failure(catalog_register(pager, "users", 8, 2, &ref, &entry), EEXIST);
+
+        // anonymous trees never conflict
+        assert_success(catalog_register(pager, nullptr, 9, 2, &ref, &entry));
+        assert_success(catalog_register(pager, "", 10, 2, &ref, &entry));
+    }
+
+    it("register trees across pages") {
+        const uint32_t count = catalog_slot_count(pager) * 4u + 1u;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            char name[CATALOG_NAME_SIZE];
+            snprintf(name, sizeof(name), "tree-%u", i);
+
+            catalog_ref_t ref;
+            catalog_entry_t entry;
+            assert_success(catalog_register(pager, name, 100 + i, 2, &ref, &entry));
+            asserteq_uint(entry.id, i + 1);
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            char name[CATALOG_NAME_SIZE];
+            snprintf(name, sizeof(name), "tree-%u", i);
+
+            catalog_ref_t ref;
+            catalog_entry_t entry;
+            assert_success(catalog_find_by_name(pager, name, &ref, &entry));
+            asserteq_uint(entry.root, 100 + i);
+        }
+
+        catalog_ref_t ref = { 0, 0 };
+        catalog_entry_t entry;
+        bool found;
+        for (uint32_t i = 0; i < count; ++i) {
+            assert_success(catalog_next(pager, &ref, &entry, &found));
+            assertis(found);
+            asserteq_uint(entry.id, i + 1);
+        }
+        assert_success(catalog_next(pager, &ref, &entry, &found));
+        assertis(!found);
+    }
+
+    it("update root and statistics") {
+        catalog_ref_t ref;
+        catalog_entry_t entry;
+        assert_success(catalog_register(pager, "users", 7, 2, &ref, &entry));
+
+        assert_success(catalog_set_root(pager, ref, 12, 2));
+        assert_success(catalog_add_stats(pager, ref, 40, 3));
+        assert_success(catalog_add_stats(pager, ref, -10, 1));
+
+        assert_success(catalog_read(pager, ref, &entry));
+        asserteq_uint(entry.root, 12);
+        asserteq_uint(entry.height, 2);
+        asserteq_uint(entry.row_count, 30);
+        asserteq_uint(entry.page_count, 5);
+    }
+
+    it("unregister tree") {
+        catalog_ref_t ref;
+        catalog_entry_t entry;
+        assert_success(catalog_register(pager, "users", 7, 2, &ref, &entry));
+        assert_success(catalog_unregister(pager, ref));
+        assert_failure(catalog_unregister(pager, ref), EINVAL);
+
+        catalog_ref_t found_ref;
+        catalog_entry_t found;
+        assert_failure(catalog_find_by_name(pager, "users", &found_ref, &found), ENOENT);
+
+        // the slot is reused with a new id
+        assert_success(catalog_register(pager, "users", 8, 2, &found_ref, &found));
+        asserteq_uint(found_ref.page, ref.page);
+        asserteq_uint(found_ref.slot, ref.slot);
+        asserteq_uint(found.id, entry.id + 1);
+    }
+
+    it("meta page without catalog") {
+        page_t meta;
+        assert_success(pager_fix(pager, PAGER_META_PAGE, true, &meta));
+        memset(meta.data, 0xab, pager_get_page_size(pager));
+        pager_unfix(meta);
+
+        catalog_ref_t ref;
+        catalog_entry_t entry;
+        assert_failure(catalog_register(pager, "users", 7, 2, &ref, &entry), EINVAL);
+    }
+}
@@ -0,0 +1,364 @@
+#include "compress.h"
+
+#include "deffer.h"
+#include "util.h"
+#include "varint.h"
+#include "winter.h"
+
+#include <assert.h>
+
+/// Number of bits used to index the match finder tables.
+#define HASH_BITS 12
+#define HASH_SIZE (1u << HASH_BITS)
+
+/// Shortest match that is encoded as a back reference.
+#define MIN_MATCH 4
+
+/// Longest literal run or match that can be encoded by a single token.
+#define MAX_LITERALS 128
+#define MAX_MATCH (MAX_LITERALS + MIN_MATCH - 1)
+
+/// Tokens with this bit set are back references, otherwise literal runs.
+#define TOKEN_MATCH 0x80u
+
+/// Marks an empty slot in the match finder tables.
+#define NO_POSITION UINT32_MAX
+
+struct compress_dict_t {
+    uint32_t size;
+    unsigned char* data;
+
+    /// Last position in the dictionary for every hash of MIN_MATCH bytes.
+    uint32_t table[HASH_SIZE];
+};
+
+static uint32_t
+hash_bytes(const unsigned char* ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(uint32_t));
+
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+result_t
+compress_dict_open(compress_dict_t** out, const blob_t data) {
+    ensure(out != nullptr);
+    ensure(data.size >= MIN_MATCH && data.size < NO_POSITION);
+
+    compress_dict_t* dict;
+    try_alloc(dict, sizeof(compress_dict_t));
+    errdefer(free, dict);
+
+    try_alloc(dict->data, data.size);
+    memcpy(dict->data, data.data, data.size);
+    dict->size = (uint32_t)data.size;
+
+    // later positions overwrite earlier ones, which keeps the encoded
+    // distances short
+    memset(dict->table, 0xff, sizeof(dict->table));
+    for (uint32_t i = 0; i + MIN_MATCH <= dict->size; ++i) {
+        dict->table[hash_bytes(dict->data + i)] = i;
+    }
+
+    *out = dict;
+
+    return SUCCESS;
+}
+
+result_t
+compress_dict_close(compress_dict_t** out) {
+    ensure(out != nullptr);
+
+    compress_dict_t* dict = *out;
+
+    free(dict->data);
+    free(dict);
+    *out = nullptr;
+
+    return SUCCESS;
+}
+
+uint64_t
+compress_bound(const uint64_t size) {
+    return varint_put_len(size) + size + size / MAX_LITERALS + 1;
+}
+
+/// Returns the length of the common prefix of a and b, up to n bytes.
+static uint64_t
+match_len(const unsigned char* a, const unsigned char* b, const uint64_t n) {
+    uint64_t len = 0;
+    while (len < n && a[len] == b[len]) {
+        len++;
+    }
+
+    return len;
+}
+
+static uint64_t
+put_literals(unsigned char* dst, const unsigned char* src, uint64_t n) {
+    uint64_t offset = 0;
+
+    while (n > 0) {
+        const uint64_t run = min(n, MAX_LITERALS);
+
+        dst[offset++] = (unsigned char)(run - 1);
+        memcpy(dst + offset, src, run);
+
+        offset += run;
+        src += run;
+        n -= run;
+    }
+
+    return offset;
+}
+
+uint64_t
+compress_encode(unsigned char* dst, const blob_t src, const compress_dict_t* dict) {
+    assert(src.size < NO_POSITION);
+
+    uint64_t offset = varint_put(dst, src.size);
+
+    // match finder table for the source, the dictionary has its own table
+    uint32_t table[HASH_SIZE];
+    memset(table, 0xff, sizeof(table));
+
+    uint64_t literals = 0;
+    uint64_t i = 0;
+    while (i + MIN_MATCH <= src.size) {
+        const uint32_t hash = hash_bytes(src.data + i);
+
+        uint64_t best_len = 0;
+        uint64_t best_distance = 0;
+
+        const uint32_t local = table[hash];
+        if (local != NO_POSITION) {
+            best_len = match_len(src.data + local, src.data + i, min(src.size - i, MAX_MATCH));
+            best_distance = i - local;
+        }
+
+        // distances into the dictionary are counted from the start of the
+        // source, i.e. the source directly follows the dictionary
+        if (dict != nullptr && dict->table[hash] != NO_POSITION) {
+            const uint32_t position = dict->table[hash];
+            const uint64_t n = min(min(src.size - i, dict->size - position), MAX_MATCH);
+            const uint64_t len = match_len(dict->data + position, src.data + i, n);
+
+            if (len > best_len) {
+                best_len = len;
+                best_distance = i + dict->size - position;
+            }
+        }
+
+        table[hash] = (uint32_t)i;
+
+        // only emit matches that are shorter than the literals they replace,
+        // this guarantees that the output never exceeds compress_bound
+        if (best_len < MIN_MATCH || best_len <= 1u + varint_put_len(best_distance)) {
+            i += 1;
+            continue;
+        }
+
+        offset += put_literals(dst + offset, src.data + literals, i - literals);
+        dst[offset++] = (unsigned char)(TOKEN_MATCH | (best_len - MIN_MATCH));
+        offset += varint_put(dst + offset, best_distance);
+
+        for (uint64_t k = i + 1; k < i + best_len && k + MIN_MATCH <= src.size; ++k) {
+            table[hash_bytes(src.data + k)] = (uint32_t)k;
+        }
+
+        i += best_len;
+        literals = i;
+    }
+
+    offset += put_literals(dst + offset, src.data + literals, src.size - literals);
+
+    assert(offset <= compress_bound(src.size));
+    return offset;
+}
+
+/// Reads a varint at the offset and advances it, returns false if the varint
+/// does not end before the end of the source.
+static bool
+get_varint(const blob_t src, uint64_t* offset, uint64_t* out) {
+    uint64_t len = 0;
+    while (true) {
+        if (*offset + len >= src.size) {
+            return false;
+        }
+        // the ninth byte has no continuation bit
+        if (len == 8 || (src.data[*offset + len] & 0x80) == 0) {
+            break;
+        }
+        len += 1;
+    }
+
+    *offset += varint_get(src.data + *offset, out);
+
+    return true;
+}
+
+uint64_t
+compress_decode_len(const unsigned char* src) {
+    uint64_t size;
+    varint_get(src, &size);
+
+    return size;
+}
+
+result_t
+compress_decode(
+  unsigned char* dst,
+  const uint64_t capacity,
+  const blob_t src,
+  const compress_dict_t* dict,
+  blob_t* out
+) {
+    ensure(out != nullptr);
+
+    uint64_t size;
+    uint64_t offset = 0;
+    if (!get_varint(src, &offset, &size)) {
+        failure(EINVAL, msg("truncated size"));
+    }
+
+    if (size > capacity) {
+        failure(EOVERFLOW, msg("buffer too small for decompressed data"), with_uint(size), with_uint(capacity));
+    }
+
+    const uint64_t dict_size = dict != nullptr ? dict->size : 0;
+
+    uint64_t position = 0;
+    while (offset < src.size) {
+        const unsigned char token = src.data[offset++];
+
+        if ((token & TOKEN_MATCH) == 0) {
+            const uint64_t len = token + 1u;
+            if (offset + len > src.size || position + len > size) {
+                failure(EINVAL, msg("corrupted literal run"), with_uint(offset));
+            }
+
+            memcpy(dst + position, src.data + offset, len);
+            offset += len;
+            position += len;
+        } else {
+            const uint64_t len = (token & ~TOKEN_MATCH) + MIN_MATCH;
+
+            uint64_t distance;
+            if (!get_varint(src, &offset, &distance)) {
+                failure(EINVAL, msg("truncated back reference"), with_uint(offset));
+            }
+
+            if (distance == 0 || distance > position + dict_size || position + len > size) {
+                failure(EINVAL, msg("corrupted back reference"), with_uint(offset), with_uint(distance));
+            }
+
+            // byte wise copy, the reference might overlap with the output
+            for (const uint64_t end = position + len; position < end; ++position) {
+                if (distance <= position) {
+                    dst[position] = dst[position - distance];
+                } else {
+                    dst[position] = dict->data[dict_size - (distance - position)];
+                }
+            }
+        }
+    }
+
+    if (position != size) {
+        failure(EINVAL, msg("decompressed size does not match"), with_uint(position), with_uint(size));
+    }
+
+    *out = (blob_t){ size, dst };
+
+    return SUCCESS;
+}
+
+TEST_ONLY static uint64_t
+test_roundtrip(const char* value, const compress_dict_t* dict) {
+    const blob_t src = blob_from_string(value);
+
+    unsigned char compressed[compress_bound(src.size)];
+    const uint64_t compressed_len = compress_encode(compressed, src, dict);
+    assertis(compressed_len <= compress_bound(src.size));
+    asserteq_uint(compress_decode_len(compressed), src.size);
+
+    unsigned char buffer[src.size];
+    blob_t result;
+    assert_success(compress_decode(buffer, src.size, (blob_t){ compressed_len, compressed }, dict, &result));
+    asserteq_int(blob_cmp(result, src), 0);
+
+    return compressed_len;
+}
+
+describe(compress) {
+    static compress_dict_t* dict;
+
+    before_each() {
+        const char* sample = "{\"name\":\"\",\"status\":\"active\",\"role\":\"admin\",\"tags\":[]}";
+        assert_success(compress_dict_open(&dict, blob_from_string(sample)));
+    }
+
+    after_each() {
+        assert_success(compress_dict_close(&dict));
+        error_clear();
+    }
+
+    it("roundtrip short values") {
+        test_roundtrip("", nullptr);
+        test_roundtrip("a", nullptr);
+        test_roundtrip("abc", dict);
+    }
+
+    it("compress repetitive value") {
+        const char* value = "abcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcd";
+        assertis(test_roundtrip(value, nullptr) < strlen(value) / 2);
+    }
+
+    it("compress with dictionary") {
+        const char* value = "{\"name\":\"alice\",\"status\":\"active\",\"role\":\"admin\",\"tags\":[]}";
+        const uint64_t without = test_roundtrip(value, nullptr);
+        const uint64_t with = test_roundtrip(value, dict);
+
+        assertis(with < without);
+        assertis(with < strlen(value) / 2);
+    }
+
+    it("incompressible value within bound") {
+        char value[1024];
+        for (uint32_t i = 0; i < sizeof(value) - 1; ++i) {
+            value[i] = (char)('!' + (i * 7919u + (i >> 3) * 31u) % 90u);
+        }
+        value[sizeof(value) - 1] = '\0';
+
+        test_roundtrip(value, dict);
+    }
+
+    it("decode into small buffer") {
+        const blob_t src = blob_from_string("hello world");
+
+        unsigned char compressed[compress_bound(src.size)];
+        const uint64_t compressed_len = compress_encode(compressed, src, nullptr);
+
+        unsigned char buffer[4];
+        blob_t result;
+        assert_failure(compress_decode(buffer, 4, (blob_t){ compressed_len, compressed }, nullptr, &result), EOVERFLOW);
+    }
+
+    it("decode corrupted back reference") {
+        // one match token referencing data before the start of the output
+        const unsigned char compressed[] = { 8, TOKEN_MATCH | 4, 3 };
+
+        unsigned char buffer[8];
+        blob_t result;
+        assert_failure(compress_decode(buffer, 8, (blob_t){ sizeof(compressed), (unsigned char*)compressed }, nullptr, &result), EINVAL);
+    }
+
+    it("decode truncated back reference") {
+        // the distance of the match continues past the end of the source
+        const unsigned char compressed[] = { 8, 0, 'a', TOKEN_MATCH | 3, 0x81 };
+
+        unsigned char buffer[8];
+        blob_t result;
+        assert_failure(compress_decode(buffer, 8, (blob_t){ sizeof(compressed), (unsigned char*)compressed }, nullptr, &result), EINVAL);
+        assert_failure(compress_decode(buffer, 8, (blob_t){ 0, (unsigned char*)compressed }, nullptr, &result), EINVAL);
+    }
+}
@@ -2,17 +2,337 @@
 
 #include "assert.h"
 #include "util.h"
+#include "winter.h"
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
 #define MAX_ERRORS 32
 
+/// Limits of the recorded messages per frame, further messages are dropped.
+#define MAX_MESSAGES 4
+#define MAX_ARGS 8
+#define MAX_STRING_BYTES 128
+
+/// Kinds of arguments, integers are widened to intmax_t or uintmax_t and
+/// floating point numbers to long double.
+enum {
+    ARG_INT,
+    ARG_UINT,
+    ARG_CHAR,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+    ARG_NONE,
+};
+
+/// Length modifiers of a conversion.
+enum {
+    LENGTH_NONE,
+    LENGTH_HH,
+    LENGTH_H,
+    LENGTH_L,
+    LENGTH_LL,
+    LENGTH_J,
+    LENGTH_Z,
+    LENGTH_T,
+    LENGTH_LONG_DOUBLE,
+};
+
+/// Conversion of a format string, the flags, width and precision are kept as
+/// they are.
+typedef struct {
+    const char* flags;
+    uint32_t flags_len;
+    uint8_t length;
+    uint8_t kind;
+    char conversion;
+} error_spec_t;
+
+typedef union {
+    intmax_t i;
+    uintmax_t u;
+    long double d;
+    const void* p;
+
+    /// Offset of a copied string, UINT16_MAX if it did not fit.
+    uint16_t s;
+} error_arg_t;
+
+/// Unformatted frame. The formats are string literals and outlive the frame.
+typedef struct {
+    const char* formats[MAX_MESSAGES];
+    uint8_t message_count;
+
+    error_arg_t args[MAX_ARGS];
+    uint8_t arg_count;
+
+    char strings[MAX_STRING_BYTES];
+    uint16_t string_size;
+} error_record_t;
+
 _Thread_local static error_frame_t error_list[MAX_ERRORS];
+_Thread_local static error_record_t error_records[MAX_ERRORS];
 _Thread_local static uint32_t error_count = 0;
 _Thread_local static int32_t error_code = 0;
 
+/// Parses the conversion after a '%' and returns the first character after it.
+static const char*
+error_parse_spec(const char* format, error_spec_t* out) {
+    out->flags = format;
+    while (*format != '\0' && strchr("-+ #0123456789.", *format) != nullptr) {
+        format += 1;
+    }
+    out->flags_len = (uint32_t)(format - out->flags);
+
+    out->length = LENGTH_NONE;
+    if (format[0] == 'h') {
+        out->length = format[1] == 'h' ? LENGTH_HH : LENGTH_H;
+    } else if (format[0] == 'l') {
+        out->length = format[1] == 'l' ? LENGTH_LL : LENGTH_L;
+    } else if (format[0] == 'j') {
+        out->length = LENGTH_J;
+    } else if (format[0] == 'z') {
+        out->length = LENGTH_Z;
+    } else if (format[0] == 't') {
+        out->length = LENGTH_T;
+    } else if (format[0] == 'L') {
+        out->length = LENGTH_LONG_DOUBLE;
+    }
+    format += out->length == LENGTH_HH || out->length == LENGTH_LL ? 2 : out->length != LENGTH_NONE;
+
+    out->conversion = *format;
+    switch (out->conversion) {
+        case 'd':
+        case 'i':
+            out->kind = ARG_INT;
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            out->kind = ARG_UINT;
+            break;
+        case 'c':
+            out->kind = ARG_CHAR;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            out->kind = ARG_DOUBLE;
+            break;
+        case 's':
+            out->kind = ARG_STRING;
+            break;
+        case 'p':
+            out->kind = ARG_POINTER;
+            break;
+        default:
+            // '%%' and unsupported conversions are printed as they are
+            out->kind = ARG_NONE;
+            break;
+    }
+
+    return *format == '\0' ? format : format + 1;
+}
+
+static intmax_t
+error_read_int(va_list* args, const uint8_t length) {
+    switch (length) {
+        case LENGTH_L:
+            return va_arg(*args, long);
+        case LENGTH_LL:
+            return va_arg(*args, long long);
+        case LENGTH_J:
+            return va_arg(*args, intmax_t);
+        case LENGTH_Z:
+            return (intmax_t)va_arg(*args, size_t);
+        case LENGTH_T:
+            return va_arg(*args, ptrdiff_t);
+        default:
+            return va_arg(*args, int);
+    }
+}
+
+static uintmax_t
+error_read_uint(va_list* args, const uint8_t length) {
+    switch (length) {
+        case LENGTH_L:
+            return va_arg(*args, unsigned long);
+        case LENGTH_LL:
+            return va_arg(*args, unsigned long long);
+        case LENGTH_J:
+            return va_arg(*args, uintmax_t);
+        case LENGTH_Z:
+            return va_arg(*args, size_t);
+        case LENGTH_T:
+            return (uintmax_t)va_arg(*args, ptrdiff_t);
+        default:
+            return va_arg(*args, unsigned int);
+    }
+}
+
+/// Copies a string argument, strings might not outlive the frame.
+static uint16_t
+error_copy_string(error_record_t* record, const char* string) {
+    const size_t len = strlen(string != nullptr ? string : "(null)") + 1;
+    if (record->string_size + len > MAX_STRING_BYTES) {
+        return UINT16_MAX;
+    }
+
+    const uint16_t offset = record->string_size;
+    memcpy(record->strings + offset, string != nullptr ? string : "(null)", len);
+    record->string_size = (uint16_t)(offset + len);
+
+    return offset;
+}
+
+/// Records the arguments of a message, drops the message if they do not fit.
+static void
+error_record(error_record_t* record, const char* format, va_list* args) {
+    if (record->message_count >= MAX_MESSAGES) {
+        return;
+    }
+
+    error_arg_t values[MAX_ARGS];
+    uint8_t count = 0;
+
+    for (const char* c = format; *c != '\0';) {
+        if (*c++ != '%') {
+            continue;
+        }
+
+        error_spec_t spec;
+        c = error_parse_spec(c, &spec);
+        if (spec.kind == ARG_NONE) {
+            continue;
+        }
+
+        if (record->arg_count + count >= MAX_ARGS) {
+            return;
+        }
+
+        error_arg_t* value = &values[count++];
+        switch (spec.kind) {
+            case ARG_INT:
+            case ARG_CHAR:
+                value->i = error_read_int(args, spec.length);
+                break;
+            case ARG_UINT:
+                value->u = error_read_uint(args, spec.length);
+                break;
+            case ARG_DOUBLE:
+                value->d = spec.length == LENGTH_LONG_DOUBLE ? va_arg(*args, long double) : va_arg(*args, double);
+                break;
+            case ARG_STRING:
+                value->s = error_copy_string(record, va_arg(*args, const char*));
+                break;
+            case ARG_POINTER:
+                value->p = va_arg(*args, const void*);
+                break;
+        }
+    }
+
+    memcpy(record->args + record->arg_count, values, sizeof(error_arg_t) * count);
+    record->arg_count += count;
+    record->formats[record->message_count++] = format;
+}
+
+/// Appends text to the message of a frame, cuts it off once the message is
+/// full.
+__attribute__((__format__(__printf__, 3, 4))) static void
+error_print(char* msg, size_t* len, const char* format, ...) {
+    if (*len + 1 >= sizeof(error_list[0].msg)) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    const int written = vsnprintf(msg + *len, sizeof(error_list[0].msg) - *len, format, args);
+    va_end(args);
+
+    if (written > 0) {
+        *len = min(*len + (size_t)written, sizeof(error_list[0].msg) - 1);
+    }
+}
+
+/// Formats the recorded messages of a frame.
+static void
+error_format(const error_record_t* record, char* msg) {
+    size_t len = 0;
+    msg[0] = '\0';
+
+    const error_arg_t* value = record->args;
+    for (uint32_t i = 0; i < record->message_count; ++i) {
+        for (const char* c = record->formats[i]; *c != '\0';) {
+            if (*c != '%') {
+                const size_t literal = strcspn(c, "%");
+                error_print(msg, &len, "%.*s", (int)literal, c);
+                c += literal;
+                continue;
+            }
+
+            error_spec_t spec;
+            const char* next = error_parse_spec(c + 1, &spec);
+
+            if (spec.kind == ARG_NONE) {
+                error_print(msg, &len, "%s", spec.conversion == '%' ? "%" : "");
+                c = next;
+                continue;
+            }
+
+            // the conversion with the widened length modifier of the argument
+            char conversion[32];
+            const char* modifier = spec.kind == ARG_INT || spec.kind == ARG_UINT    ? "j"
+                                   : spec.kind == ARG_DOUBLE ? "L"
+                                                              : "";
+            snprintf(
+              conversion,
+              sizeof(conversion),
+              "%%%.*s%s%c",
+              (int)min(spec.flags_len, 16u),
+              spec.flags,
+              modifier,
+              spec.conversion
+            );
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+            switch (spec.kind) {
+                case ARG_INT:
+                    error_print(msg, &len, conversion, value->i);
+                    break;
+                case ARG_UINT:
+                    error_print(msg, &len, conversion, value->u);
+                    break;
+                case ARG_CHAR:
+                    error_print(msg, &len, conversion, (int)value->i);
+                    break;
+                case ARG_DOUBLE:
+                    error_print(msg, &len, conversion, value->d);
+                    break;
+                case ARG_STRING:
+                    error_print(msg, &len, conversion, value->s == UINT16_MAX ? "..." : record->strings + value->s);
+                    break;
+                case ARG_POINTER:
+                    error_print(msg, &len, conversion, value->p);
+                    break;
+            }
+#pragma GCC diagnostic pop
+
+            value += 1;
+            c = next;
+        }
+    }
+}
+
 void
 error_push(const char* file, const char* func, const uint32_t line, const int32_t code) {
     assert(code != 0);
@@ -20,34 +340,43 @@ error_push(const char* file, const char* func, const uint32_t line, const int32_
     error_code = code;
 
     if (error_count >= MAX_ERRORS) {
+        // the messages of the dropped frame are dropped as well
+        error_count = MAX_ERRORS + 1;
         return;
     }
 
-    error_frame_t* frame = error_list + error_count++;
+    error_frame_t* frame = error_list + error_count;
     frame->file = file;
     frame->func = func;
     frame->line = line;
     frame->code = code;
-    frame->msg[0] = '\0';
+
+    error_record_t* record = error_records + error_count;
+    record->message_count = 0;
+    record->arg_count = 0;
+    record->string_size = 0;
+
+    error_count += 1;
 }
 
-__attribute__((__format__(__printf__, 1, 0))) void
+void
+error_set_code(const int32_t code) {
+    assert(code != 0);
+
+    error_code = code;
+}
+
+__attribute__((__format__(__printf__, 1, 2))) void
 error_append_message(const char* format, ...) {
     assert(error_count > 0);
 
-    error_frame_t* frame = error_trace_nth(error_count - 1);
-    if (frame == nullptr) {
-        return;
-    }
-
-    const size_t offset = strlen(frame->msg);
-    if (offset >= sizeof(frame->msg)) {
+    if (error_count == 0 || error_count > MAX_ERRORS) {
         return;
     }
 
     va_list args;
     va_start(args, format);
-    vsnprintf(frame->msg, sizeof(frame->msg) - offset, format, args);
+    error_record(&error_records[error_count - 1], format, &args);
     va_end(args);
 }
 
@@ -63,11 +392,14 @@ error_trace_length(void) {
 
 error_frame_t*
 error_trace_nth(const uint32_t n) {
-    if (n >= error_count || error_count >= MAX_ERRORS) {
+    if (n >= error_trace_length()) {
         return nullptr;
     }
 
-    return error_list + n;
+    error_frame_t* frame = error_list + n;
+    error_format(&error_records[n], frame->msg);
+
+    return frame;
 }
 
 void
@@ -75,3 +407,59 @@ error_clear(void) {
     error_code = 0;
     error_count = 0;
 }
+
+TEST_ONLY static result_t
+test_fail_with_path(const char* path) {
+    failure(ENOENT, msg("failed to open file: %s", path), with_uint(42u), with_int(-7));
+}
+
+TEST_ONLY static result_t
+test_fail_nested(void) {
+    try(test_fail_with_path("/tmp/file"));
+    return SUCCESS;
+}
+
+describe(error) {
+    after_each() {
+        error_clear();
+    }
+
+    it("format messages when the trace is read") {
+        char path[16];
+        strcpy(path, "/tmp/file");
+        assertis(test_fail_with_path(path) == FAILURE);
+
+        // the strings were copied when the message was recorded
+        strcpy(path, "overwritten");
+
+        asserteq_int(error_get_code(), ENOENT);
+        asserteq_uint(error_trace_length(), 1);
+        asserteq_str(error_trace_nth(0)->msg, "failed to open file: /tmp/file, '42u' = 42, '-7' = -7");
+        assertis(error_trace_nth(1) == nullptr);
+    }
+
+    it("format each frame of a trace") {
+        assertis(test_fail_nested() == FAILURE);
+
+        asserteq_uint(error_trace_length(), 2);
+        asserteq_str(error_trace_nth(1)->msg, "try test_fail_with_path(\"/tmp/file\")");
+        asserteq_int(error_trace_nth(1)->code, ENOENT);
+    }
+
+    it("format conversions") {
+        error_push(__FILE__, __FUNCTION__, __LINE__, EINVAL);
+        error_append_message("%d%% %5.2f %c %x %-3s| %lu %hhu", -3, 1.5, 'a', 255u, "ab", 7ul, (unsigned char)9);
+        asserteq_str(error_trace_nth(0)->msg, "-3%  1.50 a ff ab | 7 9");
+    }
+
+    it("keep the code after the trace is full") {
+        for (uint32_t i = 0; i < MAX_ERRORS + 4; ++i) {
+            error_push(__FILE__, __FUNCTION__, __LINE__, (int32_t)i + 1);
+            error_append_message("frame %u", i);
+        }
+
+        asserteq_int(error_get_code(), MAX_ERRORS + 4);
+        asserteq_uint(error_trace_length(), MAX_ERRORS);
+        asserteq_str(error_trace_nth(MAX_ERRORS - 1)->msg, "frame 31");
+    }
+}
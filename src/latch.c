@@ -1,39 +1,290 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
+#include <time.h>
 
 #include "latch.h"
+#include "stats.h"
+#include "trace.h"
 #include "winter.h"
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// Number of rounds that spin with an exponentially growing number of pause
+/// instructions, up to 2^LATCH_SPIN_ROUNDS pauses per round.
+#define LATCH_SPIN_ROUNDS 8
+
+/// Number of rounds after spinning that yield the processor before a waiter
+/// parks.
+#define LATCH_YIELD_ROUNDS 4
+
+/// Number of slots in the table of visible readers, shared by all latches.
+#define LATCH_SLOT_COUNT 4096
+
+/// Number of latches a thread might hold in the distributed reader mode at
+/// the same time, further latches are acquired through the counter.
+#define LATCH_MAX_SLOTS 8
+
+/// Number of shared acquisitions through the counter of read-mostly latches
+/// between attempts to enable the distributed reader mode again, so that
+/// frequent writers do not pay for scanning the table all the time.
+#define LATCH_REBIAS_INTERVAL 64
+
+typedef struct {
+    latch_t* latch;
+    uint32_t slot;
+} latch_hold_t;
+
+/// Table of visible readers. A reader of a biased latch stores the latch in
+/// the slot for its thread and the latch instead of incrementing the counter,
+/// so readers of a hot latch do not write to the same cache line. Writers
+/// clear the bias and wait until no slot stores the latch.
+static _Atomic(latch_t*) latch_slots[LATCH_SLOT_COUNT];
+
+_Thread_local static latch_hold_t latch_holds[LATCH_MAX_SLOTS];
+_Thread_local static uint32_t latch_hold_count = 0;
+_Thread_local static uint32_t latch_counted_reads = 0;
+
+static void
+latch_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+/// Blocks while the latch has the value, might return spuriously.
+static void
+latch_wait(latch_t* latch, const int32_t value) {
+#ifdef __linux__
+    syscall(SYS_futex, (int32_t*)latch, FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+#else
+    // no portable futex, parked waiters poll with a short sleep instead
+    if (atomic_load_explicit(latch, memory_order_relaxed) == value) {
+        nanosleep(&(struct timespec){ .tv_nsec = 50000 }, nullptr);
+    }
+#endif
+}
+
+/// Wakes all threads parked on the latch.
+static void
+latch_wake(latch_t* latch) {
+#ifdef __linux__
+    syscall(SYS_futex, (int32_t*)latch, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)latch;
+#endif
+}
+
+/// Waits for the next attempt to acquire the latch, which had the value at the
+/// last attempt. Spins first, then yields and finally parks the thread until
+/// the latch is released. Returns the next attempt.
+static uint32_t
+latch_backoff(latch_t* latch, int32_t value, const uint32_t attempt) {
+    if (attempt < LATCH_SPIN_ROUNDS) {
+        stats_add(STATS_LATCH_SPINS, 1);
+        for (uint32_t i = 0; i < (1u << attempt); ++i) {
+            latch_pause();
+        }
+        return attempt + 1;
+    }
+
+    if (attempt < LATCH_SPIN_ROUNDS + LATCH_YIELD_ROUNDS) {
+        stats_add(STATS_LATCH_YIELDS, 1);
+        sched_yield();
+        return attempt + 1;
+    }
+
+    // announce the waiter before parking, every release that sees the flag
+    // wakes all parked threads
+    if ((value & LATCH_WAITERS) == 0) {
+        if (!atomic_compare_exchange_strong_explicit(
+              latch, &value, value | LATCH_WAITERS, memory_order_relaxed, memory_order_relaxed
+            )) {
+            return attempt;
+        }
+        value |= LATCH_WAITERS;
+    }
+
+    stats_add(STATS_LATCH_PARKS, 1);
+    latch_wait(latch, value);
+
+    // a woken thread spins again, the latch is likely available by now
+    return 0;
+}
+
+/// Returns the slot of the current thread for the latch.
+static uint32_t
+latch_slot(const latch_t* latch) {
+    uint64_t hash = (uintptr_t)latch ^ (uintptr_t)&latch_hold_count * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+
+    return (uint32_t)(hash % LATCH_SLOT_COUNT);
+}
+
+/// Returns the index of the hold in the slot table if the current thread holds
+/// the latch in the distributed reader mode, or LATCH_MAX_SLOTS otherwise.
+static uint32_t
+latch_find_hold(const latch_t* latch) {
+    for (uint32_t i = 0; i < latch_hold_count; ++i) {
+        if (latch_holds[i].latch == latch) {
+            return i;
+        }
+    }
+
+    return LATCH_MAX_SLOTS;
+}
+
+static void
+latch_drop_hold(const uint32_t index) {
+    atomic_store_explicit(&latch_slots[latch_holds[index].slot], nullptr, memory_order_release);
+    latch_holds[index] = latch_holds[--latch_hold_count];
+}
+
+/// Acquires the latch in the distributed reader mode, fails if the latch is
+/// not biased or the slot of the thread is taken.
+static bool
+latch_try_acquire_slot(latch_t* latch, int32_t value) {
+    if ((value & (LATCH_BIASED | LATCH_WRITER | LATCH_INTENT)) != LATCH_BIASED || latch_hold_count == LATCH_MAX_SLOTS) {
+        return false;
+    }
+
+    const uint32_t slot = latch_slot(latch);
+    latch_t* expected = nullptr;
+    if (!atomic_compare_exchange_strong_explicit(
+          &latch_slots[slot], &expected, latch, memory_order_seq_cst, memory_order_relaxed
+        )) {
+        return false;
+    }
+
+    // the writer clears the bias before it scans the slots, either the writer
+    // sees the slot or the reader sees the cleared bias
+    value = atomic_load_explicit(latch, memory_order_seq_cst);
+    if ((value & (LATCH_BIASED | LATCH_WRITER | LATCH_INTENT)) != LATCH_BIASED) {
+        atomic_store_explicit(&latch_slots[slot], nullptr, memory_order_relaxed);
+        return false;
+    }
+
+    latch_holds[latch_hold_count++] = (latch_hold_t){ latch, slot };
+
+    return true;
+}
+
+/// Returns true if a slot other than the skipped one stores the latch.
+static bool
+latch_has_slots(const latch_t* latch, const uint32_t skip) {
+    for (uint32_t i = 0; i < LATCH_SLOT_COUNT; ++i) {
+        if (i != skip && atomic_load_explicit(&latch_slots[i], memory_order_seq_cst) == latch) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Waits until no slot stores the latch, the bias was cleared by the caller.
+static void
+latch_revoke(const latch_t* latch) {
+    for (uint32_t i = 0; i < LATCH_SLOT_COUNT; ++i) {
+        for (uint32_t attempt = 0; atomic_load_explicit(&latch_slots[i], memory_order_acquire) == latch; ++attempt) {
+            if (attempt < LATCH_SPIN_ROUNDS) {
+                latch_pause();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+}
+
+/// Enables the distributed reader mode again for a read-mostly latch after it
+/// was acquired through the counter with the value.
+static void
+latch_rebias(latch_t* latch, const int32_t value) {
+    if ((value & (LATCH_READ_MOSTLY | LATCH_BIASED | LATCH_INTENT)) != LATCH_READ_MOSTLY) {
+        return;
+    }
+
+    if (++latch_counted_reads % LATCH_REBIAS_INTERVAL == 0) {
+        atomic_fetch_or_explicit(latch, LATCH_BIASED, memory_order_relaxed);
+    }
+}
+
 void
 latch_init(latch_t* latch) {
     atomic_store_explicit(latch, 0, memory_order_seq_cst);
 }
 
+void
+latch_set_read_mostly(latch_t* latch) {
+    // checked first, the latch is hot and should not be written for nothing
+    if ((atomic_load_explicit(latch, memory_order_relaxed) & LATCH_READ_MOSTLY) == 0) {
+        atomic_fetch_or_explicit(latch, LATCH_READ_MOSTLY | LATCH_BIASED, memory_order_relaxed);
+    }
+}
+
 void
 latch_acquire_read(latch_t* latch) {
-    int32_t value = 0; // optimistic initialization, compare exchange will load anyway
+    uint32_t attempt = 0;
+
+    // only contended acquisitions are timed
+    bool waited = false;
+    uint64_t start = 0;
 
     while (1) {
-        if (value >= 0) {
+        int32_t value = atomic_load_explicit(latch, memory_order_relaxed);
+
+        if (latch_try_acquire_slot(latch, value)) {
+            break;
+        }
+
+        // readers wait for writers and for writers that wait themselves
+        if ((value & (LATCH_WRITER | LATCH_INTENT)) == 0) {
             const bool success = atomic_compare_exchange_weak_explicit(
               latch, &value, value + 1, memory_order_acquire, memory_order_relaxed
             );
 
             if (success) {
+                latch_rebias(latch, value);
                 break;
             }
-        } else {
-            value = atomic_load_explicit(latch, memory_order_relaxed);
+            continue;
+        }
+
+        if (!waited) {
+            waited = true;
+            start = stats_start(STATS_HISTOGRAM_LATCH_WAIT);
+            trace_event(TRACE_LATCH_WAIT_BEGIN, (uintptr_t)latch);
         }
+        attempt = latch_backoff(latch, value, attempt);
     }
+
+    stats_record(STATS_HISTOGRAM_LATCH_WAIT, start);
+    if (waited) {
+        trace_event(TRACE_LATCH_WAIT_END, (uintptr_t)latch);
+    }
+    stats_add(STATS_LATCH_SHARED, 1);
 }
 
 bool
 latch_try_acquire_read(latch_t* latch) {
-    int32_t value = 0; // optimistic initialization, compare exchange will load anyway
+    int32_t value = atomic_load_explicit(latch, memory_order_relaxed);
+
+    if (latch_try_acquire_slot(latch, value)) {
+        stats_add(STATS_LATCH_SHARED, 1);
+        return true;
+    }
 
     while (1) {
-        if (value < 0) {
+        if ((value & (LATCH_WRITER | LATCH_INTENT)) != 0) {
             return false;
         }
         const bool success = atomic_compare_exchange_weak_explicit(
@@ -41,46 +292,163 @@ latch_try_acquire_read(latch_t* latch) {
         );
 
         if (success) {
+            latch_rebias(latch, value);
+            stats_add(STATS_LATCH_SHARED, 1);
             return true;
         }
     }
 }
 
-void
-latch_acquire_write(latch_t* latch) {
-    int32_t value = 0; // optimistic initialization, compare exchange will load anyway
+static void
+latch_acquire_write_impl(latch_t* latch, const bool intent) {
+    uint32_t attempt = 0;
+
+    // only contended acquisitions are timed
+    bool waited = false;
+    uint64_t start = 0;
 
     while (1) {
-        if (value == 0) {
+        int32_t value = atomic_load_explicit(latch, memory_order_relaxed);
+
+        // keeps the waiters flag, the release has to wake the other waiters,
+        // clears the intent, other waiting writers set it again
+        if ((value & (LATCH_WRITER | LATCH_READERS)) == 0) {
+            const int32_t next = (value & ~(LATCH_INTENT | LATCH_BIASED)) | LATCH_WRITER;
             const bool success = atomic_compare_exchange_weak_explicit(
-              latch, &value, -1, memory_order_acquire, memory_order_relaxed
+              latch, &value, next, memory_order_seq_cst, memory_order_relaxed
             );
 
             if (success) {
+                if ((value & LATCH_READ_MOSTLY) != 0) {
+                    latch_revoke(latch);
+                }
                 break;
             }
-        } else {
-            value = atomic_load_explicit(latch, memory_order_relaxed);
+            continue;
+        }
+
+        // stop new readers, the current ones drain eventually
+        if (intent && (value & LATCH_INTENT) == 0) {
+            const bool success = atomic_compare_exchange_weak_explicit(
+              latch, &value, value | LATCH_INTENT, memory_order_relaxed, memory_order_relaxed
+            );
+
+            if (!success) {
+                continue;
+            }
+            value |= LATCH_INTENT;
+        }
+
+        if (!waited) {
+            waited = true;
+            start = stats_start(STATS_HISTOGRAM_LATCH_WAIT);
+            trace_event(TRACE_LATCH_WAIT_BEGIN, (uintptr_t)latch);
         }
+        attempt = latch_backoff(latch, value, attempt);
     }
+
+    stats_record(STATS_HISTOGRAM_LATCH_WAIT, start);
+    if (waited) {
+        trace_event(TRACE_LATCH_WAIT_END, (uintptr_t)latch);
+    }
+    stats_add(STATS_LATCH_EXCLUSIVE, 1);
+}
+
+void
+latch_acquire_write(latch_t* latch) {
+    latch_acquire_write_impl(latch, true);
+}
+
+void
+latch_acquire_write_reader_biased(latch_t* latch) {
+    latch_acquire_write_impl(latch, false);
 }
 
 bool
 latch_try_acquire_write(latch_t* latch) {
-    int32_t value = 0; // optimistic initialization, compare exchange will load anyway
+    int32_t value = atomic_load_explicit(latch, memory_order_relaxed);
 
     while (1) {
-        if (value != 0) {
+        if ((value & (LATCH_WRITER | LATCH_READERS)) != 0) {
             return false;
         }
+        const int32_t next = (value & ~LATCH_BIASED) | LATCH_WRITER;
         const bool success = atomic_compare_exchange_weak_explicit(
-          latch, &value, -1, memory_order_acquire, memory_order_relaxed
+          latch, &value, next, memory_order_seq_cst, memory_order_relaxed
         );
 
         if (success) {
+            break;
+        }
+    }
+
+    // the bias stays cleared, so that the readers in the slots drain
+    if ((value & LATCH_READ_MOSTLY) != 0 && latch_has_slots(latch, LATCH_SLOT_COUNT)) {
+        latch_release_write(latch);
+        return false;
+    }
+
+    stats_add(STATS_LATCH_EXCLUSIVE, 1);
+    return true;
+}
+
+bool
+latch_try_upgrade(latch_t* latch) {
+    const uint32_t hold = latch_find_hold(latch);
+    int32_t value = atomic_load_explicit(latch, memory_order_relaxed);
+
+    if (hold == LATCH_MAX_SLOTS) {
+        while (1) {
+            assert((value & LATCH_READERS) > 0);
+
+            if ((value & LATCH_READERS) != 1) {
+                return false;
+            }
+            const int32_t next = ((value - 1) & ~LATCH_BIASED) | LATCH_WRITER;
+            const bool success = atomic_compare_exchange_weak_explicit(
+              latch, &value, next, memory_order_seq_cst, memory_order_relaxed
+            );
+
+            if (success) {
+                break;
+            }
+        }
+
+        if ((value & LATCH_READ_MOSTLY) == 0 || !latch_has_slots(latch, LATCH_SLOT_COUNT)) {
+            stats_add(STATS_LATCH_EXCLUSIVE, 1);
             return true;
         }
+
+        // still a reader, the release restores the count
+        atomic_fetch_add_explicit(latch, 1, memory_order_relaxed);
+        latch_release_write(latch);
+        return false;
     }
+
+    while (1) {
+        if ((value & (LATCH_WRITER | LATCH_READERS)) != 0) {
+            return false;
+        }
+        const int32_t next = (value & ~LATCH_BIASED) | LATCH_WRITER;
+        const bool success = atomic_compare_exchange_weak_explicit(
+          latch, &value, next, memory_order_seq_cst, memory_order_relaxed
+        );
+
+        if (success) {
+            break;
+        }
+    }
+
+    // the slot of this thread still holds the latch shared on failure
+    if (latch_has_slots(latch, latch_holds[hold].slot)) {
+        latch_release_write(latch);
+        return false;
+    }
+
+    latch_drop_hold(hold);
+    stats_add(STATS_LATCH_EXCLUSIVE, 1);
+
+    return true;
 }
 
 void
@@ -94,17 +462,266 @@ latch_acquire(latch_t* latch, const bool exclusive) {
 
 void
 latch_release_read(latch_t* latch) {
-    assert(atomic_load(latch) > 0);
-    atomic_fetch_sub_explicit(latch, 1, memory_order_release);
+    const uint32_t hold = latch_find_hold(latch);
+    if (hold != LATCH_MAX_SLOTS) {
+        latch_drop_hold(hold);
+        return;
+    }
+
+    int32_t value = atomic_load_explicit(latch, memory_order_relaxed);
+    int32_t next;
+
+    do {
+        assert((value & LATCH_READERS) > 0);
+
+        // the last reader wakes the writers waiting for it and the readers
+        // waiting for their intent
+        next = value - 1;
+        if ((next & LATCH_READERS) == 0) {
+            next &= ~LATCH_WAITERS;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(latch, &value, next, memory_order_release, memory_order_relaxed));
+
+    if ((value & LATCH_WAITERS) != 0 && (next & LATCH_WAITERS) == 0) {
+        latch_wake(latch);
+    }
 }
 
 void
 latch_release_write(latch_t* latch) {
-    assert(atomic_load(latch) == -1);
-    atomic_store_explicit(latch, 0, memory_order_release);
+    // keeps the intent of writers that waited for this one
+    const int32_t value = atomic_fetch_and_explicit(latch, ~(LATCH_WRITER | LATCH_WAITERS), memory_order_release);
+    assert((value & LATCH_WRITER) != 0);
+
+    if ((value & LATCH_WAITERS) != 0) {
+        latch_wake(latch);
+    }
+}
+
+void
+latch_stats_snapshot(latch_stats_t* out) {
+    uint64_t counters[5];
+    stats_sum(STATS_LATCH_SHARED, 5, counters);
+
+    *out = (latch_stats_t){
+        .shared = counters[0],
+        .exclusive = counters[1],
+        .spins = counters[2],
+        .yields = counters[3],
+        .parks = counters[4],
+    };
 }
 
 bool
 latch_available(const latch_t* latch) {
-    return atomic_load_explicit(latch, memory_order_acquire) == 0;
+    const int32_t value = atomic_load_explicit(latch, memory_order_seq_cst);
+    if ((value & (LATCH_WRITER | LATCH_READERS)) != 0) {
+        return false;
+    }
+
+    // slots might still store the latch after its bias was cleared
+    return (value & LATCH_READ_MOSTLY) == 0 || !latch_has_slots(latch, LATCH_SLOT_COUNT);
+}
+typedef struct {
+    latch_t latch;
+    uint64_t counter;
+} test_shared_t;
+
+TEST_ONLY static void*
+test_write_thread(void* arg) {
+    test_shared_t* shared = arg;
+
+    latch_acquire_write(&shared->latch);
+    shared->counter += 1;
+    latch_release_write(&shared->latch);
+
+    return nullptr;
+}
+
+TEST_ONLY static void*
+test_increment_thread(void* arg) {
+    test_shared_t* shared = arg;
+
+    for (uint32_t i = 0; i < 2000; ++i) {
+        latch_acquire_write(&shared->latch);
+        shared->counter += 1;
+        latch_release_write(&shared->latch);
+
+        latch_acquire_read(&shared->latch);
+        assertis(shared->counter > 0);
+        latch_release_read(&shared->latch);
+    }
+
+    return nullptr;
+}
+
+describe(latch) {
+    static test_shared_t shared;
+
+    before_each() {
+        latch_init(&shared.latch);
+        shared.counter = 0;
+    }
+
+    it("share between readers") {
+        latch_acquire_read(&shared.latch);
+        assertis(latch_try_acquire_read(&shared.latch));
+        assertis(!latch_try_acquire_write(&shared.latch));
+
+        latch_release_read(&shared.latch);
+        latch_release_read(&shared.latch);
+        assertis(latch_available(&shared.latch));
+    }
+
+    it("count acquisitions") {
+        latch_stats_t before;
+        latch_stats_snapshot(&before);
+
+        latch_acquire_read(&shared.latch);
+        assertis(!latch_try_acquire_write(&shared.latch));
+        latch_release_read(&shared.latch);
+        latch_acquire_write(&shared.latch);
+        latch_release_write(&shared.latch);
+
+        latch_stats_t after;
+        latch_stats_snapshot(&after);
+        asserteq_uint(after.shared - before.shared, 1);
+        asserteq_uint(after.exclusive - before.exclusive, 1);
+    }
+
+    it("exclude readers from writers") {
+        latch_acquire_write(&shared.latch);
+        assertis(!latch_try_acquire_read(&shared.latch));
+        assertis(!latch_try_acquire_write(&shared.latch));
+
+        latch_release_write(&shared.latch);
+        assertis(latch_try_acquire_write(&shared.latch));
+        latch_release_write(&shared.latch);
+    }
+
+    it("upgrade the only reader") {
+        latch_acquire_read(&shared.latch);
+        assertis(latch_try_acquire_read(&shared.latch));
+        assertis(!latch_try_upgrade(&shared.latch));
+
+        latch_release_read(&shared.latch);
+        assertis(latch_try_upgrade(&shared.latch));
+        assertis(!latch_try_acquire_read(&shared.latch));
+
+        latch_release_write(&shared.latch);
+        assertis(latch_available(&shared.latch));
+    }
+
+    it("stop new readers while a writer waits") {
+        latch_acquire_read(&shared.latch);
+
+        pthread_t thread;
+        asserteq_int(pthread_create(&thread, nullptr, test_write_thread, &shared), 0);
+
+        while ((atomic_load(&shared.latch) & LATCH_INTENT) == 0) {
+            sched_yield();
+        }
+        assertis(!latch_try_acquire_read(&shared.latch));
+
+        latch_release_read(&shared.latch);
+        asserteq_int(pthread_join(thread, nullptr), 0);
+
+        asserteq_uint(shared.counter, 1);
+        assertis(latch_try_acquire_read(&shared.latch));
+        latch_release_read(&shared.latch);
+    }
+
+    it("share read-mostly latches through slots") {
+        latch_set_read_mostly(&shared.latch);
+
+        latch_acquire_read(&shared.latch);
+        asserteq_int(atomic_load(&shared.latch) & LATCH_READERS, 0);
+        assertis(!latch_available(&shared.latch));
+
+        // the failed writer clears the bias, later readers use the counter
+        assertis(!latch_try_acquire_write(&shared.latch));
+        assertis(latch_try_acquire_read(&shared.latch));
+        asserteq_int(atomic_load(&shared.latch) & LATCH_READERS, 1);
+
+        latch_release_read(&shared.latch);
+        latch_release_read(&shared.latch);
+        assertis(latch_available(&shared.latch));
+
+        assertis(latch_try_acquire_write(&shared.latch));
+        latch_release_write(&shared.latch);
+    }
+
+    it("upgrade read-mostly latches") {
+        latch_set_read_mostly(&shared.latch);
+
+        latch_acquire_read(&shared.latch);
+        assertis(latch_try_upgrade(&shared.latch));
+        assertis(!latch_try_acquire_read(&shared.latch));
+
+        latch_release_write(&shared.latch);
+        assertis(latch_available(&shared.latch));
+    }
+
+    it("park and wake waiters") {
+        latch_acquire_read(&shared.latch);
+
+        pthread_t thread;
+        asserteq_int(pthread_create(&thread, nullptr, test_write_thread, &shared), 0);
+
+        // the writer gives up spinning and parks
+        while ((atomic_load(&shared.latch) & LATCH_WAITERS) == 0) {
+            sched_yield();
+        }
+        asserteq_uint(shared.counter, 0);
+
+        latch_release_read(&shared.latch);
+        asserteq_int(pthread_join(thread, nullptr), 0);
+
+        asserteq_uint(shared.counter, 1);
+        asserteq_int(atomic_load(&shared.latch), 0);
+    }
+
+    it("exclude concurrent writers") {
+        pthread_t threads[8];
+        for (uint32_t i = 0; i < 8; ++i) {
+            asserteq_int(pthread_create(&threads[i], nullptr, test_increment_thread, &shared), 0);
+        }
+        for (uint32_t i = 0; i < 8; ++i) {
+            asserteq_int(pthread_join(threads[i], nullptr), 0);
+        }
+
+        asserteq_uint(shared.counter, 8 * 2000);
+        assertis(latch_available(&shared.latch));
+    }
+
+    it("exclude concurrent writers from read-mostly latches") {
+        latch_set_read_mostly(&shared.latch);
+
+        pthread_t threads[8];
+        for (uint32_t i = 0; i < 8; ++i) {
+            asserteq_int(pthread_create(&threads[i], nullptr, test_increment_thread, &shared), 0);
+        }
+        for (uint32_t i = 0; i < 8; ++i) {
+            asserteq_int(pthread_join(threads[i], nullptr), 0);
+        }
+
+        asserteq_uint(shared.counter, 8 * 2000);
+        assertis(latch_available(&shared.latch));
+    }
+
+    bench("acquire shared", 8) {
+        bench_loop() {
+            latch_acquire_read(&shared.latch);
+            latch_release_read(&shared.latch);
+        }
+    }
+
+    bench("acquire shared read-mostly", 8) {
+        latch_set_read_mostly(&shared.latch);
+
+        bench_loop() {
+            latch_acquire_read(&shared.latch);
+            latch_release_read(&shared.latch);
+        }
+    }
 }
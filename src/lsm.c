@@ -0,0 +1,1085 @@
+#include "lsm.h"
+
+#include "btree.h"
+#include "catalog.h"
+#include "deffer.h"
+#include "latch.h"
+#include "util.h"
+#include "winter.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/// Maximum number of levels of the skiplist of a memtable.
+#define MEMTABLE_MAX_HEIGHT 12
+
+/// Number of runs at which the background thread merges all runs into one.
+#define LSM_MERGE_THRESHOLD 4
+
+/// Maximum number of frozen memtables, writers wait for the background thread
+/// once it falls this far behind.
+#define LSM_MAX_FROZEN 4
+
+/// Bits per row of the Bloom filters of the runs, most lookups of missing rows
+/// skip a run without fixing a page.
+#define LSM_FILTER_BITS 10
+
+/// Tags of the values in runs, the value of a put follows its tag.
+enum {
+    LSM_VALUE_PUT = 1,
+    LSM_VALUE_DELETE = 2,
+};
+
+/// Value of a row in a memtable, newer values replace the pointer in the node.
+typedef struct {
+    uint32_t size;
+    bool deleted;
+    unsigned char data[];
+} memtable_value_t;
+
+typedef struct memtable_node {
+    uint64_t id;
+    _Atomic(memtable_value_t*) value;
+    uint32_t height;
+    _Atomic(struct memtable_node*) next[];
+} memtable_node_t;
+
+/// Insert-only skiplist. Nodes and values are bump allocated from the arena and
+/// freed together with the memtable. New nodes are linked with a CAS on every
+/// level, so writers and readers of a memtable never wait for each other.
+typedef struct memtable {
+    /// Next older frozen memtable.
+    struct memtable* next;
+
+    _Atomic(memtable_node_t*) head[MEMTABLE_MAX_HEIGHT];
+
+    /// Number of nodes, i.e. distinct ids.
+    _Atomic uint64_t count;
+
+    /// Bytes taken from the arena, exceeds the capacity after the first failed
+    /// allocation.
+    _Atomic size_t used;
+    size_t capacity;
+
+    alignas(8) unsigned char arena[];
+} memtable_t;
+
+struct lsm_t {
+    pager_t* pager;
+    char name[CATALOG_NAME_SIZE];
+    size_t memtable_size;
+
+    /// Protects the memtable and run lists. Readers and writers hold it shared,
+    /// freezing a memtable and swapping runs hold it exclusively.
+    latch_t latch;
+    memtable_t* active;
+
+    /// Frozen memtables, newest first.
+    memtable_t* frozen;
+
+    /// Runs, oldest first. Only the background thread adds or removes runs.
+    btree_t** runs;
+    uint32_t run_count;
+    uint32_t run_capacity;
+
+    /// Sequence number of the next run, only used by the background thread.
+    uint64_t sequence;
+
+    /// Set once a run might be registered in the catalog without being in the
+    /// run list, after a failed merge or flush. Such a run is loaded again by
+    /// the next open, merges keep the deletes that hide its rows until then.
+    /// Only used by the background thread.
+    bool unlisted;
+
+    pthread_t thread;
+
+    /// Protects the fields below, signalled whenever a memtable is frozen or
+    /// written to a run.
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    /// Number of frozen memtables that were not written to runs yet.
+    uint32_t pending;
+    bool closed;
+
+    /// Error code of the first failed flush or merge.
+    int32_t error;
+};
+
+_Thread_local static unsigned char lookup_buffer[UINT16_MAX];
+
+_Thread_local static uint64_t random_state;
+
+static result_t
+memtable_create(memtable_t** out, const size_t capacity) {
+    memtable_t* table;
+    try_alloc(table, sizeof(memtable_t) + capacity);
+    table->capacity = capacity;
+
+    *out = table;
+
+    return SUCCESS;
+}
+
+/// Takes memory from the arena, returns null if the arena is full.
+static void*
+memtable_alloc(memtable_t* table, const size_t size) {
+    const size_t aligned = (size + 7) & ~(size_t)7;
+    const size_t offset = atomic_fetch_add(&table->used, aligned);
+
+    if (offset + aligned > table->capacity) {
+        return nullptr;
+    }
+
+    return table->arena + offset;
+}
+
+/// Every level above the first is taken with a probability of one quarter.
+static uint32_t
+memtable_random_height(void) {
+    if (random_state == 0) {
+        random_state = (uint64_t)(uintptr_t)&random_state | 1;
+    }
+
+    // xorshift64
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+
+    uint32_t height = 1;
+    for (uint64_t bits = random_state; height < MEMTABLE_MAX_HEIGHT && (bits & 3) == 0; bits >>= 2) {
+        height += 1;
+    }
+
+    return height;
+}
+
+/// Returns the first node with an id not less than the id. If the predecessors
+/// are not null, stores the link pointing to that node on every level.
+static memtable_node_t*
+memtable_seek(memtable_t* table, const uint64_t id, _Atomic(memtable_node_t*)** predecessors) {
+    _Atomic(memtable_node_t*)* links = table->head;
+    memtable_node_t* node = nullptr;
+
+    for (uint32_t level = MEMTABLE_MAX_HEIGHT; level-- > 0;) {
+        node = atomic_load(&links[level]);
+        while (node != nullptr && node->id < id) {
+            links = node->next;
+            node = atomic_load(&links[level]);
+        }
+
+        if (predecessors != nullptr) {
+            predecessors[level] = &links[level];
+        }
+    }
+
+    return node;
+}
+
+/// Adds a value to the memtable, returns false if the arena is full.
+static bool
+memtable_put(memtable_t* table, const uint64_t id, const blob_t value, const bool deleted) {
+    memtable_value_t* entry = memtable_alloc(table, sizeof(memtable_value_t) + value.size);
+    if (entry == nullptr) {
+        return false;
+    }
+
+    entry->size = (uint32_t)value.size;
+    entry->deleted = deleted;
+    if (value.size > 0) {
+        memcpy(entry->data, value.data, value.size);
+    }
+
+    _Atomic(memtable_node_t*)* predecessors[MEMTABLE_MAX_HEIGHT];
+    memtable_node_t* node = nullptr;
+    while (true) {
+        memtable_node_t* successor = memtable_seek(table, id, predecessors);
+        if (successor != nullptr && successor->id == id) {
+            atomic_store(&successor->value, entry);
+            return true;
+        }
+
+        if (node == nullptr) {
+            const uint32_t height = memtable_random_height();
+            node = memtable_alloc(table, sizeof(memtable_node_t) + sizeof(_Atomic(memtable_node_t*)) * height);
+            if (node == nullptr) {
+                return false;
+            }
+
+            node->id = id;
+            node->height = height;
+            atomic_store(&node->value, entry);
+        }
+
+        atomic_store(&node->next[0], successor);
+        if (atomic_compare_exchange_strong(predecessors[0], &successor, node)) {
+            break;
+        }
+    }
+
+    // the node is visible once it is linked on the first level, the upper
+    // levels only shorten searches
+    for (uint32_t level = 1; level < node->height; ++level) {
+        while (true) {
+            memtable_node_t* successor = atomic_load(predecessors[level]);
+            atomic_store(&node->next[level], successor);
+
+            if (atomic_compare_exchange_strong(predecessors[level], &successor, node)) {
+                break;
+            }
+            memtable_seek(table, id, predecessors);
+        }
+    }
+
+    atomic_fetch_add(&table->count, 1);
+
+    return true;
+}
+
+/// Returns the newest value of the row or null if the memtable has none.
+static const memtable_value_t*
+memtable_find(memtable_t* table, const uint64_t id) {
+    const memtable_node_t* node = memtable_seek(table, id, nullptr);
+    if (node == nullptr || node->id != id) {
+        return nullptr;
+    }
+
+    return atomic_load(&node->value);
+}
+
+/// Encodes a value of a run into the buffer.
+static blob_t
+lsm_encode(unsigned char* buffer, const bool deleted, const blob_t value) {
+    buffer[0] = deleted ? LSM_VALUE_DELETE : LSM_VALUE_PUT;
+    if (value.size > 0) {
+        memcpy(buffer + 1, value.data, value.size);
+    }
+
+    return (blob_t){ value.size + 1, buffer };
+}
+
+/// Rows of a frozen memtable in id order, see btree_build_next_t.
+typedef struct {
+    const memtable_node_t* node;
+    unsigned char* buffer;
+} memtable_iterator_t;
+
+static result_t
+memtable_next(void* context, uint64_t* id, blob_t* value, bool* found) {
+    memtable_iterator_t* iterator = context;
+
+    *found = iterator->node != nullptr;
+    if (!*found) {
+        return SUCCESS;
+    }
+
+    const memtable_value_t* entry = atomic_load(&iterator->node->value);
+    *id = iterator->node->id;
+    *value = lsm_encode(iterator->buffer, entry->deleted, (blob_t){ entry->size, (unsigned char*)entry->data });
+
+    iterator->node = atomic_load(&iterator->node->next[0]);
+
+    return SUCCESS;
+}
+
+/// Current row of a run during a merge.
+typedef struct {
+    btree_snapshot_t* snapshot;
+    uint64_t id;
+    blob_t value;
+    bool found;
+} merge_source_t;
+
+/// Rows of all runs in id order, see btree_build_next_t. The sources are
+/// ordered from oldest to newest.
+typedef struct {
+    merge_source_t* sources;
+    uint32_t count;
+    unsigned char* buffer;
+
+    /// Whether deletes are written to the merged run as well.
+    bool keep_deletes;
+} merge_t;
+
+static result_t
+merge_next(void* context, uint64_t* id, blob_t* value, bool* found) {
+    merge_t* merge = context;
+
+    while (true) {
+        // the newest source wins if several sources contain the row
+        const merge_source_t* newest = nullptr;
+        for (uint32_t i = 0; i < merge->count; ++i) {
+            const merge_source_t* source = &merge->sources[i];
+            if (source->found && (newest == nullptr || source->id <= newest->id)) {
+                newest = source;
+            }
+        }
+
+        *found = newest != nullptr;
+        if (!*found) {
+            return SUCCESS;
+        }
+
+        // the value is only valid until its source is advanced
+        *id = newest->id;
+        memcpy(merge->buffer, newest->value.data, newest->value.size);
+        *value = (blob_t){ newest->value.size, merge->buffer };
+
+        for (uint32_t i = 0; i < merge->count; ++i) {
+            merge_source_t* source = &merge->sources[i];
+            if (source->found && source->id == *id) {
+                try(btree_snapshot_table_next(source->snapshot, &source->id, &source->value, &source->found));
+            }
+        }
+
+        // all listed runs are merged, so there are no older values left to
+        // delete, unless an unlisted run still has one
+        if (value->data[0] != LSM_VALUE_DELETE || merge->keep_deletes) {
+            return SUCCESS;
+        }
+    }
+}
+
+static void
+merge_close(merge_t* merge) {
+    for (uint32_t i = 0; i < merge->count; ++i) {
+        const int32_t result = btree_snapshot_close(&merge->sources[i].snapshot);
+        (void)result;
+    }
+    merge->count = 0;
+}
+
+defer_impl(merge_close) {
+    merge_close(defer_arg(merge_t));
+}
+
+/// Builds a run named after the table and the next sequence number.
+static result_t
+lsm_build_run(lsm_t* lsm, btree_build_next_t next, void* context, btree_t** out) {
+    char name[CATALOG_NAME_SIZE];
+    const int length = snprintf(name, sizeof(name), "%s.%" PRIu64, lsm->name, lsm->sequence);
+    ensure(length > 0 && length < CATALOG_NAME_SIZE, with_uint(lsm->sequence));
+
+    // a failed build might have registered the run already, the caller does
+    // not list it then and the next run gets another name
+    lsm->sequence += 1;
+    handle(btree_table_build(out, lsm->pager, name, next, context)) {
+        lsm->unlisted = true;
+        forward();
+    }
+
+    handle(btree_filter_build(*out, LSM_FILTER_BITS)) {
+        lsm->unlisted = true;
+        forward();
+    }
+
+    return SUCCESS;
+}
+
+static result_t
+lsm_add_run(lsm_t* lsm, btree_t* run) {
+    assert_latch_write_access(lsm->latch);
+
+    if (lsm->run_count == lsm->run_capacity) {
+        const uint32_t capacity = max(4u, lsm->run_capacity * 2);
+
+        btree_t** runs = realloc(lsm->runs, sizeof(btree_t*) * capacity);
+        if (runs == nullptr) {
+            failure(ENOMEM, msg("no memory for runs"), with_uint(capacity));
+        }
+
+        lsm->runs = runs;
+        lsm->run_capacity = capacity;
+    }
+
+    lsm->runs[lsm->run_count++] = run;
+
+    return SUCCESS;
+}
+
+/// Writes the oldest frozen memtable to a new run and frees it.
+static result_t
+lsm_flush_memtable(lsm_t* lsm) {
+    memtable_t* table;
+    {
+        latch_acquire_read(&lsm->latch);
+        defer(latch_release_read, lsm->latch);
+
+        table = lsm->frozen;
+        while (table->next != nullptr) {
+            table = table->next;
+        }
+    }
+
+    unsigned char* buffer;
+    try_alloc(buffer, pager_get_page_size(lsm->pager));
+    defer(free, buffer);
+
+    // frozen memtables are immutable, so they are read without the latch
+    memtable_iterator_t iterator = { atomic_load(&table->head[0]), buffer };
+    btree_t* run;
+    try(lsm_build_run(lsm, memtable_next, &iterator, &run));
+
+    latch_acquire_write(&lsm->latch);
+    defer(latch_release_write, lsm->latch);
+
+    try(lsm_add_run(lsm, run));
+
+    memtable_t** link = &lsm->frozen;
+    while (*link != table) {
+        link = &(*link)->next;
+    }
+    *link = nullptr;
+
+    free(table);
+
+    return SUCCESS;
+}
+
+/// Merges all runs into a single run and drops the old runs.
+static result_t
+lsm_merge(lsm_t* lsm) {
+    // only this thread changes the runs, so they are read without the latch
+    const uint32_t count = lsm->run_count;
+
+    merge_t merge = { .keep_deletes = lsm->unlisted };
+    try_alloc(merge.sources, sizeof(merge_source_t) * count);
+    defer(free, merge.sources);
+    defer(merge_close, merge);
+
+    try_alloc(merge.buffer, pager_get_page_size(lsm->pager));
+    defer(free, merge.buffer);
+
+    btree_t** old;
+    try_alloc(old, sizeof(btree_t*) * count);
+    defer(free, old);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        merge_source_t* source = &merge.sources[i];
+        old[i] = lsm->runs[i];
+
+        try(btree_snapshot_open(&source->snapshot, old[i]));
+        merge.count += 1;
+
+        try(btree_snapshot_table_next(source->snapshot, &source->id, &source->value, &source->found));
+    }
+
+    btree_t* run;
+    try(lsm_build_run(lsm, merge_next, &merge, &run));
+    merge_close(&merge);
+
+    {
+        latch_acquire_write(&lsm->latch);
+        defer(latch_release_write, lsm->latch);
+
+        lsm->runs[0] = run;
+        lsm->run_count = 1;
+    }
+
+    // readers that still used the old runs left before the latch was acquired.
+    // They are dropped oldest first, a crash leaves the newest ones. The run of
+    // a delete the merged run lost is either among them or was dropped after
+    // the older values the delete hid
+    for (uint32_t i = 0; i < count; ++i) {
+        handle(btree_drop(&old[i])) {
+            lsm->unlisted = true;
+            forward();
+        }
+    }
+
+    return SUCCESS;
+}
+
+static void*
+lsm_worker_run(void* arg) {
+    lsm_t* lsm = arg;
+
+    while (true) {
+        {
+            pthread_mutex_lock(&lsm->mutex);
+            defer(pthread_mutex_unlock, lsm->mutex);
+
+            while (lsm->pending == 0 && !lsm->closed) {
+                pthread_cond_wait(&lsm->changed, &lsm->mutex);
+            }
+
+            if (lsm->pending == 0) {
+                return nullptr;
+            }
+        }
+
+        // after a failure the memtables stay frozen and readable, lsm_flush
+        // reports the error
+        int32_t error = lsm->error;
+        if (error == 0 && lsm_flush_memtable(lsm) != SUCCESS) {
+            error = error_get_code();
+        }
+        if (error == 0 && lsm->run_count >= LSM_MERGE_THRESHOLD && lsm_merge(lsm) != SUCCESS) {
+            error = error_get_code();
+        }
+        error_clear();
+
+        pthread_mutex_lock(&lsm->mutex);
+        lsm->error = error;
+        lsm->pending -= 1;
+        pthread_cond_broadcast(&lsm->changed);
+        pthread_mutex_unlock(&lsm->mutex);
+    }
+}
+
+/// Replaces the memtable by an empty one and hands it to the background
+/// thread, unless another writer froze it already.
+static result_t
+lsm_freeze(lsm_t* lsm, memtable_t* table) {
+    {
+        pthread_mutex_lock(&lsm->mutex);
+        defer(pthread_mutex_unlock, lsm->mutex);
+
+        while (lsm->pending >= LSM_MAX_FROZEN) {
+            pthread_cond_wait(&lsm->changed, &lsm->mutex);
+        }
+    }
+
+    memtable_t* active;
+    try(memtable_create(&active, lsm->memtable_size));
+
+    {
+        latch_acquire_write(&lsm->latch);
+        defer(latch_release_write, lsm->latch);
+
+        if (lsm->active != table) {
+            free(active);
+            return SUCCESS;
+        }
+
+        table->next = lsm->frozen;
+        lsm->frozen = table;
+        lsm->active = active;
+    }
+
+    pthread_mutex_lock(&lsm->mutex);
+    lsm->pending += 1;
+    pthread_cond_broadcast(&lsm->changed);
+    pthread_mutex_unlock(&lsm->mutex);
+
+    return SUCCESS;
+}
+
+static result_t
+lsm_write(lsm_t* lsm, const uint64_t id, const blob_t value, const bool deleted) {
+    while (true) {
+        memtable_t* table;
+        {
+            latch_acquire_read(&lsm->latch);
+            defer(latch_release_read, lsm->latch);
+
+            table = lsm->active;
+            if (memtable_put(table, id, value, deleted)) {
+                return SUCCESS;
+            }
+        }
+
+        try(lsm_freeze(lsm, table));
+    }
+}
+
+/// Reference to a run in the catalog, see lsm_load_runs.
+typedef struct {
+    uint64_t sequence;
+    uint32_t id;
+} lsm_run_ref_t;
+
+static int
+lsm_run_ref_compare(const void* a, const void* b) {
+    const uint64_t a_sequence = ((const lsm_run_ref_t*)a)->sequence;
+    const uint64_t b_sequence = ((const lsm_run_ref_t*)b)->sequence;
+
+    return (a_sequence > b_sequence) - (a_sequence < b_sequence);
+}
+
+/// Opens the runs of the table in the order of their sequence numbers.
+static result_t
+lsm_load_runs(lsm_t* lsm) {
+    const size_t name_len = strlen(lsm->name);
+
+    lsm_run_ref_t* refs = nullptr;
+    defer(free, refs);
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+
+    catalog_ref_t ref = { 0 };
+    while (true) {
+        catalog_entry_t entry;
+        bool found;
+        try(catalog_next(lsm->pager, &ref, &entry, &found));
+
+        if (!found) {
+            break;
+        }
+
+        if (strncmp(entry.name, lsm->name, name_len) != 0 || entry.name[name_len] != '.') {
+            continue;
+        }
+
+        const char* digits = entry.name + name_len + 1;
+        char* end;
+        const uint64_t sequence = strtoull(digits, &end, 10);
+        if (end == digits || *end != '\0') {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = max(4u, capacity * 2);
+
+            lsm_run_ref_t* grown = realloc(refs, sizeof(lsm_run_ref_t) * capacity);
+            if (grown == nullptr) {
+                failure(ENOMEM, msg("no memory for runs"), with_uint(capacity));
+            }
+            refs = grown;
+        }
+
+        refs[count++] = (lsm_run_ref_t){ sequence, entry.id };
+        lsm->sequence = max(lsm->sequence, sequence + 1);
+    }
+
+    if (count > 0) {
+        qsort(refs, count, sizeof(lsm_run_ref_t), lsm_run_ref_compare);
+    }
+
+    latch_acquire_write(&lsm->latch);
+    defer(latch_release_write, lsm->latch);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        btree_t* run;
+        try(btree_open(&run, lsm->pager, refs[i].id));
+        try(lsm_add_run(lsm, run));
+        try(btree_filter_build(run, LSM_FILTER_BITS));
+    }
+
+    return SUCCESS;
+}
+
+/// Frees the table without flushing it, the background thread has to be
+/// stopped or never started.
+static void
+lsm_free(lsm_t* lsm) {
+    for (uint32_t i = 0; i < lsm->run_count; ++i) {
+        const int32_t result = btree_close(&lsm->runs[i]);
+        (void)result;
+    }
+    free(lsm->runs);
+
+    free(lsm->active);
+    while (lsm->frozen != nullptr) {
+        memtable_t* next = lsm->frozen->next;
+        free(lsm->frozen);
+        lsm->frozen = next;
+    }
+
+    pthread_cond_destroy(&lsm->changed);
+    pthread_mutex_destroy(&lsm->mutex);
+    free(lsm);
+}
+
+defer_impl(lsm_free) {
+    defer_guard();
+    lsm_free(*defer_arg(lsm_t*));
+}
+
+/// Waits until the background thread wrote all frozen memtables and stops it.
+static void
+lsm_stop(lsm_t* lsm) {
+    pthread_mutex_lock(&lsm->mutex);
+    lsm->closed = true;
+    pthread_cond_broadcast(&lsm->changed);
+    pthread_mutex_unlock(&lsm->mutex);
+
+    pthread_join(lsm->thread, nullptr);
+}
+
+result_t
+lsm_open(lsm_t** out, pager_t* pager, const char* name, const size_t memtable_size) {
+    ensure(out != nullptr);
+    ensure(pager != nullptr);
+    ensure(name != nullptr);
+
+    // leaves room for the sequence numbers in the names of the runs
+    const size_t name_len = strlen(name);
+    ensure(name_len > 0 && name_len < CATALOG_NAME_SIZE - 12, with_uint(name_len));
+
+    // the largest value always fits into an empty memtable
+    ensure(memtable_size >= pager_get_page_size(pager), with_uint(memtable_size));
+
+    lsm_t* lsm;
+    try_alloc(lsm, sizeof(lsm_t));
+    pthread_mutex_init(&lsm->mutex, nullptr);
+    pthread_cond_init(&lsm->changed, nullptr);
+    errdefer(lsm_free, lsm);
+
+    lsm->pager = pager;
+    lsm->memtable_size = memtable_size;
+    lsm->sequence = 1;
+    memcpy(lsm->name, name, name_len + 1);
+    latch_init(&lsm->latch);
+
+    try(lsm_load_runs(lsm));
+    try(memtable_create(&lsm->active, memtable_size));
+
+    const int error = pthread_create(&lsm->thread, nullptr, lsm_worker_run, lsm);
+    if (error != 0) {
+        failure(error, msg("failed to start lsm thread"));
+    }
+
+    *out = lsm;
+
+    return SUCCESS;
+}
+
+result_t
+lsm_put(lsm_t* lsm, const uint64_t id, const blob_t value) {
+    ensure(lsm != nullptr);
+    ensure(value.size <= pager_get_page_size(lsm->pager) / 4, with_uint(value.size));
+
+    return lsm_write(lsm, id, value, false);
+}
+
+result_t
+lsm_delete(lsm_t* lsm, const uint64_t id) {
+    ensure(lsm != nullptr);
+
+    return lsm_write(lsm, id, (blob_t){ 0 }, true);
+}
+
+result_t
+lsm_find(lsm_t* lsm, const uint64_t id, blob_t* out, bool* found) {
+    ensure(lsm != nullptr);
+    ensure(out != nullptr);
+    ensure(found != nullptr);
+
+    latch_acquire_read(&lsm->latch);
+    defer(latch_release_read, lsm->latch);
+
+    // the active memtable is newer than the frozen ones, which are newer than
+    // the runs
+    const memtable_value_t* entry = memtable_find(lsm->active, id);
+    for (memtable_t* table = lsm->frozen; entry == nullptr && table != nullptr; table = table->next) {
+        entry = memtable_find(table, id);
+    }
+
+    if (entry != nullptr) {
+        *found = !entry->deleted;
+        if (*found) {
+            memcpy(lookup_buffer, entry->data, entry->size);
+            *out = (blob_t){ entry->size, lookup_buffer };
+        }
+
+        return SUCCESS;
+    }
+
+    *found = false;
+    for (uint32_t i = lsm->run_count; i-- > 0;) {
+        blob_t value;
+        try(btree_table_find(lsm->runs[i], id, &value, found));
+
+        if (*found) {
+            *found = value.data[0] == LSM_VALUE_PUT;
+            if (*found) {
+                memcpy(lookup_buffer, value.data + 1, value.size - 1);
+                *out = (blob_t){ value.size - 1, lookup_buffer };
+            }
+
+            return SUCCESS;
+        }
+    }
+
+    return SUCCESS;
+}
+
+result_t
+lsm_lookup(lsm_t* lsm, const uint64_t id, blob_t* out) {
+    bool found;
+    try(lsm_find(lsm, id, out, &found));
+
+    if (!found) {
+        failure(ENOENT, msg("row not found"), with_uint(id));
+    }
+
+    return SUCCESS;
+}
+
+result_t
+lsm_flush(lsm_t* lsm) {
+    ensure(lsm != nullptr);
+
+    memtable_t* table;
+    bool empty;
+    {
+        latch_acquire_read(&lsm->latch);
+        defer(latch_release_read, lsm->latch);
+
+        table = lsm->active;
+        empty = atomic_load(&table->count) == 0;
+    }
+
+    if (!empty) {
+        try(lsm_freeze(lsm, table));
+    }
+
+    pthread_mutex_lock(&lsm->mutex);
+    defer(pthread_mutex_unlock, lsm->mutex);
+
+    while (lsm->pending > 0) {
+        pthread_cond_wait(&lsm->changed, &lsm->mutex);
+    }
+
+    if (lsm->error != 0) {
+        failure(lsm->error, msg("failed to flush memtable"));
+    }
+
+    return SUCCESS;
+}
+
+uint32_t
+lsm_get_run_count(lsm_t* lsm) {
+    latch_acquire_read(&lsm->latch);
+    defer(latch_release_read, lsm->latch);
+
+    return lsm->run_count;
+}
+
+result_t
+lsm_close(lsm_t** out) {
+    ensure(out != nullptr);
+
+    lsm_t* lsm = *out;
+    *out = nullptr;
+
+    // the table is freed even if the last flush failed
+    defer(lsm_free, lsm);
+
+    handle(lsm_flush(lsm)) {
+        lsm_stop(lsm);
+        forward();
+    }
+    lsm_stop(lsm);
+
+    while (lsm->run_count > 0) {
+        lsm->run_count -= 1;
+        try(btree_close(&lsm->runs[lsm->run_count]));
+    }
+
+    return SUCCESS;
+}
+
+TEST_ONLY static void
+test_put_rows(lsm_t* lsm, const uint64_t first, const uint64_t count, const uint64_t step, const char* prefix) {
+    for (uint64_t i = first; i < first + count; ++i) {
+        char value[32];
+        snprintf(value, sizeof(value), "%s-%" PRIu64, prefix, i);
+        assert_success(lsm_put(lsm, i * step, blob_from_string(value)));
+    }
+}
+
+TEST_ONLY static void
+test_assert_row(lsm_t* lsm, const uint64_t id, const char* prefix, const uint64_t index) {
+    char expected[32];
+    snprintf(expected, sizeof(expected), "%s-%" PRIu64, prefix, index);
+
+    blob_t value;
+    assert_success(lsm_lookup(lsm, id, &value));
+    asserteq_int(blob_cmp(value, blob_from_string(expected)), 0);
+}
+
+typedef struct {
+    lsm_t* lsm;
+    uint64_t thread;
+} test_thread_t;
+
+TEST_ONLY static void*
+test_put_thread(void* arg) {
+    const test_thread_t* context = arg;
+
+    for (uint64_t i = 0; i < 2000; ++i) {
+        const uint64_t id = i * 4 + context->thread;
+        assert_success(lsm_put(context->lsm, id, blob_from_string("concurrent")));
+
+        blob_t value;
+        assert_success(lsm_lookup(context->lsm, id, &value));
+    }
+
+    return nullptr;
+}
+
+describe(lsm) {
+    static pager_t* pager;
+    static lsm_t* lsm;
+
+    before_each() {
+        assert_success(pager_open(&pager, 1024, 2048));
+        assert_success(lsm_open(&lsm, pager, "events", 16 * 1024));
+    }
+
+    after_each() {
+        if (lsm != nullptr) {
+            assert_success(lsm_close(&lsm));
+        }
+        assert_success(pager_close(&pager));
+        error_clear();
+    }
+
+    it("look up rows in the memtable") {
+        test_put_rows(lsm, 0, 100, 3, "value");
+
+        for (uint64_t i = 0; i < 100; ++i) {
+            test_assert_row(lsm, i * 3, "value", i);
+        }
+        asserteq_uint(lsm_get_run_count(lsm), 0);
+
+        blob_t value;
+        bool found;
+        assert_success(lsm_find(lsm, 4, &value, &found));
+        assertis(!found);
+        assert_failure(lsm_lookup(lsm, 301, &value), ENOENT);
+    }
+
+    it("look up rows in runs") {
+        test_put_rows(lsm, 0, 3000, 1, "value");
+        assert_success(lsm_flush(lsm));
+
+        assertis(lsm_get_run_count(lsm) > 0);
+        assertis(lsm_get_run_count(lsm) < LSM_MERGE_THRESHOLD);
+
+        for (uint64_t i = 0; i < 3000; ++i) {
+            test_assert_row(lsm, i, "value", i);
+        }
+    }
+
+    it("replace and delete rows") {
+        test_put_rows(lsm, 0, 1000, 1, "old");
+        assert_success(lsm_flush(lsm));
+
+        // newer values hide older values from the runs before and after a flush
+        for (uint64_t i = 0; i < 1000; i += 3) {
+            assert_success(lsm_delete(lsm, i));
+        }
+        test_put_rows(lsm, 500, 500, 1, "new");
+
+        for (uint32_t round = 0; round < 2; ++round) {
+            for (uint64_t i = 0; i < 1000; ++i) {
+                blob_t value;
+                bool found;
+                assert_success(lsm_find(lsm, i, &value, &found));
+
+                if (i >= 500) {
+                    test_assert_row(lsm, i, "new", i);
+                } else if (i % 3 == 0) {
+                    assertis(!found);
+                } else {
+                    test_assert_row(lsm, i, "old", i);
+                }
+            }
+
+            assert_success(lsm_flush(lsm));
+        }
+    }
+
+    it("merge runs") {
+        for (uint64_t round = 0; round < 3 * LSM_MERGE_THRESHOLD; ++round) {
+            test_put_rows(lsm, round * 100, 100, 1, "value");
+            assert_success(lsm_delete(lsm, round * 100));
+            assert_success(lsm_flush(lsm));
+
+            assertis(lsm_get_run_count(lsm) < LSM_MERGE_THRESHOLD);
+        }
+
+        for (uint64_t i = 0; i < 3 * LSM_MERGE_THRESHOLD * 100; ++i) {
+            blob_t value;
+            bool found;
+            assert_success(lsm_find(lsm, i, &value, &found));
+            asserteq_int(found, i % 100 != 0);
+        }
+
+        // merged runs are dropped from the catalog
+        uint32_t count = 0;
+        catalog_ref_t ref = { 0 };
+        for (bool found = true; found;) {
+            catalog_entry_t entry;
+            assert_success(catalog_next(pager, &ref, &entry, &found));
+            count += found;
+        }
+        asserteq_uint(count, lsm_get_run_count(lsm));
+    }
+
+    it("keep deletes while a run of a failed merge is registered") {
+        test_put_rows(lsm, 0, 100, 1, "value");
+        assert_success(lsm_flush(lsm));
+        test_put_rows(lsm, 100, 100, 1, "value");
+        assert_success(lsm_flush(lsm));
+
+        // the first run can not be dropped while the snapshot is open, the
+        // background thread is idle after the flush
+        btree_t* first = lsm->runs[0];
+        btree_snapshot_t* snapshot;
+        assert_success(btree_snapshot_open(&snapshot, first));
+        assert_failure(lsm_merge(lsm), EINVAL);
+        error_clear();
+        assert_success(btree_snapshot_close(&snapshot));
+        assert_success(btree_close(&first));
+        asserteq_uint(lsm_get_run_count(lsm), 1);
+
+        // the merge drops the run of the delete, the value is still in the
+        // unlisted run
+        assert_success(lsm_delete(lsm, 5));
+        assert_success(lsm_flush(lsm));
+        assert_success(lsm_merge(lsm));
+
+        assert_success(lsm_close(&lsm));
+        assert_success(lsm_open(&lsm, pager, "events", 16 * 1024));
+
+        blob_t value;
+        bool found;
+        assert_success(lsm_find(lsm, 5, &value, &found));
+        assertis(!found);
+        test_assert_row(lsm, 6, "value", 6);
+    }
+
+    it("reopen the runs") {
+        test_put_rows(lsm, 0, 2000, 1, "first");
+        assert_success(lsm_flush(lsm));
+        test_put_rows(lsm, 0, 1000, 1, "second");
+        assert_success(lsm_close(&lsm));
+
+        // runs of other tables are not picked up
+        lsm_t* other;
+        assert_success(lsm_open(&other, pager, "event", 16 * 1024));
+        asserteq_uint(lsm_get_run_count(other), 0);
+        assert_success(lsm_close(&other));
+
+        assert_success(lsm_open(&lsm, pager, "events", 16 * 1024));
+        assertis(lsm_get_run_count(lsm) > 0);
+
+        for (uint64_t i = 0; i < 2000; ++i) {
+            test_assert_row(lsm, i, i < 1000 ? "second" : "first", i);
+        }
+    }
+
+    it("write from concurrent threads") {
+        pthread_t threads[4];
+        test_thread_t contexts[4];
+        for (uint32_t i = 0; i < 4; ++i) {
+            contexts[i] = (test_thread_t){ lsm, i };
+            asserteq_int(pthread_create(&threads[i], nullptr, test_put_thread, &contexts[i]), 0);
+        }
+        for (uint32_t i = 0; i < 4; ++i) {
+            asserteq_int(pthread_join(threads[i], nullptr), 0);
+        }
+
+        assert_success(lsm_flush(lsm));
+        for (uint64_t i = 0; i < 4 * 2000; ++i) {
+            blob_t value;
+            assert_success(lsm_lookup(lsm, i, &value));
+            asserteq_int(blob_cmp(value, blob_from_string("concurrent")), 0);
+        }
+    }
+}
@@ -3,11 +3,21 @@
 #include "deffer.h"
 #include "error.h"
 #include "latch.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
+#include "wal.h"
 #include "winter.h"
+#include "ycsb.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 enum {
     /// If the page content was modified.
@@ -19,16 +29,33 @@ enum {
 
     /// Set if the page was fixed exclusively (i.e. with write lock).
     PAGE_FLAG_EXCLUSIVE = (1u << 2),
+
+    /// Set while the page is on probation, the next unfix does not set the
+    /// second chance bit but only clears this flag.
+    PAGE_FLAG_NEW = (1u << 3),
+
+    /// Usage count of PAGER_POLICY_FREQUENCY.
+    PAGE_FLAG_USAGE = (PAGER_MAX_USAGE << 4),
 };
 
+#define PAGE_USAGE_SHIFT 4
+
 /// Page header stored before of the actual page data in memory and is not
 /// persisted to disk.
 typedef struct {
+    /// Lower bound for the start of the first logged change that is not yet
+    /// written to the file, PAGE_CLEAN if there is none. Read by checkpoints
+    /// without the page latch.
+    _Atomic lsn_t recovery_lsn;
+
     page_id_t id;
 
     /// Read-write lock of the page only protects the page's content.
     latch_t latch;
 
+    /// Index of the page's entry in the CLOCK ring.
+    uint32_t slot;
+
     /// Tracks boolean flags for the page. Can be accessed concurrently with
     /// any latch.
     _Atomic uint8_t flags;
@@ -61,42 +88,116 @@ typedef struct {
 
     /// Linked a list of further slots to track overflow.
     bucket_t* overflow;
+
+    /// Set once a resize moved the mappings to the next directory.
+    bool moved;
 } hash_entry_t;
 
+/// Hash map directory. A resize moves the mappings entry by entry to the next
+/// directory and replaces the directory of the pager afterward.
+typedef struct directory_t {
+    hash_entry_t* entries;
+    uint32_t mask;
+
+    /// Directory the moved entries are found in, only set during a resize.
+    _Atomic(struct directory_t*) next;
+
+    /// Replaced directory, threads might still read it until the pager is
+    /// closed.
+    struct directory_t* retired;
+} directory_t;
+
 /// Entry in the CLOCK ring. Mapping from a page id to a header pointer. Not
 /// directly protected by any latch, but the header should only be modified
 /// if the latch of the hash map entry for the page id was acquired.
 typedef struct {
     _Atomic page_id_t page_id;
     header_t* header;
+
+    /// Next entry of the free list plus one, zero ends the list.
+    _Atomic uint32_t next;
 } ring_entry_t;
 
+/// Marks a ring entry whose page is currently freed. The entry is neither
+/// evicted nor reused until the page is removed from the hash map.
+#define RING_ENTRY_FREEING UINT32_MAX
+
+/// Marks a ring entry on the free list. Only the thread that pops the entry
+/// from the list might reuse it.
+#define RING_ENTRY_FREE (UINT32_MAX - 1)
+
+/// The ring is split into segments that are never moved, so that it can grow
+/// while other threads access it.
+#define RING_SEGMENT_BITS 10
+#define RING_SEGMENT_SIZE (1u << RING_SEGMENT_BITS)
+#define RING_MAX_SEGMENTS (1u << 14)
+
+/// Number of ring entries an eviction sweep claims at once. Every evictable
+/// page of the chunk is evicted and its entry is put on the free list.
+#define PAGER_EVICT_BATCH 16
+
+/// Recovery LSN of pages without logged changes since they were last written.
+#define PAGE_CLEAN UINT64_MAX
+
+/// Number of dirty pages per checkpoint record and the size of each entry.
+#define CHECKPOINT_RECORD_ENTRIES 4096
+#define CHECKPOINT_ENTRY_SIZE (sizeof(page_id_t) + sizeof(lsn_t))
+
 struct pager_t {
     /// Size of a single page in bytes.
     uint16_t page_size;
 
-    /// The maximum number of pages tracked by the pager.
-    uint32_t size;
+    /// Number of entries in the CLOCK ring, only grows. At least one larger
+    /// than the capacity.
+    _Atomic uint32_t size;
 
-    /// Mask used by the hash function.
-    uint32_t mask;
+    /// The maximum number of pages tracked by the pager.
+    _Atomic uint32_t capacity;
 
     /// The number of pages currently tracked by the pager. Can be modified
     /// concurrently and might be an over approximation if the pager is
     /// accessed concurrently.
     _Atomic uint32_t page_count;
 
+    /// Serializes resizes.
+    pthread_mutex_t resize_mutex;
+
+    _Atomic pager_policy_t policy;
+
     /// Pointer into the ring, used for page eviction.
     _Atomic uint32_t evict_head;
 
     /// Pointer into the ring, used for page creation.
     _Atomic uint32_t create_head;
 
-    /// Temporary for tracking the next page in memory.
-    _Atomic uint32_t next_page;
+    /// Stack of ring entries freed by eviction sweeps. The index of the top
+    /// entry plus one in the lower half, the upper half counts the changes to
+    /// detect concurrent pops and pushes of the same entry.
+    _Atomic uint64_t free_head;
+
+    /// Protects the extent table. Shared for allocations within an extent and
+    /// exclusive to claim an empty extent or to append new extents.
+    latch_t extent_latch;
+
+    /// Allocation bitmap per extent, a set bit marks an allocated page id.
+    _Atomic uint64_t* extents;
+    uint32_t extent_count;
+    uint32_t extent_capacity;
 
-    hash_entry_t* directory;
-    ring_entry_t* ring;
+    /// Lowest extent that might be empty, empty extents are searched from here.
+    _Atomic uint32_t extent_hint;
+
+    /// File backing the pages, -1 if the pages are only kept in memory.
+    int fd;
+
+    /// Log that is flushed before pages are written back, optional.
+    wal_t* wal;
+
+    _Atomic(directory_t*) directory;
+
+    /// Segments of the CLOCK ring, only the segments up to the size are
+    /// allocated.
+    _Atomic(ring_entry_t*)* ring;
 };
 
 /// Converts a page header pointer to a pointer to the page data.
@@ -111,38 +212,204 @@ header_from_data(const unsigned char* data) {
     return (header_t*)data - 1;
 }
 
-result_t
-pager_open(pager_t** out, const uint16_t page_size, const uint32_t directory_size) {
-    ensure((directory_size & (directory_size - 1)) == 0);
-    ensure(out != nullptr);
+/// Frees a directory and its overflow buckets.
+static void
+pager_directory_free(directory_t* directory) {
+    for (uint32_t i = 0; i <= directory->mask; ++i) {
+        bucket_t* bucket = directory->entries[i].overflow;
+        while (bucket != nullptr) {
+            bucket_t* next = bucket->next;
+            free(bucket);
+            bucket = next;
+        }
+    }
+
+    free(directory->entries);
+    free(directory);
+}
+
+defer_impl(pager_directory_free) {
+    defer_guard();
+    pager_directory_free(*defer_arg(directory_t*));
+}
+
+/// Frees all segments of the ring and the pages in them.
+static void
+pager_ring_free(pager_t* pager) {
+    for (uint32_t i = 0; i < RING_MAX_SEGMENTS && pager->ring[i] != nullptr; ++i) {
+        ring_entry_t* segment = pager->ring[i];
+        for (uint32_t j = 0; j < RING_SEGMENT_SIZE; ++j) {
+            free(segment[j].header);
+        }
+        free(segment);
+    }
+
+    free(pager->ring);
+}
+
+defer_impl(pager_ring_free) {
+    defer_guard();
+    pager_ring_free(*defer_arg(pager_t*));
+}
+
+/// Returns the ring entry at the index, the index has to be below the size.
+static ring_entry_t*
+pager_ring(const pager_t* pager, const uint32_t index) {
+    ring_entry_t* segment = atomic_load_explicit(&pager->ring[index >> RING_SEGMENT_BITS], memory_order_acquire);
+    return &segment[index & (RING_SEGMENT_SIZE - 1)];
+}
+
+/// Allocates the segments of the ring up to the size and publishes the size.
+static result_t
+pager_ring_grow(pager_t* pager, const uint32_t size) {
+    if (size > RING_MAX_SEGMENTS * RING_SEGMENT_SIZE) {
+        failure(EINVAL, msg("capacity exceeds the ring"), with_uint(size));
+    }
+
+    for (uint32_t i = 0; i < (size + RING_SEGMENT_SIZE - 1) >> RING_SEGMENT_BITS; ++i) {
+        if (atomic_load(&pager->ring[i]) != nullptr) {
+            continue;
+        }
+
+        ring_entry_t* segment = calloc(RING_SEGMENT_SIZE, sizeof(ring_entry_t));
+        if (segment == nullptr) {
+            failure(ENOMEM, msg("failed to allocate ring segment"), with_uint(i));
+        }
+        atomic_store_explicit(&pager->ring[i], segment, memory_order_release);
+    }
+
+    if (size > atomic_load(&pager->size)) {
+        atomic_store(&pager->size, size);
+    }
+
+    return SUCCESS;
+}
+
+/// Allocates an empty directory, the size has to be a power of 2.
+static result_t
+pager_directory_alloc(const uint32_t size, directory_t** out) {
+    directory_t* directory;
+    try_alloc(directory, sizeof(directory_t));
+    errdefer(free, directory);
+
+    try_alloc(directory->entries, sizeof(hash_entry_t) * size);
+    directory->mask = size - 1;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        latch_init(&directory->entries[i].latch);
+    }
+
+    *out = directory;
+
+    return SUCCESS;
+}
+
+/// Returns the directory size for a capacity, keeps the load below 70%.
+static uint32_t
+pager_directory_size(const uint32_t capacity) {
+    const uint64_t minimum = (uint64_t)capacity * 10 / 7 + 1;
+
+    uint32_t size = 16;
+    while (size < minimum) {
+        size *= 2;
+    }
+
+    return size;
+}
 
+/// Allocates and initialises a pager with a directory and a capacity in pages.
+static result_t
+pager_init(pager_t** out, const uint16_t page_size, const uint32_t directory_size, const uint32_t capacity) {
     pager_t* pager;
     try_alloc(pager, sizeof(pager_t));
     errdefer(free, pager);
 
     pager->page_size = page_size;
-    pager->size = (uint32_t)(directory_size * 0.7);
+    pager->size = 0;
+    pager->capacity = capacity;
     pager->page_count = 0;
-    pager->mask = directory_size - 1;
+    pager->policy = PAGER_POLICY_CLOCK;
     pager->evict_head = 0;
     pager->create_head = 0;
-    pager->next_page = 1;
+    pager->free_head = 0;
+    pthread_mutex_init(&pager->resize_mutex, nullptr);
+    latch_init(&pager->extent_latch);
+    pager->fd = -1;
 
-    try_alloc(pager->directory, sizeof(hash_entry_t) * directory_size);
-    errdefer(free, pager->directory);
+    directory_t* directory;
+    try(pager_directory_alloc(directory_size, &directory));
+    errdefer(pager_directory_free, directory);
+    pager->directory = directory;
 
-    try_alloc(pager->ring, sizeof(ring_entry_t) * pager->size);
-    errdefer(free, pager->ring);
+    try_alloc(pager->ring, sizeof(ring_entry_t*) * RING_MAX_SEGMENTS);
+    errdefer(pager_ring_free, pager);
+    try(pager_ring_grow(pager, capacity + 1));
 
-    for (uint32_t i = 0; i < directory_size; ++i) {
-        latch_init(&pager->directory[i].latch);
-    }
+    try_alloc(pager->extents, sizeof(uint64_t) * PAGER_EXTENT_SIZE);
+    pager->extent_capacity = PAGER_EXTENT_SIZE;
+
+    // the invalid page id and the meta page are never handed out
+    pager->extents[0] = (1ull << 0) | (1ull << PAGER_META_PAGE);
+    pager->extent_count = 1;
+    pager->extent_hint = 1;
 
     *out = pager;
 
     return SUCCESS;
 }
 
+result_t
+pager_open(pager_t** out, const uint16_t page_size, const uint32_t directory_size) {
+    ensure((directory_size & (directory_size - 1)) == 0);
+    ensure(out != nullptr);
+
+    // one entry of the ring always stays empty
+    const uint32_t capacity = (uint32_t)(directory_size * 0.7) - 1;
+    try(pager_init(out, page_size, directory_size, capacity));
+
+    return SUCCESS;
+}
+
+/// Returns the number of pages that fit into the bytes, including the headers.
+static uint64_t
+pager_frames(const uint16_t page_size, const uint64_t bytes) {
+    return bytes / (sizeof(header_t) + page_size);
+}
+
+result_t
+pager_open_capacity(pager_t** out, const uint16_t page_size, const uint64_t bytes) {
+    ensure(out != nullptr);
+
+    const uint64_t capacity = pager_frames(page_size, bytes);
+    if (capacity < 2 || capacity >= RING_MAX_SEGMENTS * RING_SEGMENT_SIZE) {
+        failure(EINVAL, msg("invalid pager capacity"), with_uint(bytes));
+    }
+
+    try(pager_init(out, page_size, pager_directory_size((uint32_t)capacity), (uint32_t)capacity));
+
+    return SUCCESS;
+}
+
+void
+pager_stats_snapshot(pager_stats_t* out) {
+    uint64_t counters[6];
+    stats_sum(STATS_PAGER_HITS, 6, counters);
+
+    *out = (pager_stats_t){
+        .hits = counters[0],
+        .misses = counters[1],
+        .evictions = counters[2],
+        .evict_scanned = counters[3],
+        .evict_cleared = counters[4],
+        .evict_failures = counters[5],
+    };
+}
+
+void
+pager_set_policy(pager_t* pager, const pager_policy_t policy) {
+    atomic_store_explicit(&pager->policy, policy, memory_order_relaxed);
+}
+
 uint16_t
 pager_get_page_size(const pager_t* pager) {
     return pager->page_size;
@@ -151,13 +418,64 @@ pager_get_page_size(const pager_t* pager) {
 /// Simple hash function that maps the page id to hash map entries. (copied
 /// from Stackoverflow but forgot the source)
 static uint32_t
-pager_hash(const pager_t* pager, const page_id_t id) {
+pager_hash(const page_id_t id) {
     uint32_t hash = id;
     hash = ((hash >> 16) ^ hash) * 0x45d9f3b;
     hash = ((hash >> 16) ^ hash) * 0x45d9f3b;
     hash = ((hash >> 16) ^ hash);
 
-    return hash & pager->mask;
+    return hash;
+}
+
+/// Latches the hash map entry of a page id, shared or exclusive with the
+/// reader bias. Entries that a resize moved are followed to the next
+/// directory.
+static hash_entry_t*
+pager_directory_latch(const pager_t* pager, const page_id_t id, const bool exclusive) {
+    const uint32_t hash = pager_hash(id);
+
+    directory_t* directory = atomic_load(&pager->directory);
+    while (true) {
+        hash_entry_t* hash_entry = &directory->entries[hash & directory->mask];
+        if (exclusive) {
+            latch_acquire_write_reader_biased(&hash_entry->latch);
+        } else {
+            latch_acquire_read(&hash_entry->latch);
+        }
+
+        if (!hash_entry->moved) {
+            return hash_entry;
+        }
+
+        if (exclusive) {
+            latch_release_write(&hash_entry->latch);
+        } else {
+            latch_release_read(&hash_entry->latch);
+        }
+        directory = atomic_load(&directory->next);
+    }
+}
+
+/// Latches the hash map entry of a page id exclusively if it is not latched
+/// already, returns nullptr otherwise.
+static hash_entry_t*
+pager_directory_try_latch(const pager_t* pager, const page_id_t id) {
+    const uint32_t hash = pager_hash(id);
+
+    directory_t* directory = atomic_load(&pager->directory);
+    while (true) {
+        hash_entry_t* hash_entry = &directory->entries[hash & directory->mask];
+        if (!latch_try_acquire_write(&hash_entry->latch)) {
+            return nullptr;
+        }
+
+        if (!hash_entry->moved) {
+            return hash_entry;
+        }
+
+        latch_release_write(&hash_entry->latch);
+        directory = atomic_load(&directory->next);
+    }
 }
 
 /// Retrieves the header for the corresponding page id from the entries.
@@ -245,20 +563,113 @@ pager_directory_remove(hash_entry_t* hash_entry, const page_id_t id) {
     }
 }
 
-/// Creates a new page. Might allocate a new page if no evicted page can be reused.
+/// Reads the page from the file, the page stays zeroed if it is beyond the end
+/// of the file.
+static result_t
+pager_read_page(const pager_t* pager, header_t* header) {
+    if (pager->fd < 0) {
+        return SUCCESS;
+    }
+
+    unsigned char* data = header_get_data(header);
+    const off_t offset = (off_t)header->id * pager->page_size;
+
+    uint16_t read = 0;
+    while (read < pager->page_size) {
+        const ssize_t result = pread(pager->fd, data + read, pager->page_size - read, offset + read);
+        if (result < 0) {
+            failure(errno, msg("failed to read page"), with_uint(header->id));
+        }
+        if (result == 0) {
+            break;
+        }
+        read += (uint16_t)result;
+    }
+
+    return SUCCESS;
+}
+
+/// Writes the page to the file. The log is flushed first up to the LSN of the
+/// page, so that every change in the file can be redone or undone.
+static result_t
+pager_write_page(const pager_t* pager, const header_t* header) {
+    if (pager->fd < 0) {
+        return SUCCESS;
+    }
+
+    const unsigned char* data = header_get_data(header);
+
+    lsn_t lsn;
+    memcpy(&lsn, data, sizeof(lsn_t));
+    if (pager->wal != nullptr && lsn != 0) {
+        try(wal_flush(pager->wal, lsn));
+    }
+
+    const off_t offset = (off_t)header->id * pager->page_size;
+
+    uint16_t written = 0;
+    while (written < pager->page_size) {
+        const ssize_t result = pwrite(pager->fd, data + written, pager->page_size - written, offset + written);
+        if (result < 0) {
+            failure(errno, msg("failed to write page"), with_uint(header->id));
+        }
+        written += (uint16_t)result;
+    }
+
+    return SUCCESS;
+}
+
+/// Pushes a ring entry marked as free onto the free list.
+static void
+pager_free_push(pager_t* pager, const uint32_t index) {
+    uint64_t head = atomic_load(&pager->free_head);
+    uint64_t next;
+    do {
+        atomic_store_explicit(&pager_ring(pager, index)->next, (uint32_t)head, memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!atomic_compare_exchange_weak(&pager->free_head, &head, next));
+}
+
+/// Pops a ring entry from the free list, returns false if the list is empty.
+static bool
+pager_free_pop(pager_t* pager, uint32_t* out) {
+    uint64_t head = atomic_load(&pager->free_head);
+    while ((uint32_t)head != 0) {
+        const uint32_t index = (uint32_t)head - 1;
+        const uint64_t next = (((head >> 32) + 1) << 32) | atomic_load(&pager_ring(pager, index)->next);
+
+        if (atomic_compare_exchange_weak(&pager->free_head, &head, next)) {
+            *out = index;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// Creates a new page. Reuses entries from the free list first and falls back
+/// to searching the ring for unused entries.
 static result_t
 pager_create(pager_t* pager, hash_entry_t* hash_entry, const page_id_t id, header_t** out) {
     assert_latch_write_access(hash_entry->latch);
 
     while (true) {
-        const uint32_t index = atomic_fetch_add(&pager->create_head, 1) % pager->size;
-
-        /// acquire the ring entry by storing the page, also ensures
-        /// syncronisation since tha latch for the entry is alredy acquired
-        ring_entry_t* ring_entry = &pager->ring[index];
-        page_id_t expected = 0;
-        if (!atomic_compare_exchange_weak(&ring_entry->page_id, &expected, id)) {
-            continue;
+        uint32_t index;
+        ring_entry_t* ring_entry;
+
+        if (pager_free_pop(pager, &index)) {
+            ring_entry = pager_ring(pager, index);
+            atomic_store(&ring_entry->page_id, id);
+        } else {
+            index = atomic_fetch_add(&pager->create_head, 1) % atomic_load(&pager->size);
+
+            /// acquire the ring entry by storing the page, also ensures
+            /// syncronisation since tha latch for the entry is alredy acquired
+            ring_entry = pager_ring(pager, index);
+            page_id_t expected = 0;
+            if (!atomic_compare_exchange_weak(&ring_entry->page_id, &expected, id)) {
+                continue;
+            }
         }
 
         if (ring_entry->header == nullptr) {
@@ -270,8 +681,17 @@ pager_create(pager_t* pager, hash_entry_t* hash_entry, const page_id_t id, heade
         }
 
         ring_entry->header->id = id;
-        atomic_store(&ring_entry->header->flags, 0);
+        ring_entry->header->slot = index;
+        const pager_policy_t policy = atomic_load_explicit(&pager->policy, memory_order_relaxed);
+        atomic_store(&ring_entry->header->flags, policy == PAGER_POLICY_CLOCK ? 0 : PAGE_FLAG_NEW);
+        atomic_store(&ring_entry->header->recovery_lsn, PAGE_CLEAN);
         latch_init(&ring_entry->header->latch);
+        memset(header_get_data(ring_entry->header), 0, pager->page_size);
+
+        handle(pager_read_page(pager, ring_entry->header)) {
+            atomic_store(&ring_entry->page_id, 0); // release ring entry on failure
+            forward();
+        }
 
         handle(pager_directory_insert(hash_entry, ring_entry->header)) {
             atomic_store(&ring_entry->page_id, 0); // release ring entry on failure
@@ -284,17 +704,36 @@ pager_create(pager_t* pager, hash_entry_t* hash_entry, const page_id_t id, heade
     }
 }
 
+/// Writes a modified page back and marks it clean. The page latch has to be
+/// held at least shared, writers are excluded by it.
+static result_t
+pager_write_back(const pager_t* pager, header_t* header) {
+    if (atomic_fetch_and(&header->flags, ~PAGE_FLAG_DIRTY) & PAGE_FLAG_DIRTY) {
+        handle(pager_write_page(pager, header)) {
+            atomic_fetch_or(&header->flags, PAGE_FLAG_DIRTY);
+            forward();
+        }
+        atomic_store(&header->recovery_lsn, PAGE_CLEAN);
+    }
+
+    return SUCCESS;
+}
+
 /// Finds the corresponding hash map entry for this ring entry. Returns true if
 /// the ring entry stores a valid mapping (i.e. the page id is not zero). Since
-/// the page id might be modified concurrently, a CAS loop is required.
+/// the page id might be modified concurrently, a CAS loop is required. Returns
+/// false as well if the hash map entry is latched, a reader of it might wait
+/// for a page the evicting thread has fixed.
 static bool
 pager_directory_find_entry(const pager_t* pager, ring_entry_t* ring_entry, hash_entry_t** out) {
     page_id_t page_id = atomic_load(&ring_entry->page_id);
 
-    while (page_id != 0) {
-        // acquire the latch of the corresponding hash map entry
-        hash_entry_t* hash_entry = &pager->directory[pager_hash(pager, page_id)];
-        latch_acquire_write(&hash_entry->latch);
+    while (page_id != 0 && page_id != RING_ENTRY_FREEING && page_id != RING_ENTRY_FREE) {
+        // try to acquire the latch of the corresponding hash map entry
+        hash_entry_t* hash_entry = pager_directory_try_latch(pager, page_id);
+        if (hash_entry == nullptr) {
+            return false;
+        }
 
         // check if the page id is still valid
         if (atomic_compare_exchange_strong(&ring_entry->page_id, &page_id, page_id)) {
@@ -309,58 +748,182 @@ pager_directory_find_entry(const pager_t* pager, ring_entry_t* ring_entry, hash_
     return false;
 }
 
-/// Evicts a page, might fail if there are no pages that can be evicted, i.e.
-/// every page is currently fixed. Or if the thread is unlucky and loses a lot
-/// of races with other threads trying to evict pages.
-result_t
-pager_evict(pager_t* pager) {
-    for (uint32_t i = 0; i < pager->size * 2; ++i) {
-        const uint32_t index = atomic_fetch_add(&pager->evict_head, 1) % pager->size;
-        ring_entry_t* ring_entry = &pager->ring[index];
+/// Decides whether the page gets another pass of the CLOCK hand and updates its
+/// flags for the next pass.
+static bool
+pager_second_chance(const pager_t* pager, header_t* header, const uint8_t flags) {
+    if (atomic_load_explicit(&pager->policy, memory_order_relaxed) != PAGER_POLICY_FREQUENCY) {
+        if (flags & PAGE_FLAG_REF) {
+            atomic_fetch_and(&header->flags, ~PAGE_FLAG_REF);
+            return true;
+        }
+        return false;
+    }
+
+    uint8_t usage = (flags & PAGE_FLAG_USAGE) >> PAGE_USAGE_SHIFT;
+    if (flags & PAGE_FLAG_REF) {
+        usage = usage < PAGER_MAX_USAGE ? usage + 1 : usage;
+    } else if (usage > 0) {
+        usage -= 1;
+    } else {
+        return false;
+    }
+
+    // a concurrent unfix referenced the page again, it stays for this pass
+    uint8_t expected = flags;
+    const uint8_t next = (uint8_t)((flags & ~(PAGE_FLAG_REF | PAGE_FLAG_USAGE)) | (usage << PAGE_USAGE_SHIFT));
+    atomic_compare_exchange_strong(&header->flags, &expected, next);
+
+    return true;
+}
+
+/// Evicts the page of a ring entry unless it is fixed or gets another pass,
+/// the entry is put on the free list. Sets unfixed if the entry holds a page
+/// that is not fixed.
+static result_t
+pager_evict_entry(pager_t* pager, const uint32_t index, bool* evicted, bool* unfixed) {
+    stats_add(STATS_PAGER_EVICT_SCANNED, 1);
+    *evicted = false;
+
+    ring_entry_t* ring_entry = pager_ring(pager, index);
+
+    hash_entry_t* entry;
+    if (!pager_directory_find_entry(pager, ring_entry, &entry)) {
+        return SUCCESS;
+    }
+
+    header_t* header = ring_entry->header;
+    if (!latch_available(&header->latch)) {
+        latch_release_write(&entry->latch);
+        return SUCCESS;
+    }
+    *unfixed = true;
+
+    const uint8_t flags = atomic_load(&header->flags);
+    if (pager_second_chance(pager, header, flags)) {
+        stats_add(STATS_PAGER_EVICT_CLEARED, 1);
+        latch_release_write(&entry->latch);
+        return SUCCESS;
+    }
+
+    if ((flags & PAGE_FLAG_DIRTY) && pager->fd >= 0) {
+        const page_id_t id = atomic_load(&ring_entry->page_id);
+
+        // the shared page latch keeps the content stable and other sweeps
+        // away, fixes of the other pages of the hash map entry do not wait
+        // for the write
+        if (!latch_try_acquire_read(&header->latch)) {
+            latch_release_write(&entry->latch);
+            return SUCCESS;
+        }
+        latch_release_write(&entry->latch);
+
+        handle(pager_write_back(pager, header)) {
+            latch_release_read(&header->latch);
+            forward();
+        }
+        latch_release_read(&header->latch);
 
-        hash_entry_t* entry;
+        // the page might have been fixed or evicted during the write
         if (!pager_directory_find_entry(pager, ring_entry, &entry)) {
-            continue;
+            return SUCCESS;
         }
-        defer(latch_release_write, entry->latch);
+        header = ring_entry->header;
 
-        if (!latch_available(&ring_entry->header->latch)) {
-            continue;
+        const uint8_t written = atomic_load(&header->flags);
+        if (atomic_load(&ring_entry->page_id) != id || !latch_available(&header->latch) ||
+            (written & (PAGE_FLAG_DIRTY | PAGE_FLAG_REF)) != 0) {
+            latch_release_write(&entry->latch);
+            return SUCCESS;
         }
+    }
+    defer(latch_release_write, entry->latch);
 
-        const uint8_t flags = atomic_load(&ring_entry->header->flags);
-        if (flags & PAGE_FLAG_REF) {
-            atomic_fetch_and(&ring_entry->header->flags, ~PAGE_FLAG_REF);
-            continue;
+    trace_event(TRACE_PAGER_EVICT, ring_entry->page_id);
+    pager_directory_remove(entry, ring_entry->page_id);
+    atomic_store(&ring_entry->page_id, RING_ENTRY_FREE);
+    pager_free_push(pager, index);
+
+    atomic_fetch_sub(&pager->page_count, 1);
+    stats_add(STATS_PAGER_EVICTIONS, 1);
+    *evicted = true;
+
+    return SUCCESS;
+}
+
+/// Evicts pages until at least one was evicted. Every sweep claims a chunk of
+/// the ring and evicts all pages of it that can be evicted, the surplus frames
+/// are left on the free list for later misses. Fails if there are no pages
+/// that can be evicted, i.e. every page is currently fixed, and no other
+/// thread freed capacity in the meantime.
+static result_t
+pager_evict(pager_t* pager) {
+    const uint64_t start = stats_start(STATS_HISTOGRAM_PAGER_EVICT);
+
+    const uint32_t size = atomic_load(&pager->size);
+    uint32_t swept = 0;
+    while (swept < size * 2) {
+        const uint32_t first = atomic_fetch_add(&pager->evict_head, PAGER_EVICT_BATCH);
+
+        uint32_t victims = 0;
+        bool unfixed = false;
+        for (uint32_t i = 0; i < PAGER_EVICT_BATCH; ++i) {
+            const uint32_t index = (first + i) % size;
+
+            bool evicted;
+            try(pager_evict_entry(pager, index, &evicted, &unfixed));
+            victims += evicted;
         }
 
-        pager_directory_remove(entry, ring_entry->page_id);
-        atomic_store(&ring_entry->page_id, 0);
+        // concurrent sweeps might have freed the capacity
+        if (victims > 0 || atomic_load(&pager->page_count) < atomic_load(&pager->capacity)) {
+            stats_record(STATS_HISTOGRAM_PAGER_EVICT, start);
+            return SUCCESS;
+        }
 
-        return SUCCESS;
+        // a page that got another pass is evicted by a later one, unless a
+        // concurrent sweep takes it first, which is likely if the ring is
+        // sparse after the pool shrank
+        swept = unfixed ? 0 : swept + PAGER_EVICT_BATCH;
     }
 
+    stats_add(STATS_PAGER_EVICT_FAILURES, 1);
+    stats_record(STATS_HISTOGRAM_PAGER_EVICT, start);
     failure(ENOMEM, msg("no pages to evict"));
 }
 
+/// Result of looking up a page in a hash map entry.
+typedef enum {
+    LOOKUP_MISSING,
+    LOOKUP_FIXED,
+    LOOKUP_LATCHED,
+} lookup_t;
+
 /// Looks up a page in the hash map entry and acquires the page latch if found.
-bool
+/// Does not wait for the page latch, the thread holding it might need the hash
+/// map entry exclusively for a miss or an eviction. The caller releases the
+/// hash map entry and retries if the page is latched.
+static lookup_t
 pager_lookup(const hash_entry_t* hash_entry, const page_id_t id, const bool exclusive, page_t* out) {
     header_t* header;
     if (!entry_directory_lookup(hash_entry, id, &header)) {
-        return false;
+        return LOOKUP_MISSING;
     }
 
-    latch_acquire(&header->latch, exclusive);
-
     if (exclusive) {
+        if (!latch_try_acquire_write(&header->latch)) {
+            return LOOKUP_LATCHED;
+        }
+
         // only needs to be visible to this thread, latch was acquired exclusively
         atomic_fetch_or_explicit(&header->flags, PAGE_FLAG_EXCLUSIVE, memory_order_relaxed);
+    } else if (!latch_try_acquire_read(&header->latch)) {
+        return LOOKUP_LATCHED;
     }
 
     *out = (page_t){ id, header_get_data(header) };
 
-    return true;
+    return LOOKUP_FIXED;
 }
 
 result_t
@@ -372,158 +935,1128 @@ pager_fix(pager_t* pager, const page_id_t id, const bool exclusive, page_t* out)
         failure(EINVAL, msg("invalid page id"));
     }
 
-    hash_entry_t* hash_entry = &pager->directory[pager_hash(pager, id)];
-    { // fast pass, try to look up the page with read-only lock
-        latch_acquire_read(&hash_entry->latch);
-        defer(latch_release_read, hash_entry->latch);
+    while (true) {
+        lookup_t lookup;
+        { // fast pass, try to look up the page with read-only lock
+            hash_entry_t* hash_entry = pager_directory_latch(pager, id, false);
+            defer(latch_release_read, hash_entry->latch);
 
-        if (pager_lookup(hash_entry, id, exclusive, out)) {
-            return SUCCESS;
+            lookup = pager_lookup(hash_entry, id, exclusive, out);
         }
-    }
 
-    // ensure that there is at least enough capacity to allocate a new page if required
-    uint32_t count = atomic_load(&pager->page_count);
-    while (true) {
-        if (count >= pager->size - 1) {
-            try(pager_evict(pager));
-            break;
+        if (lookup == LOOKUP_FIXED) {
+            stats_add(STATS_PAGER_HITS, 1);
+            return SUCCESS;
         }
-
-        if (atomic_compare_exchange_weak(&pager->page_count, &count, count + 1)) {
+        if (lookup == LOOKUP_MISSING) {
             break;
         }
+        sched_yield();
     }
 
-    latch_acquire_write(&hash_entry->latch);
-    defer(latch_release_write, hash_entry->latch);
+    // only recorded for misses, includes the eviction and the wait for the hash map entry
+    const uint64_t start = stats_start(STATS_HISTOGRAM_PAGER_MISS);
 
-    // retry the lookup after acquiring the write lock
-    if (pager_lookup(hash_entry, id, exclusive, out)) {
+    while (true) {
+        // ensure that there is at least enough capacity to allocate a new page if required
+        uint32_t count = atomic_load(&pager->page_count);
+        while (true) {
+            if (count >= atomic_load(&pager->capacity)) {
+                try(pager_evict(pager));
+                count = atomic_load(&pager->page_count);
+                continue;
+            }
+
+            if (atomic_compare_exchange_weak(&pager->page_count, &count, count + 1)) {
+                break;
+            }
+        }
+
+        {
+            hash_entry_t* hash_entry = pager_directory_latch(pager, id, true);
+            defer(latch_release_write, hash_entry->latch);
+
+            // retry the lookup after acquiring the write lock
+            const lookup_t lookup = pager_lookup(hash_entry, id, exclusive, out);
+            if (lookup == LOOKUP_FIXED) {
+                atomic_fetch_sub(&pager->page_count, 1);
+                stats_add(STATS_PAGER_HITS, 1);
+                return SUCCESS;
+            }
+
+            if (lookup == LOOKUP_MISSING) {
+                header_t* header;
+                handle(pager_create(pager, hash_entry, id, &header)) {
+                    atomic_fetch_sub(&pager->page_count, 1);
+                    forward();
+                }
+                stats_add(STATS_PAGER_MISSES, 1);
+                trace_event(TRACE_PAGER_MISS, id);
+
+                latch_acquire(&header->latch, exclusive);
+
+                if (exclusive) {
+                    // only needs to be visible to this thread, latch was acquired exclusively
+                    atomic_fetch_or_explicit(&header->flags, PAGE_FLAG_EXCLUSIVE, memory_order_relaxed);
+                }
+
+                *out = (page_t){ id, header_get_data(header) };
+                stats_record(STATS_HISTOGRAM_PAGER_MISS, start);
+
+                return SUCCESS;
+            }
+        }
+
+        // another thread created the page in the meantime and latched it
         atomic_fetch_sub(&pager->page_count, 1);
-        return SUCCESS;
+        sched_yield();
     }
+}
 
-    header_t* header;
-    handle(pager_create(pager, hash_entry, id, &header)) {
-        atomic_fetch_sub(&pager->page_count, 1);
-        forward();
+/// Allocates a free page id in the extent, preferring the ids after the
+/// position. Returns false if the extent is full.
+static bool
+pager_alloc_in_extent(pager_t* pager, const uint32_t extent, const uint32_t position, page_id_t* out) {
+    assert_latch_read_access(pager->extent_latch);
+
+    _Atomic uint64_t* bitmap = &pager->extents[extent];
+    uint64_t value = atomic_load(bitmap);
+
+    while (value != UINT64_MAX) {
+        const uint64_t free_bits = ~value;
+        const uint64_t after = position < PAGER_EXTENT_SIZE ? free_bits & (UINT64_MAX << position) : 0;
+        const uint32_t bit = (uint32_t)__builtin_ctzll(after != 0 ? after : free_bits);
+
+        if (atomic_compare_exchange_weak(bitmap, &value, value | (1ull << bit))) {
+            *out = extent * PAGER_EXTENT_SIZE + bit;
+            return true;
+        }
     }
 
-    latch_acquire(&header->latch, exclusive);
+    return false;
+}
 
-    if (exclusive) {
-        // only needs to be visible to this thread, latch was acquired exclusively
-        atomic_fetch_or_explicit(&header->flags, PAGE_FLAG_EXCLUSIVE, memory_order_relaxed);
+/// Appends empty extents to the extent table, grows the table if necessary.
+static result_t
+pager_append_extents(pager_t* pager, const uint32_t count, uint32_t* first) {
+    assert_latch_write_access(pager->extent_latch);
+
+    if (pager->extent_count > UINT32_MAX / PAGER_EXTENT_SIZE - count) {
+        failure(ENOSPC, msg("no page ids left"), with_uint(pager->extent_count));
     }
 
-    *out = (page_t){ id, header_get_data(header) };
+    if (pager->extent_count + count > pager->extent_capacity) {
+        const uint32_t capacity = max(pager->extent_capacity * 2, pager->extent_count + count);
+
+        _Atomic uint64_t* extents = realloc(pager->extents, sizeof(uint64_t) * capacity);
+        if (extents == nullptr) {
+            failure(ENOMEM, msg("failed to grow the extent table"), with_uint(capacity));
+        }
+
+        memset(extents + pager->extent_capacity, 0, sizeof(uint64_t) * (capacity - pager->extent_capacity));
+        pager->extents = extents;
+        pager->extent_capacity = capacity;
+    }
+
+    *first = pager->extent_count;
+    pager->extent_count += count;
+
+    return SUCCESS;
+}
+
+/// Claims an empty extent and allocates its first page id. Reuses extents
+/// where all pages were freed before appending a new one.
+static result_t
+pager_alloc_extent(pager_t* pager, page_id_t* out) {
+    latch_acquire_write(&pager->extent_latch);
+    defer(latch_release_write, pager->extent_latch);
+
+    uint32_t extent = atomic_load(&pager->extent_hint);
+    while (extent < pager->extent_count && atomic_load(&pager->extents[extent]) != 0) {
+        extent++;
+    }
+
+    if (extent == pager->extent_count) {
+        try(pager_append_extents(pager, 1, &extent));
+    }
+
+    atomic_store(&pager->extents[extent], 1ull);
+    atomic_store(&pager->extent_hint, extent + 1);
+
+    *out = extent * PAGER_EXTENT_SIZE;
+
+    return SUCCESS;
+}
+
+void
+pager_release(pager_t* pager, const page_id_t first, const uint32_t count) {
+    latch_acquire_read(&pager->extent_latch);
+    defer(latch_release_read, pager->extent_latch);
+
+    for (page_id_t id = first; id < first + count; ++id) {
+        const uint32_t extent = id / PAGER_EXTENT_SIZE;
+        assert(extent < pager->extent_count);
+
+        const uint64_t bit = 1ull << (id % PAGER_EXTENT_SIZE);
+        const uint64_t value = atomic_fetch_and(&pager->extents[extent], ~bit);
+        assert((value & bit) != 0);
+
+        // remember empty extents, so they can be claimed again
+        uint32_t hint = atomic_load(&pager->extent_hint);
+        while ((value & ~bit) == 0 && extent < hint) {
+            if (atomic_compare_exchange_weak(&pager->extent_hint, &hint, extent)) {
+                break;
+            }
+        }
+    }
+}
+
+result_t
+pager_alloc(pager_t* pager, const page_id_t hint, page_t* out) {
+    ensure(pager != nullptr);
+    ensure(out != nullptr);
+
+    page_id_t id = 0;
+    if (hint != 0) {
+        latch_acquire_read(&pager->extent_latch);
+        defer(latch_release_read, pager->extent_latch);
+
+        const uint32_t extent = hint / PAGER_EXTENT_SIZE;
+        if (extent < pager->extent_count) {
+            pager_alloc_in_extent(pager, extent, hint % PAGER_EXTENT_SIZE + 1, &id);
+        }
+    }
+
+    if (id == 0) {
+        try(pager_alloc_extent(pager, &id));
+    }
+
+    handle(pager_fix(pager, id, true, out)) {
+        pager_release(pager, id, 1);
+        forward();
+    }
+
+    // a reused id might still have an old page in the file
+    memset(out->data, 0, pager->page_size);
 
     return SUCCESS;
 }
 
 result_t
 pager_next(pager_t* pager, page_t* out) {
+    return pager_alloc(pager, 0, out);
+}
+
+result_t
+pager_reserve(pager_t* pager, const uint32_t count, page_id_t* first) {
+    ensure(pager != nullptr);
+    ensure(first != nullptr);
+    ensure(count > 0);
+
+    latch_acquire_write(&pager->extent_latch);
+    defer(latch_release_write, pager->extent_latch);
+
+    // reserved ranges always start at a new extent, so that they are not
+    // interleaved with pages allocated in the same extent
+    const uint32_t extent_count = (count + PAGER_EXTENT_SIZE - 1) / PAGER_EXTENT_SIZE;
+
+    uint32_t extent;
+    try(pager_append_extents(pager, extent_count, &extent));
+
+    for (uint32_t i = 0; i < extent_count; ++i) {
+        const uint32_t bits = min(count - i * PAGER_EXTENT_SIZE, PAGER_EXTENT_SIZE);
+        atomic_store(&pager->extents[extent + i], bits == PAGER_EXTENT_SIZE ? UINT64_MAX : (1ull << bits) - 1);
+    }
+
+    *first = extent * PAGER_EXTENT_SIZE;
+
+    return SUCCESS;
+}
+
+void
+pager_free(pager_t* pager, const page_t page) {
+    header_t* header = header_from_data(page.data);
+    assert_latch_write_access(header->latch);
+
+    // take the ring entry out of the CLOCK ring while the page latch still
+    // prevents the eviction, afterward the header cannot be reused
+    ring_entry_t* ring_entry = pager_ring(pager, header->slot);
+    atomic_store(&ring_entry->page_id, RING_ENTRY_FREEING);
+
+    // threads that found the page before it became unreachable get the latch
+    // and are waited for without holding the hash map entry. Fixes only try
+    // the page latch while they hold the entry, so it is latched afterward and
+    // the page removed before a new thread can fix it
+    latch_release_write(&header->latch);
+    latch_acquire_write(&header->latch);
+
+    hash_entry_t* hash_entry = pager_directory_latch(pager, page.id, true);
+    pager_directory_remove(hash_entry, page.id);
+    latch_release_write(&hash_entry->latch);
+
+    atomic_store(&ring_entry->page_id, 0);
+    atomic_fetch_sub(&pager->page_count, 1);
+
+    // the id can only be reused after the page was removed from the hash map
+    pager_release(pager, page.id, 1);
+}
+
+/// Spare buckets of a migration, see pager_directory_move.
+typedef struct {
+    bucket_t* buckets;
+    uint32_t count;
+} spares_t;
+
+static void
+pager_spares_free(spares_t* spares) {
+    while (spares->buckets != nullptr) {
+        bucket_t* next = spares->buckets->next;
+        free(spares->buckets);
+        spares->buckets = next;
+    }
+}
+
+defer_impl(pager_spares_free) {
+    pager_spares_free(defer_arg(spares_t));
+}
+
+/// Places a mapping into the next directory, takes a spare bucket if the
+/// entry is full. Entries of the next directory that receive mappings are not
+/// reachable by other threads yet.
+static void
+pager_directory_place(directory_t* directory, const mapping_t mapping, spares_t* spares) {
+    if (mapping.page_id == 0) {
+        return;
+    }
+
+    hash_entry_t* hash_entry = &directory->entries[pager_hash(mapping.page_id) & directory->mask];
+    if (hash_entry->first.page_id == 0) {
+        hash_entry->first = mapping;
+        return;
+    }
+    if (hash_entry->second.page_id == 0) {
+        hash_entry->second = mapping;
+        return;
+    }
+
+    bucket_t* bucket = spares->buckets;
+    spares->buckets = bucket->next;
+    spares->count -= 1;
+
+    bucket->value = mapping;
+    bucket->next = hash_entry->overflow;
+    hash_entry->overflow = bucket;
+}
+
+/// Moves a group of entries to the next directory. The entries of a group are
+/// the only source of their entries in the next directory, which therefore
+/// stay unreachable until the group is marked as moved. Requires two spare
+/// buckets per entry of the group, the overflow buckets of the entries are
+/// reused.
+static void
+pager_directory_move(directory_t* directory, const uint32_t group, const uint32_t step, spares_t* spares) {
+    directory_t* next = atomic_load(&directory->next);
+    const uint32_t count = (directory->mask + 1) / step;
+
+    // only the first latch is waited for, other threads might wait for a page
+    // latch while holding the latch of an entry
+    while (true) {
+        latch_acquire_write_reader_biased(&directory->entries[group].latch);
+
+        uint32_t latched = 1;
+        while (latched < count && latch_try_acquire_write(&directory->entries[group + latched * step].latch)) {
+            latched += 1;
+        }
+        if (latched == count) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < latched; ++i) {
+            latch_release_write(&directory->entries[group + i * step].latch);
+        }
+        sched_yield();
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        hash_entry_t* hash_entry = &directory->entries[group + i * step];
+        pager_directory_place(next, hash_entry->first, spares);
+        pager_directory_place(next, hash_entry->second, spares);
+
+        // every bucket becomes a spare before its mapping is placed
+        bucket_t* bucket = hash_entry->overflow;
+        while (bucket != nullptr) {
+            bucket_t* following = bucket->next;
+            const mapping_t mapping = bucket->value;
+
+            bucket->next = spares->buckets;
+            spares->buckets = bucket;
+            spares->count += 1;
+
+            pager_directory_place(next, mapping, spares);
+            bucket = following;
+        }
+
+        hash_entry->overflow = nullptr;
+        hash_entry->moved = true;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        latch_release_write(&directory->entries[group + i * step].latch);
+    }
+}
+
+/// Moves all entries of the directory that are not moved yet to the next
+/// directory and replaces the directory of the pager. The replaced directory
+/// is kept until the pager is closed, since other threads might still read
+/// it. On failure, the moved entries stay in the next directory.
+static result_t
+pager_directory_migrate(pager_t* pager, directory_t* directory) {
+    directory_t* next = atomic_load(&directory->next);
+    const uint32_t step = (directory->mask < next->mask ? directory->mask : next->mask) + 1;
+    const uint32_t count = (directory->mask + 1) / step;
+
+    spares_t spares = { nullptr, 0 };
+    defer(pager_spares_free, spares);
+
+    for (uint32_t group = 0; group < step; ++group) {
+        // only the migration moves entries, reading the flag without latch is safe
+        if (directory->entries[group].moved) {
+            continue;
+        }
+
+        while (spares.count < count * 2) {
+            bucket_t* bucket;
+            try_alloc(bucket, sizeof(bucket_t));
+
+            bucket->next = spares.buckets;
+            spares.buckets = bucket;
+            spares.count += 1;
+        }
+
+        pager_directory_move(directory, group, step, &spares);
+    }
+
+    next->retired = directory;
+    atomic_store(&pager->directory, next);
+
+    return SUCCESS;
+}
+
+/// Replaces the directory with one that fits the capacity.
+static result_t
+pager_directory_resize(pager_t* pager, const uint32_t capacity) {
+    directory_t* directory = atomic_load(&pager->directory);
+
+    const uint32_t size = pager_directory_size(capacity);
+    if (directory->mask + 1 == size) {
+        return SUCCESS;
+    }
+
+    directory_t* next;
+    try(pager_directory_alloc(size, &next));
+    atomic_store(&directory->next, next);
+
+    try(pager_directory_migrate(pager, directory));
+
+    return SUCCESS;
+}
+
+result_t
+pager_resize(pager_t* pager, const uint64_t bytes) {
+    ensure(pager != nullptr);
+
+    const uint64_t frames = pager_frames(pager->page_size, bytes);
+    if (frames < 2 || frames >= RING_MAX_SEGMENTS * RING_SEGMENT_SIZE) {
+        failure(EINVAL, msg("invalid pager capacity"), with_uint(bytes));
+    }
+    const uint32_t capacity = (uint32_t)frames;
+
+    pthread_mutex_lock(&pager->resize_mutex);
+    defer(pthread_mutex_unlock, pager->resize_mutex);
+
+    // finish the migration of a failed resize first
+    directory_t* directory = atomic_load(&pager->directory);
+    if (atomic_load(&directory->next) != nullptr) {
+        try(pager_directory_migrate(pager, directory));
+    }
+
+    if (capacity >= atomic_load(&pager->capacity)) {
+        try(pager_ring_grow(pager, capacity + 1));
+        try(pager_directory_resize(pager, capacity));
+
+        // misses only use the new frames once the directory fits them
+        atomic_store(&pager->capacity, capacity);
+
+        return SUCCESS;
+    }
+
+    // misses evict down to the new capacity from now on
+    atomic_store(&pager->capacity, capacity);
+    while (atomic_load(&pager->page_count) > capacity) {
+        try(pager_evict(pager));
+    }
+
+    // evicted frames are kept on the free list, release their memory
+    uint32_t index;
+    while (pager_free_pop(pager, &index)) {
+        ring_entry_t* ring_entry = pager_ring(pager, index);
+        free(ring_entry->header);
+        ring_entry->header = nullptr;
+        atomic_store(&ring_entry->page_id, 0);
+    }
+
+    try(pager_directory_resize(pager, capacity));
+
+    return SUCCESS;
+}
+
+lsn_t
+pager_get_lsn(const page_t page) {
+    lsn_t lsn;
+    memcpy(&lsn, page.data, sizeof(lsn_t));
+
+    return lsn;
+}
+
+void
+pager_set_lsn(const page_t page, const lsn_t lsn) {
+    memcpy(page.data, &lsn, sizeof(lsn_t));
+}
+
+result_t
+pager_log(pager_t* pager, const page_t page, const uint8_t type, const blob_t payload) {
+    assert_latch_write_access(header_from_data(page.data)->latch);
+
+    if (pager->wal == nullptr) {
+        return SUCCESS;
+    }
+
+    // the end of the log before the append is a lower bound for the start of
+    // the record, checkpoints that miss it only miss records after their begin
+    header_t* header = header_from_data(page.data);
+    if (atomic_load(&header->recovery_lsn) == PAGE_CLEAN) {
+        atomic_store(&header->recovery_lsn, wal_get_end_lsn(pager->wal));
+    }
+
+    lsn_t lsn;
+    try(wal_append(pager->wal, type, page.id, payload, &lsn));
+    memcpy(page.data, &lsn, sizeof(lsn_t));
+
+    return SUCCESS;
+}
+
+result_t
+pager_log_image(pager_t* pager, const page_t page) {
+    return pager_log(pager, page, WAL_RECORD_PAGE_IMAGE, (blob_t){ pager->page_size, page.data });
+}
+
+result_t
+pager_flush(pager_t* pager) {
+    ensure(pager != nullptr);
+
+    if (pager->fd < 0) {
+        return SUCCESS;
+    }
+
+    const uint32_t size = atomic_load(&pager->size);
+    for (uint32_t i = 0; i < size; ++i) {
+        const page_id_t id = atomic_load(&pager_ring(pager, i)->page_id);
+        if (id == 0 || id == RING_ENTRY_FREEING || id == RING_ENTRY_FREE) {
+            continue;
+        }
+
+        // fix the page shared like pager_fix, but without touching the
+        // second chance bit
+        page_t page;
+        lookup_t lookup;
+        while (true) {
+            {
+                hash_entry_t* hash_entry = pager_directory_latch(pager, id, false);
+                defer(latch_release_read, hash_entry->latch);
+
+                lookup = pager_lookup(hash_entry, id, false, &page);
+            }
+
+            if (lookup != LOOKUP_LATCHED) {
+                break;
+            }
+            sched_yield();
+        }
+        if (lookup == LOOKUP_MISSING) {
+            continue;
+        }
+
+        header_t* header = header_from_data(page.data);
+        defer(latch_release_read, header->latch);
+
+        try(pager_write_back(pager, header));
+    }
+
+    if (fsync(pager->fd) != 0) {
+        failure(errno, msg("failed to sync page file"));
+    }
+
+    return SUCCESS;
+}
+
+/// Appends a checkpoint record with the collected entries of the dirty page
+/// table.
+static result_t
+pager_append_checkpoint(const pager_t* pager, unsigned char* buffer, const uint32_t count, lsn_t* out) {
+    const blob_t payload = { sizeof(lsn_t) + count * CHECKPOINT_ENTRY_SIZE, buffer };
+    try(wal_append(pager->wal, WAL_RECORD_CHECKPOINT, 0, payload, out));
+
+    return SUCCESS;
+}
+
+result_t
+pager_checkpoint(pager_t* pager) {
+    ensure(pager != nullptr);
+    ensure(pager->wal != nullptr);
+
+    unsigned char* buffer;
+    try_alloc(buffer, sizeof(lsn_t) + CHECKPOINT_RECORD_ENTRIES * CHECKPOINT_ENTRY_SIZE);
+    defer(free, buffer);
+
+    // changes logged after this point are found by the recovery without the
+    // dirty page table
+    pager_checkpoint_t checkpoint = { wal_get_end_lsn(pager->wal), 0 };
+    memcpy(buffer, &checkpoint.begin, sizeof(lsn_t));
+
+    uint32_t count = 0;
+    const uint32_t size = atomic_load(&pager->size);
+    for (uint32_t i = 0; i < size; ++i) {
+        const page_id_t id = atomic_load(&pager_ring(pager, i)->page_id);
+        if (id == 0 || id == RING_ENTRY_FREEING || id == RING_ENTRY_FREE) {
+            continue;
+        }
+
+        // only the hash map entry is latched, writers of the page proceed
+        lsn_t lsn;
+        {
+            hash_entry_t* hash_entry = pager_directory_latch(pager, id, false);
+            defer(latch_release_read, hash_entry->latch);
+
+            header_t* header;
+            if (!entry_directory_lookup(hash_entry, id, &header)) {
+                continue;
+            }
+            lsn = atomic_load(&header->recovery_lsn);
+        }
+
+        if (lsn == PAGE_CLEAN) {
+            continue;
+        }
+
+        unsigned char* entry = buffer + sizeof(lsn_t) + count * CHECKPOINT_ENTRY_SIZE;
+        memcpy(entry, &id, sizeof(page_id_t));
+        memcpy(entry + sizeof(page_id_t), &lsn, sizeof(lsn_t));
+
+        if (++count == CHECKPOINT_RECORD_ENTRIES) {
+            try(pager_append_checkpoint(pager, buffer, count, &checkpoint.end));
+            count = 0;
+        }
+    }
+
+    // the last record is appended even if it is empty, it marks the end
+    try(pager_append_checkpoint(pager, buffer, count, &checkpoint.end));
+    try(wal_flush(pager->wal, checkpoint.end));
+
+    if (pager->fd < 0) {
+        return SUCCESS;
+    }
+
+    if (pwrite(pager->fd, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint)) {
+        failure(errno, msg("failed to write checkpoint"), with_uint(checkpoint.end));
+    }
+    if (fsync(pager->fd) != 0) {
+        failure(errno, msg("failed to sync page file"));
+    }
+
+    return SUCCESS;
+}
+
+result_t
+pager_get_checkpoint(const pager_t* pager, pager_checkpoint_t* out) {
+    ensure(pager != nullptr);
+    ensure(out != nullptr);
+
+    *out = (pager_checkpoint_t){ 0, 0 };
+    if (pager->fd < 0) {
+        return SUCCESS;
+    }
+
+    const ssize_t result = pread(pager->fd, out, sizeof(pager_checkpoint_t), 0);
+    if (result < 0) {
+        failure(errno, msg("failed to read checkpoint"));
+    }
+    if (result != sizeof(pager_checkpoint_t)) {
+        *out = (pager_checkpoint_t){ 0, 0 };
+    }
+
+    return SUCCESS;
+}
+
+result_t
+pager_claim(pager_t* pager, const page_id_t id) {
     ensure(pager != nullptr);
+    ensure(id != 0);
+
+    latch_acquire_write(&pager->extent_latch);
+    defer(latch_release_write, pager->extent_latch);
+
+    const uint32_t extent = id / PAGER_EXTENT_SIZE;
+    if (extent >= pager->extent_count) {
+        uint32_t first;
+        try(pager_append_extents(pager, extent + 1 - pager->extent_count, &first));
+    }
+
+    atomic_fetch_or(&pager->extents[extent], 1ull << (id % PAGER_EXTENT_SIZE));
+
+    return SUCCESS;
+}
+
+bool
+pager_try_upgrade(const page_t page) {
+    header_t* header = header_from_data(page.data);
+    if (!latch_try_upgrade(&header->latch)) {
+        return false;
+    }
+
+    // only needs to be visible to this thread, latch was acquired exclusively
+    atomic_fetch_or_explicit(&header->flags, PAGE_FLAG_EXCLUSIVE, memory_order_relaxed);
+
+    return true;
+}
+
+void
+pager_set_read_mostly(const page_t page) {
+    latch_set_read_mostly(&header_from_data(page.data)->latch);
+}
+
+/// Unfixes a page and sets the second chance bit if the page is referenced
+/// and not on probation.
+static void
+pager_unfix_impl(const page_t page, const bool reference) {
+    header_t* header = header_from_data(page.data);
+
+    const uint8_t flags = atomic_load_explicit(&header->flags, memory_order_acquire);
+    const uint8_t ref = reference && !(flags & PAGE_FLAG_NEW) ? PAGE_FLAG_REF : 0;
+
+    if (flags & PAGE_FLAG_EXCLUSIVE) {
+        // latch guarantees exclusive access, safe to do non-CAS write
+        const uint8_t kept = flags & (PAGE_FLAG_REF | PAGE_FLAG_USAGE);
+        atomic_store_explicit(&header->flags, kept | PAGE_FLAG_DIRTY | ref, memory_order_relaxed);
+        latch_release_write(&header->latch);
+    } else {
+        // concurrent writes possible
+        if (flags & PAGE_FLAG_NEW) {
+            atomic_fetch_and_explicit(&header->flags, ~PAGE_FLAG_NEW, memory_order_seq_cst);
+        } else if (ref) {
+            atomic_fetch_or_explicit(&header->flags, ref, memory_order_seq_cst);
+        }
+        latch_release_read(&header->latch);
+    }
+}
+
+void
+pager_unfix(const page_t page) {
+    pager_unfix_impl(page, true);
+}
+
+void
+pager_unfix_once(const page_t page) {
+    pager_unfix_impl(page, false);
+}
+
+result_t
+pager_open_file(pager_t** out, const char* path, const uint16_t page_size, const uint32_t directory_size) {
+    ensure(out != nullptr);
+    ensure(path != nullptr);
+
+    const int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        failure(errno, msg("failed to open page file: %s", path));
+    }
+
+    struct stat stat;
+    if (fstat(fd, &stat) != 0) {
+        close(fd);
+        failure(errno, msg("failed to stat page file: %s", path));
+    }
+
+    pager_t* pager;
+    handle(pager_open(&pager, page_size, directory_size)) {
+        close(fd);
+        forward();
+    }
+    pager->fd = fd;
+
+    // the free space is not persisted, so every page in the file is treated
+    // as allocated
+    const uint64_t page_count = (uint64_t)stat.st_size / page_size;
+    if (page_count > PAGER_EXTENT_SIZE) {
+        const uint32_t extent_count = (uint32_t)((page_count + PAGER_EXTENT_SIZE - 1) / PAGER_EXTENT_SIZE);
+
+        latch_acquire_write(&pager->extent_latch);
+        uint32_t first;
+        handle(pager_append_extents(pager, extent_count - 1, &first)) {
+            latch_release_write(&pager->extent_latch);
+            close(fd);
+            pager->fd = -1;
+            try(pager_close(&pager));
+            forward();
+        }
+        latch_release_write(&pager->extent_latch);
+    }
+    for (uint64_t id = 0; id < page_count; ++id) {
+        pager->extents[id / PAGER_EXTENT_SIZE] |= 1ull << (id % PAGER_EXTENT_SIZE);
+    }
+    pager->extent_hint = pager->extent_count;
+
+    *out = pager;
+
+    return SUCCESS;
+}
+
+void
+pager_set_wal(pager_t* pager, wal_t* wal) {
+    pager->wal = wal;
+}
+
+result_t
+pager_close(pager_t** out) {
     ensure(out != nullptr);
 
-    // no rollback on error, fine for this temporary solution
-    const page_id_t next_page = atomic_fetch_add(&pager->next_page, 1);
+    pager_t* pager = *out;
+
+    if (pager->fd >= 0) {
+        try(pager_flush(pager));
+        close(pager->fd);
+    }
+
+    pager_ring_free(pager);
+
+    // a failed resize might have left a partially filled directory behind
+    directory_t* directory = pager->directory;
+    if (directory->next != nullptr) {
+        pager_directory_free(directory->next);
+    }
+    while (directory != nullptr) {
+        directory_t* retired = directory->retired;
+        pager_directory_free(directory);
+        directory = retired;
+    }
+
+    pthread_mutex_destroy(&pager->resize_mutex);
+    free(pager->extents);
+
+    free(pager);
+    *out = nullptr;
+
+    return SUCCESS;
+}
+
+/// Fixes a hot page twice and fills the pager with pages that are used once,
+/// returns whether the hot page survives the next miss. The CLOCK hand starts
+/// at the hot page.
+TEST_ONLY static bool
+test_policy_keeps_hot(pager_t* pager, const pager_policy_t policy, const bool once) {
+    pager_set_policy(pager, policy);
+
+    page_t page;
+    for (uint32_t i = 0; i < 2; ++i) {
+        assert_success(pager_fix(pager, 1, false, &page));
+        pager_unfix(page);
+    }
+
+    for (page_id_t id = 2; id < pager->size; ++id) {
+        assert_success(pager_fix(pager, id, false, &page));
+        if (once) {
+            pager_unfix_once(page);
+        } else {
+            pager_unfix(page);
+        }
+    }
+    assert_success(pager_fix(pager, pager->size, false, &page));
+    pager_unfix(page);
+
+    pager_stats_t before;
+    pager_stats_snapshot(&before);
+    assert_success(pager_fix(pager, 1, false, &page));
+    pager_unfix(page);
 
-    return pager_fix(pager, next_page, true, out);
+    pager_stats_t after;
+    pager_stats_snapshot(&after);
+    return after.misses == before.misses;
 }
 
-void
-pager_unfix(const page_t page) {
-    header_t* header = header_from_data(page.data);
+describe(pager) {
+    static pager_t* pager;
+
+    before_each() {
+        assert_success(pager_open(&pager, 124, 64));
+    }
+
+    after_each() {
+        assert_success(pager_close(&pager));
+        error_clear();
+    }
+
+    it("alignment") {
+        // the buffer for the page and header is allocated by malloc with
+        // the correct alignment, so the header size has to be a multiple of
+        // the guaranteed alignment in order for the data to have the right
+        // alignment
+        assertis(sizeof(header_t) % PAGE_ALIGNMENT == 0);
+    }
+
+    it("fix a page") {
+        page_t page;
+        assert_success(pager_fix(pager, 3, false, &page));
+        asserteq_uint(page.id, 3);
+        assertis((intptr_t)page.data % PAGE_ALIGNMENT == 0);
+    }
+
+    it("fix the same page twice") {
+        page_t first;
+        assert_success(pager_fix(pager, 3, false, &first));
+        page_t second;
+        assert_success(pager_fix(pager, 3, false, &second));
+
+        asserteq_uint(first.id, second.id);
+        asserteq_ptr(first.data, second.data);
+    }
+
+    it("fix two different pages") {
+        page_t first;
+        assert_success(pager_fix(pager, 3, false, &first));
+        page_t second;
+        assert_success(pager_fix(pager, 4, false, &second));
+
+        assertneq_uint(first.id, second.id);
+        assertneq_ptr(first.data, second.data);
+    }
+
+    it("count hits, misses and evictions") {
+        pager_stats_t before;
+        pager_stats_snapshot(&before);
+
+        for (page_id_t i = 1; i <= 100; ++i) {
+            page_t page;
+            assert_success(pager_fix(pager, i, false, &page));
+            pager_unfix(page);
+        }
+        page_t page;
+        assert_success(pager_fix(pager, 100, false, &page));
+        pager_unfix(page);
+
+        pager_stats_t after;
+        pager_stats_snapshot(&after);
+        asserteq_uint(after.hits - before.hits, 1);
+        asserteq_uint(after.misses - before.misses, 100);
+        assertis(after.evictions - before.evictions > 0);
+        assertis(after.evict_scanned - before.evict_scanned >= after.evictions - before.evictions);
+    }
+
+    it("record miss latencies") {
+        stats_set_sample_rate(1);
+
+        stats_latency_t before;
+        stats_latency_snapshot(STATS_HISTOGRAM_PAGER_MISS, &before);
+
+        for (page_id_t i = 1; i <= 100; ++i) {
+            page_t page;
+            assert_success(pager_fix(pager, i, false, &page));
+            pager_unfix(page);
+        }
+
+        // the countdown of the previous rate might skip the first misses
+        stats_latency_t after;
+        stats_latency_snapshot(STATS_HISTOGRAM_PAGER_MISS, &after);
+        stats_set_sample_rate(STATS_DEFAULT_SAMPLE_RATE);
+
+        assertis(after.count - before.count >= 100 - STATS_DEFAULT_SAMPLE_RATE);
+        assertis(stats_latency_percentile(&after, 0.5) > 0);
+    }
+
+    it("evict a batch of pages per sweep") {
+        for (page_id_t id = 1; id < pager->size; ++id) {
+            page_t page;
+            assert_success(pager_fix(pager, id, false, &page));
+            pager_unfix_once(page);
+        }
+
+        pager_stats_t before;
+        pager_stats_snapshot(&before);
+
+        page_t page;
+        assert_success(pager_fix(pager, pager->size, false, &page));
+        pager_unfix(page);
+
+        pager_stats_t after;
+        pager_stats_snapshot(&after);
+        asserteq_uint(after.evictions - before.evictions, PAGER_EVICT_BATCH);
+        asserteq_uint(after.evict_scanned - before.evict_scanned, PAGER_EVICT_BATCH);
+
+        // the following misses reuse the evicted frames without a sweep
+        for (page_id_t id = pager->size + 1; id < pager->size + PAGER_EVICT_BATCH; ++id) {
+            assert_success(pager_fix(pager, id, false, &page));
+            pager_unfix(page);
+        }
+
+        pager_stats_snapshot(&before);
+        asserteq_uint(before.evict_scanned, after.evict_scanned);
+        asserteq_uint(pager->page_count, pager->size - 1);
+    }
+
+    it("open a pager by pool size") {
+        pager_t* other;
+        assert_success(pager_open_capacity(&other, 124, (sizeof(header_t) + 124) * 100));
+        asserteq_uint(other->capacity, 100);
+        asserteq_uint(other->directory->mask + 1, 256);
+
+        pager_stats_t before;
+        pager_stats_snapshot(&before);
+
+        for (page_id_t id = 1; id <= 100; ++id) {
+            page_t page;
+            assert_success(pager_fix(other, id, false, &page));
+            pager_unfix(page);
+        }
+
+        pager_stats_t after;
+        pager_stats_snapshot(&after);
+        asserteq_uint(after.evictions, before.evictions);
+
+        assert_success(pager_close(&other));
+        assert_failure(pager_open_capacity(&other, 124, 124), EINVAL);
+    }
+
+    it("grow the pool") {
+        for (page_id_t id = 1; id <= pager->capacity; ++id) {
+            page_t page;
+            assert_success(pager_fix(pager, id, true, &page));
+            page.data[8] = (unsigned char)id;
+            pager_unfix(page);
+        }
+
+        assert_success(pager_resize(pager, (sizeof(header_t) + 124) * 200));
+        asserteq_uint(pager->capacity, 200);
+        asserteq_uint(pager->directory->mask + 1, 512);
+
+        pager_stats_t before;
+        pager_stats_snapshot(&before);
+
+        // the cached pages are found in the new directory
+        page_t page;
+        for (page_id_t id = 1; id <= 43; ++id) {
+            assert_success(pager_fix(pager, id, false, &page));
+            asserteq_uint(page.data[8], id);
+            pager_unfix(page);
+        }
+        for (page_id_t id = 44; id <= 200; ++id) {
+            assert_success(pager_fix(pager, id, false, &page));
+            pager_unfix(page);
+        }
 
-    const uint8_t flags = atomic_load_explicit(&header->flags, memory_order_acquire);
-    if (flags & PAGE_FLAG_EXCLUSIVE) {
-        // latch guarantees exclusive access, safe to do non-CAS write
-        atomic_store_explicit(&header->flags, PAGE_FLAG_DIRTY | PAGE_FLAG_REF, memory_order_relaxed);
-        latch_release_write(&header->latch);
-    } else {
-        // concurrent writes possible
-        atomic_fetch_or_explicit(&header->flags, PAGE_FLAG_REF, memory_order_seq_cst);
-        latch_release_read(&header->latch);
+        pager_stats_t after;
+        pager_stats_snapshot(&after);
+        asserteq_uint(after.hits - before.hits, 43);
+        asserteq_uint(after.evictions, before.evictions);
     }
-}
 
-result_t
-pager_close(pager_t** out) {
-    ensure(out != nullptr);
+    it("shrink the pool") {
+        for (page_id_t id = 1; id <= pager->capacity; ++id) {
+            page_t page;
+            assert_success(pager_fix(pager, id, true, &page));
+            page.data[8] = (unsigned char)id;
+            pager_unfix(page);
+        }
 
-    pager_t* pager = *out;
+        assert_success(pager_resize(pager, (sizeof(header_t) + 124) * 8));
+        asserteq_uint(pager->capacity, 8);
+        asserteq_uint(pager->directory->mask + 1, 16);
+        assertis(pager->page_count <= 8);
 
-    for (uint32_t i = 0; i < pager->size; ++i) {
-        const ring_entry_t* ring_entry = &pager->ring[i];
-        if (ring_entry->header != nullptr) {
-            free(ring_entry->header);
+        // the frames of the evicted pages are released
+        uint32_t frames = 0;
+        for (uint32_t i = 0; i < pager->size; ++i) {
+            frames += pager_ring(pager, i)->header != nullptr;
         }
-    }
-    free(pager->ring);
+        asserteq_uint(frames, pager->page_count);
 
-    for (uint32_t i = 0; i <= pager->mask; ++i) {
-        bucket_t* bucket = pager->directory[i].overflow;
-        while (bucket != nullptr) {
-            bucket_t* next = bucket->next;
-            free(bucket);
-            bucket = next;
+        // the remaining pages are found in the new directory
+        for (page_id_t id = 1; id <= 43; ++id) {
+            page_t page;
+            assert_success(pager_fix(pager, id, false, &page));
+            assertis(page.data[8] == id || page.data[8] == 0);
+            pager_unfix(page);
         }
+        assertis(pager->page_count <= 8);
     }
-    free(pager->directory);
 
-    free(pager);
-    *out = nullptr;
+    it("keep the smaller capacity if pages are fixed") {
+        page_t pages[8];
+        for (page_id_t id = 1; id <= 8; ++id) {
+            assert_success(pager_fix(pager, id, false, &pages[id - 1]));
+        }
 
-    return SUCCESS;
-}
+        assert_failure(pager_resize(pager, (sizeof(header_t) + 124) * 4), ENOMEM);
+        asserteq_uint(pager->capacity, 4);
+        error_clear();
 
-describe(pager) {
-    static pager_t* pager;
+        for (page_id_t id = 1; id <= 8; ++id) {
+            pager_unfix(pages[id - 1]);
+        }
 
-    before_each() {
-        assert_success(pager_open(&pager, 124, 64));
+        page_t page;
+        assert_success(pager_fix(pager, 9, false, &page));
+        pager_unfix(page);
+        assertis(pager->page_count <= 4);
     }
 
-    after_each() {
-        assert_success(pager_close(&pager));
-        error_clear();
-    }
+    parallel("resize while fixing pages", 8) {
+        if (thread_index() == 0) {
+            for (uint32_t i = 0; i < 64; ++i) {
+                const uint64_t frames = i % 2 == 0 ? 512 : 16;
+                assert_success(pager_resize(pager, (sizeof(header_t) + 124) * frames));
+            }
+            return;
+        }
 
-    it("alignment") {
-        // the buffer for the page and header is allocated by malloc with
-        // the correct alignment, so the header size has to be a multiple of
-        // the guaranteed alignment in order for the data to have the right
-        // alignment
-        assertis(sizeof(header_t) % PAGE_ALIGNMENT == 0);
+        for (uint32_t i = 1; i <= 4096; ++i) {
+            const page_id_t id = i % 600 + 1;
+
+            page_t page;
+            assert_success(pager_fix(pager, id, true, &page));
+            asserteq_uint(header_from_data(page.data)->id, id);
+            pager_unfix(page);
+        }
     }
 
-    it("fix a page") {
-        page_t page;
-        assert_success(pager_fix(pager, 3, false, &page));
-        asserteq_uint(page.id, 3);
-        assertis((intptr_t)page.data % PAGE_ALIGNMENT == 0);
+    it("replace referenced pages by a scan") {
+        assertis(!test_policy_keeps_hot(pager, PAGER_POLICY_CLOCK, false));
     }
 
-    it("fix the same page twice") {
-        page_t first;
-        assert_success(pager_fix(pager, 3, false, &first));
-        page_t second;
-        assert_success(pager_fix(pager, 3, false, &second));
+    it("keep referenced pages if the scan uses pages once") {
+        assertis(test_policy_keeps_hot(pager, PAGER_POLICY_CLOCK, true));
+    }
 
-        asserteq_uint(first.id, second.id);
-        asserteq_ptr(first.data, second.data);
+    it("evict pages on probation first") {
+        assertis(test_policy_keeps_hot(pager, PAGER_POLICY_PROBATION, false));
     }
 
-    it("fix two different pages") {
-        page_t first;
-        assert_success(pager_fix(pager, 3, false, &first));
-        page_t second;
-        assert_success(pager_fix(pager, 4, false, &second));
+    it("count the usage of referenced pages") {
+        assertis(test_policy_keeps_hot(pager, PAGER_POLICY_FREQUENCY, false));
 
-        assertneq_uint(first.id, second.id);
-        assertneq_ptr(first.data, second.data);
+        // the pass of the hand turned the reference into one usage count
+        page_t page;
+        assert_success(pager_fix(pager, 1, false, &page));
+        const uint8_t flags = atomic_load(&header_from_data(page.data)->flags);
+        pager_unfix(page);
+
+        asserteq_uint((flags & PAGE_FLAG_USAGE) >> PAGE_USAGE_SHIFT, 1);
     }
 
     it("acquire the page latch") {
@@ -532,7 +2065,7 @@ describe(pager) {
         asserteq_int(header_from_data(page.data)->latch, 1);
 
         assert_success(pager_fix(pager, 4, true, &page));
-        asserteq_int(header_from_data(page.data)->latch, -1);
+        asserteq_int(header_from_data(page.data)->latch, LATCH_WRITER);
     }
 
     it("fill pager") {
@@ -566,10 +2099,117 @@ describe(pager) {
         asserteq_int(header_from_data(page.data)->latch, 0);
 
         assert_success(pager_fix(pager, 3, true, &page));
-        asserteq_int(header_from_data(page.data)->latch, -1);
+        asserteq_int(header_from_data(page.data)->latch, LATCH_WRITER);
+
+        pager_unfix(page);
+        asserteq_int(header_from_data(page.data)->latch, 0);
+    }
+
+    it("share read-mostly pages") {
+        page_t page, other;
+        assert_success(pager_fix(pager, 3, false, &page));
+        pager_set_read_mostly(page);
+
+        assert_success(pager_fix(pager, 3, false, &other));
+        asserteq_int(header_from_data(page.data)->latch & LATCH_READERS, 1);
+        pager_unfix(page);
+        pager_unfix(other);
+
+        assert_success(pager_fix(pager, 3, true, &page));
+        asserteq_int(header_from_data(page.data)->latch & LATCH_WRITER, LATCH_WRITER);
+        pager_unfix(page);
+    }
+
+    it("upgrade the page latch") {
+        page_t page, other;
+        assert_success(pager_fix(pager, 3, false, &page));
+        assert_success(pager_fix(pager, 3, false, &other));
+        assertis(!pager_try_upgrade(page));
+
+        pager_unfix(other);
+        assertis(pager_try_upgrade(page));
+        asserteq_int(header_from_data(page.data)->latch, LATCH_WRITER);
 
         pager_unfix(page);
         asserteq_int(header_from_data(page.data)->latch, 0);
+        assertis(atomic_load(&header_from_data(page.data)->flags) & PAGE_FLAG_DIRTY);
+    }
+
+    it("allocate pages in new extents") {
+        page_t first;
+        assert_success(pager_next(pager, &first));
+        assertis(first.id > PAGER_META_PAGE);
+
+        page_t second;
+        assert_success(pager_next(pager, &second));
+        asserteq_uint(second.id / PAGER_EXTENT_SIZE, first.id / PAGER_EXTENT_SIZE + 1);
+    }
+
+    it("allocate pages close to the hint") {
+        page_t first;
+        assert_success(pager_next(pager, &first));
+
+        page_t page = first;
+        for (uint32_t i = 1; i < PAGER_EXTENT_SIZE; ++i) {
+            assert_success(pager_alloc(pager, page.id, &page));
+            asserteq_uint(page.id, first.id + i);
+            pager_unfix(page);
+        }
+
+        // the extent is full, the next page is placed in a new extent
+        assert_success(pager_alloc(pager, page.id, &page));
+        asserteq_uint(page.id, first.id + PAGER_EXTENT_SIZE);
+    }
+
+    it("reserve consecutive page ids") {
+        page_id_t first;
+        assert_success(pager_reserve(pager, PAGER_EXTENT_SIZE + 4, &first));
+        asserteq_uint(first % PAGER_EXTENT_SIZE, 0);
+
+        page_t page;
+        assert_success(pager_alloc(pager, first + PAGER_EXTENT_SIZE, &page));
+        asserteq_uint(page.id, first + PAGER_EXTENT_SIZE + 4);
+
+        pager_release(pager, first, PAGER_EXTENT_SIZE);
+        pager_unfix(page);
+    }
+
+    it("free a page") {
+        page_t page;
+        assert_success(pager_next(pager, &page));
+        page.data[0] = 42;
+
+        const page_id_t id = page.id;
+        pager_free(pager, page);
+        asserteq_uint(pager->page_count, 0);
+
+        // the freed id is reused and the page is zeroed
+        assert_success(pager_next(pager, &page));
+        asserteq_uint(page.id, id);
+        asserteq_uint(page.data[0], 0);
+    }
+
+    it("reuse freed extents") {
+        for (uint32_t i = 1; i <= pager->size * 10; ++i) {
+            page_t page;
+            assert_success(pager_next(pager, &page));
+            pager_free(pager, page);
+        }
+
+        asserteq_uint(pager->page_count, 0);
+        asserteq_uint(pager->extent_count, 2);
+    }
+
+    parallel("allocate and free pages", 8) {
+        page_t pages[4];
+        for (uint32_t i = 0; i < pager->size; ++i) {
+            assert_success(pager_alloc(pager, i % 4 == 0 ? 0 : pages[i % 4 - 1].id, &pages[i % 4]));
+            if (i % 4 == 3) {
+                for (uint32_t k = 0; k < 4; ++k) {
+                    pager_free(pager, pages[k]);
+                }
+            }
+        }
     }
 
     parallel("fix and unfix pages non-exclusive", 8) {
@@ -585,8 +2225,368 @@ describe(pager) {
         for (uint32_t i = 1; i <= pager->size * 10; ++i) {
             page_t page;
             assert_success(pager_fix(pager, i, true, &page));
-            assertis(header_from_data(page.data)->latch == -1);
+            assertis((header_from_data(page.data)->latch & (LATCH_WRITER | LATCH_READERS)) == LATCH_WRITER);
+            pager_unfix(page);
+        }
+    }
+
+    bench("fix and unfix cached pages", 1) {
+        bench_loop() {
+            page_t page;
+            assert_success(pager_fix(pager, bench_iteration() % 32 + 1, false, &page));
+            pager_unfix(page);
+        }
+    }
+
+    bench("fix and unfix cached pages", 8) {
+        bench_loop() {
+            page_t page;
+            assert_success(pager_fix(pager, bench_iteration() % 32 + 1, false, &page));
+            pager_unfix(page);
+        }
+    }
+}
+
+describe(pager_file) {
+    static char path[32];
+    static pager_t* pager;
+
+    before_each() {
+        strcpy(path, "/tmp/wednesday-pages-XXXXXX");
+        const int fd = mkstemp(path);
+        assertis(fd >= 0);
+        close(fd);
+
+        assert_success(pager_open_file(&pager, path, 128, 16));
+    }
+
+    after_each() {
+        assert_success(pager_close(&pager));
+        unlink(path);
+        error_clear();
+    }
+
+    it("read back evicted pages") {
+        page_id_t ids[100];
+        for (uint32_t i = 0; i < 100; ++i) {
+            page_t page;
+            assert_success(pager_next(pager, &page));
+            memset(page.data, (int)i, pager->page_size);
+            ids[i] = page.id;
+            pager_unfix(page);
+        }
+
+        for (uint32_t i = 0; i < 100; ++i) {
+            page_t page;
+            assert_success(pager_fix(pager, ids[i], false, &page));
+            asserteq_uint(page.data[0], i);
+            asserteq_uint(page.data[pager->page_size - 1], i);
             pager_unfix(page);
         }
     }
+
+    parallel("modify pages during their write back", 8) {
+        page_id_t ids[8];
+        unsigned char counts[8] = { 0 };
+        for (uint32_t i = 0; i < 8; ++i) {
+            page_t page;
+            assert_success(pager_next(pager, &page));
+            ids[i] = page.id;
+            pager_unfix(page);
+        }
+
+        // every fix is likely to evict a dirty page of another thread, changes
+        // made while it is written back must not get lost
+        for (uint32_t i = 0; i < 512; ++i) {
+            const uint32_t k = (i * 5 + thread_index()) % 8;
+
+            page_t page;
+            assert_success(pager_fix(pager, ids[k], true, &page));
+            asserteq_uint(page.data[sizeof(lsn_t)], counts[k]);
+            page.data[sizeof(lsn_t)] = ++counts[k];
+            pager_unfix(page);
+        }
+    }
+
+    it("reopen page file") {
+        page_t page;
+        assert_success(pager_next(pager, &page));
+        const page_id_t id = page.id;
+        memcpy(page.data + sizeof(lsn_t), "hello", 5);
+        pager_unfix(page);
+
+        assert_success(pager_close(&pager));
+        assert_success(pager_open_file(&pager, path, 128, 16));
+
+        assert_success(pager_fix(pager, id, false, &page));
+        asserteq_int(memcmp(page.data + sizeof(lsn_t), "hello", 5), 0);
+        pager_unfix(page);
+
+        // pages in the file are not handed out again
+        assert_success(pager_next(pager, &page));
+        assertis(page.id > id);
+        pager_unfix(page);
+    }
+
+    it("flush the log before writing back") {
+        char wal_path[32] = "/tmp/wednesday-wal-XXXXXX";
+        const int fd = mkstemp(wal_path);
+        assertis(fd >= 0);
+        close(fd);
+
+        wal_t* wal;
+        assert_success(wal_open(&wal, wal_path));
+        pager_set_wal(pager, wal);
+
+        page_t page;
+        assert_success(pager_next(pager, &page));
+        page.data[sizeof(lsn_t)] = 42;
+        assert_success(pager_log_image(pager, page));
+        const lsn_t lsn = pager_get_lsn(page);
+        pager_unfix(page);
+
+        assertis(lsn > 0);
+        asserteq_uint(wal_get_flushed_lsn(wal), 0);
+
+        assert_success(pager_flush(pager));
+        asserteq_uint(wal_get_flushed_lsn(wal), lsn);
+
+        pager_set_wal(pager, nullptr);
+        assert_success(wal_close(&wal));
+        unlink(wal_path);
+    }
+
+    it("checkpoint the dirty pages") {
+        char wal_path[32] = "/tmp/wednesday-wal-XXXXXX";
+        const int fd = mkstemp(wal_path);
+        assertis(fd >= 0);
+        close(fd);
+
+        wal_t* wal;
+        assert_success(wal_open(&wal, wal_path));
+        pager_set_wal(pager, wal);
+
+        pager_checkpoint_t checkpoint;
+        assert_success(pager_get_checkpoint(pager, &checkpoint));
+        asserteq_uint(checkpoint.end, 0);
+
+        page_t page;
+        assert_success(pager_next(pager, &page));
+        const lsn_t start = wal_get_end_lsn(wal);
+        assert_success(pager_log_image(pager, page));
+        pager_unfix(page);
+
+        assert_success(pager_checkpoint(pager));
+        assert_success(pager_get_checkpoint(pager, &checkpoint));
+        asserteq_uint(checkpoint.end, wal_get_flushed_lsn(wal));
+
+        // the checkpoint record lists the page with the start of its record
+        lsn_t cursor = checkpoint.begin;
+        wal_record_t record;
+        bool found;
+        assert_success(wal_read(wal, &cursor, &record, &found));
+        assertis(found);
+        asserteq_uint(record.type, WAL_RECORD_CHECKPOINT);
+        asserteq_uint(record.payload.size, sizeof(lsn_t) + CHECKPOINT_ENTRY_SIZE);
+
+        page_id_t id;
+        lsn_t recovery_lsn;
+        memcpy(&id, record.payload.data + sizeof(lsn_t), sizeof(page_id_t));
+        memcpy(&recovery_lsn, record.payload.data + sizeof(lsn_t) + sizeof(page_id_t), sizeof(lsn_t));
+        asserteq_uint(id, page.id);
+        asserteq_uint(recovery_lsn, start);
+
+        // written pages are no longer part of the next checkpoint
+        assert_success(pager_flush(pager));
+        assert_success(pager_checkpoint(pager));
+        assert_success(pager_get_checkpoint(pager, &checkpoint));
+
+        cursor = checkpoint.begin;
+        assert_success(wal_read(wal, &cursor, &record, &found));
+        assertis(found);
+        asserteq_uint(record.payload.size, sizeof(lsn_t));
+
+        pager_set_wal(pager, nullptr);
+        assert_success(wal_close(&wal));
+        unlink(wal_path);
+    }
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pager_t* pager;
+
+    /// Fixes of the hot pages of scan benchmarks and how many of them missed.
+    _Atomic uint64_t hot_fixes;
+    _Atomic uint64_t hot_misses;
+} test_bench_t;
+
+/// Opens the pager of a benchmark on the first thread that gets here.
+TEST_ONLY static pager_t*
+test_bench_open(test_bench_t* bench, const uint32_t directory_size) {
+    pthread_mutex_lock(&bench->mutex);
+    if (bench->pager == nullptr) {
+        assert_success(pager_open(&bench->pager, 124, directory_size));
+    }
+    pthread_mutex_unlock(&bench->mutex);
+
+    return bench->pager;
+}
+
+/// Fixes pages out of a working set, which is a multiple of the capacity of
+/// the pager, so that a share of the fixes misses for working sets above one.
+TEST_ONLY static void
+test_bench_fix(
+  test_bench_t* bench,
+  const uint32_t directory_size,
+  const double working_set,
+  const bool exclusive,
+  const bool zipf
+) {
+    pager_t* pager = test_bench_open(bench, directory_size);
+    const uint32_t count = (uint32_t)(pager->size * working_set);
+
+    ycsb_generator_t generator;
+    ycsb_generator_init(&generator, zipf ? YCSB_ZIPFIAN : YCSB_UNIFORM, count, thread_index());
+
+    bench_loop() {
+        const page_id_t id = (page_id_t)ycsb_next_key(&generator, count) + 1;
+
+        page_t page;
+        assert_success(pager_fix(pager, id, exclusive, &page));
+        pager_unfix(page);
+    }
+}
+
+/// Fixes hot pages, which fill half of the pager, interleaved with a scan over
+/// eight times the capacity of the pager. The trace is the same for every
+/// policy, so the misses of the hot pages compare the policies.
+TEST_ONLY static void
+test_bench_scan(test_bench_t* bench, const pager_policy_t policy, const bool once) {
+    pager_t* pager = test_bench_open(bench, 4096);
+    pager_set_policy(pager, policy);
+
+    const uint32_t hot = pager->size / 2;
+    const uint32_t scan = pager->size * 8;
+
+    ycsb_generator_t generator;
+    ycsb_generator_init(&generator, YCSB_ZIPFIAN, hot, thread_index());
+
+    uint64_t fixes = 0;
+    uint64_t misses = 0;
+    uint32_t cursor = 0;
+
+    bench_loop() {
+        page_t page;
+
+        // every fourth fix belongs to the scan
+        if (fixes % 3 == 2) {
+            assert_success(pager_fix(pager, hot + 1 + cursor, false, &page));
+            if (once) {
+                pager_unfix_once(page);
+            } else {
+                pager_unfix(page);
+            }
+            cursor = (cursor + 1) % scan;
+        }
+
+        const uint64_t before = stats_local_count(STATS_PAGER_MISSES);
+        assert_success(pager_fix(pager, (page_id_t)ycsb_next_key(&generator, hot) + 1, false, &page));
+        pager_unfix(page);
+
+        misses += stats_local_count(STATS_PAGER_MISSES) - before;
+        fixes += 1;
+    }
+
+    atomic_fetch_add(&bench->hot_fixes, fixes);
+    atomic_fetch_add(&bench->hot_misses, misses);
+}
+
+describe(pager_bench) {
+    static test_bench_t bench = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+    after_each() {
+        pager_stats_t stats;
+        pager_stats_snapshot(&stats);
+        bench_counter("misses", stats.misses);
+        bench_counter("evictions", stats.evictions);
+        bench_counter("second chances", stats.evict_cleared);
+
+        const uint64_t hot_fixes = atomic_exchange(&bench.hot_fixes, 0);
+        if (hot_fixes > 0) {
+            bench_counter("hot fixes", hot_fixes);
+            bench_counter("hot misses", atomic_exchange(&bench.hot_misses, 0));
+        }
+
+        assert_success(pager_close(&bench.pager));
+        error_clear();
+    }
+
+    // scaling of hits, the working set fits into the pager
+    bench("shared, uniform, working set 0.5", 1) {
+        test_bench_fix(&bench, 4096, 0.5, false, false);
+    }
+    bench("shared, uniform, working set 0.5", 2) {
+        test_bench_fix(&bench, 4096, 0.5, false, false);
+    }
+    bench("shared, uniform, working set 0.5", 4) {
+        test_bench_fix(&bench, 4096, 0.5, false, false);
+    }
+    bench("shared, uniform, working set 0.5", 8) {
+        test_bench_fix(&bench, 4096, 0.5, false, false);
+    }
+    bench("exclusive, uniform, working set 0.5", 1) {
+        test_bench_fix(&bench, 4096, 0.5, true, false);
+    }
+    bench("exclusive, uniform, working set 0.5", 4) {
+        test_bench_fix(&bench, 4096, 0.5, true, false);
+    }
+    bench("exclusive, uniform, working set 0.5", 8) {
+        test_bench_fix(&bench, 4096, 0.5, true, false);
+    }
+    bench("shared, zipf, working set 0.5", 8) {
+        test_bench_fix(&bench, 4096, 0.5, false, true);
+    }
+    bench("exclusive, zipf, working set 0.5", 8) {
+        test_bench_fix(&bench, 4096, 0.5, true, true);
+    }
+
+    // hit ratio, the working set exceeds the pager
+    bench("shared, uniform, working set 2", 1) {
+        test_bench_fix(&bench, 4096, 2, false, false);
+    }
+    bench("shared, uniform, working set 2", 8) {
+        test_bench_fix(&bench, 4096, 2, false, false);
+    }
+    bench("shared, uniform, working set 8", 8) {
+        test_bench_fix(&bench, 4096, 8, false, false);
+    }
+    bench("shared, zipf, working set 2", 8) {
+        test_bench_fix(&bench, 4096, 2, false, true);
+    }
+    bench("shared, zipf, working set 8", 8) {
+        test_bench_fix(&bench, 4096, 8, false, true);
+    }
+
+    // scan resistance of the replacement policies
+    bench("scan, clock", 1) {
+        test_bench_scan(&bench, PAGER_POLICY_CLOCK, false);
+    }
+    bench("scan, clock, use once", 1) {
+        test_bench_scan(&bench, PAGER_POLICY_CLOCK, true);
+    }
+    bench("scan, probation", 1) {
+        test_bench_scan(&bench, PAGER_POLICY_PROBATION, false);
+    }
+    bench("scan, frequency", 1) {
+        test_bench_scan(&bench, PAGER_POLICY_FREQUENCY, false);
+    }
+
+    // directory size, the capacity grows with it
+    bench("shared, uniform, working set 0.5, directory 256", 8) {
+        test_bench_fix(&bench, 256, 0.5, false, false);
+    }
+    bench("shared, uniform, working set 0.5, directory 65536", 8) {
+        test_bench_fix(&bench, 65536, 0.5, false, false);
+    }
 }
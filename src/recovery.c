@@ -0,0 +1,654 @@
+#include "recovery.h"
+
+#include "btree.h"
+#include "deffer.h"
+#include "util.h"
+#include "winter.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/// Minimum capacity of a batch of records handed to a worker.
+#define RECOVERY_BATCH_SIZE (1u << 16)
+
+/// Maximum number of batches queued per worker, the reader waits for the
+/// worker once its queue is full.
+#define RECOVERY_QUEUE_SIZE 4
+
+/// Records of a worker. Every record is stored as wal_record_t followed by its
+/// payload, padded to a multiple of eight bytes.
+typedef struct recovery_batch {
+    struct recovery_batch* next;
+    uint32_t size;
+    uint32_t capacity;
+    alignas(8) unsigned char data[];
+} recovery_batch_t;
+
+typedef struct {
+    pager_t* pager;
+    pthread_t thread;
+
+    /// Protects the queue, signalled whenever a batch is added or removed.
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    recovery_batch_t* head;
+    recovery_batch_t* tail;
+    uint32_t queued;
+
+    /// Set by the reader after the last batch was queued.
+    bool closed;
+
+    /// Batch that is filled by the reader, only accessed by the reader.
+    recovery_batch_t* current;
+
+    /// Error code and page of the first failed record, only accessed by the
+    /// worker until it is joined.
+    int32_t error;
+    page_id_t error_page;
+
+    uint64_t redo_count;
+} recovery_worker_t;
+
+/// Recovery LSN of a page, see pager_checkpoint.
+typedef struct {
+    page_id_t page;
+    lsn_t lsn;
+} recovery_page_t;
+
+/// Open addressing hash map of the dirty page table, zero marks empty slots.
+typedef struct {
+    recovery_page_t* entries;
+    uint32_t capacity;
+    uint32_t count;
+} recovery_table_t;
+
+typedef struct {
+    pager_t* pager;
+    wal_t* wal;
+    pager_checkpoint_t checkpoint;
+    recovery_table_t table;
+
+    recovery_worker_t* workers;
+    uint32_t worker_count;
+
+    recovery_stats_t stats;
+} recovery_t;
+
+static uint32_t
+recovery_table_slot(const recovery_table_t* table, const page_id_t page) {
+    uint32_t slot = (page * 2654435761u) & (table->capacity - 1);
+    while (table->entries[slot].page != 0 && table->entries[slot].page != page) {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    return slot;
+}
+
+static recovery_page_t*
+recovery_table_find(const recovery_table_t* table, const page_id_t page) {
+    if (table->capacity == 0) {
+        return nullptr;
+    }
+
+    recovery_page_t* entry = &table->entries[recovery_table_slot(table, page)];
+    return entry->page == page ? entry : nullptr;
+}
+
+/// Inserts the recovery LSN of a page, keeps the smaller LSN if the page is
+/// already in the table.
+static result_t
+recovery_table_insert(recovery_table_t* table, const page_id_t page, const lsn_t lsn) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        recovery_table_t grown = { nullptr, max(table->capacity * 2, 64u), 0 };
+        try_alloc(grown.entries, sizeof(recovery_page_t) * grown.capacity);
+
+        for (uint32_t i = 0; i < table->capacity; ++i) {
+            if (table->entries[i].page != 0) {
+                grown.entries[recovery_table_slot(&grown, table->entries[i].page)] = table->entries[i];
+                grown.count += 1;
+            }
+        }
+
+        free(table->entries);
+        *table = grown;
+    }
+
+    recovery_page_t* entry = &table->entries[recovery_table_slot(table, page)];
+    if (entry->page == 0) {
+        *entry = (recovery_page_t){ page, lsn };
+        table->count += 1;
+    } else {
+        entry->lsn = min(entry->lsn, lsn);
+    }
+
+    return SUCCESS;
+}
+
+/// Reads the dirty page table of the last checkpoint and returns the position
+/// of the oldest change that might not be in the file.
+static result_t
+recovery_read_checkpoint(recovery_t* recovery, lsn_t* start) {
+    const pager_checkpoint_t checkpoint = recovery->checkpoint;
+
+    *start = checkpoint.begin;
+    if (checkpoint.end == 0) {
+        return SUCCESS;
+    }
+
+    lsn_t cursor = checkpoint.begin;
+    while (cursor < checkpoint.end) {
+        wal_record_t record;
+        bool found;
+        try(wal_read(recovery->wal, &cursor, &record, &found));
+        if (!found) {
+            failure(EINVAL, msg("log ends before the checkpoint"), with_uint(checkpoint.end));
+        }
+
+        if (record.type != WAL_RECORD_CHECKPOINT) {
+            continue;
+        }
+
+        for (uint64_t offset = sizeof(lsn_t); offset < record.payload.size; offset += sizeof(page_id_t) + sizeof(lsn_t)) {
+            page_id_t page;
+            lsn_t lsn;
+            memcpy(&page, record.payload.data + offset, sizeof(page_id_t));
+            memcpy(&lsn, record.payload.data + offset + sizeof(page_id_t), sizeof(lsn_t));
+
+            try(recovery_table_insert(&recovery->table, page, lsn));
+            *start = min(*start, lsn);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/// Applies a record to its page unless the page already contains it.
+static result_t
+recovery_redo(recovery_worker_t* worker, const wal_record_t* record) {
+    page_t page;
+    try(pager_fix(worker->pager, record->page, true, &page));
+    defer(pager_unfix, page);
+
+    if (pager_get_lsn(page) >= record->lsn) {
+        return SUCCESS;
+    }
+
+    const uint16_t page_size = pager_get_page_size(worker->pager);
+    if (record->type == WAL_RECORD_PAGE_IMAGE) {
+        ensure(record->payload.size == page_size, with_uint(record->page));
+        memcpy(page.data, record->payload.data, page_size);
+    } else {
+        try(btree_redo(page, page_size, record));
+    }
+
+    pager_set_lsn(page, record->lsn);
+    worker->redo_count += 1;
+
+    return SUCCESS;
+}
+
+static void*
+recovery_worker_run(void* arg) {
+    recovery_worker_t* worker = arg;
+
+    while (true) {
+        recovery_batch_t* batch;
+        {
+            pthread_mutex_lock(&worker->mutex);
+            defer(pthread_mutex_unlock, worker->mutex);
+
+            while (worker->head == nullptr && !worker->closed) {
+                pthread_cond_wait(&worker->changed, &worker->mutex);
+            }
+
+            batch = worker->head;
+            if (batch != nullptr) {
+                worker->head = batch->next;
+                worker->tail = worker->head == nullptr ? nullptr : worker->tail;
+                worker->queued -= 1;
+                pthread_cond_signal(&worker->changed);
+            }
+        }
+
+        if (batch == nullptr) {
+            return nullptr;
+        }
+
+        // batches after a failure are only drained, so the reader never waits
+        for (uint32_t offset = 0; offset < batch->size && worker->error == 0;) {
+            wal_record_t record;
+            memcpy(&record, batch->data + offset, sizeof(wal_record_t));
+            record.payload.data = batch->data + offset + sizeof(wal_record_t);
+
+            if (recovery_redo(worker, &record) != SUCCESS) {
+                worker->error = error_get_code();
+                worker->error_page = record.page;
+                error_clear();
+            }
+
+            offset += (uint32_t)(sizeof(wal_record_t) + ((record.payload.size + 7) & ~7ull));
+        }
+
+        free(batch);
+    }
+}
+
+/// Hands the current batch of the worker over to the worker thread.
+static void
+recovery_submit(recovery_worker_t* worker) {
+    pthread_mutex_lock(&worker->mutex);
+    defer(pthread_mutex_unlock, worker->mutex);
+
+    while (worker->queued >= RECOVERY_QUEUE_SIZE) {
+        pthread_cond_wait(&worker->changed, &worker->mutex);
+    }
+
+    if (worker->tail == nullptr) {
+        worker->head = worker->current;
+    } else {
+        worker->tail->next = worker->current;
+    }
+    worker->tail = worker->current;
+    worker->queued += 1;
+    worker->current = nullptr;
+
+    pthread_cond_signal(&worker->changed);
+}
+
+/// Adds a copy of the record to the current batch of the worker.
+static result_t
+recovery_push(recovery_worker_t* worker, const wal_record_t* record) {
+    const uint32_t size = (uint32_t)(sizeof(wal_record_t) + ((record->payload.size + 7) & ~7ull));
+
+    if (worker->current != nullptr && worker->current->size + size > worker->current->capacity) {
+        recovery_submit(worker);
+    }
+
+    if (worker->current == nullptr) {
+        const uint32_t capacity = max(RECOVERY_BATCH_SIZE, size);
+        try_alloc(worker->current, sizeof(recovery_batch_t) + capacity);
+        worker->current->capacity = capacity;
+    }
+
+    unsigned char* entry = worker->current->data + worker->current->size;
+    memcpy(entry, record, sizeof(wal_record_t));
+    if (record->payload.size > 0) {
+        memcpy(entry + sizeof(wal_record_t), record->payload.data, record->payload.size);
+    }
+    worker->current->size += size;
+
+    return SUCCESS;
+}
+
+/// Reads the log from the start and distributes the records that might not
+/// be in the file to the workers.
+static result_t
+recovery_dispatch(recovery_t* recovery) {
+    lsn_t cursor = recovery->stats.start;
+
+    while (true) {
+        const lsn_t record_start = cursor;
+
+        wal_record_t record;
+        bool found;
+        try(wal_read(recovery->wal, &cursor, &record, &found));
+        if (!found) {
+            break;
+        }
+
+        recovery->stats.record_count += 1;
+        if (record.page == 0) {
+            continue;
+        }
+
+        // pages that are not in the dirty page table were written before the
+        // checkpoint began, changes after it are found in the log
+        const recovery_page_t* entry = recovery_table_find(&recovery->table, record.page);
+        if (entry == nullptr) {
+            if (record_start < recovery->checkpoint.begin) {
+                continue;
+            }
+            try(recovery_table_insert(&recovery->table, record.page, record_start));
+        } else if (record_start < entry->lsn) {
+            continue;
+        }
+
+        // the page might have been allocated after the file was last written
+        try(pager_claim(recovery->pager, record.page));
+        recovery_worker_t* worker = &recovery->workers[record.page % recovery->worker_count];
+        try(recovery_push(worker, &record));
+    }
+
+    for (uint32_t i = 0; i < recovery->worker_count; ++i) {
+        if (recovery->workers[i].current != nullptr) {
+            recovery_submit(&recovery->workers[i]);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/// Closes the queues of all workers and waits until they drained them.
+static void
+recovery_stop(recovery_t* recovery) {
+    for (uint32_t i = 0; i < recovery->worker_count; ++i) {
+        recovery_worker_t* worker = &recovery->workers[i];
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->closed = true;
+        pthread_cond_signal(&worker->changed);
+        pthread_mutex_unlock(&worker->mutex);
+
+        pthread_join(worker->thread, nullptr);
+        pthread_cond_destroy(&worker->changed);
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker->current);
+
+        recovery->stats.redo_count += worker->redo_count;
+    }
+}
+
+result_t
+recovery_run(pager_t* pager, wal_t* wal, const uint32_t threads, recovery_stats_t* out) {
+    ensure(pager != nullptr);
+    ensure(wal != nullptr);
+    ensure(threads > 0);
+
+    recovery_t recovery = { .pager = pager, .wal = wal };
+    defer(free, recovery.table.entries);
+
+    try(pager_get_checkpoint(pager, &recovery.checkpoint));
+    try(recovery_read_checkpoint(&recovery, &recovery.stats.start));
+
+    try_alloc(recovery.workers, sizeof(recovery_worker_t) * threads);
+    defer(free, recovery.workers);
+
+    for (uint32_t i = 0; i < threads; ++i) {
+        recovery_worker_t* worker = &recovery.workers[i];
+        worker->pager = pager;
+        pthread_mutex_init(&worker->mutex, nullptr);
+        pthread_cond_init(&worker->changed, nullptr);
+
+        const int error = pthread_create(&worker->thread, nullptr, recovery_worker_run, worker);
+        if (error != 0) {
+            pthread_cond_destroy(&worker->changed);
+            pthread_mutex_destroy(&worker->mutex);
+            recovery_stop(&recovery);
+            failure(error, msg("failed to start recovery thread"), with_uint(i));
+        }
+        recovery.worker_count += 1;
+    }
+
+    handle(recovery_dispatch(&recovery)) {
+        recovery_stop(&recovery);
+        forward();
+    }
+    recovery_stop(&recovery);
+
+    for (uint32_t i = 0; i < recovery.worker_count; ++i) {
+        if (recovery.workers[i].error != 0) {
+            failure(recovery.workers[i].error, msg("failed to redo page"), with_uint(recovery.workers[i].error_page));
+        }
+    }
+
+    // the redone pages are not part of any dirty page table, so they are
+    // written back before the next checkpoint
+    try(pager_flush(pager));
+    try(pager_checkpoint(pager));
+
+    if (out != nullptr) {
+        *out = recovery.stats;
+    }
+
+    return SUCCESS;
+}
+
+TEST_ONLY result_t
+recovery_copy_file(const char* source, const char* target) {
+    const int in = open(source, O_RDONLY);
+    if (in < 0) {
+        failure(errno, msg("failed to open file: %s", source));
+    }
+
+    const int out = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        failure(errno, msg("failed to open file: %s", target));
+    }
+
+    unsigned char buffer[4096];
+    ssize_t size;
+    while ((size = read(in, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, (size_t)size) != size) {
+            size = -1;
+            break;
+        }
+    }
+
+    close(in);
+    close(out);
+
+    if (size < 0) {
+        failure(errno, msg("failed to copy file: %s", source));
+    }
+
+    return SUCCESS;
+}
+
+/// Files of a recovery test. A crash copies the files as they are on disk and
+/// continues with the copies, the generation selects the current ones.
+typedef struct {
+    char page_path[2][48];
+    char wal_path[2][48];
+    uint32_t generation;
+
+    pager_t* pager;
+    wal_t* wal;
+} test_files_t;
+
+TEST_ONLY static void
+test_files_open(test_files_t* files) {
+    strcpy(files->page_path[0], "/tmp/wednesday-pages-XXXXXX");
+    strcpy(files->wal_path[0], "/tmp/wednesday-wal-XXXXXX");
+
+    int fd = mkstemp(files->page_path[0]);
+    assertis(fd >= 0);
+    close(fd);
+    fd = mkstemp(files->wal_path[0]);
+    assertis(fd >= 0);
+    close(fd);
+
+    strcat(strcpy(files->page_path[1], files->page_path[0]), "-crash");
+    strcat(strcpy(files->wal_path[1], files->wal_path[0]), "-crash");
+    files->generation = 0;
+
+    assert_success(pager_open_file(&files->pager, files->page_path[0], 128, 16));
+    assert_success(wal_open(&files->wal, files->wal_path[0]));
+    pager_set_wal(files->pager, files->wal);
+}
+
+TEST_ONLY static void
+test_files_close(test_files_t* files) {
+    pager_set_wal(files->pager, nullptr);
+    assert_success(pager_close(&files->pager));
+    assert_success(wal_close(&files->wal));
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        unlink(files->page_path[i]);
+        unlink(files->wal_path[i]);
+    }
+}
+
+TEST_ONLY static void
+test_crash_and_recover(test_files_t* files, const uint32_t threads, recovery_stats_t* stats) {
+    const uint32_t current = files->generation % 2;
+    const uint32_t next = (files->generation + 1) % 2;
+
+    assert_success(recovery_copy_file(files->page_path[current], files->page_path[next]));
+    assert_success(recovery_copy_file(files->wal_path[current], files->wal_path[next]));
+
+    // pages that were not written back are lost with the old pager
+    pager_set_wal(files->pager, nullptr);
+    assert_success(pager_close(&files->pager));
+    assert_success(wal_close(&files->wal));
+
+    assert_success(pager_open_file(&files->pager, files->page_path[next], 128, 16));
+    assert_success(wal_open(&files->wal, files->wal_path[next]));
+    pager_set_wal(files->pager, files->wal);
+    files->generation += 1;
+
+    assert_success(recovery_run(files->pager, files->wal, threads, stats));
+}
+
+TEST_ONLY static void
+test_write_page(pager_t* pager, const page_id_t id, const unsigned char value) {
+    page_t page;
+    assert_success(pager_fix(pager, id, true, &page));
+    memset(page.data + sizeof(lsn_t), value, pager_get_page_size(pager) - sizeof(lsn_t));
+    assert_success(pager_log_image(pager, page));
+    pager_unfix(page);
+}
+
+TEST_ONLY static void
+test_assert_page(pager_t* pager, const page_id_t id, const unsigned char value) {
+    page_t page;
+    assert_success(pager_fix(pager, id, false, &page));
+    asserteq_uint(page.data[sizeof(lsn_t)], value);
+    asserteq_uint(page.data[pager_get_page_size(pager) - 1], value);
+    pager_unfix(page);
+}
+
+describe(recovery) {
+    static test_files_t files;
+
+    before_each() {
+        test_files_open(&files);
+    }
+
+    after_each() {
+        test_files_close(&files);
+        error_clear();
+    }
+
+    it("redo committed pages") {
+        // more pages than the pager holds, some of them are written back
+        page_id_t ids[40];
+        for (uint32_t i = 0; i < 40; ++i) {
+            page_t page;
+            assert_success(pager_next(files.pager, &page));
+            ids[i] = page.id;
+            pager_unfix(page);
+
+            test_write_page(files.pager, ids[i], (unsigned char)i);
+        }
+
+        lsn_t lsn;
+        assert_success(wal_commit(files.wal, &lsn));
+
+        recovery_stats_t stats;
+        test_crash_and_recover(&files, 4, &stats);
+        asserteq_uint(stats.start, 0);
+        assertis(stats.redo_count > 0);
+
+        for (uint32_t i = 0; i < 40; ++i) {
+            test_assert_page(files.pager, ids[i], (unsigned char)i);
+        }
+
+        // the recovered pages are not handed out again
+        page_t page;
+        assert_success(pager_next(files.pager, &page));
+        assertis(page.id > ids[39]);
+        pager_unfix(page);
+    }
+
+    it("start at the checkpoint") {
+        page_id_t ids[8];
+        for (uint32_t i = 0; i < 8; ++i) {
+            page_t page;
+            assert_success(pager_next(files.pager, &page));
+            ids[i] = page.id;
+            pager_unfix(page);
+
+            test_write_page(files.pager, ids[i], 1);
+        }
+
+        assert_success(pager_flush(files.pager));
+        assert_success(pager_checkpoint(files.pager));
+
+        pager_checkpoint_t checkpoint;
+        assert_success(pager_get_checkpoint(files.pager, &checkpoint));
+
+        for (uint32_t i = 0; i < 4; ++i) {
+            test_write_page(files.pager, ids[i], 2);
+        }
+
+        lsn_t lsn;
+        assert_success(wal_commit(files.wal, &lsn));
+
+        recovery_stats_t stats;
+        test_crash_and_recover(&files, 2, &stats);
+        asserteq_uint(stats.start, checkpoint.begin);
+        asserteq_uint(stats.redo_count, 4);
+
+        for (uint32_t i = 0; i < 8; ++i) {
+            test_assert_page(files.pager, ids[i], i < 4 ? 2 : 1);
+        }
+    }
+
+    it("redo pages from the dirty page table") {
+        page_id_t ids[8];
+        for (uint32_t i = 0; i < 8; ++i) {
+            page_t page;
+            assert_success(pager_next(files.pager, &page));
+            ids[i] = page.id;
+            pager_unfix(page);
+        }
+
+        // the first pages are only in the log when the checkpoint is taken
+        for (uint32_t i = 0; i < 4; ++i) {
+            test_write_page(files.pager, ids[i], 1);
+        }
+        assert_success(pager_checkpoint(files.pager));
+
+        pager_checkpoint_t checkpoint;
+        assert_success(pager_get_checkpoint(files.pager, &checkpoint));
+
+        for (uint32_t i = 4; i < 8; ++i) {
+            test_write_page(files.pager, ids[i], 2);
+        }
+
+        lsn_t lsn;
+        assert_success(wal_commit(files.wal, &lsn));
+
+        recovery_stats_t stats;
+        test_crash_and_recover(&files, 3, &stats);
+        assertis(stats.start < checkpoint.begin);
+        asserteq_uint(stats.redo_count, 8);
+
+        for (uint32_t i = 0; i < 8; ++i) {
+            test_assert_page(files.pager, ids[i], i < 4 ? 1 : 2);
+        }
+    }
+
+    it("recover twice") {
+        page_t page;
+        assert_success(pager_next(files.pager, &page));
+        const page_id_t id = page.id;
+        pager_unfix(page);
+        test_write_page(files.pager, id, 7);
+
+        lsn_t lsn;
+        assert_success(wal_commit(files.wal, &lsn));
+
+        recovery_stats_t stats;
+        test_crash_and_recover(&files, 1, &stats);
+        asserteq_uint(stats.redo_count, 1);
+
+        // the recovery ends with a checkpoint, nothing is redone again
+        test_crash_and_recover(&files, 1, &stats);
+        asserteq_uint(stats.redo_count, 0);
+        test_assert_page(files.pager, id, 7);
+    }
+}
@@ -0,0 +1,215 @@
+#include "stats.h"
+
+#include "util.h"
+#include "winter.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Thread_local stats_shard_t* stats_local = nullptr;
+
+_Atomic uint32_t stats_sample_rate = STATS_DEFAULT_SAMPLE_RATE;
+
+/// All shards ever created, shards are never freed.
+static _Atomic(stats_shard_t*) stats_shards = nullptr;
+
+/// Shared by all threads that failed to allocate a shard, might lose counts.
+static stats_shard_t stats_fallback = { .used = true };
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+/// Releases the shard of a finished thread for the next thread.
+static void
+stats_release(void* shard) {
+    atomic_store_explicit(&((stats_shard_t*)shard)->used, false, memory_order_release);
+}
+
+static void
+stats_init(void) {
+    pthread_key_create(&stats_key, stats_release);
+}
+
+stats_shard_t*
+stats_register(void) {
+    pthread_once(&stats_once, stats_init);
+
+    stats_shard_t* shard = atomic_load_explicit(&stats_shards, memory_order_acquire);
+    for (; shard != nullptr; shard = shard->next) {
+        bool used = atomic_load_explicit(&shard->used, memory_order_relaxed);
+        if (!used && atomic_compare_exchange_strong_explicit(
+                       &shard->used, &used, true, memory_order_acquire, memory_order_relaxed
+                     )) {
+            break;
+        }
+    }
+
+    if (shard == nullptr) {
+        shard = aligned_alloc(alignof(stats_shard_t), sizeof(stats_shard_t));
+        if (shard == nullptr) {
+            stats_local = &stats_fallback;
+            return stats_local;
+        }
+        memset(shard, 0, sizeof(stats_shard_t));
+        shard->used = true;
+
+        shard->next = atomic_load_explicit(&stats_shards, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(
+          &stats_shards, &shard->next, shard, memory_order_release, memory_order_relaxed
+        )) {}
+    }
+
+    pthread_setspecific(stats_key, shard);
+    stats_local = shard;
+
+    return shard;
+}
+
+void
+stats_sum(const stats_counter_t first, const uint32_t count, uint64_t* out) {
+    memset(out, 0, sizeof(uint64_t) * count);
+
+    stats_shard_t* shard = atomic_load_explicit(&stats_shards, memory_order_acquire);
+    for (; shard != nullptr; shard = shard->next) {
+        for (uint32_t i = 0; i < count; ++i) {
+            out[i] += atomic_load_explicit(&shard->counters[first + i], memory_order_relaxed);
+        }
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        out[i] += atomic_load_explicit(&stats_fallback.counters[first + i], memory_order_relaxed);
+    }
+}
+
+void
+stats_set_sample_rate(const uint32_t rate) {
+    atomic_store_explicit(&stats_sample_rate, rate, memory_order_relaxed);
+}
+
+static void
+stats_merge(const stats_shard_t* shard, const stats_histogram_t histogram, stats_latency_t* out) {
+    for (uint32_t i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i) {
+        const uint64_t count = atomic_load_explicit(&shard->histograms[histogram][i], memory_order_relaxed);
+        out->buckets[i] += count;
+        out->count += count;
+    }
+}
+
+void
+stats_latency_snapshot(const stats_histogram_t histogram, stats_latency_t* out) {
+    memset(out, 0, sizeof(stats_latency_t));
+
+    stats_shard_t* shard = atomic_load_explicit(&stats_shards, memory_order_acquire);
+    for (; shard != nullptr; shard = shard->next) {
+        stats_merge(shard, histogram, out);
+    }
+    stats_merge(&stats_fallback, histogram, out);
+}
+
+uint64_t
+stats_latency_percentile(const stats_latency_t* latency, const double quantile) {
+    if (latency->count == 0) {
+        return 0;
+    }
+
+    // rank of the latency at the quantile, starting at one
+    uint64_t rank = (uint64_t)(quantile * (double)latency->count + 0.5);
+    rank = rank == 0 ? 1 : min(rank, latency->count);
+
+    uint32_t bucket = 0;
+    for (uint64_t seen = latency->buckets[0]; seen < rank; seen += latency->buckets[bucket]) {
+        bucket += 1;
+    }
+
+    if (bucket < (1u << STATS_HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+
+    // inverse of stats_bucket
+    const uint32_t shift = (bucket >> STATS_HISTOGRAM_SUB_BITS) - 1;
+    const uint32_t sub = bucket & ((1u << STATS_HISTOGRAM_SUB_BITS) - 1);
+    const uint64_t lower = (uint64_t)((1u << STATS_HISTOGRAM_SUB_BITS) | sub) << shift;
+
+    return lower + (1ull << shift) - 1;
+}
+
+describe(stats) {
+    it("sum the shards of all threads") {
+        uint64_t before[2];
+        stats_sum(STATS_BTREE_SPLITS, 2, before);
+
+        stats_add(STATS_BTREE_SPLITS, 3);
+        stats_add(STATS_BTREE_COMPACTIONS, 1);
+
+        uint64_t after[2];
+        stats_sum(STATS_BTREE_SPLITS, 2, after);
+        asserteq_uint(after[0] - before[0], 3);
+        asserteq_uint(after[1] - before[1], 1);
+    }
+
+    parallel("count concurrently", 8) {
+        static _Atomic uint32_t done;
+        static uint64_t before;
+
+        if (thread_index() == 0) {
+            stats_sum(STATS_BTREE_LOOKUPS, 1, &before);
+        }
+        // every thread waits until the first one took the snapshot
+        atomic_fetch_add(&done, 1);
+        while (atomic_load(&done) < 8) {}
+
+        for (uint32_t i = 0; i < 10000; ++i) {
+            stats_add(STATS_BTREE_LOOKUPS, 1);
+        }
+
+        atomic_fetch_add(&done, 1);
+        if (thread_index() == 0) {
+            while (atomic_load(&done) < 16) {}
+
+            uint64_t after;
+            stats_sum(STATS_BTREE_LOOKUPS, 1, &after);
+            asserteq_uint(after - before, 80000);
+        }
+    }
+
+    it("bucket latencies with bounded error") {
+        uint32_t last = 0;
+        for (uint64_t value = 1; value < (1ull << 40); value = value * 3 / 2 + 1) {
+            const uint32_t bucket = stats_bucket(value);
+            assertis(bucket >= last && bucket < STATS_HISTOGRAM_BUCKETS);
+            last = bucket;
+
+            stats_latency_t latency = { .count = 1 };
+            latency.buckets[bucket] = 1;
+
+            const uint64_t upper = stats_latency_percentile(&latency, 1.0);
+            assertis(upper >= value && upper - value <= value / 8);
+        }
+        asserteq_uint(stats_bucket(UINT64_MAX), STATS_HISTOGRAM_BUCKETS - 1);
+    }
+
+    it("record sampled latencies") {
+        stats_set_sample_rate(4);
+
+        stats_latency_t before;
+        stats_latency_snapshot(STATS_HISTOGRAM_BTREE_LOOKUP, &before);
+
+        for (uint32_t i = 0; i < 100; ++i) {
+            stats_record(STATS_HISTOGRAM_BTREE_LOOKUP, stats_start(STATS_HISTOGRAM_BTREE_LOOKUP));
+        }
+
+        stats_latency_t after;
+        stats_latency_snapshot(STATS_HISTOGRAM_BTREE_LOOKUP, &after);
+        asserteq_uint(after.count - before.count, 25);
+
+        stats_set_sample_rate(0);
+        for (uint32_t i = 0; i < 100; ++i) {
+            stats_record(STATS_HISTOGRAM_BTREE_LOOKUP, stats_start(STATS_HISTOGRAM_BTREE_LOOKUP));
+        }
+
+        stats_latency_snapshot(STATS_HISTOGRAM_BTREE_LOOKUP, &before);
+        asserteq_uint(before.count, after.count);
+
+        stats_set_sample_rate(STATS_DEFAULT_SAMPLE_RATE);
+    }
+}
@@ -0,0 +1,368 @@
+#include "trace.h"
+
+#include "deffer.h"
+#include "winter.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Marks the start of a dump, followed by the number of events.
+#define TRACE_MAGIC "WEDTRACE"
+
+/// Events of one thread. Only the owning thread writes the ring, readers
+/// validate the events they copied against the head afterward.
+typedef struct trace_ring_t {
+    /// Number of events ever recorded, the next event goes to head modulo the
+    /// ring size.
+    _Atomic uint64_t head;
+    trace_event_t events[TRACE_RING_SIZE];
+
+    uint32_t thread;
+    _Atomic bool used;
+    struct trace_ring_t* next;
+} trace_ring_t;
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+} trace_header_t;
+
+_Atomic bool trace_enabled = false;
+
+static _Thread_local trace_ring_t* trace_local = nullptr;
+
+/// All rings ever created, rings are never freed.
+static _Atomic(trace_ring_t*) trace_rings = nullptr;
+
+/// Last thread id handed out, ids start at one.
+static _Atomic uint32_t trace_threads = 0;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+
+/// Releases the ring of a finished thread for the next thread.
+static void
+trace_release(void* ring) {
+    atomic_store_explicit(&((trace_ring_t*)ring)->used, false, memory_order_release);
+}
+
+static void
+trace_init(void) {
+    pthread_key_create(&trace_key, trace_release);
+}
+
+/// Claims a ring for the calling thread, returns null if out of memory.
+static trace_ring_t*
+trace_register(void) {
+    pthread_once(&trace_once, trace_init);
+
+    trace_ring_t* ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+    for (; ring != nullptr; ring = ring->next) {
+        bool used = atomic_load_explicit(&ring->used, memory_order_relaxed);
+        if (!used && atomic_compare_exchange_strong_explicit(
+                       &ring->used, &used, true, memory_order_acquire, memory_order_relaxed
+                     )) {
+            break;
+        }
+    }
+
+    if (ring == nullptr) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        if (ring == nullptr) {
+            return nullptr;
+        }
+        ring->used = true;
+
+        ring->next = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(
+          &trace_rings, &ring->next, ring, memory_order_release, memory_order_relaxed
+        )) {}
+    }
+
+    // events of the previous owner keep its id
+    ring->thread = atomic_fetch_add_explicit(&trace_threads, 1, memory_order_relaxed) + 1;
+
+    pthread_setspecific(trace_key, ring);
+    trace_local = ring;
+
+    return ring;
+}
+
+void
+trace_enable(const bool enabled) {
+    atomic_store_explicit(&trace_enabled, enabled, memory_order_relaxed);
+}
+
+void
+trace_record(const trace_kind_t kind, const uint64_t argument) {
+    trace_ring_t* ring = trace_local != nullptr ? trace_local : trace_register();
+    if (ring == nullptr) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->events[head % TRACE_RING_SIZE] = (trace_event_t){
+        .time = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec,
+        .argument = argument,
+        .thread = ring->thread,
+        .kind = kind,
+    };
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/// Copies the valid events of a ring, returns the number of copied events.
+static uint32_t
+trace_copy(const trace_ring_t* ring, trace_event_t* out) {
+    const uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    const uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    for (uint64_t i = first; i < head; ++i) {
+        out[i - first] = ring->events[i % TRACE_RING_SIZE];
+    }
+
+    // the owner might have overwritten the oldest events during the copy, the
+    // next event goes to the slot of the event one ring size before it
+    atomic_thread_fence(memory_order_acquire);
+    const uint64_t now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const uint64_t valid = now >= TRACE_RING_SIZE ? now - TRACE_RING_SIZE + 1 : 0;
+    if (valid <= first) {
+        return (uint32_t)(head - first);
+    }
+    if (valid >= head) {
+        return 0;
+    }
+
+    memmove(out, out + (valid - first), sizeof(trace_event_t) * (head - valid));
+    return (uint32_t)(head - valid);
+}
+
+static int
+trace_compare(const void* lhs, const void* rhs) {
+    const uint64_t a = ((const trace_event_t*)lhs)->time;
+    const uint64_t b = ((const trace_event_t*)rhs)->time;
+
+    return (a > b) - (a < b);
+}
+
+defer_impl(trace_fclose) {
+    fclose(*defer_arg(FILE*));
+}
+
+result_t
+trace_dump(const char* path) {
+    ensure(path != nullptr);
+
+    uint32_t capacity = 0;
+    trace_ring_t* rings = atomic_load_explicit(&trace_rings, memory_order_acquire);
+    for (const trace_ring_t* ring = rings; ring != nullptr; ring = ring->next) {
+        capacity += TRACE_RING_SIZE;
+    }
+
+    trace_event_t* events = malloc(sizeof(trace_event_t) * (capacity > 0 ? capacity : 1));
+    if (events == nullptr) {
+        failure(ENOMEM, msg("failed to allocate memory for trace"), with_uint(capacity));
+    }
+    defer(free, events);
+
+    // rings created after the first load are not part of the dump
+    uint64_t count = 0;
+    for (const trace_ring_t* ring = rings; ring != nullptr; ring = ring->next) {
+        count += trace_copy(ring, events + count);
+    }
+    qsort(events, count, sizeof(trace_event_t), trace_compare);
+
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) {
+        failure(errno, msg("failed to open trace file: %s", path));
+    }
+    defer(trace_fclose, file);
+
+    trace_header_t header = { .count = count };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(events, sizeof(trace_event_t), count, file) != count ||
+        fflush(file) != 0) {
+        failure(EIO, msg("failed to write trace file: %s", path));
+    }
+
+    return SUCCESS;
+}
+
+/// Writes an event in the format of the Chrome trace viewer, times are in
+/// microseconds since the first event.
+static void
+trace_write_json(FILE* file, const trace_event_t* event, const uint64_t origin) {
+    const double time = (double)(event->time - origin) / 1000.0;
+
+    switch ((trace_kind_t)event->kind) {
+        case TRACE_LATCH_WAIT_BEGIN:
+        case TRACE_LATCH_WAIT_END:
+            fprintf(
+              file,
+              "{\"name\":\"latch wait\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"latch\":\"0x%jx\"}}",
+              event->kind == TRACE_LATCH_WAIT_BEGIN ? "B" : "E",
+              time,
+              event->thread,
+              (uintmax_t)event->argument
+            );
+            return;
+        case TRACE_PAGER_MISS:
+        case TRACE_PAGER_EVICT:
+        case TRACE_BTREE_SPLIT: {
+            const char* names[] = {
+                [TRACE_PAGER_MISS] = "miss",
+                [TRACE_PAGER_EVICT] = "evict",
+                [TRACE_BTREE_SPLIT] = "split",
+            };
+            fprintf(
+              file,
+              "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"page\":%ju}}",
+              names[event->kind],
+              time,
+              event->thread,
+              (uintmax_t)event->argument
+            );
+            return;
+        }
+    }
+
+    fprintf(
+      file, "{\"name\":\"unknown\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", time, event->thread
+    );
+}
+
+result_t
+trace_convert(const char* dump_path, const char* json_path) {
+    ensure(dump_path != nullptr);
+    ensure(json_path != nullptr);
+
+    FILE* dump = fopen(dump_path, "rb");
+    if (dump == nullptr) {
+        failure(errno, msg("failed to open trace file: %s", dump_path));
+    }
+    defer(trace_fclose, dump);
+
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, dump) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        failure(EINVAL, msg("invalid trace file: %s", dump_path));
+    }
+
+    FILE* json = fopen(json_path, "w");
+    if (json == nullptr) {
+        failure(errno, msg("failed to open trace file: %s", json_path));
+    }
+    defer(trace_fclose, json);
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", json);
+
+    uint64_t origin = 0;
+    for (uint64_t i = 0; i < header.count; ++i) {
+        trace_event_t event;
+        if (fread(&event, sizeof(event), 1, dump) != 1) {
+            failure(EINVAL, msg("truncated trace file: %s", dump_path), with_uint(i));
+        }
+
+        if (i == 0) {
+            origin = event.time;
+        } else {
+            fputc(',', json);
+        }
+        fputc('\n', json);
+        trace_write_json(json, &event, origin);
+    }
+
+    fputs("\n]}\n", json);
+    if (fflush(json) != 0) {
+        failure(EIO, msg("failed to write trace file: %s", json_path));
+    }
+
+    return SUCCESS;
+}
+
+describe(trace) {
+    static char dump_path[32];
+    static char json_path[32];
+
+    before_each() {
+        strcpy(dump_path, "/tmp/wednesday-trace-XXXXXX");
+        strcpy(json_path, "/tmp/wednesday-json-XXXXXX");
+
+        int fd = mkstemp(dump_path);
+        assertis(fd >= 0);
+        close(fd);
+        fd = mkstemp(json_path);
+        assertis(fd >= 0);
+        close(fd);
+    }
+
+    after_each() {
+        trace_enable(false);
+        unlink(dump_path);
+        unlink(json_path);
+        error_clear();
+    }
+
+    it("ignore events while disabled") {
+        trace_ring_t* ring = trace_local != nullptr ? trace_local : trace_register();
+        const uint64_t head = ring->head;
+
+        trace_event(TRACE_PAGER_MISS, 1);
+        asserteq_uint(ring->head, head);
+
+        trace_enable(true);
+        trace_event(TRACE_PAGER_MISS, 1);
+        asserteq_uint(ring->head, head + 1);
+    }
+
+    it("keep the latest events of a full ring") {
+        trace_enable(true);
+        for (uint64_t i = 0; i < TRACE_RING_SIZE * 2; ++i) {
+            trace_event(TRACE_PAGER_EVICT, i);
+        }
+
+        static trace_event_t events[TRACE_RING_SIZE];
+        // the oldest event might be overwritten by the next one at any time
+        asserteq_uint(trace_copy(trace_local, events), TRACE_RING_SIZE - 1);
+        asserteq_uint(events[0].argument, TRACE_RING_SIZE + 1);
+        asserteq_uint(events[TRACE_RING_SIZE - 2].argument, TRACE_RING_SIZE * 2 - 1);
+    }
+
+    it("convert a dump to json") {
+        uint64_t latch = 0;
+
+        trace_enable(true);
+        trace_event(TRACE_LATCH_WAIT_BEGIN, (uintptr_t)&latch);
+        trace_event(TRACE_PAGER_MISS, 42);
+        trace_event(TRACE_LATCH_WAIT_END, (uintptr_t)&latch);
+        trace_enable(false);
+
+        assert_success(trace_dump(dump_path));
+        assert_success(trace_convert(dump_path, json_path));
+
+        FILE* file = fopen(json_path, "r");
+        assertis(file != nullptr);
+
+        static char json[1 << 20];
+        const size_t size = fread(json, 1, sizeof(json) - 1, file);
+        fclose(file);
+        json[size] = '\0';
+
+        assertis(strstr(json, "\"traceEvents\"") != nullptr);
+        assertis(strstr(json, "\"name\":\"miss\"") != nullptr);
+        assertis(strstr(json, "\"args\":{\"page\":42}") != nullptr);
+        assertis(strstr(json, "\"ph\":\"B\"") != nullptr);
+        assertis(strstr(json, "\"ph\":\"E\"") != nullptr);
+    }
+
+    it("reject invalid dumps") {
+        assert_failure(trace_convert(json_path, dump_path), EINVAL);
+    }
+}
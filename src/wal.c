@@ -0,0 +1,483 @@
+#include "wal.h"
+
+#include "deffer.h"
+#include "util.h"
+#include "winter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Capacity of the buffer for records that are not written yet. Appends flush
+/// the buffer if it is full.
+#define WAL_BUFFER_SIZE (1u << 20)
+
+/// Encoded size of the record header: size, checksum, page id and type.
+#define RECORD_HEADER_SIZE 13
+
+struct wal_t {
+    int fd;
+
+    /// Protects all fields below, the file is written without holding it.
+    pthread_mutex_t mutex;
+
+    /// Signalled whenever a flush finished.
+    pthread_cond_t flushed;
+
+    /// Records appended after the last flush started, they end at the end LSN.
+    /// The spare buffer is swapped in by the flushing thread.
+    unsigned char* buffer;
+    unsigned char* spare;
+    uint32_t buffer_size;
+
+    /// End of the last appended record.
+    lsn_t end_lsn;
+
+    /// End of the last durable record.
+    lsn_t flushed_lsn;
+
+    /// Set while one thread writes and syncs the log, all others wait for it.
+    bool flushing;
+
+    /// Error of a failed write, the content of the log is unknown afterward
+    /// and all further operations fail.
+    int error;
+
+    /// Number of syncs of the log file.
+    uint64_t sync_count;
+
+    /// Buffer for the payloads returned by wal_read.
+    unsigned char* read_buffer;
+    uint32_t read_capacity;
+};
+
+/// FNV-1a over the record without the size and checksum fields, only used to
+/// detect torn writes.
+static uint32_t
+wal_checksum(const unsigned char* data, const uint64_t size) {
+    uint32_t hash = 2166136261u;
+    for (uint64_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/// Writes the buffer at the offset and syncs the file. Returns zero or the
+/// error number.
+static int
+wal_write(const int fd, const unsigned char* buffer, const uint32_t size, const lsn_t offset) {
+    uint32_t written = 0;
+    while (written < size) {
+        const ssize_t result = pwrite(fd, buffer + written, size - written, (off_t)(offset + written));
+        if (result < 0) {
+            return errno;
+        }
+        written += (uint32_t)result;
+    }
+
+#ifdef __linux__
+    return fdatasync(fd) == 0 ? 0 : errno;
+#else
+    return fsync(fd) == 0 ? 0 : errno;
+#endif
+}
+
+/// Waits until all records up to the LSN are durable. If no other thread is
+/// flushing, the thread becomes the leader and writes the buffered records of
+/// all threads with a single sync. Expects the mutex to be locked.
+static result_t
+wal_sync_locked(wal_t* wal, const lsn_t lsn) {
+    while (wal->flushed_lsn < lsn) {
+        if (wal->error != 0) {
+            failure(wal->error, msg("log is unusable after a failed write"));
+        }
+
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->flushed, &wal->mutex);
+            continue;
+        }
+
+        // take all buffered records, other threads append to the spare
+        // buffer in the meantime
+        unsigned char* buffer = wal->buffer;
+        const uint32_t size = wal->buffer_size;
+        const lsn_t end = wal->end_lsn;
+
+        wal->buffer = wal->spare;
+        wal->buffer_size = 0;
+        wal->flushing = true;
+
+        pthread_mutex_unlock(&wal->mutex);
+        const int error = wal_write(wal->fd, buffer, size, end - size);
+        pthread_mutex_lock(&wal->mutex);
+
+        wal->spare = buffer;
+        wal->flushing = false;
+        wal->error = error;
+        pthread_cond_broadcast(&wal->flushed);
+
+        if (error != 0) {
+            failure(error, msg("failed to write the log"), with_uint(end));
+        }
+
+        wal->flushed_lsn = end;
+        wal->sync_count += 1;
+    }
+
+    return SUCCESS;
+}
+
+/// Reads exactly size bytes at the offset. Sets complete to false if the file
+/// ends before.
+static result_t
+wal_read_at(const wal_t* wal, unsigned char* buffer, const uint32_t size, const lsn_t offset, bool* complete) {
+    uint32_t read = 0;
+    while (read < size) {
+        const ssize_t result = pread(wal->fd, buffer + read, size - read, (off_t)(offset + read));
+        if (result < 0) {
+            failure(errno, msg("failed to read the log"), with_uint(offset));
+        }
+        if (result == 0) {
+            break;
+        }
+        read += (uint32_t)result;
+    }
+
+    *complete = read == size;
+
+    return SUCCESS;
+}
+
+result_t
+wal_read(wal_t* wal, lsn_t* cursor, wal_record_t* out, bool* found) {
+    ensure(wal != nullptr);
+    ensure(cursor != nullptr);
+    ensure(out != nullptr);
+    ensure(found != nullptr);
+
+    *found = false;
+
+    unsigned char header[RECORD_HEADER_SIZE];
+    bool complete;
+    try(wal_read_at(wal, header, RECORD_HEADER_SIZE, *cursor, &complete));
+    if (!complete) {
+        return SUCCESS;
+    }
+
+    uint32_t size, checksum;
+    memcpy(&size, header, sizeof(uint32_t));
+    memcpy(&checksum, header + 4, sizeof(uint32_t));
+
+    // a torn write might leave any value in the size field
+    if (size < RECORD_HEADER_SIZE || size > WAL_BUFFER_SIZE) {
+        return SUCCESS;
+    }
+
+    if (size > wal->read_capacity) {
+        unsigned char* buffer = realloc(wal->read_buffer, size);
+        if (buffer == nullptr) {
+            failure(ENOMEM, msg("failed to grow the read buffer"), with_uint(size));
+        }
+        wal->read_buffer = buffer;
+        wal->read_capacity = size;
+    }
+
+    memcpy(wal->read_buffer, header, RECORD_HEADER_SIZE);
+    try(wal_read_at(wal, wal->read_buffer + RECORD_HEADER_SIZE, size - RECORD_HEADER_SIZE, *cursor + RECORD_HEADER_SIZE, &complete));
+    if (!complete || wal_checksum(wal->read_buffer + 8, size - 8u) != checksum) {
+        return SUCCESS;
+    }
+
+    memcpy(&out->page, wal->read_buffer + 8, sizeof(page_id_t));
+    out->type = wal->read_buffer[12];
+    out->payload = (blob_t){ size - RECORD_HEADER_SIZE, wal->read_buffer + RECORD_HEADER_SIZE };
+    out->lsn = *cursor + size;
+
+    *cursor = out->lsn;
+    *found = true;
+
+    return SUCCESS;
+}
+
+result_t
+wal_open(wal_t** out, const char* path) {
+    ensure(out != nullptr);
+    ensure(path != nullptr);
+
+    wal_t* wal;
+    try_alloc(wal, sizeof(wal_t));
+    errdefer(free, wal);
+
+    try_alloc(wal->buffer, WAL_BUFFER_SIZE);
+    errdefer(free, wal->buffer);
+
+    try_alloc(wal->spare, WAL_BUFFER_SIZE);
+    errdefer(free, wal->spare);
+
+    wal->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (wal->fd < 0) {
+        failure(errno, msg("failed to open log file: %s", path));
+    }
+
+    // find the end of the log, a torn write is cut off so that new records
+    // directly follow the last complete one
+    lsn_t end = 0;
+    bool found = true;
+    while (found) {
+        wal_record_t record;
+        handle(wal_read(wal, &end, &record, &found)) {
+            close(wal->fd);
+            free(wal->read_buffer);
+            forward();
+        }
+    }
+
+    if (ftruncate(wal->fd, (off_t)end) != 0) {
+        close(wal->fd);
+        free(wal->read_buffer);
+        failure(errno, msg("failed to truncate log file"), with_uint(end));
+    }
+
+    wal->end_lsn = end;
+    wal->flushed_lsn = end;
+
+    pthread_mutex_init(&wal->mutex, nullptr);
+    pthread_cond_init(&wal->flushed, nullptr);
+
+    *out = wal;
+
+    return SUCCESS;
+}
+
+result_t
+wal_append(wal_t* wal, const uint8_t type, const page_id_t page, const blob_t payload, lsn_t* out) {
+    ensure(wal != nullptr);
+    ensure(out != nullptr);
+    ensure(payload.size <= WAL_BUFFER_SIZE - RECORD_HEADER_SIZE);
+
+    const uint32_t size = (uint32_t)(RECORD_HEADER_SIZE + payload.size);
+
+    pthread_mutex_lock(&wal->mutex);
+    defer(pthread_mutex_unlock, wal->mutex);
+
+    // make room by flushing all buffered records, other threads might fill
+    // the buffer again while waiting for the flush
+    while (wal->buffer_size + size > WAL_BUFFER_SIZE) {
+        try(wal_sync_locked(wal, wal->end_lsn));
+    }
+
+    unsigned char* record = wal->buffer + wal->buffer_size;
+    memcpy(record, &size, sizeof(uint32_t));
+    memcpy(record + 8, &page, sizeof(page_id_t));
+    record[12] = type;
+    if (payload.size > 0) {
+        memcpy(record + RECORD_HEADER_SIZE, payload.data, payload.size);
+    }
+
+    const uint32_t checksum = wal_checksum(record + 8, size - 8u);
+    memcpy(record + 4, &checksum, sizeof(uint32_t));
+
+    wal->buffer_size += size;
+    wal->end_lsn += size;
+    *out = wal->end_lsn;
+
+    return SUCCESS;
+}
+
+result_t
+wal_flush(wal_t* wal, const lsn_t lsn) {
+    ensure(wal != nullptr);
+
+    pthread_mutex_lock(&wal->mutex);
+    defer(pthread_mutex_unlock, wal->mutex);
+
+    ensure(lsn <= wal->end_lsn, with_uint(lsn), with_uint(wal->end_lsn));
+    try(wal_sync_locked(wal, lsn));
+
+    return SUCCESS;
+}
+
+result_t
+wal_commit(wal_t* wal, lsn_t* out) {
+    ensure(wal != nullptr);
+    ensure(out != nullptr);
+
+    try(wal_append(wal, WAL_RECORD_COMMIT, 0, (blob_t){ 0, nullptr }, out));
+    try(wal_flush(wal, *out));
+
+    return SUCCESS;
+}
+
+lsn_t
+wal_get_end_lsn(wal_t* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    defer(pthread_mutex_unlock, wal->mutex);
+
+    return wal->end_lsn;
+}
+
+lsn_t
+wal_get_flushed_lsn(wal_t* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    defer(pthread_mutex_unlock, wal->mutex);
+
+    return wal->flushed_lsn;
+}
+
+result_t
+wal_close(wal_t** out) {
+    ensure(out != nullptr);
+
+    wal_t* wal = *out;
+
+    {
+        pthread_mutex_lock(&wal->mutex);
+        defer(pthread_mutex_unlock, wal->mutex);
+
+        try(wal_sync_locked(wal, wal->end_lsn));
+    }
+
+    pthread_cond_destroy(&wal->flushed);
+    pthread_mutex_destroy(&wal->mutex);
+
+    close(wal->fd);
+    free(wal->read_buffer);
+    free(wal->spare);
+    free(wal->buffer);
+    free(wal);
+    *out = nullptr;
+
+    return SUCCESS;
+}
+
+TEST_ONLY static void*
+test_commit_thread(void* arg) {
+    wal_t* wal = arg;
+
+    for (uint32_t i = 0; i < 200; ++i) {
+        lsn_t lsn;
+        assert_success(wal_append(wal, WAL_RECORD_LEAF_INSERT, i + 2, blob_from_string("row"), &lsn));
+        assert_success(wal_commit(wal, &lsn));
+        assertis(wal_get_flushed_lsn(wal) >= lsn);
+    }
+
+    return nullptr;
+}
+
+describe(wal) {
+    static char path[32];
+    static wal_t* wal;
+
+    before_each() {
+        strcpy(path, "/tmp/wednesday-wal-XXXXXX");
+        const int fd = mkstemp(path);
+        assertis(fd >= 0);
+        close(fd);
+
+        assert_success(wal_open(&wal, path));
+    }
+
+    after_each() {
+        if (wal != nullptr) {
+            assert_success(wal_close(&wal));
+        }
+        unlink(path);
+        error_clear();
+    }
+
+    it("append and read records") {
+        lsn_t first, second;
+        assert_success(wal_append(wal, WAL_RECORD_PAGE_IMAGE, 7, blob_from_string("image"), &first));
+        assert_success(wal_append(wal, WAL_RECORD_LEAF_INSERT, 8, blob_from_string("cell"), &second));
+        assertis(first < second);
+
+        // records are only readable after they are durable
+        lsn_t cursor = 0;
+        wal_record_t record;
+        bool found;
+        assert_success(wal_read(wal, &cursor, &record, &found));
+        assertis(!found);
+
+        assert_success(wal_flush(wal, second));
+        asserteq_uint(wal_get_flushed_lsn(wal), second);
+
+        assert_success(wal_read(wal, &cursor, &record, &found));
+        assertis(found);
+        asserteq_uint(record.lsn, first);
+        asserteq_uint(record.type, WAL_RECORD_PAGE_IMAGE);
+        asserteq_uint(record.page, 7);
+        asserteq_int(blob_cmp(record.payload, blob_from_string("image")), 0);
+
+        assert_success(wal_read(wal, &cursor, &record, &found));
+        assertis(found);
+        asserteq_uint(record.lsn, second);
+        asserteq_uint(record.page, 8);
+
+        assert_success(wal_read(wal, &cursor, &record, &found));
+        assertis(!found);
+    }
+
+    it("reopen the log") {
+        lsn_t lsn;
+        assert_success(wal_append(wal, WAL_RECORD_LEAF_INSERT, 3, blob_from_string("cell"), &lsn));
+        assert_success(wal_close(&wal));
+
+        assert_success(wal_open(&wal, path));
+        asserteq_uint(wal_get_flushed_lsn(wal), lsn);
+
+        lsn_t next;
+        assert_success(wal_commit(wal, &next));
+        assertis(next > lsn);
+    }
+
+    it("discard torn record") {
+        lsn_t lsn;
+        assert_success(wal_commit(wal, &lsn));
+        assert_success(wal_close(&wal));
+
+        // half of a record header
+        const int fd = open(path, O_WRONLY | O_APPEND);
+        assertis(fd >= 0);
+        asserteq_int(write(fd, "\x20\x00\x00\x00\x01\x02", 6), 6);
+        close(fd);
+
+        assert_success(wal_open(&wal, path));
+        asserteq_uint(wal_get_flushed_lsn(wal), lsn);
+
+        lsn_t next;
+        assert_success(wal_commit(wal, &next));
+
+        lsn_t cursor = 0;
+        wal_record_t record;
+        bool found;
+        assert_success(wal_read(wal, &cursor, &record, &found));
+        assert_success(wal_read(wal, &cursor, &record, &found));
+        assertis(found);
+        asserteq_uint(record.lsn, next);
+    }
+
+    it("group concurrent commits") {
+        pthread_t threads[8];
+        for (uint32_t i = 0; i < 8; ++i) {
+            asserteq_int(pthread_create(&threads[i], nullptr, test_commit_thread, wal), 0);
+        }
+        for (uint32_t i = 0; i < 8; ++i) {
+            asserteq_int(pthread_join(threads[i], nullptr), 0);
+        }
+
+        // every commit is durable, but most of them share a sync
+        assertis(wal->sync_count < 8 * 200);
+
+        uint32_t commits = 0;
+        lsn_t cursor = 0;
+        for (bool found = true; found;) {
+            wal_record_t record;
+            assert_success(wal_read(wal, &cursor, &record, &found));
+            commits += found && record.type == WAL_RECORD_COMMIT;
+        }
+        asserteq_uint(commits, 8 * 200);
+    }
+}
@@ -0,0 +1,194 @@
+#include "ycsb.h"
+
+#include "winter.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+/// Skew of the zipfian distributions, the default of YCSB.
+#define YCSB_THETA 0.99
+
+const ycsb_workload_t ycsb_workload_a = { .read = 50, .update = 50, .distribution = YCSB_ZIPFIAN };
+const ycsb_workload_t ycsb_workload_b = { .read = 95, .update = 5, .distribution = YCSB_ZIPFIAN };
+const ycsb_workload_t ycsb_workload_c = { .read = 100, .distribution = YCSB_ZIPFIAN };
+const ycsb_workload_t ycsb_workload_d = { .read = 95, .insert = 5, .distribution = YCSB_LATEST };
+const ycsb_workload_t ycsb_workload_e = { .scan = 95, .insert = 5, .distribution = YCSB_ZIPFIAN };
+const ycsb_workload_t ycsb_workload_f = { .read = 50, .read_modify_write = 50, .distribution = YCSB_ZIPFIAN };
+
+/// Finalizer of splitmix64, spreads seeds and the popular zipfian keys.
+static uint64_t
+ycsb_hash(uint64_t key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+
+    return key;
+}
+
+void
+ycsb_generator_init(
+  ycsb_generator_t* generator,
+  const ycsb_distribution_t distribution,
+  const uint64_t count,
+  const uint64_t seed
+) {
+    const uint64_t state = ycsb_hash(seed);
+
+    *generator = (ycsb_generator_t){
+        .state = state != 0 ? state : 1,
+        .distribution = distribution,
+        .count = count,
+    };
+
+    if (distribution == YCSB_UNIFORM) {
+        return;
+    }
+
+    // constants of the zipfian generator by Gray et al., also used by YCSB
+    for (uint64_t i = 1; i <= count; ++i) {
+        generator->zetan += 1.0 / pow((double)i, YCSB_THETA);
+    }
+
+    generator->half = 1.0 + pow(0.5, YCSB_THETA);
+    generator->alpha = 1.0 / (1.0 - YCSB_THETA);
+    generator->eta = (1.0 - pow(2.0 / (double)count, 1.0 - YCSB_THETA)) / (1.0 - generator->half / generator->zetan);
+}
+
+uint64_t
+ycsb_random(ycsb_generator_t* generator) {
+    // xorshift64*
+    generator->state ^= generator->state >> 12;
+    generator->state ^= generator->state << 25;
+    generator->state ^= generator->state >> 27;
+
+    return generator->state * 0x2545f4914f6cdd1dull;
+}
+
+/// Returns a zipfian rank, zero is the most popular one.
+static uint64_t
+ycsb_next_rank(ycsb_generator_t* generator) {
+    const double u = (double)(ycsb_random(generator) >> 11) / (double)(1ull << 53);
+    const double uz = u * generator->zetan;
+
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < generator->half) {
+        return 1;
+    }
+
+    const double scale = pow(generator->eta * u - generator->eta + 1.0, generator->alpha);
+    const uint64_t rank = (uint64_t)((double)generator->count * scale);
+    return rank < generator->count ? rank : generator->count - 1;
+}
+
+uint64_t
+ycsb_next_key(ycsb_generator_t* generator, const uint64_t count) {
+    switch (generator->distribution) {
+        case YCSB_UNIFORM:
+            return ycsb_random(generator) % generator->count;
+        case YCSB_ZIPFIAN:
+            return ycsb_hash(ycsb_next_rank(generator)) % generator->count;
+        case YCSB_LATEST: {
+            const uint64_t rank = ycsb_next_rank(generator);
+            return rank < count ? count - 1 - rank : 0;
+        }
+    }
+
+    abort();
+}
+
+ycsb_op_t
+ycsb_next_op(ycsb_generator_t* generator, const ycsb_workload_t* workload) {
+    uint64_t choice = ycsb_random(generator) % 100;
+
+    if (choice < workload->read) {
+        return YCSB_READ;
+    }
+    choice -= workload->read;
+
+    if (choice < workload->update) {
+        return YCSB_UPDATE;
+    }
+    choice -= workload->update;
+
+    if (choice < workload->insert) {
+        return YCSB_INSERT;
+    }
+    choice -= workload->insert;
+
+    if (choice < workload->scan) {
+        return YCSB_SCAN;
+    }
+
+    return YCSB_READ_MODIFY_WRITE;
+}
+
+describe(ycsb) {
+    static ycsb_generator_t generator;
+
+    it("keys stay in range") {
+        const ycsb_distribution_t distributions[] = { YCSB_UNIFORM, YCSB_ZIPFIAN, YCSB_LATEST };
+
+        for (uint32_t i = 0; i < 3; ++i) {
+            ycsb_generator_init(&generator, distributions[i], 1000, 1);
+
+            for (uint32_t j = 0; j < 10000; ++j) {
+                assertis(ycsb_next_key(&generator, 1000) < 1000);
+            }
+        }
+    }
+
+    it("same seed same keys") {
+        ycsb_generator_t other;
+        ycsb_generator_init(&generator, YCSB_ZIPFIAN, 1000, 7);
+        ycsb_generator_init(&other, YCSB_ZIPFIAN, 1000, 7);
+
+        for (uint32_t i = 0; i < 1000; ++i) {
+            asserteq_uint(ycsb_next_key(&generator, 1000), ycsb_next_key(&other, 1000));
+        }
+    }
+
+    it("skew zipfian keys") {
+        static uint32_t hits[1000];
+        ycsb_generator_init(&generator, YCSB_ZIPFIAN, 1000, 1);
+
+        for (uint32_t i = 0; i < 100000; ++i) {
+            hits[ycsb_next_key(&generator, 1000)] += 1;
+        }
+
+        // the most popular key gets about a seventh of all hits
+        uint32_t max = 0;
+        for (uint32_t i = 0; i < 1000; ++i) {
+            max = hits[i] > max ? hits[i] : max;
+        }
+        assertis(max > 10000);
+    }
+
+    it("prefer the latest keys") {
+        ycsb_generator_init(&generator, YCSB_LATEST, 1000, 1);
+
+        uint32_t recent = 0;
+        for (uint32_t i = 0; i < 10000; ++i) {
+            recent += ycsb_next_key(&generator, 5000) >= 4990;
+        }
+
+        // the ten latest keys get about two fifths of all hits
+        assertis(recent > 3000);
+    }
+
+    it("mix operations by their share") {
+        uint32_t counts[5] = { 0 };
+        ycsb_generator_init(&generator, YCSB_UNIFORM, 1, 1);
+
+        for (uint32_t i = 0; i < 100000; ++i) {
+            counts[ycsb_next_op(&generator, &ycsb_workload_b)] += 1;
+        }
+
+        assertis(counts[YCSB_READ] > 94000 && counts[YCSB_READ] < 96000);
+        assertis(counts[YCSB_UPDATE] > 4000 && counts[YCSB_UPDATE] < 6000);
+        asserteq_uint(counts[YCSB_INSERT] + counts[YCSB_SCAN] + counts[YCSB_READ_MODIFY_WRITE], 0);
+    }
+}